@@ -10,12 +10,26 @@
 // note, this is overritten by the IRC_USER environment variable
 #define DEFAULT_BOT_NAME "fake-insobot"
 
-// minimum milliseconds between messages
+// minimum milliseconds between messages (globally on normal servers, per channel on twitch unless modded)
 #define CMD_RATE_LIMIT_MS 1500
 
-// number of backed-up commands to keep
+// number of backed-up commands to keep for each channel
 #define CMD_QUEUE_MAX 32
 
+// twitch's chat rate limits, as N commands per window of milliseconds
+#define TWITCH_MSG_LIMIT      20
+#define TWITCH_MOD_MSG_LIMIT  100
+#define TWITCH_MSG_WINDOW_MS  30000
+#define TWITCH_JOIN_LIMIT     20
+#define TWITCH_JOIN_WINDOW_MS 10000
+
+// modules' save requests within this many milliseconds are written out together, in a forked copy of the bot.
+// overridden by the INSOBOT_SAVE_DELAY_MS environment variable
+#define SAVE_DELAY_MS 5000
+
+// how many modules can be running on_init at once when the bot starts
+#define INIT_THREADS 4
+
 // URL to the schedule webpage if you're using mod_schedule / mod_twitter
 #define SCHEDULE_URL ""
 
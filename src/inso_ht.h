@@ -18,11 +18,23 @@ typedef struct {
 	char*  memory;
 	char*  prev_memory;
 
+	// per-slot metadata: a control byte (7-bit hash fingerprint, or INSO_HT_EMPTY) for each slot, with the
+	// first group mirrored at the end so groups can be loaded without wrapping, then each slot's probe distance.
+	uint8_t* ctrl;
+	uint8_t* prev_ctrl;
+
 	// set these manually before init if you want custom allocation
 	void* (*alloc_fn)(size_t);
 	void  (*free_fn)(void*, size_t);
 } inso_ht;
 
+#define INSO_HT_GROUP    16
+#define INSO_HT_EMPTY    0x80
+#define INSO_HT_DIST_MAX 255 // distances saturate here, and are recomputed from the hash if needed
+
+// size in bytes of the ctrl array for a table with cap slots
+#define INSO_HT_CTRL_SIZE(cap) ((cap) * 2 + INSO_HT_GROUP)
+
 #ifndef NDEBUG
 	#include <stdio.h>
 	#define INSO_HT_DBG(fmt, ...) printf(fmt, ##__VA_ARGS__);
@@ -40,34 +52,54 @@ void* inso_ht_get  (inso_ht*, size_t hash, inso_ht_cmp_fn, void* param);
 bool  inso_ht_del  (inso_ht*, size_t hash, inso_ht_cmp_fn, void* param);
 bool  inso_ht_tick (inso_ht*);
 
+// for tables whose memory + capacity were filled in directly (e.g. read from a file) instead of via put.
+// all-zero elements are taken to be empty slots, everything else is re-inserted.
+void  inso_ht_rebuild (inso_ht*);
+
 #endif
 
-#define INSO_HT_VERSION 2
+#define INSO_HT_VERSION 3
+
 
 // Implementation
 
 #ifdef INSO_IMPL
 
-static inline void*  inso_htpriv_put   (inso_ht*, const void*);
-static inline bool   inso_htpriv_get_i (inso_ht*, intptr_t*, size_t, inso_ht_cmp_fn, void*);
-static inline void   inso_htpriv_del_i (inso_ht*, intptr_t);
-static inline bool   inso_htpriv_empty (inso_ht*, const char*);
-static inline size_t inso_htpriv_align (size_t);
+#include <alloca.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+// Robin Hood open addressing: entries further from their home slot push out ones that are closer to theirs,
+// which keeps probe sequences short and lets lookups stop early. Probing looks at groups of INSO_HT_GROUP
+// control bytes at once, and only calls cmp for slots whose fingerprint matches.
+
+
+static inline void*    inso_htpriv_put      (inso_ht*, const void*);
+static inline intptr_t inso_htpriv_find     (inso_ht*, char*, uint8_t*, size_t, size_t, size_t, inso_ht_cmp_fn, void*);
+static inline bool     inso_htpriv_get_i    (inso_ht*, intptr_t*, size_t, inso_ht_cmp_fn, void*);
+static inline void     inso_htpriv_del_i    (inso_ht*, intptr_t);
+static inline bool     inso_htpriv_zero     (inso_ht*, const char*);
+static inline size_t   inso_htpriv_align    (size_t);
+static inline void*    inso_htpriv_alloc    (inso_ht*, size_t);
+static inline void     inso_htpriv_release  (inso_ht*, void*, size_t);
+static inline uint8_t* inso_htpriv_new_ctrl (inso_ht*, size_t);
+
+#define inso_htpriv_ctrl_size(cap) INSO_HT_CTRL_SIZE(cap)
+#define inso_htpriv_dist(ctrl, cap) ((ctrl) + (cap) + INSO_HT_GROUP)
 
 void inso_ht_init(inso_ht* ht, size_t nmemb, size_t size, inso_ht_hash_fn hash_fn){
 	assert(ht);
 
-	nmemb = inso_htpriv_align(nmemb);
+	nmemb = inso_htpriv_align(nmemb < INSO_HT_GROUP ? INSO_HT_GROUP : nmemb);
 
 	ht->capacity  = nmemb;
 	ht->elem_size = size;
 	ht->hash_fn   = hash_fn;
-
-	if(ht->alloc_fn && ht->free_fn){
-		ht->memory = ht->alloc_fn(ht->capacity * ht->elem_size);
-	} else {
-		ht->memory = calloc(ht->capacity, ht->elem_size);
-	}
+	ht->used      = 0;
+	ht->memory    = inso_htpriv_alloc(ht, ht->capacity * ht->elem_size);
+	ht->ctrl      = inso_htpriv_new_ctrl(ht, ht->capacity);
 
 	INSO_HT_DBG("ht_init: nmemb: %zu, cap: %zu\n", nmemb, ht->capacity);
 
@@ -76,20 +108,14 @@ void inso_ht_init(inso_ht* ht, size_t nmemb, size_t size, inso_ht_hash_fn hash_f
 
 void inso_ht_free(inso_ht* ht){
 	if(ht && ht->memory){
-		bool custom = ht->alloc_fn && ht->free_fn;
-
-		if(custom){
-			ht->free_fn(ht->memory, ht->capacity * ht->elem_size);
-		} else {
-			free(ht->memory);
+		inso_htpriv_release(ht, ht->memory, ht->capacity * ht->elem_size);
+		if(ht->ctrl){
+			inso_htpriv_release(ht, ht->ctrl, inso_htpriv_ctrl_size(ht->capacity));
 		}
 
 		if(ht->prev_memory){
-			if(custom){
-				ht->free_fn(ht->prev_memory, ht->prev_cap * ht->elem_size);
-			} else {
-				free(ht->prev_memory);
-			}
+			inso_htpriv_release(ht, ht->prev_memory, ht->prev_cap * ht->elem_size);
+			inso_htpriv_release(ht, ht->prev_ctrl, inso_htpriv_ctrl_size(ht->prev_cap));
 		}
 		memset(ht, 0, sizeof(*ht));
 	}
@@ -107,14 +133,11 @@ void* inso_ht_put(inso_ht* ht, const void* elem){
 		ht->prev_cap    = ht->capacity;
 		ht->capacity   *= 2;
 		ht->prev_memory = ht->memory;
+		ht->prev_ctrl   = ht->ctrl;
 		ht->rehash_idx  = 0;
 		ht->used        = 0;
-		
-		if(ht->alloc_fn && ht->free_fn){
-			ht->memory = ht->alloc_fn(ht->capacity * ht->elem_size);
-		} else {
-			ht->memory = calloc(ht->capacity, ht->elem_size);
-		}
+		ht->memory      = inso_htpriv_alloc(ht, ht->capacity * ht->elem_size);
+		ht->ctrl        = inso_htpriv_new_ctrl(ht, ht->capacity);
 
 		INSO_HT_DBG("ht_put: expanding table. %zu -> %zu\n", ht->prev_cap, ht->capacity);
 
@@ -148,7 +171,9 @@ void* inso_ht_get(inso_ht* ht, size_t hash, inso_ht_cmp_fn cmp, void* param){
 bool inso_ht_del(inso_ht* ht, size_t hash, inso_ht_cmp_fn cmp, void* param){
 	assert(ht);
 	assert(ht->memory);
-	inso_ht_tick(ht);
+
+	// entries still in the old table can't be shifted back, so finish moving them over first.
+	while(inso_ht_tick(ht));
 
 	intptr_t index;
 	if(inso_htpriv_get_i(ht, &index, hash, cmp, param)){
@@ -164,43 +189,133 @@ bool inso_ht_tick(inso_ht* ht){
 
 	size_t i;
 	for(i = ht->rehash_idx; i < ht->prev_cap; ++i){
-		void* ptr = ht->prev_memory + i * ht->elem_size;
-		if(!inso_htpriv_empty(ht, ptr)){
-			inso_htpriv_put(ht, ptr);
+		if(!(ht->prev_ctrl[i] & INSO_HT_EMPTY)){
+			inso_htpriv_put(ht, ht->prev_memory + i * ht->elem_size);
 			ht->rehash_idx = ++i;
 			break;
 		}
 	}
 
 	if(i >= ht->prev_cap){
-		if(ht->alloc_fn && ht->free_fn){
-			ht->free_fn(ht->prev_memory, ht->prev_cap * ht->elem_size);
-		} else {
-			free(ht->prev_memory);
-		}
+		inso_htpriv_release(ht, ht->prev_memory, ht->prev_cap * ht->elem_size);
+		inso_htpriv_release(ht, ht->prev_ctrl, inso_htpriv_ctrl_size(ht->prev_cap));
 		ht->prev_memory = NULL;
+		ht->prev_ctrl   = NULL;
 		INSO_HT_DBG("done rehashing table.\n");
 	}
 
 	return ht->prev_memory;
 }
 
+void inso_ht_rebuild(inso_ht* ht){
+	assert(ht);
+	assert(ht->memory);
+	assert(!ht->prev_memory);
+
+	char*  old_mem = ht->memory;
+	size_t old_cap = ht->capacity;
+
+	if(ht->ctrl){
+		inso_htpriv_release(ht, ht->ctrl, inso_htpriv_ctrl_size(old_cap));
+	}
+
+	ht->capacity = inso_htpriv_align(old_cap < INSO_HT_GROUP ? INSO_HT_GROUP : old_cap);
+	ht->used     = 0;
+	ht->memory   = inso_htpriv_alloc(ht, ht->capacity * ht->elem_size);
+	ht->ctrl     = inso_htpriv_new_ctrl(ht, ht->capacity);
+
+	for(size_t i = 0; i < old_cap; ++i){
+		const char* ptr = old_mem + i * ht->elem_size;
+		if(!inso_htpriv_zero(ht, ptr)){
+			inso_htpriv_put(ht, ptr);
+		}
+	}
+
+	inso_htpriv_release(ht, old_mem, old_cap * ht->elem_size);
+
+	INSO_HT_DBG("ht_rebuild: %zu entries, cap: %zu\n", ht->used, ht->capacity);
+}
+
 //////////////////////////////////
 
+static inline uint8_t inso_htpriv_h7(size_t hash){
+	// the top bits, so they're independent of the home slot for all but huge tables.
+	return ((uint32_t)(hash ^ ((uint64_t)hash >> 32)) >> 25) & 0x7F;
+}
+
+static inline void inso_htpriv_set_ctrl(uint8_t* ctrl, size_t cap, size_t i, uint8_t val){
+	ctrl[i] = val;
+	if(i < INSO_HT_GROUP){
+		ctrl[cap + i] = val;
+	}
+}
+
+// returns a mask of the slots in the group starting at g whose control byte is h7, and sets *empty to the
+// mask of empty slots.
+static inline uint32_t inso_htpriv_match(const uint8_t* g, uint8_t h7, uint32_t* empty){
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i*)g);
+	*empty = _mm_movemask_epi8(v);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(h7)));
+#else
+	uint32_t m = 0, e = 0;
+	for(int i = 0; i < INSO_HT_GROUP; ++i){
+		m |= (uint32_t)(g[i] == h7) << i;
+		e |= (uint32_t)(g[i] >> 7) << i;
+	}
+	*empty = e;
+	return m;
+#endif
+}
+
 static inline void* inso_htpriv_put(inso_ht* ht, const void* elem){
+	const size_t mask = ht->capacity - 1;
+	const size_t sz   = ht->elem_size;
+	uint8_t*     dist = inso_htpriv_dist(ht->ctrl, ht->capacity);
 
-	// TODO: robin-hood hashing?
+	size_t  hash = ht->hash_fn(elem);
+	uint8_t h7   = inso_htpriv_h7(hash);
+	size_t  d    = 0;
 
-	size_t hash  = ht->hash_fn(elem);
+	char* carry = alloca(sz);
+	char* tmp   = alloca(sz);
+	char* result = NULL;
 
-	for(size_t count = 0; count < ht->capacity; ++count){
-		size_t i  = (hash + count) & (ht->capacity - 1);
-		void* ptr = ht->memory + i * ht->elem_size;
+	memcpy(carry, elem, sz);
 
-		if(inso_htpriv_empty(ht, ptr)){
+	for(size_t count = 0, i = hash & mask; count < ht->capacity; ++count, i = (i + 1) & mask){
+		char* ptr = ht->memory + i * sz;
+
+		if(ht->ctrl[i] & INSO_HT_EMPTY){
+			memcpy(ptr, carry, sz);
+			inso_htpriv_set_ctrl(ht->ctrl, ht->capacity, i, h7);
+			dist[i] = d < INSO_HT_DIST_MAX ? d : INSO_HT_DIST_MAX;
 			ht->used++;
-			return memcpy(ptr, elem, ht->elem_size);
+			return result ? result : ptr;
+		}
+
+		size_t slot_d = dist[i];
+		if(slot_d == INSO_HT_DIST_MAX){
+			slot_d = (i - ht->hash_fn(ptr)) & mask;
+		}
+
+		// take the slot from an entry that's closer to its home, and carry that one on instead.
+		if(slot_d < d){
+			memcpy(tmp, ptr, sz);
+			memcpy(ptr, carry, sz);
+			memcpy(carry, tmp, sz);
+
+			uint8_t c = ht->ctrl[i];
+			inso_htpriv_set_ctrl(ht->ctrl, ht->capacity, i, h7);
+			h7 = c;
+
+			dist[i] = d < INSO_HT_DIST_MAX ? d : INSO_HT_DIST_MAX;
+			d = slot_d;
+
+			if(!result) result = ptr;
 		}
+
+		++d;
 	}
 
 	assert(!"ht_put: no space? wat.");
@@ -208,73 +323,93 @@ static inline void* inso_htpriv_put(inso_ht* ht, const void* elem){
 	return NULL;
 }
 
-// TODO: i think the negative index == in secondary table was a bad idea, just make this rehash
-// and return the new index?
+// index of the matching entry in the given table, or -1. entries before min_idx are ignored.
+static inline intptr_t inso_htpriv_find(inso_ht* ht, char* mem, uint8_t* ctrl, size_t cap, size_t min_idx, size_t hash, inso_ht_cmp_fn cmp, void* param){
+	const size_t   mask = cap - 1;
+	const uint8_t  h7   = inso_htpriv_h7(hash);
+	const uint8_t* dist = inso_htpriv_dist(ctrl, cap);
 
-static inline bool inso_htpriv_get_i(inso_ht* ht, intptr_t* idx, size_t hash, inso_ht_cmp_fn cmp, void* param){
+	size_t pos = hash & mask;
 
-	char*  mem[] = { ht->memory   , ht->prev_memory };
-	size_t cap[] = { ht->capacity , ht->prev_cap    };
+	for(size_t probed = 0; probed < cap; probed += INSO_HT_GROUP){
+		uint32_t empty;
+		uint32_t match = inso_htpriv_match(ctrl + pos, h7, &empty);
 
-	for(size_t n = 0; n < 2; ++n){
-		size_t limit = cap[n];
-
-		for(size_t count = 0; count < limit; ++count){
-			size_t i  = (hash + count) & (limit - 1);
-			void* ptr = mem[n] + i * ht->elem_size;
-
-			if(inso_htpriv_empty(ht, ptr)) break;
+		// the probe sequence ends at the first empty slot
+		if(empty){
+			match &= (empty & -empty) - 1;
+		}
 
-			if((!n || i >= ht->rehash_idx) && cmp(ptr, param)){
-				*idx = n ? -(i+1) : i;
-				return true;
+		for(; match; match &= match - 1){
+			size_t i = (pos + __builtin_ctz(match)) & mask;
+			if(i >= min_idx && cmp(mem + i * ht->elem_size, param)){
+				return i;
 			}
 		}
 
-		if(!ht->prev_memory) break;
+		if(empty) break;
+
+		// if the group ends with an entry closer to its home than we would be, we'd have displaced it.
+		size_t  last = (pos + INSO_HT_GROUP - 1) & mask;
+		uint8_t ld   = dist[last];
+		if(ld != INSO_HT_DIST_MAX && ld < probed + INSO_HT_GROUP - 1) break;
+
+		pos = (pos + INSO_HT_GROUP) & mask;
 	}
 
-	return false;
+	return -1;
 }
 
-static inline void inso_htpriv_del_i(inso_ht* ht, intptr_t idx){
+// TODO: i think the negative index == in secondary table was a bad idea, just make this rehash
+// and return the new index?
 
-	if(idx < 0){
-		memset(ht->prev_memory - (idx+1), 0, ht->elem_size);
-		return;
+static inline bool inso_htpriv_get_i(inso_ht* ht, intptr_t* idx, size_t hash, inso_ht_cmp_fn cmp, void* param){
+	intptr_t i = inso_htpriv_find(ht, ht->memory, ht->ctrl, ht->capacity, 0, hash, cmp, param);
+	if(i >= 0){
+		*idx = i;
+		return true;
 	}
 
-	memset(ht->memory + idx * ht->elem_size, 0, ht->elem_size);
-	INSO_HT_DBG("ht_del: starting. idx=%zu, cap=%zu\n", idx, ht->capacity);
+	if(ht->prev_memory){
+		i = inso_htpriv_find(ht, ht->prev_memory, ht->prev_ctrl, ht->prev_cap, ht->rehash_idx, hash, cmp, param);
+		if(i >= 0){
+			*idx = -(i+1);
+			return true;
+		}
+	}
 
-	for(size_t count = 1; count < ht->capacity; ++count){
-		size_t i  = (idx + count) & (ht->capacity - 1);
-		void* ptr = ht->memory + i * ht->elem_size;
+	return false;
+}
 
-		if(inso_htpriv_empty(ht, ptr)){
-			INSO_HT_DBG("ending\n");
-			return;
-		}
+static inline void inso_htpriv_del_i(inso_ht* ht, intptr_t idx){
+	assert(idx >= 0);
 
-		size_t hash = ht->hash_fn(ptr);
-		size_t idx2 = hash & (ht->capacity - 1);
+	const size_t mask = ht->capacity - 1;
+	const size_t sz   = ht->elem_size;
+	uint8_t*     dist = inso_htpriv_dist(ht->ctrl, ht->capacity);
+	size_t       hole = idx;
 
-		INSO_HT_DBG("hash=%zu, idx2=%zu, ", hash, idx2);
+	INSO_HT_DBG("ht_del: starting. idx=%zu, cap=%zu\n", (size_t)idx, ht->capacity);
 
-		if(idx2 <= (size_t)idx){
-			INSO_HT_DBG("swapping.");
-			memcpy(
-				ht->memory + idx  * ht->elem_size,
-				ht->memory + idx2 * ht->elem_size,
-				ht->elem_size
-			);
-			memset(ht->memory + idx2 * ht->elem_size, 0, ht->elem_size);
-			idx = i;
+	// backward shift: pull the rest of the run back a slot, until an empty slot or an entry already at home.
+	for(size_t i = (hole + 1) & mask; !(ht->ctrl[i] & INSO_HT_EMPTY) && dist[i]; i = (i + 1) & mask){
+		size_t d = dist[i];
+		if(d == INSO_HT_DIST_MAX){
+			d = (i - ht->hash_fn(ht->memory + i * sz)) & mask;
 		}
-		INSO_HT_DBG("\n");
+
+		memcpy(ht->memory + hole * sz, ht->memory + i * sz, sz);
+		inso_htpriv_set_ctrl(ht->ctrl, ht->capacity, hole, ht->ctrl[i]);
+		dist[hole] = d - 1 < INSO_HT_DIST_MAX ? d - 1 : INSO_HT_DIST_MAX;
+
+		hole = i;
 	}
 
-	assert(!"ht_del: not found and no empty slots? wtf");
+	// empty slots are kept zeroed, so the memory can be saved and rebuilt later.
+	memset(ht->memory + hole * sz, 0, sz);
+	inso_htpriv_set_ctrl(ht->ctrl, ht->capacity, hole, INSO_HT_EMPTY);
+	dist[hole] = 0;
+	ht->used--;
 }
 
 static inline size_t inso_htpriv_align(size_t i){
@@ -282,7 +417,7 @@ static inline size_t inso_htpriv_align(size_t i){
 	return UINTMAX_C(1) << ++shift;
 }
 
-static inline bool inso_htpriv_empty(inso_ht* ht, const char* ptr){
+static inline bool inso_htpriv_zero(inso_ht* ht, const char* ptr){
 
 	const size_t len4 = ht->elem_size & ~3ul;
 	for(const uint32_t *p = (const uint32_t*)ptr, *q = (const uint32_t*)(ptr + len4); p < q; ++p){
@@ -300,4 +435,30 @@ static inline bool inso_htpriv_empty(inso_ht* ht, const char* ptr){
 	return a == 0;
 }
 
+static inline void* inso_htpriv_alloc(inso_ht* ht, size_t size){
+	if(ht->alloc_fn && ht->free_fn){
+		return ht->alloc_fn(size);
+	} else {
+		return calloc(1, size);
+	}
+}
+
+static inline void inso_htpriv_release(inso_ht* ht, void* ptr, size_t size){
+	if(ht->alloc_fn && ht->free_fn){
+		ht->free_fn(ptr, size);
+	} else {
+		free(ptr);
+	}
+}
+
+static inline uint8_t* inso_htpriv_new_ctrl(inso_ht* ht, size_t cap){
+	uint8_t* ctrl = inso_htpriv_alloc(ht, inso_htpriv_ctrl_size(cap));
+	assert(ctrl);
+
+	memset(ctrl, INSO_HT_EMPTY, cap + INSO_HT_GROUP);
+	memset(inso_htpriv_dist(ctrl, cap), 0, cap);
+
+	return ctrl;
+}
+
 #endif
@@ -121,6 +121,20 @@ static inline bool inso_in_chan(const IRCCoreCtx* ctx, const char* chan){
 	return false;
 }
 
+// value of the current message's IRCv3 tag called key, or NULL. Works with cores older than API v8 too.
+static inline const char* inso_tag(const IRCCoreCtx* ctx, const char* key){
+	if(ctx->api_version >= 8){
+		return ctx->get_tag_by_key(key);
+	}
+
+	const char *k, *v;
+	for(size_t i = 0; ctx->get_tag(i, &k, &v); ++i){
+		if(strcmp(k, key) == 0) return v;
+	}
+
+	return NULL;
+}
+
 static inline int inso_match_cmd(const char* msg, const char* cmd, bool skip_control){
 
 	size_t len_adjust = 0;
@@ -17,6 +17,7 @@
 #include <dlfcn.h>
 #include <link.h>
 #include <execinfo.h>
+#include <pthread.h>
 
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -26,6 +27,9 @@
 #include <sys/inotify.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include <libircclient.h>
 #include <libirc_rfcnumeric.h>
@@ -35,6 +39,7 @@
 #include "module.h"
 #include "stb_sb.h"
 #include "inso_utils.h"
+#include "inso_ht.h"
 
 #ifndef LIBIRC_OPTION_SSL_NO_VERIFY
 	#define LIBIRC_OPTION_SSL_NO_VERIFY (1 << 3)
@@ -58,8 +63,19 @@ typedef struct Module_ {
 	IRCModuleCtx* ctx;
 	size_t ctx_size;
 	bool needs_reload, data_modified;
+	bool save_pending; // save_me was called, on_save is due when save_timer fires
+	pid_t save_pid;    // a forked copy writing the module's data to save_tmp, or 0
+	char* save_tmp;
+	uint64_t save_start; // when save_pid was forked
+	void* handoff;     // from the old code's on_handoff while it's being reloaded
+	uint8_t state;     // MOD_LIVE once on_init is done, see util_init_worker
+	bool init_nodeps;  // its init_after is ignored, to get out of a dependency cycle
 } Module;
 
+// modules initialized on the pool at startup go QUEUED -> INITIALIZING -> INIT_OK / INIT_FAILED on the pool
+// threads, then to LIVE / DEAD on the main thread. Only LIVE ones get any other callbacks.
+enum { MOD_LIVE, MOD_QUEUED, MOD_INITIALIZING, MOD_INIT_OK, MOD_INIT_FAILED, MOD_DEAD };
+
 typedef struct INotifyWatch {
 	int wd;
 	char* path;
@@ -74,27 +90,209 @@ typedef struct IRCCmd_ {
 	size_t id;
 	int cmd;
 	char *chan, *data;
+	uint64_t queued_ms;
+	bool filtered;
 } IRCCmd;
 
+// up to limit commands in any window_ms, as a log of when the last limit of them were sent:
+// the next one can go once the oldest of those is window_ms old.
+typedef struct CmdBucket_ {
+	uint32_t  limit;
+	uint32_t  window_ms;
+	uint64_t* sent; // stb sb used as a ring once it has limit entries
+	uint32_t  next; // index of the oldest entry in sent once it's full
+} CmdBucket;
+
+// replies to commands and moderation actions go out before everything else.
+enum { CMD_PRIO_HIGH, CMD_PRIO_NORMAL, CMD_PRIO_COUNT };
+
+typedef struct CmdLane_ {
+	IRCCmd   ring[CMD_QUEUE_MAX];
+	uint32_t head;
+	uint32_t count;
+} CmdLane;
+
+// outgoing commands for one target (or raw ones, with chan == NULL), served round-robin with the others.
+// the lanes are in order of priority, see CMD_PRIO_*.
+typedef struct CmdQueue_ {
+	char*     chan;
+	CmdLane   lanes[CMD_PRIO_COUNT];
+	CmdBucket bucket; // per-channel limit, only used for twitch channels we aren't a mod in
+	bool      is_mod;
+} CmdQueue;
+
+// each instance's incoming IPC messages go into a ring in a memfd that its peers map, the fd for it and an
+// eventfd to wake the instance up are passed to them over its socket (see util_ipc_hello). Peers take the
+// (robust, process-shared) lock to append to it, the owner reads from head up to tail without it.
+typedef struct IPCRing_ {
+	uint32_t magic;    // IPC_RING_MAGIC
+	uint32_t hdr_size; // sizeof(IPCRing), in case the layout of the lock differs
+	uint32_t size;     // of data, a power of 2
+	pthread_mutex_t lock;
+	uint64_t head;     // read position, only written by the owner
+	uint64_t tail;     // write position, only written with the lock held
+	uint8_t data[];
+} IPCRing;
+
+// one message in a ring, followed by the null-terminated name of the module it's for and then the data.
+// Frames start at multiples of 8 in the ring, and can wrap around its end.
+typedef struct IPCFrame_ {
+	uint32_t len;      // of the whole frame including this header, without padding
+	uint32_t sender;   // id of the sending instance, for on_ipc
+	uint32_t name_len; // including the null
+	uint32_t reserved;
+} IPCFrame;
+
 typedef struct IPCAddress_ {
 	int id;
 	struct sockaddr_un addr;
+	IPCRing* ring;   // the peer's ring once it sent us its fds, otherwise it's sent datagrams like before
+	int ring_efd;
+	bool hello_sent;
 } IPCAddress;
 
+// a frame waiting in ipc_out for util_ipc_flush, target 0 means every peer.
+typedef struct IPCPending_ {
+	int    target;
+	size_t off;
+} IPCPending;
+
+typedef struct HTTPRequest_ {
+	CURL* curl;
+	const IRCModuleCtx* owner;
+	IRCHttpCallback cb;
+	intptr_t arg;
+	char* data;
+	bool parked; // finished while the owner was still initializing, result is passed on once it's done
+	long result;
+} HTTPRequest;
+
+typedef struct IOWatch_ {
+	int fd; // -1 once removed
+	uint32_t events;
+	const IRCModuleCtx* owner; // NULL if owned by the core
+	IRCFdCallback cb;
+	intptr_t arg;
+} IOWatch;
+
+// timers live in a slot array so that handles can be a slot index + generation pair, and a binary
+// min-heap of slot indices ordered by deadline decides how long the main loop can sleep for.
+typedef struct CoreTimer_ {
+	uint64_t deadline;
+	uint32_t interval; // 0 for one-shot timers
+	uint32_t gen;      // bumped each time the slot is freed, so stale handles don't match
+	int heap_idx;      // -1 when the slot is free
+	const IRCModuleCtx* owner;
+	IRCTimerCallback cb;
+	intptr_t arg;
+} CoreTimer;
+
+typedef struct CmdMatch_ {
+	const IRCModuleCtx* ctx;
+	int cmd; // index into ctx->commands
+} CmdMatch;
+
+// node of a case-folded trie of every loaded module's command aliases. Nodes refer to each other by index
+// into cmd_trie, index 0 is the root (so 0 can also mean "none" for child / sibling).
+typedef struct CmdNode_ {
+	uint32_t child;
+	uint32_t sibling;
+	uint32_t match_idx; // the commands ending at this node are cmd_matches[match_idx .. match_idx + match_count)
+	uint32_t match_count;
+	uint8_t  c;
+} CmdNode;
+
+// cached result of asking every module's on_meta whether a module is allowed in a channel, as one bitset
+// (indexed like irc_modules) per IRC_CB_* id. It is only filled in when first needed for each id.
+typedef struct ChanPerms_ {
+	char*     chan;
+	uint32_t  valid; // bit per IRC_CB_* id that has been filled in
+	uint64_t* bits;  // PERMS_CB_COUNT * perms_words
+} ChanPerms;
+
+// the hash comes first in each of the index entry types, so they can share util_index_hash.
+typedef struct ChanIndexEntry_ {
+	size_t      hash;
+	const char* name;  // channels[idx]
+	uint32_t    idx;
+	ChanPerms*  perms; // the channel's chan_perms entry, once it's been looked up
+} ChanIndexEntry;
+
+typedef struct NickIndexEntry_ {
+	size_t      hash;
+	const char* chan; // channels[] entry of the channel
+	const char* nick; // interned
+	uint32_t    pos;  // index into chan_nicks[] of that channel
+} NickIndexEntry;
+
+typedef struct InternEntry_ {
+	size_t hash;
+	char*  str;
+	size_t refs;
+} InternEntry;
+
+typedef struct ModIndexEntry_ {
+	size_t      hash;
+	const char* name; // ctx->name of irc_modules[idx]
+	uint32_t    idx;
+} ModIndexEntry;
+
+// an IRCv3 tag of the current message, as spans over the raw tag string libircclient gave us.
+// k and v are only made (null-terminated and unescaped, in irc_tag_arena) once a module asks for the tag.
+typedef struct IRCTag_ {
+	const char* key;
+	const char* val;
+	uint32_t    key_len;
+	uint32_t    val_len;
+	const char* k;
+	const char* v;
+} IRCTag;
+
+// slot of the perfect hash table of tags twitch sends, see util_tag_hash_init.
+typedef struct IRCTagSlot_ {
+	uint8_t  known; // index + 1 into irc_tag_known, 0 if nothing hashes here
+	uint32_t gen;   // irc_tag_gen of the message tag was set for
+	uint32_t tag;   // index into irc_tags
+} IRCTagSlot;
+
 enum { MOD_GET_SONAME, MOD_GET_CTXNAME };
 
 enum { IRC_CMD_JOIN, IRC_CMD_PART, IRC_CMD_MSG, IRC_CMD_RAW };
 
-static IRCCmd* cmd_queue;
-static uint32_t prev_cmd_ms;
-static size_t last_cmd_id;
+// used between short messages to the same target that get sent as one line.
+static const char cmd_merge_sep[] = " | ";
+
+static bool in_cmd_dispatch;
+
+static CmdQueue** cmd_queues; // [0] is for raw commands
+static size_t     cmd_queue_rr;
+static size_t     last_cmd_id;
+
+static CmdBucket  cmd_bucket      = { 1, CMD_RATE_LIMIT_MS }; // everything, on normal servers
+static CmdBucket  cmd_bucket_msg  = { TWITCH_MSG_LIMIT    , TWITCH_MSG_WINDOW_MS  };
+static CmdBucket  cmd_bucket_mod  = { TWITCH_MOD_MSG_LIMIT, TWITCH_MSG_WINDOW_MS  };
+static CmdBucket  cmd_bucket_join = { TWITCH_JOIN_LIMIT   , TWITCH_JOIN_WINDOW_MS };
+
+static size_t     cmd_stat_sent;
+static size_t     cmd_stat_dropped;
+static uint32_t   cmd_stat_latency;
+static uint32_t   cmd_stat_latency_max;
+
+static bool irc_is_twitch;
 
 static irc_session_t* irc_ctx;
 
 static Module* irc_modules;
-static Module** mod_call_stack;
-static IRCModuleCtx** chan_mod_list;
-static IRCModuleCtx** global_mod_list;
+static __thread Module** mod_call_stack;
+
+static CmdNode*  cmd_trie;
+static CmdMatch* cmd_matches;
+
+static ChanPerms** chan_perms;
+static size_t     perms_words;
+static uint32_t   perms_epoch;
+static __thread IRCModuleCtx** chan_mod_list;
+static __thread IRCModuleCtx** global_mod_list;
 
 static char* modules_include;
 static char* modules_exclude;
@@ -104,24 +302,84 @@ static char*  bot_nick;
 static size_t bot_host_len;
 
 static char**  channels;
-static char*** chan_nicks;
+static char*** chan_nicks; // nicks in here are interned, see util_intern
+
+// indexes over channels / chan_nicks, keyed by the case-folded names. The nick index is keyed by the
+// channels[] string pointer of a channel plus the nick, since channel indices shift when one is left.
+static inso_ht chan_index;
+static inso_ht nick_index;
+static inso_ht nick_intern;
 
 static INotifyData inotify;
 
-static struct timeval idle_tv;
-static bool ping_sent;
+static int      irc_fd = -1;
+static uint32_t irc_events;
+static uint32_t irc_read_ms;
+static bool     ping_sent;
 
 static int         ipc_socket;
 static IPCAddress  ipc_self;
 static IPCAddress* ipc_peers;
+static IPCRing*    ipc_ring; // ours
+static int         ipc_ring_fd = -1;
+static int         ipc_efd = -1;
+static uint8_t*    ipc_out;  // frames from send_ipc since the last util_ipc_flush
+static IPCPending* ipc_pending;
+static intptr_t    ipc_flush_timer;
+static uint8_t*    ipc_scratch; // for frames that wrap around the end of the ring
+static inso_ht     mod_index;   // module name -> irc_modules index, for routing IPC messages
+
+static CURLM*        curl_multi;
+static HTTPRequest** http_reqs;
+
+static int         epoll_fd;
+static IOWatch**   io_watches;
+static IOWatch**   io_dead; // removed while dispatching, freed once the batch of events is done
+static CoreTimer* timer_slots;
+static uint32_t*  timer_free;
+static uint32_t*  timer_heap;
+
+static intptr_t ping_timer;
+static intptr_t cmd_timer;
+static intptr_t tick_timer;
+static intptr_t http_timer;
+static intptr_t save_timer;
+static intptr_t save_reap_timer;
+static int      save_delay_ms = SAVE_DELAY_MS;
+
+// held by the main thread except while it waits for events, and by the init pool threads while they're in
+// the core. core_locked is whether the current thread has it.
+static pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool   core_locked;
+
+static int      init_efd = -1;
+static size_t   init_threads;
+static uint64_t init_start;
 
 static sig_atomic_t running = 1;
 
 static bool send_msg_called;
 
-static char   irc_tag_buf[512];
-static char** irc_tag_ptrs;
-static bool   have_tag_hack;
+static IRCTag* irc_tags;
+static char*   irc_tag_arena;
+static bool    have_tag_hack;
+
+static const char* const irc_tag_known[] = {
+	"badge-info", "badges", "bits", "client-nonce", "color", "display-name", "emote-only", "emote-sets", "emotes",
+	"first-msg", "flags", "id", "login", "message-id", "mod", "msg-id", "returning-chatter", "room-id", "subscriber",
+	"system-msg", "thread-id", "tmi-sent-ts", "turbo", "user-id", "user-type", "vip",
+	"followers-only", "r9k", "slow", "subs-only", "ban-duration", "target-msg-id", "target-user-id",
+	"reply-parent-display-name", "reply-parent-msg-body", "reply-parent-msg-id", "reply-parent-user-id",
+	"reply-parent-user-login", "msg-param-cumulative-months", "msg-param-displayName", "msg-param-login",
+	"msg-param-months", "msg-param-recipient-display-name", "msg-param-recipient-user-name",
+	"msg-param-ritual-name", "msg-param-sub-plan", "msg-param-sub-plan-name", "msg-param-viewerCount",
+};
+
+enum { IRC_TAG_SLOTS = 256 };
+
+static IRCTagSlot irc_tag_slots[IRC_TAG_SLOTS];
+static uint32_t   irc_tag_seed; // 0 if util_tag_hash_init didn't find one, then lookups go through every tag
+static uint32_t   irc_tag_gen;
 
 static int pipe_fds[2];
 static int debug_pipe[2];
@@ -152,31 +410,52 @@ static char* insobot_path;
 	ret;                                                                      \
 })
 
-#define IRC_MOD_CALL_ALL(ptr, args) \
-	sb_each(m, irc_modules){        \
-		IRC_MOD_CALL(m, ptr, args); \
+#define IRC_MOD_CALL_ALL(ptr, args)         \
+	sb_each(m, irc_modules){                \
+		if(m->state != MOD_LIVE) continue;  \
+		IRC_MOD_CALL(m, ptr, args);         \
 	}
 
-#define IRC_MOD_CALL_ALL_CHECK(ptr, args, id)             \
-	sb_each(m, irc_modules){                              \
-		if(                                               \
-			(m->ctx->flags & IRC_MOD_GLOBAL) ||           \
-			util_check_perms(m->ctx->name, params[0], id) \
-		){                                                \
-			IRC_MOD_CALL(m, ptr, args);                   \
+#define IRC_MOD_CALL_ALL_CHECK(ptr, args, chan, id)       \
+	do {                                                  \
+		ChanPerms* _perms = util_chan_perms(chan);        \
+		sb_each(m, irc_modules){                          \
+			if(m->state != MOD_LIVE) continue;            \
+			if(                                           \
+				(m->ctx->flags & IRC_MOD_GLOBAL) ||       \
+				util_check_perms(m, _perms, id)           \
+			){                                            \
+				IRC_MOD_CALL(m, ptr, args);               \
+			}                                             \
 		}                                                 \
-	}
+	} while(0)
 
 #define IRC_MOD_CALL_ALL_ABI(ptr, args, abi)              \
 	sb_each(m, irc_modules){                              \
+		if(m->state != MOD_LIVE) continue;                \
 		if(ABI_CHECK(m, abi)) IRC_MOD_CALL(m, ptr, args); \
 	}
 
 #define ABI_FILTER  24
 #define ABI_UNKNOWN 25
 #define ABI_HELP    27
+#define ABI_JOIN_BULK 28
+#define ABI_ADOPT   30
+#define ABI_INIT_AFTER 31
 #define ABI_CHECK(m, abi) ((m)->ctx_size >= (sizeof(void*)*(abi)))
 
+#define PERMS_CB_COUNT (IRC_CB_PM + 1)
+
+enum { IRC_PING_MS = 60000, IRC_RESTART_MS = 90000 };
+
+enum { SAVE_REAP_MS = 100, SAVE_TIMEOUT_MS = 30000 };
+
+enum { INIT_RETRY_MS = 50 };
+
+enum { IPC_RING_MAGIC = 0x1b51c001, IPC_RING_SIZE = 1 << 20 };
+
+static const char ipc_hello[] = "\0insobot-ring";
+
 /*********************************
  * Required forward declarations *
  *********************************/
@@ -187,9 +466,22 @@ IRC_STR_CALLBACK(on_part);
 static const char* core_get_datafile(void);
 static IPCAddress* util_ipc_add(const char* name);
 static void        util_ipc_del(const char* name);
+static void        util_module_detach(Module* m);
+static void        util_cmd_timer_arm(void);
+static intptr_t    util_timer_add(const IRCModuleCtx* owner, uint64_t deadline, uint32_t interval, IRCTimerCallback cb, intptr_t arg);
+static void        util_timer_del(intptr_t handle);
+static void        util_tick_update(void);
 static void        util_module_filter_update(void);
+static void        util_init_start(void);
+static size_t      util_fold_hash(const char* str, bool fold);
+static size_t      util_index_hash(const void* entry);
+static bool        util_chan_cmp(const void* entry, void* param);
+static void        util_mod_index_build(void);
 static bool        util_module_filter_allowed(const char*);
 static void        core_join(const char* chan);
+static size_t      core_send_msg(const char* chan, const char* fmt, ...);
+
+static const IRCCoreCtx core_ctx_locked;
 
 
 /****************
@@ -317,575 +609,2722 @@ static inline const char* util_env_else(const char* env, const char* def){
 	return c ? c : def;
 }
 
-static bool util_check_perms(const char* mod, const char* chan, int id){
+static uint64_t util_now_ms(void){
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000);
+}
+
+static uint32_t util_ms(void){
+	return util_now_ms();
+}
+
+static void util_core_lock(void){
+	pthread_mutex_lock(&core_lock);
+	core_locked = true;
+}
+
+static void util_core_unlock(void){
+	core_locked = false;
+	pthread_mutex_unlock(&core_lock);
+}
+
+static bool util_check_perms_uncached(const char* mod, const char* chan, int id){
 	bool ret = true;
 	sb_each(m, irc_modules){
-		if(!m->ctx->on_meta) continue;
+		if(m->state != MOD_LIVE || !m->ctx->on_meta) continue;
 		ret &= IRC_MOD_CALL(m, on_meta, (mod, chan, id));
 	}
 	return ret;
 }
 
-static void util_dispatch_cmds(Module* m, const char* chan, const char* name, const char* msg){
-	if(!m->ctx || !m->ctx->commands || !m->ctx->on_cmd) return;
-
-	for(const char** cmd_list = m->ctx->commands; *cmd_list; ++cmd_list){
-		const char *cmd = *cmd_list, *cmd_end;
-
-		do {
-			cmd_end = strchrnul(cmd, ' ');
-			const size_t sz = cmd_end - cmd;
-
-			if(strncasecmp(msg, cmd, sz) == 0 && (msg[sz] == ' ' || msg[sz] == '\0')){
-				IRC_MOD_CALL(m, on_cmd, (chan, name, msg + sz, cmd_list - m->ctx->commands));
-				break;
-			}
+static void util_perms_clear(void){
+	sb_each(p, chan_perms){
+		ChanIndexEntry* e = inso_ht_get(&chan_index, util_fold_hash((*p)->chan, true), &util_chan_cmp, (*p)->chan);
+		if(e) e->perms = NULL;
 
-			while(*cmd_end == ' ') ++cmd_end;
-			cmd = cmd_end;
-		} while(*cmd_end);
+		free((*p)->chan);
+		free((*p)->bits);
+		free(*p);
 	}
+	sb_free(chan_perms);
+	perms_words = (sb_count(irc_modules) + 63) / 64;
+	++perms_epoch;
 }
 
-static size_t util_cmd_enqueue(int cmd, const char* chan, const char* data){
-	if(sb_count(cmd_queue) > CMD_QUEUE_MAX) return 0;
+// finds (or adds) chan's cache entry, once per message so each module's check doesn't have to. Channel names
+// are case-insensitive, so #Foo and #foo share one. Entries are only freed by util_perms_clear when the modules
+// change, so the pointer stays valid while a message is dispatched.
+// Joined channels keep a pointer to theirs in chan_index, so only other targets (e.g. PMs) search the list.
+static ChanPerms* util_chan_perms(const char* chan){
+	ChanIndexEntry* e = inso_ht_get(&chan_index, util_fold_hash(chan, true), &util_chan_cmp, (void*)chan);
+	if(e && e->perms) return e->perms;
+
+	ChanPerms* cp = NULL;
+	sb_each(p, chan_perms){
+		if(strcasecmp((*p)->chan, chan) == 0){
+			cp = *p;
+			break;
+		}
+	}
 
-	size_t id = ++last_cmd_id;
-	if(!id) ++id;
+	if(!cp){
+		cp = malloc(sizeof(*cp));
+		*cp = (ChanPerms){
+			.chan = strdup(chan),
+			.bits = calloc(PERMS_CB_COUNT * perms_words, sizeof(uint64_t)),
+		};
+		sb_push(chan_perms, cp);
+	}
 
-	IRCCmd c = {
-		.id   = id,
-		.cmd  = cmd,
-		.chan = chan ? strdup(chan) : NULL,
-		.data = data ? strdup(data) : NULL
-	};
+	if(e) e->perms = cp;
+	return cp;
+}
 
-	sb_push(cmd_queue, c);
+static bool util_check_perms(Module* mod, ChanPerms* cp, int id){
+	size_t i = mod - irc_modules;
 
-	return c.id;
-}
+	// modules are being (re)loaded, the cache is rebuilt when that's done.
+	if(id < 0 || id >= PERMS_CB_COUNT || i >= perms_words * 64){
+		return util_check_perms_uncached(mod->ctx->name, cp->chan, id);
+	}
 
-static void util_process_pending_cmds(void){
-	if(!sb_count(cmd_queue)) return;
+	uint64_t* bits = cp->bits + (id * perms_words);
 
-	struct timespec ts = {};
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	uint32_t cmd_ms = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
-
-	if((cmd_ms - prev_cmd_ms) > CMD_RATE_LIMIT_MS){
-		prev_cmd_ms = cmd_ms;
-
-		IRCCmd cmd = cmd_queue[0];
-		switch(cmd.cmd){
-
-			case IRC_CMD_JOIN: {
-				irc_cmd_join(irc_ctx, cmd.chan, cmd.data);
-//				irc_on_join(irc_ctx, "join", cmd.data, (const char**)&cmd.chan, 1);
-			} break;
-
-			case IRC_CMD_PART: {
-				irc_cmd_part(irc_ctx, cmd.chan);
-//				irc_on_part(irc_ctx, "part", cmd.data, (const char**)&cmd.chan, 1);
-			} break;
-
-			case IRC_CMD_MSG: {
-				size_t len = strlen(cmd.data);
-				IRC_MOD_CALL_ALL_ABI(on_filter, (cmd.id, cmd.chan, cmd.data, len), ABI_FILTER);
-				if(*cmd.data){
-					printf("send: [%s] [%s]\n", cmd.chan, cmd.data);
-					irc_cmd_msg(irc_ctx, cmd.chan, cmd.data);
-					IRC_MOD_CALL_ALL(on_msg_out, (cmd.chan, cmd.data));
-				}
-			} break;
+	if(!(cp->valid & (1u << id))){
+		uint32_t epoch = perms_epoch;
+		memset(bits, 0, perms_words * sizeof(uint64_t));
 
-			case IRC_CMD_RAW: {
-				size_t len = strlen(cmd.data);
-				IRC_MOD_CALL_ALL_ABI(on_filter, (cmd.id, NULL, cmd.data, len), ABI_FILTER);
-				if(*cmd.data){
-					irc_send_raw(irc_ctx, "%s", cmd.data);
-				}
-			} break;
+		for(size_t j = 0; j < sb_count(irc_modules); ++j){
+			if(util_check_perms_uncached(irc_modules[j].ctx->name, cp->chan, id)){
+				bits[j / 64] |= (1ULL << (j % 64));
+			}
 		}
 
-		if(cmd.chan) free(cmd.chan);
-		if(cmd.data) free(cmd.data);
-		sb_erase(cmd_queue, 0);
+		// if an on_meta call changed the permissions part way through, just recompute next time.
+		if(epoch == perms_epoch){
+			cp->valid |= (1u << id);
+		}
 	}
+
+	return bits[i / 64] & (1ULL << (i % 64));
 }
 
-static void util_module_add(const char* name){
-	char path_buf[PATH_MAX];
-	const char* path = name;
+static uint32_t util_cmd_trie_child(uint32_t node, uint8_t c, bool create){
+	uint32_t n = cmd_trie[node].child;
 
-	if(!strchr(path, '/')){
-		if(snprintf(path_buf, PATH_MAX, "%s%s", inotify.module.path, name) >= PATH_MAX) return;
-		path = path_buf;
+	while(n && cmd_trie[n].c != c){
+		n = cmd_trie[n].sibling;
 	}
 
-	if(util_module_filter_allowed(path)){
-		Module m = {
-			.lib_path = strdup(path),
-			.needs_reload = true
-		};
-
-		sb_push(irc_modules, m);
-	} else {
-		printf("NOTE: Loading module '%s' cancelled due to filter.\n", basename(path));
+	if(!n && create){
+		n = sb_count(cmd_trie);
+		sb_push(cmd_trie, ((CmdNode){ .c = c, .sibling = cmd_trie[node].child }));
+		cmd_trie[node].child = n;
 	}
+
+	return n;
 }
 
-static void util_module_save(Module* m){
-	if(!m->ctx || !m->ctx->on_save) return;
+typedef struct {
+	char*    key;
+	size_t   seq;
+	CmdMatch match;
+} CmdKey;
 
-	// change the inotify data watch to something we don't care about to disable it temporarily
-	inotify.data.wd = inotify_add_watch(inotify.fd, inotify.data.path, IN_DELETE_SELF);
+static int util_cmd_key_sort(const void* _a, const void* _b){
+	const CmdKey *a = _a, *b = _b;
+	int cmp = strcmp(a->key, b->key);
+	return cmp ? cmp : (a->seq > b->seq) - (a->seq < b->seq);
+}
 
-	sb_push(mod_call_stack, m);
+// rebuilds the command trie from scratch, this needs to be called whenever irc_modules changes.
+// matches for the same alias are kept in irc_modules order so that dispatch order is unchanged.
+static void util_cmd_index_build(void){
+	CmdKey* keys = NULL;
 
-	const char*  save_fname = core_get_datafile();
-	const size_t save_fsz   = strlen(save_fname);
-	const char   tmp_end[]  = ".XXXXXX";
-	char*        tmp_fname  = alloca(save_fsz + sizeof(tmp_end));
+	sb_free(cmd_trie);
+	sb_free(cmd_matches);
+	util_perms_clear();
+	sb_push(cmd_trie, (CmdNode){});
 
-	memcpy(tmp_fname, save_fname, save_fsz);
-	memcpy(tmp_fname + save_fsz, tmp_end, sizeof(tmp_end));
+	sb_each(m, irc_modules){
+		if(!m->ctx || !m->ctx->commands || !m->ctx->on_cmd) continue;
 
-	int tmp_fd = mkstemp(tmp_fname);
-	if(tmp_fd < 0){
-		fprintf(stderr, "Error saving file for %s: %s\n", m->ctx->name, strerror(errno));
-	} else {
-		FILE* tmp_file = fdopen(tmp_fd, "wb");
-		bool saved = m->ctx->on_save(tmp_file);
-		fclose(tmp_file);
+		for(const char** cmd_list = m->ctx->commands; *cmd_list; ++cmd_list){
+			const char* cmd = *cmd_list;
+
+			while(*cmd){
+				size_t sz = strcspn(cmd, " ");
 
-		if(saved && rename(tmp_fname, save_fname) < 0){
-			fprintf(stderr, "Error saving file for %s: %s\n", m->ctx->name, strerror(errno));
-		} else if(!saved){
-			unlink(tmp_fname);
+				if(sz){
+					CmdKey k = {
+						.key   = strndup(cmd, sz),
+						.seq   = sb_count(keys),
+						.match = { m->ctx, cmd_list - m->ctx->commands },
+					};
+
+					for(char* c = k.key; *c; ++c){
+						*c = tolower((unsigned char)*c);
+					}
+
+					sb_push(keys, k);
+				}
+
+				cmd += sz;
+				cmd += strspn(cmd, " ");
+			}
 		}
 	}
 
-	sb_pop(mod_call_stack);
-
-	inotify.data.wd = inotify_add_watch(inotify.fd, inotify.data.path, IN_CLOSE_WRITE | IN_MOVED_TO);
-}
+	qsort(keys, sb_count(keys), sizeof(*keys), &util_cmd_key_sort);
 
-static Module* util_module_get(const char* name, int type){
-	sb_each(m, irc_modules){
-		const char* base_path = basename(m->lib_path);
+	for(size_t i = 0; i < sb_count(keys); ++i){
+		CmdKey* k = keys + i;
 
-		if(type == MOD_GET_CTXNAME && !m->ctx){ // can happen inside inotify loop
+		// the same alias given twice for one command only dispatched once before either.
+		if(i > 0 && strcmp(k[-1].key, k->key) == 0 && k[-1].match.ctx == k->match.ctx && k[-1].match.cmd == k->match.cmd){
 			continue;
 		}
 
-		const char* comparison
-			= (type == MOD_GET_CTXNAME)	? m->ctx->name
-			: (type == MOD_GET_SONAME)  ? base_path
-			: NULL;
+		uint32_t node = 0;
+		for(const char* c = k->key; *c; ++c){
+			node = util_cmd_trie_child(node, *c, true);
+		}
 
-		if(strcmp(name, comparison) == 0){
-			return m;
+		if(!cmd_trie[node].match_count){
+			cmd_trie[node].match_idx = sb_count(cmd_matches);
 		}
+		++cmd_trie[node].match_count;
+
+		sb_push(cmd_matches, k->match);
 	}
-	return NULL;
-}
 
-static int util_mod_sort(const void* a, const void* b){
-	return ((Module*)b)->ctx->priority - ((Module*)a)->ctx->priority;
+	sb_each(k, keys){
+		free(k->key);
+	}
+	sb_free(keys);
 }
 
-static void util_reload_modules(const IRCCoreCtx* core_ctx){
-
-	sb_each(m, irc_modules){
-		if(!m->needs_reload) continue;
+// finds the commands matching the first word of msg, returns the trie node or NULL if there are none.
+static const CmdNode* util_cmd_lookup(const char* msg, size_t* len){
+	if(!cmd_trie || !*msg || !strchr(CONTROL_CHARS, *msg)){
+		return NULL;
+	}
 
-		const char* mod_name = basename(m->lib_path);
+	uint32_t node = 0;
+	const char* p = msg;
 
-		if(m->lib_handle){
-			util_module_save(m);
-			IRC_MOD_CALL(m, on_quit, ());
-			dlclose(m->lib_handle);
+	for(; *p && *p != ' '; ++p){
+		if(!(node = util_cmd_trie_child(node, tolower((unsigned char)*p), false))){
+			return NULL;
 		}
+	}
 
-		if(!util_module_filter_allowed(mod_name)){
-			printf("Module '%s' is now filtered. Unloading.\n", mod_name);
-			free(m->lib_path);
-			sb_erase(irc_modules, m - irc_modules);
-			--m;
-			continue;
-		}
+	*len = p - msg;
+	return cmd_trie[node].match_count ? cmd_trie + node : NULL;
+}
 
-		dlerror();
-		m->lib_handle = dlopen(m->lib_path, RTLD_LAZY | RTLD_LOCAL);
+static void util_dispatch_cmds(Module* m, const CmdMatch* match, size_t count, const char* chan, const char* name, const char* msg){
+	if(!m->ctx || !m->ctx->on_cmd) return;
 
-		printf("Loading module %-20s", mod_name);
+	in_cmd_dispatch = true;
+	for(size_t i = 0; i < count; ++i){
+		IRC_MOD_CALL(m, on_cmd, (chan, name, msg, match[i].cmd));
+	}
+	in_cmd_dispatch = false;
+}
 
-		const char* errmsg = dlerror();
-		if(!errmsg && m->lib_handle){
-			m->ctx = dlsym(m->lib_handle, "irc_mod_ctx");
-			errmsg = dlerror();
-		} else if(!errmsg && !m->lib_handle){
-			errmsg = "NULL lib handle.";
-		}
+static uint64_t util_bucket_wait(const CmdBucket* b, uint64_t now){
+	if(sb_count(b->sent) < b->limit) return 0;
 
-		if(!errmsg){
-			const ElfW(Sym)* sym = NULL;
-			Dl_info unused;
-			if(dladdr1(m->ctx, &unused, (void**)&sym, RTLD_DL_SYMENT) == 0){
-				errmsg = "dladdr1 failed.";
-			} else if(sym->st_size < (sizeof(void*)*23)) {
+	uint64_t ready = b->sent[b->next] + b->window_ms;
+	return ready > now ? ready - now : 0;
+}
 
-				// NOTE: ABI Table for IRCModuleCtx:
-				//
-				//       | sizeof(void*) | last field |
-				//       +---------------+------------+
-				//       |      x23      | on_ipc     |
-				//       |      x24      | on_filter  |
-				//       |      x25      | on_unknown |
-				//       |      x27      | help_url   |
+static void util_bucket_take(CmdBucket* b, uint64_t now){
+	if(sb_count(b->sent) < b->limit){
+		sb_push(b->sent, now);
+	} else {
+		b->sent[b->next] = now;
+		b->next = (b->next + 1) % b->limit;
+	}
+}
 
-				errmsg = "version mismatch (wrong size irc_mod_ctx)";
-			} else {
-				m->ctx_size = sym->st_size;
-			}
-		}
+// the highest priority lane with something in it, or NULL if the queue is empty.
+static CmdLane* util_cmd_lane(CmdQueue* q){
+	for(int i = 0; i < CMD_PRIO_COUNT; ++i){
+		if(q->lanes[i].count) return q->lanes + i;
+	}
+	return NULL;
+}
 
-		if(errmsg){
-			puts("");
-			fprintf(stderr, "** Error loading module %s:\n  %s\n", mod_name, errmsg);
-			if(m->lib_handle){
-				dlclose(m->lib_handle);
-				m->lib_handle = NULL;
-			}
-			free(m->lib_path);
-			sb_erase(irc_modules, m - irc_modules);
-			--m;
-		} else {
-			struct link_map* mod_info = m->lib_handle;
-			printf("[0x%zx]\n", (size_t)mod_info->l_addr);
+static IRCCmd util_cmd_pop(CmdLane* l){
+	IRCCmd cmd = l->ring[l->head];
+	l->head = (l->head + 1) % CMD_QUEUE_MAX;
+	--l->count;
+	return cmd;
+}
+
+// the buckets a command has to conform to before it can be sent, based on twitch's rate classes.
+static size_t util_cmd_buckets(CmdQueue* q, const IRCCmd* cmd, CmdBucket** out){
+	size_t n = 0;
+
+	if(!irc_is_twitch){
+		out[n++] = &cmd_bucket;
+	} else if(cmd->cmd == IRC_CMD_JOIN || cmd->cmd == IRC_CMD_PART){
+		out[n++] = &cmd_bucket_join;
+	} else {
+		out[n++] = &cmd_bucket_mod;
+		if(!q->is_mod){
+			out[n++] = &cmd_bucket_msg;
+			if(q->chan) out[n++] = &q->bucket;
 		}
 	}
 
-	qsort(irc_modules, sb_count(irc_modules), sizeof(*irc_modules), &util_mod_sort);
+	return n;
+}
 
-	sb_each(m, irc_modules){
-		if(!m->needs_reload) continue;
-		m->needs_reload = false;
+static uint64_t util_cmd_wait(CmdQueue* q, CmdLane* l, uint64_t now){
+	CmdBucket* buckets[3];
+	size_t n = util_cmd_buckets(q, l->ring + l->head, buckets);
 
-		const char* mod_name = basename(m->lib_path);
-		printf("Init %s...\n", mod_name);
+	uint64_t wait = 0;
+	for(size_t i = 0; i < n; ++i){
+		uint64_t w = util_bucket_wait(buckets[i], now);
+		if(w > wait) wait = w;
+	}
 
-		if(!IRC_MOD_CALL(m, on_init, (core_ctx))){
-			printf("** Init failed for %s.\n", mod_name);
-			dlclose(m->lib_handle);
-			m->lib_handle = NULL;
-			free(m->lib_path);
-			sb_erase(irc_modules, m - irc_modules);
-			--m;
-			continue;
-		}
+	return wait;
+}
 
-		if(irc_ctx && irc_is_connected(irc_ctx)){
-			IRC_MOD_CALL(m, on_connect, (serv));
+static CmdQueue* util_cmd_queue_get(const char* chan, bool create){
+	sb_each(q, cmd_queues){
+		if((*q)->chan == chan || ((*q)->chan && chan && strcasecmp((*q)->chan, chan) == 0)){
+			return *q;
 		}
+	}
 
-		for(size_t i = 0; i < sb_count(channels) - 1; ++i){
-			const char** c = (const char**)channels + i;
+	if(!create) return NULL;
 
-			IRC_MOD_CALL(m, on_join, (*c, bot_nick));
-			for(size_t j = 0; j < sb_count(chan_nicks[i]); ++j){
-				IRC_MOD_CALL(m, on_join, (*c, chan_nicks[i][j]));
-			}
+	CmdQueue* q = calloc(1, sizeof(*q));
+	q->chan   = chan ? strdup(chan) : NULL;
+	q->bucket = (CmdBucket){ 1, CMD_RATE_LIMIT_MS };
+	sb_push(cmd_queues, q);
+
+	return q;
+}
+
+static void util_cmd_queue_free(CmdQueue* q){
+	for(int i = 0; i < CMD_PRIO_COUNT; ++i){
+		CmdLane* l = q->lanes + i;
+		while(l->count){
+			IRCCmd c = util_cmd_pop(l);
+			free(c.chan);
+			free(c.data);
 		}
 	}
+	sb_free(q->bucket.sent);
+	free(q->chan);
+	free(q);
 }
 
-static void util_inotify_add(INotifyWatch* watch, const char* path, uint32_t flags){
+// the longest PRIVMSG text that fits in one line to chan, or 0 if we don't know our own host yet.
+static size_t util_msg_max_len(const char* chan){
+	if(!bot_host_len) return 0;
+	return INSO_MAX(64, 512 - (int)(sizeof("PRIVMSG :\r\n") + strlen(chan) + bot_host_len));
+}
 
-	if(access(path, W_OK) != 0){
-		printf("Creating dir [%s] for inotify.\n", path);
-		if(mkdir(path, 00750) == -1){
-			perror("Error creating dir");
+static int util_cmd_prio(int cmd, const char* data){
+	static const char* mod_cmds[] = { "timeout ", "ban ", "unban ", "untimeout ", "delete ", "clear" };
+
+	if(cmd == IRC_CMD_MSG && data && (*data == '.' || *data == '/')){
+		for(size_t i = 0; i < ARRAY_SIZE(mod_cmds); ++i){
+			if(strncmp(data + 1, mod_cmds[i], strlen(mod_cmds[i])) == 0) return CMD_PRIO_HIGH;
 		}
 	}
 
-	watch->path = strdup(path);
-	watch->wd   = inotify_add_watch(inotify.fd, path, flags);
+	if(cmd == IRC_CMD_RAW && data && (strncmp(data, "KICK ", 5) == 0 || strncmp(data, "MODE ", 5) == 0)){
+		return CMD_PRIO_HIGH;
+	}
+
+	return in_cmd_dispatch ? CMD_PRIO_HIGH : CMD_PRIO_NORMAL;
 }
 
-static void util_inotify_check(const IRCCoreCtx* core_ctx){
-	struct inotify_event* ev;
-	char buff[sizeof(*ev) + NAME_MAX + 1];
-	bool reload = false;
-	bool updated_filter = false;
+static size_t util_cmd_enqueue_id(size_t id, int cmd, int prio, const char* chan, const char* data){
+	CmdQueue* q = util_cmd_queue_get(cmd == IRC_CMD_RAW ? NULL : chan, true);
+	CmdLane*  l = q->lanes + prio;
 
-	ssize_t num_read;
-	while((num_read = read(inotify.fd, &buff, sizeof(buff))) > 0){
-		for(char* p = buff; (p - buff) < num_read; p += (sizeof(*ev) + ev->len)){
-			ev = (struct inotify_event*)p;
+	if(l->count >= CMD_QUEUE_MAX){
+		++cmd_stat_dropped;
+		printf("Dropping command for [%s], its queue is full.\n", q->chan ?: "raw");
+		return 0;
+	}
 
-			if(ev->wd == inotify.module.wd){
-				if(!updated_filter){
-					updated_filter = true;
-					util_module_filter_update();
-				}
+	l->ring[(l->head + l->count++) % CMD_QUEUE_MAX] = (IRCCmd){
+		.id        = id,
+		.cmd       = cmd,
+		.chan      = chan ? strdup(chan) : NULL,
+		.data      = data ? strdup(data) : NULL,
+		.queued_ms = util_now_ms(),
+	};
 
-				Module* m = util_module_get(ev->name, MOD_GET_SONAME);
-				if(m){
-					m->needs_reload = true;
-				} else {
-					util_module_add(ev->name);
-					// XXX: Careful, this leaves some parts of the new irc_module null
-					//      if util_module_get is called later in the loop, it must check this
-				}
-				reload = true;
-			} else if(ev->wd == inotify.data.wd){
-				if(!memmem(ev->name, ev->len, ".data", 6)) continue;
-				fprintf(stderr, "%s was modified. %x\n", ev->name, ev->mask);
+	util_cmd_timer_arm();
 
-				Module* m = util_module_get(strndupa(ev->name, strlen(ev->name) - 5), MOD_GET_CTXNAME);
-				if(m){
-					m->data_modified = true;
+	return id;
+}
+
+static size_t util_cmd_next_id(void){
+	size_t id = ++last_cmd_id;
+	if(!id) id = ++last_cmd_id;
+	return id;
+}
+
+static size_t util_cmd_enqueue(int cmd, const char* chan, const char* data){
+	return util_cmd_enqueue_id(util_cmd_next_id(), cmd, util_cmd_prio(cmd, data), chan, data);
+}
+
+// twitch commands and CTCPs have to stay at the start of their own line.
+static bool util_cmd_mergeable(const IRCCmd* cmd){
+	return cmd->cmd == IRC_CMD_MSG && *cmd->data && !strchr("./\001", *cmd->data);
+}
+
+// runs on_filter over a message once, with its own id. this happens before merging, so the length checks see
+// the text that will actually be sent.
+static void util_cmd_filter(IRCCmd* cmd){
+	if(cmd->cmd != IRC_CMD_MSG || cmd->filtered) return;
+	cmd->filtered = true;
+
+	size_t len = strlen(cmd->data);
+	IRC_MOD_CALL_ALL_ABI(on_filter, (cmd->id, cmd->chan, cmd->data, len), ABI_FILTER);
+}
+
+// sends cmds[0], and any following messages merged into it, as one PRIVMSG.
+// they've already been through util_cmd_filter.
+static void util_cmd_send_msgs(IRCCmd* cmds, size_t count){
+	const char* chan = cmds[0].chan;
+
+	size_t total = 0;
+	for(size_t i = 0; i < count; ++i){
+		total += strlen(cmds[i].data) + sizeof(cmd_merge_sep);
+	}
+
+	char* line = alloca(total + 1);
+	char* p    = line;
+
+	for(size_t i = 0; i < count; ++i){
+		if(!*cmds[i].data) continue;
+
+		if(p != line){
+			memcpy(p, cmd_merge_sep, sizeof(cmd_merge_sep) - 1);
+			p += sizeof(cmd_merge_sep) - 1;
+		}
+
+		size_t len = strlen(cmds[i].data);
+		memcpy(p, cmds[i].data, len);
+		p += len;
+	}
+	*p = 0;
+
+	if(*line){
+		printf("send: [%s] [%s]\n", chan, line);
+		irc_cmd_msg(irc_ctx, chan, line);
+		IRC_MOD_CALL_ALL(on_msg_out, (chan, line));
+	}
+}
+
+// pops the next command from l, along with any short messages after it that fit on the same line.
+// messages are filtered before they're measured, one that doesn't fit stays at the head already filtered.
+static size_t util_cmd_pop_merged(CmdLane* l, IRCCmd* out, size_t max){
+	size_t n = 0;
+	out[n++] = util_cmd_pop(l);
+	util_cmd_filter(out);
+
+	size_t max_len = out[0].chan ? util_msg_max_len(out[0].chan) : 0;
+	if(!max_len || !util_cmd_mergeable(out)) return n;
+
+	size_t len = strlen(out[0].data);
+
+	while(n < max && l->count){
+		IRCCmd* next = l->ring + l->head;
+		if(next->cmd != IRC_CMD_MSG || strcmp(next->chan, out[0].chan) != 0) break;
+
+		// on_filter might queue more commands onto this lane, so look the head up again after it.
+		util_cmd_filter(next);
+		next = l->ring + l->head;
+
+		if(!*next->data){
+			out[n++] = util_cmd_pop(l);
+			continue;
+		}
+
+		if(!util_cmd_mergeable(next)) break;
+
+		size_t next_len = len + sizeof(cmd_merge_sep) - 1 + strlen(next->data);
+		if(next_len > max_len) break;
+
+		out[n++] = util_cmd_pop(l);
+		len = next_len;
+	}
+
+	return n;
+}
+
+static void util_cmd_send(IRCCmd* cmds, size_t count){
+	IRCCmd cmd = cmds[0];
+
+	switch(cmd.cmd){
+
+		case IRC_CMD_JOIN: {
+			irc_cmd_join(irc_ctx, cmd.chan, cmd.data);
+//			irc_on_join(irc_ctx, "join", cmd.data, (const char**)&cmd.chan, 1);
+		} break;
+
+		case IRC_CMD_PART: {
+			irc_cmd_part(irc_ctx, cmd.chan);
+//			irc_on_part(irc_ctx, "part", cmd.data, (const char**)&cmd.chan, 1);
+		} break;
+
+		case IRC_CMD_MSG: {
+			util_cmd_send_msgs(cmds, count);
+		} break;
+
+		case IRC_CMD_RAW: {
+			size_t len = strlen(cmd.data);
+			IRC_MOD_CALL_ALL_ABI(on_filter, (cmd.id, NULL, cmd.data, len), ABI_FILTER);
+			if(*cmd.data){
+				irc_send_raw(irc_ctx, "%s", cmd.data);
+			}
+		} break;
+	}
+
+	for(size_t i = 0; i < count; ++i){
+		if(cmds[i].chan) free(cmds[i].chan);
+		if(cmds[i].data) free(cmds[i].data);
+	}
+}
+
+// sends everything the rate limits allow right now. each priority is served in turn, and within one
+// priority the queues take turns sending a line each.
+static void util_process_pending_cmds(void){
+	uint64_t now = util_now_ms();
+
+	for(int prio = 0; prio < CMD_PRIO_COUNT; ++prio){
+		size_t idle = 0;
+
+		while(idle < sb_count(cmd_queues)){
+			cmd_queue_rr %= sb_count(cmd_queues);
+			CmdQueue* q = cmd_queues[cmd_queue_rr++];
+			CmdLane*  l = util_cmd_lane(q);
+
+			if(!l || l - q->lanes != prio || util_cmd_wait(q, l, now)){
+				++idle;
+				continue;
+			}
+			idle = 0;
+
+			CmdBucket* buckets[3];
+			size_t n = util_cmd_buckets(q, l->ring + l->head, buckets);
+			for(size_t i = 0; i < n; ++i){
+				util_bucket_take(buckets[i], now);
+			}
+
+			// pop them before sending, on_filter / on_msg_out might queue more commands.
+			IRCCmd cmds[CMD_QUEUE_MAX];
+			size_t count = util_cmd_pop_merged(l, cmds, CMD_QUEUE_MAX);
+
+			for(size_t i = 0; i < count; ++i){
+				uint32_t latency = now - cmds[i].queued_ms;
+				cmd_stat_latency = (cmd_stat_latency * 7 + latency) / 8;
+				if(latency > cmd_stat_latency_max) cmd_stat_latency_max = latency;
+			}
+			cmd_stat_sent += count;
+
+			util_cmd_send(cmds, count);
+		}
+	}
+
+	// queues for private messages come and go, don't keep them around once they're empty.
+	for(size_t i = 0; i < sb_count(cmd_queues); ++i){
+		CmdQueue* q = cmd_queues[i];
+		if(!util_cmd_lane(q) && q->chan && *q->chan != '#'){
+			util_cmd_queue_free(q);
+			sb_erase(cmd_queues, i);
+			--i;
+		}
+	}
+}
+
+static void util_module_add(const char* name){
+	char path_buf[PATH_MAX];
+	const char* path = name;
+
+	if(!strchr(path, '/')){
+		if(snprintf(path_buf, PATH_MAX, "%s%s", inotify.module.path, name) >= PATH_MAX) return;
+		path = path_buf;
+	}
+
+	if(util_module_filter_allowed(path)){
+		Module m = {
+			.lib_path = strdup(path),
+			.needs_reload = true
+		};
+
+		sb_push(irc_modules, m);
+	} else {
+		printf("NOTE: Loading module '%s' cancelled due to filter.\n", basename(path));
+	}
+}
+
+// reads the handoff version a module's .so was built with from the file, see DEFINE_HANDOFF_VERSION.
+static bool util_module_file_handoff_version(const char* path, uint32_t* version){
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) return false;
+
+	struct stat st;
+	void* map = MAP_FAILED;
+
+	if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ElfW(Ehdr))){
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if(map == MAP_FAILED) return false;
+
+	const char* base = map;
+	const size_t size = st.st_size;
+	const ElfW(Ehdr)* eh = map;
+	bool found = false;
+
+	if(memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0
+	&& eh->e_shentsize == sizeof(ElfW(Shdr))
+	&& eh->e_shoff + eh->e_shnum * sizeof(ElfW(Shdr)) <= size
+	&& eh->e_shstrndx < eh->e_shnum){
+		const ElfW(Shdr)* sh    = (const ElfW(Shdr)*)(base + eh->e_shoff);
+		const ElfW(Shdr)* names = sh + eh->e_shstrndx;
+
+		for(int i = 0; i < eh->e_shnum && !found; ++i){
+			size_t name_off = names->sh_offset + sh[i].sh_name;
+
+			if(name_off + sizeof(IRC_HANDOFF_SECTION) > size) continue;
+			if(memcmp(base + name_off, IRC_HANDOFF_SECTION, sizeof(IRC_HANDOFF_SECTION)) != 0) continue;
+			if(sh[i].sh_type == SHT_NOBITS || sh[i].sh_size < sizeof(*version)) continue;
+			if(sh[i].sh_offset + sizeof(*version) > size) continue;
+
+			memcpy(version, base + sh[i].sh_offset, sizeof(*version));
+			found = true;
+		}
+	}
+
+	munmap(map, size);
+	return found;
+}
+
+// whether the old code of m should hand its state over to the new .so, which has to be built for the same version.
+static bool util_module_handoff_ok(Module* m){
+	if(!ABI_CHECK(m, ABI_ADOPT) || !m->ctx->on_handoff) return false;
+
+	const uint32_t* old_version = dlsym(m->lib_handle, "irc_mod_handoff_version");
+	uint32_t new_version;
+
+	if(!old_version || !util_module_file_handoff_version(m->lib_path, &new_version)){
+		return false;
+	}
+
+	if(*old_version != new_version){
+		printf("Not handing over %s's state, it's changed from version %u to %u.\n", m->ctx->name, *old_version, new_version);
+		return false;
+	}
+
+	return true;
+}
+
+// makes a temp file next to m's data file for on_save to write to. Returns its fd, and the name in tmp_fname.
+static int util_module_save_open(Module* m, char** tmp_fname){
+	sb_push(mod_call_stack, m);
+
+	const char*  save_fname = core_get_datafile();
+	const size_t save_fsz   = strlen(save_fname);
+	const char   tmp_end[]  = ".XXXXXX";
+
+	*tmp_fname = malloc(save_fsz + sizeof(tmp_end));
+	memcpy(*tmp_fname, save_fname, save_fsz);
+	memcpy(*tmp_fname + save_fsz, tmp_end, sizeof(tmp_end));
+
+	int tmp_fd = mkstemp(*tmp_fname);
+	if(tmp_fd < 0){
+		fprintf(stderr, "Error saving file for %s: %s\n", m->ctx->name, strerror(errno));
+		free(*tmp_fname);
+		*tmp_fname = NULL;
+	}
+
+	sb_pop(mod_call_stack);
+	return tmp_fd;
+}
+
+// renames the temp file into place if saved is true, or removes it otherwise.
+static void util_module_save_finish(Module* m, char* tmp_fname, bool saved){
+	sb_push(mod_call_stack, m);
+	const char* save_fname = core_get_datafile();
+	sb_pop(mod_call_stack);
+
+	if(saved && rename(tmp_fname, save_fname) < 0){
+		fprintf(stderr, "Error saving file for %s: %s\n", m->ctx->name, strerror(errno));
+	} else if(!saved){
+		unlink(tmp_fname);
+	}
+
+	free(tmp_fname);
+}
+
+static void util_module_save(Module* m);
+
+// finishes the save m's forked copy was doing, once it has exited. Returns false if it's still going.
+// A copy that takes longer than SAVE_TIMEOUT_MS is killed, and the module is saved inline instead.
+static bool util_module_save_reap(Module* m, bool block){
+	if(!m->save_pid) return true;
+
+	int status;
+	pid_t pid;
+	bool timed_out = false;
+
+	for(;;){
+		while((pid = waitpid(m->save_pid, &status, WNOHANG)) == -1 && errno == EINTR);
+		if(pid != 0) break;
+
+		// the fork only copies the thread that called it, so if another one (e.g. a module's worker) held a lock
+		// the child needs, like stdio's or malloc's, the child waits on it forever.
+		if(util_now_ms() - m->save_start >= SAVE_TIMEOUT_MS){
+			fprintf(stderr, "Saving %s is taking too long, killing it.\n", m->ctx->name);
+			kill(m->save_pid, SIGKILL);
+			while((pid = waitpid(m->save_pid, &status, 0)) == -1 && errno == EINTR);
+			timed_out = true;
+			break;
+		}
+
+		if(!block) return false;
+		usleep(SAVE_REAP_MS * 1000);
+	}
+
+	bool saved = false;
+	if(pid == -1){
+		perror("waitpid");
+	} else if(WIFSIGNALED(status)){
+		fprintf(stderr, "Error saving file for %s: killed by signal %d\n", m->ctx->name, WTERMSIG(status));
+	} else {
+		saved = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+
+	// disable the data watch while renaming, like util_module_save does, so the module doesn't reload its own file.
+	inotify.data.wd = inotify_add_watch(inotify.fd, inotify.data.path, IN_DELETE_SELF);
+	util_module_save_finish(m, m->save_tmp, saved);
+	inotify.data.wd = inotify_add_watch(inotify.fd, inotify.data.path, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+	m->save_pid = 0;
+	m->save_tmp = NULL;
+
+	// util_module_save does it straight after a blocking reap anyway.
+	if(timed_out && !block){
+		util_module_save(m);
+	}
+
+	return true;
+}
+
+static void util_module_save(Module* m){
+	if(!m->ctx || !m->ctx->on_save) return;
+
+	// a save still being written in the background is older than this one, so let it land first.
+	util_module_save_reap(m, true);
+	m->save_pending = false;
+
+	// change the inotify data watch to something we don't care about to disable it temporarily
+	inotify.data.wd = inotify_add_watch(inotify.fd, inotify.data.path, IN_DELETE_SELF);
+
+	char* tmp_fname;
+	int tmp_fd = util_module_save_open(m, &tmp_fname);
+
+	if(tmp_fd >= 0){
+		FILE* tmp_file = fdopen(tmp_fd, "wb");
+		bool saved = IRC_MOD_CALL(m, on_save, (tmp_file));
+		fclose(tmp_file);
+
+		util_module_save_finish(m, tmp_fname, saved);
+	}
+
+	inotify.data.wd = inotify_add_watch(inotify.fd, inotify.data.path, IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
+static void util_save_reap(intptr_t arg);
+
+// runs on_save in a forked copy of the bot, so the IRC thread only pays for the fork. The child's memory is a
+// snapshot of the module's state, and it's renamed into place by util_module_save_reap once the child is done.
+static void util_module_save_fork(Module* m){
+	if(!m->ctx || !m->ctx->on_save) return;
+
+	// the init pool threads could be anywhere in the core or a module's on_init, holding any lock.
+	if(m->ctx->flags & IRC_MOD_SAVE_INLINE || init_threads > 0){
+		util_module_save(m);
+		return;
+	}
+
+	char* tmp_fname;
+	int tmp_fd = util_module_save_open(m, &tmp_fname);
+	if(tmp_fd < 0) return;
+
+	// otherwise anything still buffered would be written by both processes.
+	fflush(NULL);
+
+	pid_t pid = fork();
+
+	if(pid == 0){
+		FILE* tmp_file = fdopen(tmp_fd, "wb");
+		bool saved = IRC_MOD_CALL(m, on_save, (tmp_file));
+		saved = fclose(tmp_file) == 0 && saved;
+		fflush(NULL);
+		_exit(saved ? 0 : 1);
+	}
+
+	close(tmp_fd);
+
+	if(pid == -1){
+		perror("fork");
+		unlink(tmp_fname);
+		free(tmp_fname);
+		util_module_save(m);
+		return;
+	}
+
+	m->save_pid   = pid;
+	m->save_tmp   = tmp_fname;
+	m->save_start = util_now_ms();
+
+	if(!save_reap_timer){
+		save_reap_timer = util_timer_add(NULL, util_now_ms() + SAVE_REAP_MS, SAVE_REAP_MS, &util_save_reap, 0);
+	}
+}
+
+// saves every module that asked to since the timer was armed.
+static void util_save_run(intptr_t arg){
+	save_timer = 0;
+
+	sb_each(m, irc_modules){
+		// only one save per module at a time, it'll be started again when the current one is reaped.
+		// modules still in on_init are saved once it's done.
+		if(!m->save_pending || m->save_pid || m->state != MOD_LIVE) continue;
+
+		m->save_pending = false;
+		util_module_save_fork(m);
+	}
+}
+
+static void util_save_arm(void){
+	if(!save_timer){
+		save_timer = util_timer_add(NULL, util_now_ms() + save_delay_ms, 0, &util_save_run, 0);
+	}
+}
+
+static void util_save_reap(intptr_t arg){
+	bool busy = false;
+
+	sb_each(m, irc_modules){
+		if(!util_module_save_reap(m, false)){
+			busy = true;
+		} else if(m->save_pending){
+			util_save_arm();
+		}
+	}
+
+	if(!busy){
+		util_timer_del(save_reap_timer);
+		save_reap_timer = 0;
+	}
+}
+
+static Module* util_module_get(const char* name, int type){
+	sb_each(m, irc_modules){
+		const char* base_path = basename(m->lib_path);
+
+		if(type == MOD_GET_CTXNAME && !m->ctx){ // can happen inside inotify loop
+			continue;
+		}
+
+		const char* comparison
+			= (type == MOD_GET_CTXNAME)	? m->ctx->name
+			: (type == MOD_GET_SONAME)  ? base_path
+			: NULL;
+
+		if(strcmp(name, comparison) == 0){
+			return m;
+		}
+	}
+	return NULL;
+}
+
+static int util_mod_sort(const void* a, const void* b){
+	return ((Module*)b)->ctx->priority - ((Module*)a)->ctx->priority;
+}
+
+// brings a module that was just initialized up to date with the connection and channels it missed.
+static void util_module_catch_up(Module* m){
+	if(irc_ctx && irc_is_connected(irc_ctx)){
+		IRC_MOD_CALL(m, on_connect, (serv));
+	}
+
+	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
+		const char** c = (const char**)channels + i;
+
+		IRC_MOD_CALL(m, on_join, (*c, bot_nick));
+
+		if(ABI_CHECK(m, ABI_JOIN_BULK) && m->ctx->on_join_bulk){
+			IRC_MOD_CALL(m, on_join_bulk, (*c, (const char**)chan_nicks[i], sb_count(chan_nicks[i])));
+		} else {
+			for(size_t j = 0; j < sb_count(chan_nicks[i]); ++j){
+				IRC_MOD_CALL(m, on_join, (*c, chan_nicks[i][j]));
+			}
+		}
+	}
+}
+
+// true if m asked to have its on_init run on the pool. mod_core never is, the others' on_meta relies on it.
+static bool util_init_async(Module* m){
+	if(!ABI_CHECK(m, ABI_INIT_AFTER) || strcmp(m->ctx->name, "core") == 0){
+		return false;
+	}
+
+	return m->ctx->init_after || (m->ctx->flags & IRC_MOD_INIT_ASYNC);
+}
+
+// with async, modules that opted in with init_after / IRC_MOD_INIT_ASYNC are only queued for the init pool.
+static void util_reload_modules(const IRCCoreCtx* core_ctx, bool async){
+
+	sb_each(m, irc_modules){
+		if(!m->needs_reload) continue;
+
+		const char* mod_name = basename(m->lib_path);
+
+		bool allowed = util_module_filter_allowed(mod_name);
+
+		if(m->lib_handle){
+			util_module_detach(m);
+
+			// the new code can carry on with the old one's state instead of loading it all again, so the save is
+			// only started here, not waited for. One that's still being written is redone once it's reaped.
+			if(allowed && util_module_handoff_ok(m)){
+				if(m->save_pid){
+					m->save_pending = true;
+				} else {
+					m->save_pending = false;
+					util_module_save_fork(m);
+				}
+				m->handoff = IRC_MOD_CALL(m, on_handoff, ());
+			}
+
+			if(!m->handoff){
+				util_module_save(m);
+				IRC_MOD_CALL(m, on_quit, ());
+				if(m->save_pending) util_module_save(m);
+			}
+
+			dlclose(m->lib_handle);
+		}
+
+		if(!allowed){
+			printf("Module '%s' is now filtered. Unloading.\n", mod_name);
+			free(m->lib_path);
+			sb_erase(irc_modules, m - irc_modules);
+			--m;
+			continue;
+		}
+
+		dlerror();
+		m->lib_handle = dlopen(m->lib_path, RTLD_LAZY | RTLD_LOCAL);
+
+		printf("Loading module %-20s", mod_name);
+
+		const char* errmsg = dlerror();
+		if(!errmsg && m->lib_handle){
+			m->ctx = dlsym(m->lib_handle, "irc_mod_ctx");
+			errmsg = dlerror();
+		} else if(!errmsg && !m->lib_handle){
+			errmsg = "NULL lib handle.";
+		}
+
+		if(!errmsg){
+			const ElfW(Sym)* sym = NULL;
+			Dl_info unused;
+			if(dladdr1(m->ctx, &unused, (void**)&sym, RTLD_DL_SYMENT) == 0){
+				errmsg = "dladdr1 failed.";
+			} else if(sym->st_size < (sizeof(void*)*23)) {
+
+				// NOTE: ABI Table for IRCModuleCtx:
+				//
+				//       | sizeof(void*) | last field |
+				//       +---------------+------------+
+				//       |      x23      | on_ipc     |
+				//       |      x24      | on_filter  |
+				//       |      x25      | on_unknown |
+				//       |      x27      | help_url   |
+				//       |      x28      | on_join_bulk |
+				//       |      x30      | on_adopt   |
+				//       |      x31      | init_after |
+
+				errmsg = "version mismatch (wrong size irc_mod_ctx)";
+			} else {
+				m->ctx_size = sym->st_size;
+			}
+		}
+
+		if(errmsg){
+			puts("");
+			fprintf(stderr, "** Error loading module %s:\n  %s\n", mod_name, errmsg);
+			if(m->handoff){
+				fprintf(stderr, "** The state %s handed over is lost.\n", mod_name);
+			}
+			if(m->lib_handle){
+				dlclose(m->lib_handle);
+				m->lib_handle = NULL;
+			}
+			free(m->lib_path);
+			sb_erase(irc_modules, m - irc_modules);
+			--m;
+		} else {
+			struct link_map* mod_info = m->lib_handle;
+			printf("[0x%zx]\n", (size_t)mod_info->l_addr);
+		}
+	}
+
+	qsort(irc_modules, sb_count(irc_modules), sizeof(*irc_modules), &util_mod_sort);
+
+	sb_each(m, irc_modules){
+		if(!m->needs_reload) continue;
+		m->needs_reload = false;
+
+		const char* mod_name = basename(m->lib_path);
+
+		void* handoff = m->handoff;
+		m->handoff = NULL;
+
+		if(handoff && ABI_CHECK(m, ABI_ADOPT) && m->ctx->on_adopt){
+			uint64_t start = util_now_ms();
+			printf("Adopt %s...\n", mod_name);
+
+			if(IRC_MOD_CALL(m, on_adopt, (core_ctx, handoff))){
+				printf("Adopted %s in %ums.\n", mod_name, (unsigned)(util_now_ms() - start));
+				continue;
+			}
+		} else if(handoff){
+			fprintf(stderr, "** %s can't adopt the state its old code handed over, it's lost.\n", mod_name);
+		}
+
+		if(async && util_init_async(m)){
+			m->state = MOD_QUEUED;
+			continue;
+		}
+
+		printf("Init %s...\n", mod_name);
+
+		if(!IRC_MOD_CALL(m, on_init, (core_ctx))){
+			printf("** Init failed for %s.\n", mod_name);
+			util_module_detach(m);
+			dlclose(m->lib_handle);
+			m->lib_handle = NULL;
+			free(m->lib_path);
+			sb_erase(irc_modules, m - irc_modules);
+			--m;
+			continue;
+		}
+
+		util_module_catch_up(m);
+	}
+
+	util_cmd_index_build();
+	util_mod_index_build();
+	util_perms_clear();
+	util_tick_update();
+
+	if(async){
+		util_init_start();
+	}
+}
+
+static void util_inotify_add(INotifyWatch* watch, const char* path, uint32_t flags){
+
+	if(access(path, W_OK) != 0){
+		printf("Creating dir [%s] for inotify.\n", path);
+		if(mkdir(path, 00750) == -1){
+			perror("Error creating dir");
+		}
+	}
+
+	watch->path = strdup(path);
+	watch->wd   = inotify_add_watch(inotify.fd, path, flags);
+}
+
+static void util_inotify_check(const IRCCoreCtx* core_ctx){
+	struct inotify_event* ev;
+	char buff[sizeof(*ev) + NAME_MAX + 1];
+	bool reload = false;
+	bool updated_filter = false;
+
+	ssize_t num_read;
+	while((num_read = read(inotify.fd, &buff, sizeof(buff))) > 0){
+		for(char* p = buff; (p - buff) < num_read; p += (sizeof(*ev) + ev->len)){
+			ev = (struct inotify_event*)p;
+
+			if(ev->wd == inotify.module.wd){
+				if(!updated_filter){
+					updated_filter = true;
+					util_module_filter_update();
+				}
+
+				Module* m = util_module_get(ev->name, MOD_GET_SONAME);
+				if(m){
+					m->needs_reload = true;
+				} else {
+					util_module_add(ev->name);
+					// XXX: Careful, this leaves some parts of the new irc_module null
+					//      if util_module_get is called later in the loop, it must check this
+				}
+				reload = true;
+			} else if(ev->wd == inotify.data.wd){
+				if(!memmem(ev->name, ev->len, ".data", 6)) continue;
+				fprintf(stderr, "%s was modified. %x\n", ev->name, ev->mask);
+
+				Module* m = util_module_get(strndupa(ev->name, strlen(ev->name) - 5), MOD_GET_CTXNAME);
+				if(m){
+					m->data_modified = true;
 				}
 			} else if(ev->wd == inotify.ipc.wd){
 				struct sockaddr_un addr;
 
-				assert(strlen(ev->name) + strlen(inotify.ipc.path) + 1 < sizeof(addr.sun_path));
+				assert(strlen(ev->name) + strlen(inotify.ipc.path) + 1 < sizeof(addr.sun_path));
+
+				strcpy(addr.sun_path, inotify.ipc.path);
+				strcat(addr.sun_path, ev->name);
+
+				if(ev->mask & IN_DELETE){
+					util_ipc_del(addr.sun_path);
+				} else {
+					util_ipc_add(addr.sun_path);
+				}
+			}
+		}
+	}
+
+	sb_each(m, irc_modules){
+		if(!m->data_modified) continue;
+		m->data_modified = false;
+
+		fprintf(stderr, "Calling on_data_modified for %s\n", m->ctx->name);
+		IRC_MOD_CALL(m, on_modified, ());
+	}
+
+	if(reload){
+		util_reload_modules(core_ctx, false);
+	}
+}
+
+// makes the ring our peers write messages for us into, see IPCRing.
+static bool util_ipc_ring_create(void){
+	const size_t map_size = sizeof(IPCRing) + IPC_RING_SIZE;
+
+	if((ipc_ring_fd = memfd_create("insobot-ipc", MFD_CLOEXEC)) == -1 || ftruncate(ipc_ring_fd, map_size) == -1){
+		perror("ipc_init: memfd");
+		goto fail;
+	}
+
+	ipc_ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ipc_ring_fd, 0);
+	if(ipc_ring == MAP_FAILED){
+		perror("ipc_init: mmap");
+		ipc_ring = NULL;
+		goto fail;
+	}
+
+	if((ipc_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1){
+		perror("ipc_init: eventfd");
+		goto fail;
+	}
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&ipc_ring->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	ipc_ring->hdr_size = sizeof(IPCRing);
+	ipc_ring->size     = IPC_RING_SIZE;
+	ipc_ring->magic    = IPC_RING_MAGIC;
+
+	return true;
+
+fail:
+	if(ipc_ring) munmap(ipc_ring, map_size);
+	if(ipc_ring_fd != -1) close(ipc_ring_fd);
+	ipc_ring = NULL;
+	ipc_ring_fd = -1;
+	return false;
+}
+
+// sends a peer the fds for our ring and eventfd, it replies with its own if it hasn't sent them already.
+static void util_ipc_hello(IPCAddress* p){
+	if(!ipc_ring || p->hello_sent) return;
+
+	int fds[2] = { ipc_ring_fd, ipc_efd };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} ctrl = {};
+
+	struct iovec iov = { (void*)ipc_hello, sizeof(ipc_hello) };
+	struct msghdr msg = {
+		.msg_name       = &p->addr,
+		.msg_namelen    = sizeof(p->addr),
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+
+	struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type  = SCM_RIGHTS;
+	c->cmsg_len   = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+	if(sendmsg(ipc_socket, &msg, 0) == -1){
+		perror("ipc_hello: sendmsg");
+		return;
+	}
+
+	p->hello_sent = true;
+}
+
+static void util_ipc_peer_free(IPCAddress* p){
+	if(p->ring){
+		munmap(p->ring, sizeof(IPCRing) + p->ring->size);
+		close(p->ring_efd);
+		p->ring = NULL;
+	}
+}
+
+// maps the ring a peer sent us the fds for, messages to it go in there instead of datagrams from now on.
+static bool util_ipc_attach(IPCAddress* p, int ring_fd, int efd){
+	struct stat st;
+	IPCRing* r = MAP_FAILED;
+
+	if(fstat(ring_fd, &st) == 0 && (size_t)st.st_size > sizeof(IPCRing)){
+		r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+	}
+	close(ring_fd);
+
+	if(r == MAP_FAILED){
+		close(efd);
+		return false;
+	}
+
+	const uint32_t size = r->size;
+
+	if(r->magic != IPC_RING_MAGIC || r->hdr_size != sizeof(IPCRing) || !size || (size & (size - 1)) || sizeof(IPCRing) + size != (size_t)st.st_size){
+		fprintf(stderr, "ipc: %d's ring is in a different format, it'll get datagrams.\n", p->id);
+		munmap(r, st.st_size);
+		close(efd);
+		return false;
+	}
+
+	util_ipc_peer_free(p);
+	p->ring     = r;
+	p->ring_efd = efd;
+
+	return true;
+}
+
+static void util_ipc_init(void){
+	char ipc_dir[128];
+	struct stat st;
+
+	// get dir to store ipc sockets
+
+	const char* ipc_dir_prefix   = getenv("XDG_RUNTIME_DIR");
+	const char  ipc_dir_suffix[] = "/insobot/";
+
+	if(!ipc_dir_prefix || stat(ipc_dir_prefix, &st) == -1 || !S_ISDIR(st.st_mode) || access(ipc_dir_prefix, W_OK) == -1){
+		ipc_dir_prefix = "/run/shm";
+	}
+
+	if(strlen(ipc_dir_prefix) + sizeof(ipc_dir_suffix) + 8 > sizeof(ipc_self.addr.sun_path)){
+		fprintf(stderr, "IPC dir name too long!");
+		return;
+	}
+
+	strcpy(ipc_dir, ipc_dir_prefix);
+	strcat(ipc_dir, ipc_dir_suffix);
+
+	if(stat(ipc_dir, &st) == -1){
+		if(mkdir(ipc_dir, 0777) == -1){
+			perror("ipc_init: mkdir");
+		}
+	}
+
+	// create our socket
+
+	ipc_self.id = getpid();
+	ipc_self.addr.sun_family = AF_UNIX;
+
+	snprintf(ipc_self.addr.sun_path, sizeof(ipc_self.addr.sun_path), "%s%d", ipc_dir, ipc_self.id);
+	unlink(ipc_self.addr.sun_path);
+
+	printf("IPC socket: %s\n", ipc_self.addr.sun_path);
+
+	ipc_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if(ipc_socket == -1){
+		perror("ipc_init: socket");
+	}
+
+	if(bind(ipc_socket, &ipc_self.addr, sizeof(ipc_self.addr)) == -1){
+		perror("ipc_init: bind");
+	}
+
+	// and the ring the peers will write to, without it they just send datagrams to the socket.
+
+	if(!util_ipc_ring_create()){
+		fprintf(stderr, "ipc_init: no shared memory ring, falling back to datagrams.\n");
+	}
+
+	// get all the peer addresses in the dir
+
+	util_inotify_add(&inotify.ipc, ipc_dir, IN_CREATE | IN_DELETE | IN_MOVED_TO);
+
+	strcat(ipc_dir, "*");
+
+	glob_t glob_data;
+	if(glob(ipc_dir, 0, NULL, &glob_data) != 0){
+		perror("ipc_init: glob");
+	} else {
+		for(size_t i = 0; i < glob_data.gl_pathc; ++i){
+			if(strcmp(ipc_self.addr.sun_path, glob_data.gl_pathv[i]) == 0) continue;
+
+			IPCAddress peer = {
+				.id   = atoi(basename(glob_data.gl_pathv[i])),
+				.addr = { .sun_family = AF_UNIX }
+			};
+
+			printf("ipc_init: adding peer %d [%s]\n", peer.id, glob_data.gl_pathv[i]);
+
+			strcpy(peer.addr.sun_path, glob_data.gl_pathv[i]);
+			sb_push(ipc_peers, peer);
+		}
+
+		globfree(&glob_data);
+	}
+
+	// check for stale peers, on a separate socket since disconnecting ipc_socket would drop any hellos it has queued.
+
+	int probe = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	for(IPCAddress* p = ipc_peers; p < sb_end(ipc_peers); ++p){
+		if(connect(probe, &p->addr, sizeof(p->addr)) == -1){
+			if(errno == ECONNREFUSED){
+				unlink(p->addr.sun_path);
+			}
+			sb_erase(ipc_peers, p - ipc_peers);
+			--p;
+		} else {
+			struct sockaddr sa = { .sa_family = AF_UNSPEC };
+			connect(probe, &sa, sizeof(sa));
+		}
+	}
+
+	if(probe != -1) close(probe);
+
+	sb_each(p, ipc_peers){
+		util_ipc_hello(p);
+	}
+}
+
+static IPCAddress* util_ipc_add(const char* name){
+	for(size_t i = 0; i < sb_count(ipc_peers); ++i){
+		if(strcmp(ipc_peers[i].addr.sun_path, name) == 0){
+			return ipc_peers + i;
+		}
+	}
+
+	IPCAddress peer = {
+		.id   = atoi(basename(name)),
+		.addr = {
+			.sun_family = AF_UNIX
+		}
+	};
+
+	strcpy(peer.addr.sun_path, name);
+	sb_push(ipc_peers, peer);
+
+	printf("ipc_add: %d: [%s]\n", peer.id, peer.addr.sun_path);
+
+	util_ipc_hello(&sb_last(ipc_peers));
+
+	return &sb_last(ipc_peers);
+}
+
+static void util_ipc_del(const char* name){
+	for(size_t i = 0; i < sb_count(ipc_peers); ++i){
+		if(strcmp(ipc_peers[i].addr.sun_path, name) == 0){
+			util_ipc_peer_free(ipc_peers + i);
+			sb_erase(ipc_peers, i);
+			break;
+		}
+	}
+}
+
+static bool util_mod_index_cmp(const void* entry, void* param){
+	return strcmp(((const ModIndexEntry*)entry)->name, param) == 0;
+}
+
+// rebuilds mod_index, this needs to be called whenever irc_modules changes like util_cmd_index_build.
+// if two modules have the same name, the first one gets its messages.
+static void util_mod_index_build(void){
+	inso_ht_free(&mod_index);
+	inso_ht_init(&mod_index, 64, sizeof(ModIndexEntry), &util_index_hash);
+
+	for(size_t i = 0; i < sb_count(irc_modules); ++i){
+		const char* name = irc_modules[i].ctx->name;
+		ModIndexEntry e = { util_fold_hash(name, false), name, i };
+
+		if(!inso_ht_get(&mod_index, e.hash, &util_mod_index_cmp, (void*)name)){
+			inso_ht_put(&mod_index, &e);
+		}
+	}
+}
+
+static void util_ipc_deliver(int sender, const char* name, const uint8_t* data, size_t data_len){
+	ModIndexEntry* e = inso_ht_get(&mod_index, util_fold_hash(name, false), &util_mod_index_cmp, (void*)name);
+	if(!e) return;
+
+	Module* m = irc_modules + e->idx;
+	if(m->state != MOD_LIVE) return;
+
+	printf("Got IPC msg from %d for %s\n", sender, name);
+	IRC_MOD_CALL(m, on_ipc, (sender, data, data_len));
+}
+
+// the socket gets the hellos with peers' ring fds, and messages from instances that don't have one.
+static void util_ipc_recv(void){
+	char buffer[4096];
+	struct sockaddr_un addr;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+	} ctrl;
+
+	struct iovec iov = { buffer, sizeof(buffer) };
+	struct msghdr msg = {
+		.msg_name       = &addr,
+		.msg_namelen    = sizeof(addr),
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+
+	ssize_t num = recvmsg(ipc_socket, &msg, MSG_CMSG_CLOEXEC);
+	if(num == -1){
+		perror("ipc_recv: recvmsg");
+		return;
+	}
+
+	assert(addr.sun_family == AF_UNIX);
+
+	IPCAddress* peer = util_ipc_add(addr.sun_path);
+
+	int fds[2] = { -1, -1 };
+	size_t fd_count = 0;
+
+	for(struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)){
+		if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+
+		for(size_t i = 0; i < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i){
+			int fd;
+			memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+
+			if(fd_count < 2){
+				fds[fd_count++] = fd;
+			} else {
+				close(fd);
+			}
+		}
+	}
+
+	if(num == sizeof(ipc_hello) && memcmp(buffer, ipc_hello, sizeof(ipc_hello)) == 0 && fd_count == 2){
+		bool restarted = peer->ring;
+
+		if(util_ipc_attach(peer, fds[0], fds[1])){
+			printf("ipc: attached ring of %d\n", peer->id);
+
+			// a new process with the same id, it won't know about our ring either.
+			if(restarted) peer->hello_sent = false;
+			util_ipc_hello(peer);
+		}
+		return;
+	}
+
+	for(size_t i = 0; i < fd_count; ++i){
+		close(fds[i]);
+	}
+
+	const size_t name_len = strnlen(buffer, num);
+	if(name_len == (size_t)num) return;
+
+	util_ipc_deliver(peer->id, buffer, (uint8_t*)buffer + name_len + 1, num - name_len - 1);
+}
+
+static void util_ipc_ring_read(const IPCRing* r, uint64_t pos, void* dst, size_t n){
+	const size_t off   = pos & (r->size - 1);
+	const size_t first = INSO_MIN(n, r->size - off);
+
+	memcpy(dst, r->data + off, first);
+	memcpy((uint8_t*)dst + first, r->data, n - first);
+}
+
+static void util_ipc_ring_write(IPCRing* r, uint64_t pos, const void* src, size_t n){
+	const size_t off   = pos & (r->size - 1);
+	const size_t first = INSO_MIN(n, r->size - off);
+
+	memcpy(r->data + off, src, first);
+	memcpy(r->data, (const uint8_t*)src + first, n - first);
+}
+
+// delivers everything peers have written into our ring since last time. Frames that don't wrap around the
+// end of the ring are passed to on_ipc where they are, the space is only given back once they're all done.
+static void util_ipc_ring_io(int fd, uint32_t events, intptr_t arg){
+	eventfd_t val;
+	eventfd_read(fd, &val);
+
+	IPCRing* r = ipc_ring;
+	uint64_t head = r->head;
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	while(head < tail){
+		IPCFrame f;
+		util_ipc_ring_read(r, head, &f, sizeof(f));
+
+		const size_t padded = ((size_t)f.len + 7) & ~(size_t)7;
+
+		if(tail - head > r->size || f.len < sizeof(f) + f.name_len || !f.name_len || padded > tail - head){
+			fprintf(stderr, "ipc: bad frame in our ring, dropping %zu bytes.\n", (size_t)(tail - head));
+			head = tail;
+			break;
+		}
+
+		const uint8_t* frame;
+		if((head & (r->size - 1)) + f.len <= r->size){
+			frame = r->data + (head & (r->size - 1));
+		} else {
+			if(ipc_scratch) stb__sbn(ipc_scratch) = 0;
+			frame = sb_add(ipc_scratch, f.len);
+			util_ipc_ring_read(r, head, ipc_scratch, f.len);
+		}
+
+		const char* name = (const char*)frame + sizeof(f);
+		if(name[f.name_len - 1] == '\0'){
+			util_ipc_deliver(f.sender, name, (const uint8_t*)name + f.name_len, f.len - sizeof(f) - f.name_len);
+		}
+
+		head += padded;
+	}
+
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+// appends the frames in ipc_out for peer p to its ring in one go, until one doesn't fit. Returns how many bytes it wrote.
+static size_t util_ipc_ring_put(IPCAddress* p){
+	IPCRing* r = p->ring;
+
+	int ret = pthread_mutex_lock(&r->lock);
+
+	// another instance died while holding it. tail only moves once a whole batch is in, so nothing needs undoing.
+	if(ret == EOWNERDEAD){
+		pthread_mutex_consistent(&r->lock);
+	} else if(ret != 0){
+		return 0;
+	}
+
+	const uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	const uint64_t start = r->tail;
+	uint64_t tail = start;
+
+	sb_each(e, ipc_pending){
+		if(e->target != 0 && e->target != p->id) continue;
+
+		const IPCFrame* f = (IPCFrame*)(ipc_out + e->off);
+		const size_t padded = (f->len + 7) & ~7u;
+
+		if(tail + padded - head > r->size) break;
+
+		util_ipc_ring_write(r, tail, f, padded);
+		tail += padded;
+	}
+
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&r->lock);
+
+	return tail - start;
+}
+
+// writes the frames send_ipc queued up into the peers' rings, with one lock and one wakeup per peer.
+static void util_ipc_flush(intptr_t arg){
+	ipc_flush_timer = 0;
+
+	for(IPCAddress* p = ipc_peers; p < sb_end(ipc_peers); ++p){
+		if(!p->ring) continue;
+
+		size_t total = 0;
+		sb_each(e, ipc_pending){
+			if(e->target == 0 || e->target == p->id){
+				total += (((IPCFrame*)(ipc_out + e->off))->len + 7) & ~7u;
+			}
+		}
+
+		if(!total) continue;
+
+		const size_t written = util_ipc_ring_put(p);
+		if(written){
+			eventfd_write(p->ring_efd, 1);
+		}
+
+		if(written == total) continue;
+
+		// it died without removing its socket, or it's stuck.
+		if(kill(p->id, 0) == -1 && errno == ESRCH){
+			printf("removing [%s]\n", p->addr.sun_path);
+			unlink(p->addr.sun_path);
+			util_ipc_peer_free(p);
+			sb_erase(ipc_peers, p - ipc_peers);
+			--p;
+		} else {
+			fprintf(stderr, "ipc: %d's ring is full, dropped %zu bytes.\n", p->id, total - written);
+		}
+	}
+
+	sb_free(ipc_out);
+	sb_free(ipc_pending);
+}
+
+// adds a frame to the batch for util_ipc_flush, which runs once the current event has been dealt with.
+static void util_ipc_queue(int target, const char* name, const void* data, size_t data_len){
+	const size_t name_len = strlen(name) + 1;
+	const size_t len      = sizeof(IPCFrame) + name_len + data_len;
+	const size_t padded   = (len + 7) & ~7u;
+
+	if(padded > IPC_RING_SIZE){
+		fprintf(stderr, "send_ipc: %zu bytes for %s won't fit in a ring.\n", data_len, name);
+		return;
+	}
+
+	IPCPending e = { target, sb_count(ipc_out) };
+	sb_push(ipc_pending, e);
+
+	uint8_t* p = memset(sb_add(ipc_out, padded), 0, padded);
+	IPCFrame f = {
+		.len      = len,
+		.sender   = ipc_self.id,
+		.name_len = name_len,
+	};
+
+	memcpy(p, &f, sizeof(f));
+	memcpy(p + sizeof(f), name, name_len);
+	memcpy(p + sizeof(f) + name_len, data, data_len);
+
+	if(!ipc_flush_timer){
+		ipc_flush_timer = util_timer_add(NULL, util_now_ms(), 0, &util_ipc_flush, 0);
+	}
+}
+
+static size_t util_http_write(char* ptr, size_t sz, size_t nmemb, void* arg){
+	HTTPRequest* req = arg;
+	const size_t total = sz * nmemb;
+
+	memcpy(sb_add(req->data, total), ptr, total);
+
+	return total;
+}
+
+static void util_http_finish(HTTPRequest* req, Module* m, long result){
+	for(size_t i = 0; i < sb_count(http_reqs); ++i){
+		if(http_reqs[i] == req){
+			sb_erase(http_reqs, i);
+			break;
+		}
+	}
+
+	curl_multi_remove_handle(curl_multi, req->curl);
+	sb_push(req->data, 0);
+
+	if(m){
+		sb_push(mod_call_stack, m);
+		req->cb(req->curl, result, req->data, req->arg);
+		sb_pop(mod_call_stack);
+	}
+
+	curl_easy_cleanup(req->curl);
+	sb_free(req->data);
+	free(req);
+}
+
+static Module* util_module_find(const IRCModuleCtx* ctx){
+	sb_each(m, irc_modules){
+		if(m->ctx == ctx){
+			return m;
+		}
+	}
+	return NULL;
+}
+
+static void util_http_process(void){
+	CURLMsg* msg;
+	int msgs_left;
+
+	while((msg = curl_multi_info_read(curl_multi, &msgs_left))){
+		if(msg->msg != CURLMSG_DONE) continue;
+
+		HTTPRequest* req = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &req);
+
+		long result = 0;
+		if(msg->data.result != CURLE_OK){
+			result = -msg->data.result;
+		} else {
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &result);
+		}
+
+		Module* m = util_module_find(req->owner);
+
+		if(m && m->state != MOD_LIVE){
+			req->parked = true;
+			req->result = result;
+			continue;
+		}
+
+		util_http_finish(req, m, result);
+	}
+}
+
+// called before a module is unloaded, so that no callbacks point into its (soon to be unmapped) code
+static void util_http_cancel(Module* m){
+	for(size_t i = 0; i < sb_count(http_reqs); ++i){
+		if(http_reqs[i]->owner != m->ctx) continue;
+		util_http_finish(http_reqs[i], m, -CURLE_ABORTED_BY_CALLBACK);
+		--i;
+	}
+}
+
+static IOWatch* util_io_find(int fd){
+	sb_each(w, io_watches){
+		if((*w)->fd == fd){
+			return *w;
+		}
+	}
+	return NULL;
+}
+
+static bool util_io_add(int fd, uint32_t events, const IRCModuleCtx* owner, IRCFdCallback cb, intptr_t arg){
+	IOWatch* w = util_io_find(fd);
+	bool is_new = !w;
+
+	if(is_new){
+		w = calloc(1, sizeof(*w));
+		w->fd = fd;
+	}
+
+	// fds added by an on_init running on the init pool are only watched once it's done, see util_module_live.
+	Module* m = owner ? util_module_find(owner) : NULL;
+
+	struct epoll_event ev = {
+		.events   = (m && m->state != MOD_LIVE) ? 0 : events,
+		.data.ptr = w,
+	};
+
+	int ret = epoll_ctl(epoll_fd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+
+	// the fd was closed and reopened without del_fd, so epoll forgot about it.
+	if(ret == -1 && !is_new && errno == ENOENT){
+		ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	if(ret == -1){
+		if(is_new){
+			int e = errno;
+			free(w);
+			errno = e;
+		}
+		return false;
+	}
+
+	if(is_new){
+		sb_push(io_watches, w);
+	}
+
+	w->events = events;
+	w->owner  = owner;
+	w->cb     = cb;
+	w->arg    = arg;
+
+	return true;
+}
+
+static void util_io_del(int fd){
+	for(size_t i = 0; i < sb_count(io_watches); ++i){
+		IOWatch* w = io_watches[i];
+		if(w->fd != fd) continue;
+
+		// this can fail if the fd was already closed, which is fine.
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+		w->fd = -1;
+		sb_push(io_dead, w);
+		sb_erase(io_watches, i);
+		break;
+	}
+}
+
+// stops epoll reporting anything for a watched fd without forgetting the watch, or starts it again.
+static void util_io_pause(int fd, bool paused){
+	IOWatch* w = util_io_find(fd);
+	if(!w) return;
+
+	struct epoll_event ev = {
+		.events   = paused ? 0 : w->events,
+		.data.ptr = w,
+	};
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void util_io_wait(int timeout_ms){
+	struct epoll_event events[32];
+
+	// the only time the init pool can get into the core.
+	util_core_unlock();
+	int n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timeout_ms);
+	int e = errno;
+	util_core_lock();
+
+	if(n == -1 && e != EINTR){
+		errno = e;
+		perror("epoll_wait");
+	}
+
+	for(int i = 0; i < n; ++i){
+		IOWatch* w = events[i].data.ptr;
+
+		// removed by an earlier callback in this batch
+		if(w->fd == -1) continue;
+
+		if(w->owner){
+			Module* m = util_module_find(w->owner);
+			if(!m || m->state != MOD_LIVE) continue;
+
+			sb_push(mod_call_stack, m);
+			w->cb(w->fd, events[i].events, w->arg);
+			sb_pop(mod_call_stack);
+		} else {
+			w->cb(w->fd, events[i].events, w->arg);
+		}
+	}
+
+	sb_each(w, io_dead){
+		free(*w);
+	}
+	sb_free(io_dead);
+}
+
+static bool util_timer_before(uint32_t a, uint32_t b){
+	return timer_slots[timer_heap[a]].deadline < timer_slots[timer_heap[b]].deadline;
+}
+
+static void util_timer_swap(uint32_t a, uint32_t b){
+	uint32_t tmp = timer_heap[a];
+	timer_heap[a] = timer_heap[b];
+	timer_heap[b] = tmp;
+
+	timer_slots[timer_heap[a]].heap_idx = a;
+	timer_slots[timer_heap[b]].heap_idx = b;
+}
+
+static void util_timer_sift(uint32_t i){
+	while(i > 0 && util_timer_before(i, (i - 1) / 2)){
+		util_timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for(;;){
+		uint32_t l = i * 2 + 1, r = l + 1, min = i;
+		if(l < sb_count(timer_heap) && util_timer_before(l, min)) min = l;
+		if(r < sb_count(timer_heap) && util_timer_before(r, min)) min = r;
+		if(min == i) break;
+		util_timer_swap(i, min);
+		i = min;
+	}
+}
+
+static void util_timer_unlink(uint32_t slot){
+	CoreTimer* t = timer_slots + slot;
+	uint32_t i = t->heap_idx;
+	uint32_t last = sb_count(timer_heap) - 1;
+
+	if(i != last){
+		util_timer_swap(i, last);
+	}
+	sb_pop(timer_heap);
+
+	if(i != last){
+		util_timer_sift(i);
+	}
+
+	t->heap_idx = -1;
+	t->cb = NULL;
+	++t->gen;
+	sb_push(timer_free, slot);
+}
+
+static intptr_t util_timer_add(const IRCModuleCtx* owner, uint64_t deadline, uint32_t interval, IRCTimerCallback cb, intptr_t arg){
+	uint32_t slot;
+
+	if(sb_count(timer_free)){
+		slot = sb_last(timer_free);
+		sb_pop(timer_free);
+	} else {
+		slot = sb_count(timer_slots);
+		sb_push(timer_slots, (CoreTimer){ .heap_idx = -1 });
+	}
+
+	CoreTimer* t = timer_slots + slot;
+	t->deadline = deadline;
+	t->interval = interval;
+	t->owner    = owner;
+	t->cb       = cb;
+	t->arg      = arg;
+	t->heap_idx = sb_count(timer_heap);
+
+	sb_push(timer_heap, slot);
+	util_timer_sift(t->heap_idx);
+
+	return ((intptr_t)(t->gen & 0x7FFFFF) << 24) | (slot + 1);
+}
+
+static CoreTimer* util_timer_get(intptr_t handle){
+	uint32_t slot = (handle & 0xFFFFFF) - 1;
+	uint32_t gen  = handle >> 24;
+
+	if(handle <= 0 || slot >= sb_count(timer_slots)) return NULL;
+
+	CoreTimer* t = timer_slots + slot;
+	if(t->heap_idx == -1 || (t->gen & 0x7FFFFF) != gen) return NULL;
+
+	return t;
+}
+
+static void util_timer_del(intptr_t handle){
+	CoreTimer* t = util_timer_get(handle);
+	if(t){
+		util_timer_unlink(t - timer_slots);
+	}
+}
+
+// how long the main loop may block for before the earliest timer is due, -1 if there are none.
+static int util_timer_timeout(void){
+	if(!sb_count(timer_heap)) return -1;
+
+	uint64_t now = util_now_ms();
+	uint64_t deadline = timer_slots[timer_heap[0]].deadline;
+
+	if(deadline <= now) return 0;
+	return INSO_MIN(deadline - now, (uint64_t)INT_MAX);
+}
+
+static void util_timer_run(void){
+	uint64_t now = util_now_ms();
+
+	while(sb_count(timer_heap)){
+		uint32_t slot = timer_heap[0];
+		CoreTimer* t = timer_slots + slot;
+
+		if(t->deadline > now) break;
+
+		IRCTimerCallback cb = t->cb;
+		intptr_t arg = t->arg;
+		Module* m = t->owner ? util_module_find(t->owner) : NULL;
+
+		// added by an on_init that's still running on the pool, it can only go off once that's done.
+		if(m && m->state != MOD_LIVE){
+			t->deadline = now + INIT_RETRY_MS;
+			util_timer_sift(0);
+			continue;
+		}
+
+		if(t->interval){
+			// don't try to catch up on missed intervals if the loop was held up for a while.
+			t->deadline += t->interval;
+			if(t->deadline <= now){
+				t->deadline = now + t->interval;
+			}
+			util_timer_sift(0);
+		} else {
+			util_timer_unlink(slot);
+		}
+
+		if(t->owner && !m) continue;
+
+		// the callback can add or remove timers, so t is not safe to use after this.
+		if(m) sb_push(mod_call_stack, m);
+		cb(arg);
+		if(m) sb_pop(mod_call_stack);
+	}
+}
+
+static void util_io_cancel(Module* m){
+	for(size_t i = 0; i < sb_count(timer_slots); ++i){
+		if(timer_slots[i].heap_idx == -1 || timer_slots[i].owner != m->ctx) continue;
+		util_timer_unlink(i);
+	}
+
+	for(size_t i = 0; i < sb_count(io_watches); ++i){
+		if(io_watches[i]->owner != m->ctx) continue;
+		util_io_del(io_watches[i]->fd);
+		--i;
+	}
+}
+
+static void util_module_detach(Module* m){
+	util_http_cancel(m);
+	util_io_cancel(m);
+}
+
+// true if none of the modules m has to be initialized after are still waiting for or in their on_init.
+// ones that aren't loaded or failed to initialize don't hold it up.
+static bool util_init_deps_done(Module* m){
+	if(m->init_nodeps || !m->ctx->init_after) return true;
+
+	for(const char** name = m->ctx->init_after; *name; ++name){
+		Module* dep = util_module_get(*name, MOD_GET_CTXNAME);
+		if(dep && dep != m && dep->state != MOD_LIVE && dep->state != MOD_DEAD){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// the next module a pool thread can initialize, called with the core lock held.
+static Module* util_init_next(void){
+	if(!running) return NULL;
+
+	sb_each(m, irc_modules){
+		if(m->state == MOD_QUEUED && util_init_deps_done(m)){
+			return m;
+		}
+	}
+
+	return NULL;
+}
+
+// pool thread, runs on_init of queued modules until there are none left that can start yet. Everything but the
+// on_init itself happens with the core lock held, and the module takes it for any core calls through
+// core_ctx_locked. The main thread picks up the result in util_init_io.
+static void* util_init_worker(void* arg){
+	util_core_lock();
+
+	Module* m;
+	while((m = util_init_next())){
+		const char* mod_name = basename(m->lib_path);
+		m->state = MOD_INITIALIZING;
+		util_core_unlock();
+
+		uint64_t start = util_now_ms();
+		printf("Init %s...\n", mod_name);
+
+		bool ok = IRC_MOD_CALL(m, on_init, (&core_ctx_locked));
+
+		if(ok){
+			printf("Init %s done in %ums.\n", mod_name, (unsigned)(util_now_ms() - start));
+		} else {
+			printf("** Init failed for %s.\n", mod_name);
+		}
+
+		util_core_lock();
+		m->state = ok ? MOD_INIT_OK : MOD_INIT_FAILED;
+		eventfd_write(init_efd, 1);
+	}
+
+	--init_threads;
+	eventfd_write(init_efd, 1);
+	util_core_unlock();
+
+	sb_free(mod_call_stack);
+	sb_free(chan_mod_list);
+	sb_free(global_mod_list);
+
+	return NULL;
+}
 
-				strcpy(addr.sun_path, inotify.ipc.path);
-				strcat(addr.sun_path, ev->name);
+// starts pool threads for the queued modules that can be initialized now, up to INIT_THREADS at once.
+static void util_init_schedule(void){
+	if(!running) return;
 
-				if(ev->mask & IN_DELETE){
-					util_ipc_del(addr.sun_path);
-				} else {
-					util_ipc_add(addr.sun_path);
-				}
+	Module* first_queued = NULL;
+	size_t ready = 0;
+	bool busy = init_threads > 0;
+
+	sb_each(m, irc_modules){
+		if(m->state == MOD_QUEUED){
+			if(!first_queued) first_queued = m;
+			if(util_init_deps_done(m)) ++ready;
+		} else if(m->state != MOD_LIVE && m->state != MOD_DEAD){
+			busy = true;
+		}
+	}
+
+	// nothing is going to finish and let the rest start, so their init_after must go round in a circle.
+	if(first_queued && !ready && !busy){
+		fprintf(stderr, "** Modules' init_after form a cycle, initializing %s anyway.\n", first_queued->ctx->name);
+		first_queued->init_nodeps = true;
+		ready = 1;
+	}
+
+	while(ready > 0 && init_threads < INIT_THREADS){
+		pthread_t thread;
+
+		int ret = pthread_create(&thread, NULL, &util_init_worker, NULL);
+		if(ret != 0){
+			if(!init_threads){
+				errno = ret;
+				err(1, "Can't start module init thread");
 			}
+			break;
 		}
+
+		pthread_detach(thread);
+		++init_threads;
+		--ready;
 	}
+}
 
-	sb_each(m, irc_modules){
-		if(!m->data_modified) continue;
-		m->data_modified = false;
+// called on the main thread once a module's on_init on the pool is done: lets the fds, timers and http requests
+// it made go, and catches it up with the connection and channels like after a reload.
+static void util_module_live(Module* m){
+	sb_each(w, io_watches){
+		if((*w)->owner == m->ctx){
+			util_io_pause((*w)->fd, false);
+		}
+	}
 
-		fprintf(stderr, "Calling on_data_modified for %s\n", m->ctx->name);
-		IRC_MOD_CALL(m, on_modified, ());
+	for(size_t i = 0; i < sb_count(http_reqs); ++i){
+		HTTPRequest* req = http_reqs[i];
+		if(req->owner != m->ctx || !req->parked) continue;
+		util_http_finish(req, m, req->result);
+		--i;
 	}
 
-	if(reload){
-		util_reload_modules(core_ctx);
+	if(m->save_pending){
+		util_save_arm();
 	}
+
+	// its on_meta (if any) counts from now on.
+	util_perms_clear();
+	util_module_catch_up(m);
 }
 
-static void util_ipc_init(void){
-	char ipc_dir[128];
-	struct stat st;
+// the last of the pool's modules are done, so the ones that failed can go and module reloads can start again.
+static void util_init_finish(void){
+	for(size_t i = 0; i < sb_count(irc_modules); ++i){
+		Module* m = irc_modules + i;
+		if(m->state != MOD_DEAD) continue;
 
-	// get dir to store ipc sockets
+		dlclose(m->lib_handle);
+		free(m->lib_path);
+		sb_erase(irc_modules, i);
+		--i;
+	}
 
-	const char* ipc_dir_prefix   = getenv("XDG_RUNTIME_DIR");
-	const char  ipc_dir_suffix[] = "/insobot/";
+	util_cmd_index_build();
+	util_mod_index_build();
+	util_tick_update();
+	util_io_pause(inotify.fd, false);
 
-	if(!ipc_dir_prefix || stat(ipc_dir_prefix, &st) == -1 || !S_ISDIR(st.st_mode) || access(ipc_dir_prefix, W_OK) == -1){
-		ipc_dir_prefix = "/run/shm";
+	printf("Modules initialized in %ums.\n", (unsigned)(util_now_ms() - init_start));
+	init_start = 0;
+}
+
+static void util_init_io(int fd, uint32_t events, intptr_t arg){
+	eventfd_t val;
+	eventfd_read(fd, &val);
+
+	if(!init_start) return;
+
+	bool pending = false;
+
+	sb_each(m, irc_modules){
+		if(m->state == MOD_INIT_OK){
+			m->state = MOD_LIVE;
+			util_module_live(m);
+		} else if(m->state == MOD_INIT_FAILED){
+			m->state = MOD_DEAD;
+			util_module_detach(m);
+		}
+
+		if(m->state != MOD_LIVE && m->state != MOD_DEAD){
+			pending = true;
+		}
 	}
 
-	if(strlen(ipc_dir_prefix) + sizeof(ipc_dir_suffix) + 8 > sizeof(ipc_self.addr.sun_path)){
-		fprintf(stderr, "IPC dir name too long!");
-		return;
+	if(pending){
+		util_init_schedule();
+	} else {
+		util_init_finish();
 	}
+}
 
-	strcpy(ipc_dir, ipc_dir_prefix);
-	strcat(ipc_dir, ipc_dir_suffix);
+// starts the init pool on the modules util_reload_modules queued, the bot carries on and connects meanwhile.
+// inotify is paused until they're all done, so that irc_modules stays put under the pool threads.
+static void util_init_start(void){
+	bool queued = false;
 
-	if(stat(ipc_dir, &st) == -1){
-		if(mkdir(ipc_dir, 0777) == -1){
-			perror("ipc_init: mkdir");
+	sb_each(m, irc_modules){
+		if(m->state == MOD_QUEUED){
+			queued = true;
+			break;
 		}
 	}
 
-	// create our socket
+	if(!queued) return;
 
-	ipc_self.id = getpid();
-	ipc_self.addr.sun_family = AF_UNIX;
+	if(init_efd == -1){
+		if((init_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1){
+			err(errno, "eventfd");
+		}
+		util_io_add(init_efd, EPOLLIN, NULL, &util_init_io, 0);
+	}
 
-	snprintf(ipc_self.addr.sun_path, sizeof(ipc_self.addr.sun_path), "%s%d", ipc_dir, ipc_self.id);
-	unlink(ipc_self.addr.sun_path);
+	util_io_pause(inotify.fd, true);
+	init_start = util_now_ms();
+	util_init_schedule();
+}
 
-	printf("IPC socket: %s\n", ipc_self.addr.sun_path);
+static void util_irc_io(int fd, uint32_t events, intptr_t arg){
+	fd_set in, out;
 
-	ipc_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
-	if(ipc_socket == -1){
-		perror("ipc_init: socket");
+	FD_ZERO(&in);
+	FD_ZERO(&out);
+
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+		FD_SET(fd, &in);
+		irc_read_ms = util_ms();
+		ping_sent = false;
 	}
 
-	if(bind(ipc_socket, &ipc_self.addr, sizeof(ipc_self.addr)) == -1){
-		perror("ipc_init: bind");
+	if(events & EPOLLOUT){
+		FD_SET(fd, &out);
 	}
 
-	// get all the peer addresses in the dir
+	if(irc_process_select_descriptors(irc_ctx, &in, &out) != 0){
+		fprintf(stderr, "Error processing select fds: %s\n", irc_strerror(irc_errno(irc_ctx)));
+	}
+}
 
-	util_inotify_add(&inotify.ipc, ipc_dir, IN_CREATE | IN_DELETE | IN_MOVED_TO);
+// libircclient only exposes its socket through fd_sets, so ask it which fd it is using and whether it
+// has anything to write each time around the loop, and only call into epoll when that changes.
+static void util_irc_io_update(void){
+	fd_set in, out;
+	int fd = -1;
 
-	strcat(ipc_dir, "*");
+	FD_ZERO(&in);
+	FD_ZERO(&out);
 
-	glob_t glob_data;
-	if(glob(ipc_dir, 0, NULL, &glob_data) != 0){
-		perror("ipc_init: glob");
-	} else {
-		for(size_t i = 0; i < glob_data.gl_pathc; ++i){
-			if(strcmp(ipc_self.addr.sun_path, glob_data.gl_pathv[i]) == 0) continue;
+	if(irc_add_select_descriptors(irc_ctx, &in, &out, &fd) != 0){
+		fprintf(stderr, "Error adding select fds: %s\n", irc_strerror(irc_errno(irc_ctx)));
+	}
 
-			IPCAddress peer = {
-				.id   = atoi(basename(glob_data.gl_pathv[i])),
-				.addr = { .sun_family = AF_UNIX }
-			};
+	uint32_t events = 0;
+	if(fd != -1){
+		if(FD_ISSET(fd, &in))  events |= EPOLLIN;
+		if(FD_ISSET(fd, &out)) events |= EPOLLOUT;
+	}
 
-			printf("ipc_init: adding peer %d [%s]\n", peer.id, glob_data.gl_pathv[i]);
+	if(fd != irc_fd && irc_fd != -1){
+		util_io_del(irc_fd);
+		irc_fd = -1;
+	}
 
-			strcpy(peer.addr.sun_path, glob_data.gl_pathv[i]);
-			sb_push(ipc_peers, peer);
+	if(fd != -1 && (fd != irc_fd || events != irc_events)){
+		if(util_io_add(fd, events, NULL, &util_irc_io, 0)){
+			irc_fd = fd;
+			irc_events = events;
+		} else {
+			perror("epoll_ctl irc");
 		}
+	}
+}
 
-		globfree(&glob_data);
+static void util_ping_check(intptr_t arg){
+	uint32_t idle = util_ms() - irc_read_ms;
+
+	if(!ping_sent && idle > IRC_PING_MS){
+		irc_send_raw(irc_ctx, "PING %s", serv);
+		ping_sent = true;
+	} else if(ping_sent && idle > IRC_RESTART_MS){
+		puts("Reached 'no PONG' threshold, disconnecting.");
+		irc_disconnect(irc_ctx);
+		ping_timer = 0;
+		return;
 	}
 
-	// check for stale peers
+	uint32_t limit = ping_sent ? IRC_RESTART_MS : IRC_PING_MS;
+	ping_timer = util_timer_add(NULL, util_now_ms() + (idle > limit ? 0 : limit - idle + 1), 0, &util_ping_check, 0);
+}
 
-	for(IPCAddress* p = ipc_peers; p < sb_end(ipc_peers); ++p){
-		if(connect(ipc_socket, &p->addr, sizeof(p->addr)) == -1){
-			if(errno == ECONNREFUSED){
-				unlink(p->addr.sun_path);
-			}
-			sb_erase(ipc_peers, p - ipc_peers);
-			--p;
-		} else {
-			struct sockaddr sa = { .sa_family = AF_UNSPEC };
-			connect(ipc_socket, &sa, sizeof(sa));
-		}
+static void util_cmd_timer(intptr_t arg);
+
+// (re)arms the timer for whenever the first queued command will be allowed through.
+static void util_cmd_timer_arm(void){
+	uint64_t now  = util_now_ms();
+	uint64_t wait = UINT64_MAX;
+
+	sb_each(q, cmd_queues){
+		CmdLane* l = util_cmd_lane(*q);
+		if(!l) continue;
+		uint64_t w = util_cmd_wait(*q, l, now);
+		if(w < wait) wait = w;
+	}
+
+	if(cmd_timer){
+		util_timer_del(cmd_timer);
+		cmd_timer = 0;
+	}
+
+	if(wait != UINT64_MAX){
+		cmd_timer = util_timer_add(NULL, now + wait, 0, &util_cmd_timer, 0);
 	}
 }
 
-static IPCAddress* util_ipc_add(const char* name){
-	for(size_t i = 0; i < sb_count(ipc_peers); ++i){
-		if(strcmp(ipc_peers[i].addr.sun_path, name) == 0){
-			return ipc_peers + i;
+static void util_cmd_timer(intptr_t arg){
+	cmd_timer = 0;
+
+	util_process_pending_cmds();
+	util_cmd_timer_arm();
+}
+
+static void util_tick(intptr_t arg){
+	IRC_MOD_CALL_ALL(on_tick, (time(0)));
+}
+
+// on_tick is only a shim for older modules now, so only wake up for it if something implements it.
+static void util_tick_update(void){
+	bool want_tick = false;
+
+	sb_each(m, irc_modules){
+		if(m->ctx->on_tick){
+			want_tick = true;
+			break;
 		}
 	}
 
-	IPCAddress peer = {
-		.id   = atoi(basename(name)),
-		.addr = {
-			.sun_family = AF_UNIX
+	if(want_tick && !tick_timer){
+		tick_timer = util_timer_add(NULL, util_now_ms() + 250, 250, &util_tick, 0);
+	} else if(!want_tick && tick_timer){
+		util_timer_del(tick_timer);
+		tick_timer = 0;
+	}
+}
+
+static void util_http_io(int fd, uint32_t events, intptr_t arg){
+	int mask = 0;
+	int running_handles;
+
+	if(events & EPOLLIN)               mask |= CURL_CSELECT_IN;
+	if(events & EPOLLOUT)              mask |= CURL_CSELECT_OUT;
+	if(events & (EPOLLERR | EPOLLHUP)) mask |= CURL_CSELECT_ERR;
+
+	curl_multi_socket_action(curl_multi, fd, mask, &running_handles);
+	util_http_process();
+}
+
+static void util_http_timeout(intptr_t arg){
+	int running_handles;
+
+	http_timer = 0;
+	curl_multi_socket_action(curl_multi, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+	util_http_process();
+}
+
+static int util_http_sock_cb(CURL* curl, curl_socket_t sock, int what, void* userp, void* sockp){
+	if(what == CURL_POLL_REMOVE){
+		util_io_del(sock);
+	} else {
+		uint32_t events = 0;
+		if(what & CURL_POLL_IN)  events |= EPOLLIN;
+		if(what & CURL_POLL_OUT) events |= EPOLLOUT;
+
+		if(!util_io_add(sock, events, NULL, &util_http_io, 0)){
+			perror("epoll_ctl curl");
 		}
+	}
+	return 0;
+}
+
+static int util_http_timer_cb(CURLM* multi, long timeout_ms, void* userp){
+	util_timer_del(http_timer);
+	http_timer = 0;
+
+	if(timeout_ms >= 0){
+		http_timer = util_timer_add(NULL, util_now_ms() + timeout_ms, 0, &util_http_timeout, 0);
+	}
+	return 0;
+}
+
+static void util_stdin_read(int fd, uint32_t events, intptr_t arg){
+	char stdin_buf[1024];
+	ssize_t n = read(fd, stdin_buf, sizeof(stdin_buf));
+
+	if(n > 0){
+		stdin_buf[n-1] = 0; // remove \n
+		IRC_MOD_CALL_ALL(on_stdin, (stdin_buf));
+	} else if(n == 0){
+		// EOF, stop watching it or it'd be readable forever.
+		util_io_del(fd);
+	}
+}
+
+static void util_debug_read(int fd, uint32_t events, intptr_t arg){
+	char buf[256];
+	char* fname;
+	int off;
+	ssize_t n = read(fd, buf, sizeof(buf)-1);
+
+	if(n > 0 && sscanf(buf, "%m[^(]%n", &fname, &off) == 1){
+		buf[n-1] = 0; // remove \n
+		core_send_msg(debug_chan, "Recovered from crash: %s%s", basename(fname), buf + off);
+		free(fname);
+	}
+}
+
+static void util_ipc_io(int fd, uint32_t events, intptr_t arg){
+	util_ipc_recv();
+}
+
+static void util_inotify_io(int fd, uint32_t events, intptr_t arg){
+	util_inotify_check((const IRCCoreCtx*)arg);
+}
+
+static size_t util_fold_hash(const char* str, bool fold){
+	size_t hash = 0xcbf29ce484222325ULL;
+	for(const char* c = str; *c; ++c){
+		hash ^= fold ? tolower((unsigned char)*c) : (unsigned char)*c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static size_t util_index_hash(const void* entry){
+	return *(const size_t*)entry;
+}
+
+static bool util_intern_cmp(const void* entry, void* param){
+	return strcmp(((const InternEntry*)entry)->str, param) == 0;
+}
+
+static const char* util_intern(const char* str){
+	size_t hash = util_fold_hash(str, false);
+
+	InternEntry* e = inso_ht_get(&nick_intern, hash, &util_intern_cmp, (void*)str);
+	if(e){
+		++e->refs;
+		return e->str;
+	}
+
+	InternEntry new_e = { hash, strdup(str), 1 };
+	inso_ht_put(&nick_intern, &new_e);
+
+	return new_e.str;
+}
+
+static void util_unintern(const char* str){
+	size_t hash = util_fold_hash(str, false);
+
+	InternEntry* e = inso_ht_get(&nick_intern, hash, &util_intern_cmp, (void*)str);
+	if(e && --e->refs == 0){
+		char* p = e->str;
+		inso_ht_del(&nick_intern, hash, &util_intern_cmp, (void*)str);
+		free(p);
+	}
+}
+
+static bool util_chan_cmp(const void* entry, void* param){
+	return strcasecmp(((const ChanIndexEntry*)entry)->name, param) == 0;
+}
+
+static int util_chan_find(const char* chan){
+	ChanIndexEntry* e = inso_ht_get(&chan_index, util_fold_hash(chan, true), &util_chan_cmp, (void*)chan);
+	return e ? (int)e->idx : -1;
+}
+
+static int util_chan_add(const char* chan){
+	int idx = util_chan_find(chan);
+	if(idx != -1) return idx;
+
+	idx = sb_count(channels) - 1;
+	sb_last(channels) = strdup(chan);
+	sb_push(channels, 0);
+	sb_push(chan_nicks, 0);
+
+	ChanIndexEntry e = { util_fold_hash(chan, true), channels[idx], idx };
+	inso_ht_put(&chan_index, &e);
+
+	return idx;
+}
+
+typedef struct {
+	const char* chan;
+	const char* nick;
+} NickKey;
+
+static bool util_nick_cmp(const void* entry, void* param){
+	const NickIndexEntry* e = entry;
+	const NickKey* k = param;
+	return e->chan == k->chan && strcasecmp(e->nick, k->nick) == 0;
+}
+
+static size_t util_nick_hash(int chan_idx, const char* nick){
+	return util_fold_hash(nick, true) ^ ((uintptr_t)channels[chan_idx] * 0x9E3779B97F4A7C15ULL);
+}
+
+static int util_nick_find(int chan_idx, const char* nick){
+	NickKey k = { channels[chan_idx], nick };
+	NickIndexEntry* e = inso_ht_get(&nick_index, util_nick_hash(chan_idx, nick), &util_nick_cmp, &k);
+	return e ? (int)e->pos : -1;
+}
+
+static void util_nick_add(int chan_idx, const char* nick){
+	if(util_nick_find(chan_idx, nick) != -1) return;
+
+	NickIndexEntry e = {
+		.hash = util_nick_hash(chan_idx, nick),
+		.chan = channels[chan_idx],
+		.nick = util_intern(nick),
+		.pos  = sb_count(chan_nicks[chan_idx]),
 	};
 
-	strcpy(peer.addr.sun_path, name);
-	sb_push(ipc_peers, peer);
+	sb_push(chan_nicks[chan_idx], (char*)e.nick);
+	inso_ht_put(&nick_index, &e);
+}
 
-	printf("ipc_add: %d: [%s]\n", peer.id, peer.addr.sun_path);
+// swaps the last nick of the channel into the removed one's place, so get_nicks stays a flat array.
+static bool util_nick_del(int chan_idx, const char* nick){
+	int pos = util_nick_find(chan_idx, nick);
+	if(pos == -1) return false;
 
-	return &sb_last(ipc_peers);
+	char** nicks = chan_nicks[chan_idx];
+	char*  name  = nicks[pos];
+
+	NickKey k = { channels[chan_idx], name };
+	inso_ht_del(&nick_index, util_nick_hash(chan_idx, name), &util_nick_cmp, &k);
+
+	size_t last = sb_count(nicks) - 1;
+	if((size_t)pos != last){
+		nicks[pos] = nicks[last];
+
+		NickKey moved = { channels[chan_idx], nicks[pos] };
+		NickIndexEntry* e = inso_ht_get(&nick_index, util_nick_hash(chan_idx, nicks[pos]), &util_nick_cmp, &moved);
+		assert(e);
+		e->pos = pos;
+	}
+	sb_pop(chan_nicks[chan_idx]);
+
+	util_unintern(name);
+	return true;
 }
 
-static void util_ipc_del(const char* name){
-	for(size_t i = 0; i < sb_count(ipc_peers); ++i){
-		if(strcmp(ipc_peers[i].addr.sun_path, name) == 0){
-			sb_erase(ipc_peers, i);
-			break;
-		}
+static void util_nick_rename(int chan_idx, const char* from, const char* to){
+	int pos = util_nick_find(chan_idx, from);
+	if(pos == -1) return;
+
+	char* old = chan_nicks[chan_idx][pos];
+
+	NickKey k = { channels[chan_idx], old };
+	inso_ht_del(&nick_index, util_nick_hash(chan_idx, old), &util_nick_cmp, &k);
+
+	NickIndexEntry e = {
+		.hash = util_nick_hash(chan_idx, to),
+		.chan = channels[chan_idx],
+		.nick = util_intern(to),
+		.pos  = pos,
+	};
+
+	chan_nicks[chan_idx][pos] = (char*)e.nick;
+	inso_ht_put(&nick_index, &e);
+
+	util_unintern(old);
+}
+
+static void util_chan_del(int chan_idx){
+	while(sb_count(chan_nicks[chan_idx])){
+		util_nick_del(chan_idx, sb_last(chan_nicks[chan_idx]));
+	}
+	sb_free(chan_nicks[chan_idx]);
+
+	free(channels[chan_idx]);
+	sb_erase(channels, chan_idx);
+	sb_erase(chan_nicks, chan_idx);
+
+	// leaving a channel is rare, so just rebuild the channel index rather than fixing up the indices.
+	inso_ht_free(&chan_index);
+	inso_ht_init(&chan_index, 64, sizeof(ChanIndexEntry), &util_index_hash);
+
+	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
+		ChanIndexEntry e = { util_fold_hash(channels[i], true), channels[i], i };
+		inso_ht_put(&chan_index, &e);
 	}
 }
 
-static void util_ipc_recv(void){
-	char buffer[4096];
-	struct sockaddr_un addr;
-	socklen_t addr_len = sizeof(addr);
+static void util_trim_end_spaces(char* msg, size_t len){
+	if(len > 0){
+		for(char* p = msg + len - 1; p >= msg && *p == ' '; --p){
+			*p = 0;
+		}
+	}
+}
 
-	ssize_t num = recvfrom(ipc_socket, buffer, sizeof(buffer), 0, &addr, &addr_len);
-	if(num == -1){
-		perror("ipc_recv: recvfrom");
-		return;
+static uint32_t util_tag_hash(const char* str, size_t len, uint32_t seed){
+	uint32_t hash = 0x811c9dc5 ^ seed;
+	for(size_t i = 0; i < len; ++i){
+		hash ^= (unsigned char)str[i];
+		hash *= 0x01000193;
 	}
+	return (hash ^ (hash >> 16)) & (IRC_TAG_SLOTS - 1);
+}
 
-	assert(addr.sun_family == AF_UNIX);
+// finds a seed that gives every tag in irc_tag_known its own slot.
+static void util_tag_hash_init(void){
+	for(uint32_t seed = 1; seed < (1 << 20); ++seed){
+		memset(irc_tag_slots, 0, sizeof(irc_tag_slots));
 
-	IPCAddress* peer = util_ipc_add(addr.sun_path);
+		bool ok = true;
+		for(size_t i = 0; ok && i < ARRAY_SIZE(irc_tag_known); ++i){
+			IRCTagSlot* slot = irc_tag_slots + util_tag_hash(irc_tag_known[i], strlen(irc_tag_known[i]), seed);
+			ok = !slot->known;
+			slot->known = i + 1;
+		}
 
-	sb_each(m, irc_modules){
-		if(strncmp(buffer, m->ctx->name, num) == 0){
-			printf("Got IPC msg from %d for %s\n", peer->id, m->ctx->name);
-			const size_t off = strlen(m->ctx->name) + 1;
-			IRC_MOD_CALL(m, on_ipc, (peer->id, (uint8_t*)(buffer + off), num - off));
+		if(ok){
+			irc_tag_seed = seed;
+			return;
 		}
 	}
+
+	memset(irc_tag_slots, 0, sizeof(irc_tag_slots));
+	fprintf(stderr, "No perfect hash for the known IRCv3 tags, looking them up will be slower.\n");
 }
 
-static void util_find_chan_nick(const char* chan, const char* nick, int* chan_idx, int* nick_idx){
+// splits the message's tags into spans in one go, without copying or unescaping them.
+static void util_update_tags(const char** params){
+	if(!have_tag_hack) return;
 
-	if(chan_idx) *chan_idx = -1;
-	if(nick_idx) *nick_idx = -1;
+	const char* raw = params[-1] ? params[-1] : "";
+	const char* p = raw;
 
-	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
-		if(strcasecmp(channels[i], chan) != 0) continue;
+	if(irc_tags){
+		stb__sbn(irc_tags) = 0;
+	}
+	++irc_tag_gen;
+
+	while(*p){
+		const char* end = strchrnul(p, ';');
+		const char* eq  = memchr(p, '=', end - p);
+
+		if(end != p){
+			IRCTag t = {
+				.key     = p,
+				.key_len = (eq ? eq : end) - p,
+				.val     = eq ? eq + 1 : end,
+				.val_len = eq ? end - (eq + 1) : 0,
+			};
 
-		if(chan_idx) *chan_idx = i;
+			if(irc_tag_seed){
+				IRCTagSlot* slot = irc_tag_slots + util_tag_hash(t.key, t.key_len, irc_tag_seed);
+				const char* known = slot->known ? irc_tag_known[slot->known - 1] : NULL;
 
-		for(size_t j = 0; j < sb_count(chan_nicks[i]); ++j){
-			if(strcasecmp(chan_nicks[i][j], nick) == 0){
-				if(nick_idx) *nick_idx = j;
-				break;
+				if(known && slot->gen != irc_tag_gen && strncmp(known, t.key, t.key_len) == 0 && !known[t.key_len]){
+					slot->gen = irc_tag_gen;
+					slot->tag = sb_count(irc_tags);
+				}
 			}
+
+			sb_push(irc_tags, t);
 		}
 
-		break;
+		p = *end ? end + 1 : end;
 	}
-}
 
-static void util_trim_end_spaces(char* msg, size_t len){
-	if(len > 0){
-		for(char* p = msg + len - 1; p >= msg && *p == ' '; --p){
-			*p = 0;
-		}
+	// make sure unescaping every tag fits without irc_tag_arena moving, since modules keep pointers into it.
+	if(irc_tag_arena){
+		stb__sbn(irc_tag_arena) = 0;
+	}
+	const size_t need = (p - raw) + sb_count(irc_tags) * 2;
+	if(need){
+		(void)sb_add(irc_tag_arena, need);
+		stb__sbn(irc_tag_arena) = 0;
 	}
 }
 
-static void util_update_tags(const char** params){
-	if(!have_tag_hack) return;
-	strncpy(irc_tag_buf, params[-1], sizeof(irc_tag_buf)-1);
-
-	if(irc_tag_ptrs){
-		stb__sbn(irc_tag_ptrs) = 0;
-	}
+static const char* util_tag_unescape(const char* str, size_t len){
+	char* out = sb_add(irc_tag_arena, len + 1);
+	char* o = out;
 
-	char* state;
-	char* k = strtok_r(irc_tag_buf, ";", &state);
+	for(const char* c = str; c < str + len; ++c){
+		if(*c != '\\'){
+			*o++ = *c;
+			continue;
+		}
 
-	for(; k; k = strtok_r(NULL, ";", &state)){
-		char* v = k;
+		if(++c == str + len) break;
 
-		while(*v && *v != '=') ++v;
+		switch(*c){
+			case ':': *o++ = ';';  break;
+			case 's': *o++ = ' ';  break;
+			case 'r': *o++ = '\r'; break;
+			case 'n': *o++ = '\n'; break;
+			default : *o++ = *c;   break;
+		}
+	}
 
-		if(*v == '='){
-			*v++ = '\0';
+	*o = '\0';
+	return out;
+}
 
-			for(char* p = v; *p; ++p){
-				if(*p != '\\') continue;
+static IRCTag* util_tag_decode(IRCTag* t){
+	if(!t->k){
+		t->k = util_tag_unescape(t->key, t->key_len);
+		t->v = util_tag_unescape(t->val, t->val_len);
+	}
+	return t;
+}
 
-				if(p[1] == ':') *p = ';';
-				else if(p[1] == 's') *p = ' ';
-				else if(p[1] == 'r') *p = '\r';
-				else if(p[1] == 'n') *p = '\n';
+static IRCTag* util_tag_find(const char* key){
+	size_t len = strlen(key);
 
-				for(char* q = p + 1; *q; ++q){
-					q[0] = q[1];
-				}
-			}
+	if(irc_tag_seed){
+		IRCTagSlot* slot = irc_tag_slots + util_tag_hash(key, len, irc_tag_seed);
+		if(slot->known && strcmp(irc_tag_known[slot->known - 1], key) == 0){
+			return slot->gen == irc_tag_gen ? irc_tags + slot->tag : NULL;
 		}
+	}
 
-		sb_push(irc_tag_ptrs, k);
-		sb_push(irc_tag_ptrs, v);
+	sb_each(t, irc_tags){
+		if(t->key_len == len && memcmp(t->key, key, len) == 0){
+			return t;
+		}
 	}
+
+	return NULL;
 }
 
 static char* util_file_read(const char* name){
@@ -1036,6 +3475,11 @@ IRC_STR_CALLBACK(on_connect) {
 
 	printf("connect origin = %s\n", origin_full);
 
+	irc_is_twitch = strcasecmp(serv, "irc.chat.twitch.tv") == 0 || getenv("IRC_IS_TWITCH");
+	sb_each(q, cmd_queues){
+		(*q)->is_mod = false;
+	}
+
 	IRC_MOD_CALL_ALL(on_connect, (serv));
 }
 
@@ -1061,12 +3505,40 @@ IRC_STR_CALLBACK(on_chat_msg) {
 
 	send_msg_called = false;
 
+	// copy the matches, since a command could cause the modules to be reloaded and the trie to be rebuilt.
+	size_t cmd_len = 0;
+	const CmdNode* node = util_cmd_lookup(_msg, &cmd_len);
+	size_t match_count = node ? node->match_count : 0;
+	CmdMatch* matches = alloca(match_count * sizeof(CmdMatch) + 1);
+
+	if(node){
+		memcpy(matches, cmd_matches + node->match_idx, match_count * sizeof(CmdMatch));
+	}
+
+	CmdMatch* match = matches;
+	CmdMatch* match_end = matches + match_count;
+
+	ChanPerms* perms = util_chan_perms(_chan);
+
 	sb_each(m, irc_modules){
 		bool global = m->ctx->flags & IRC_MOD_GLOBAL;
-		if(global || util_check_perms(m->ctx->name, _chan, IRC_CB_CMD)){
-			util_dispatch_cmds(m, _chan, _name, _msg);
+
+		CmdMatch* mod_end = match;
+		while(mod_end != match_end && mod_end->ctx == m->ctx){
+			++mod_end;
+		}
+
+		if(m->state != MOD_LIVE){
+			match = mod_end;
+			continue;
 		}
-		if(global || util_check_perms(m->ctx->name, _chan, IRC_CB_MSG)){
+
+		if(mod_end != match && (global || util_check_perms(m, perms, IRC_CB_CMD))){
+			util_dispatch_cmds(m, match, mod_end - match, _chan, _name, _msg + cmd_len);
+		}
+		match = mod_end;
+
+		if(global || util_check_perms(m, perms, IRC_CB_MSG)){
 			IRC_MOD_CALL(m, on_msg, (_chan, _name, _msg));
 		}
 	}
@@ -1084,7 +3556,7 @@ IRC_STR_CALLBACK(on_action) {
 	char* _msg = strdupa(params[1]);
 	util_trim_end_spaces(_msg, strlen(_msg));
 
-	IRC_MOD_CALL_ALL_CHECK(on_action, (_chan, _name, _msg), IRC_CB_ACTION);
+	IRC_MOD_CALL_ALL_CHECK(on_action, (_chan, _name, _msg), _chan, IRC_CB_ACTION);
 }
 
 IRC_STR_CALLBACK(on_pm){
@@ -1109,20 +3581,7 @@ IRC_STR_CALLBACK(on_join) {
 
 	fprintf(stderr, "JOIN: %s %s\n", params[0], origin);
 
-	int chan_i, nick_i;
-	util_find_chan_nick(params[0], origin, &chan_i, &nick_i);
-
-	if(chan_i == -1){
-		sb_last(channels) = strdup(params[0]);
-		chan_i = sb_count(channels) - 1;
-
-		sb_push(channels, 0);
-		sb_push(chan_nicks, 0);
-	}
-
-	if(nick_i == -1){
-		sb_push(chan_nicks[chan_i], strdup(origin));
-	}
+	util_nick_add(util_chan_add(params[0]), origin);
 
 	if(strcmp(origin, bot_nick) == 0){
 
@@ -1130,6 +3589,9 @@ IRC_STR_CALLBACK(on_join) {
 		const char* c = getenv("INSOBOT_DEBUG_CHAN");
 		if(c && strcmp(params[0], c) == 0){
 			debug_chan = c;
+			if(debug_pipe[0]){
+				util_io_add(debug_pipe[0], EPOLLIN, NULL, &util_debug_read, 0);
+			}
 		}
 
 		if(strlen(origin_full) > strlen(origin)){
@@ -1148,27 +3610,17 @@ IRC_STR_CALLBACK(on_part) {
 	char origin[128] = "";
 	irc_target_get_nick(origin_full, origin, sizeof(origin));
 
-	int chan_i, nick_i;
-	util_find_chan_nick(params[0], origin, &chan_i, &nick_i);
+	int chan_i = util_chan_find(params[0]);
 
 	printf("PART: %s %s\n", params[0], origin);
 
 	if(chan_i != -1 && strcasecmp(origin, bot_nick) == 0){
-		free(channels[chan_i]);
-		sb_erase(channels, chan_i);
-
-		for(size_t i = 0; i < sb_count(chan_nicks[chan_i]); ++i){
-			free(chan_nicks[chan_i][i]);
-		}
-		sb_free(chan_nicks[chan_i]);
-		sb_erase(chan_nicks, chan_i);
-
-	} else if(nick_i != -1){
-		free(chan_nicks[chan_i][nick_i]);
-		sb_erase(chan_nicks[chan_i], nick_i);
+		util_chan_del(chan_i);
+	} else if(chan_i != -1){
+		util_nick_del(chan_i, origin);
 	}
 
-	IRC_MOD_CALL_ALL_CHECK(on_part, (params[0], origin), IRC_CB_PART);
+	IRC_MOD_CALL_ALL_CHECK(on_part, (params[0], origin), params[0], IRC_CB_PART);
 }
 
 IRC_STR_CALLBACK(on_quit) {
@@ -1182,14 +3634,8 @@ IRC_STR_CALLBACK(on_quit) {
 	printf("QUIT: %s\n", origin);
 
 	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
-		for(size_t j = 0; j < sb_count(chan_nicks[i]); ++j){
-			if(strcmp(origin, chan_nicks[i][j]) == 0){
-				free(chan_nicks[i][j]);
-				sb_erase(chan_nicks[i], j);
-
-				IRC_MOD_CALL_ALL_CHECK(on_part, (channels[i], origin), IRC_CB_PART);
-				break;
-			}
+		if(util_nick_del(i, origin)){
+			IRC_MOD_CALL_ALL_CHECK(on_part, (channels[i], origin), channels[i], IRC_CB_PART);
 		}
 	}
 }
@@ -1209,13 +3655,7 @@ IRC_STR_CALLBACK(on_nick) {
 	}
 
 	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
-		for(size_t j = 0; j < sb_count(chan_nicks[i]); ++j){
-			if(strcasecmp(chan_nicks[i][j], origin) == 0){
-				free(chan_nicks[i][j]);
-				chan_nicks[i][j] = strdup(params[0]);
-				break;
-			}
-		}
+		util_nick_rename(i, origin, params[0]);
 	}
 
 	IRC_MOD_CALL_ALL(on_nick, (origin, params[0]));
@@ -1230,10 +3670,21 @@ IRC_STR_CALLBACK(on_unknown) {
 	if(strcmp(event, "PONG") == 0){
 //		printf(":: PONG");
 		return;
-	} else {
-		printf("Unknown event:\n:: %s :: %s", event, origin);
 	}
 
+	if(strcmp(event, "USERSTATE") == 0 && count >= 1 && params[0]){
+		// twitch tells us if we're a mod here, which gets us the higher rate limit.
+		IRCTag* mod    = util_tag_find("mod");
+		IRCTag* badges = util_tag_find("badges");
+
+		bool is_mod = (mod && strcmp(util_tag_decode(mod)->v, "1") == 0)
+		           || (badges && strstr(util_tag_decode(badges)->v, "broadcaster/"));
+		util_cmd_queue_get(params[0], true)->is_mod = is_mod;
+		util_cmd_timer_arm();
+	}
+
+	printf("Unknown event:\n:: %s :: %s", event, origin);
+
 	for(size_t i = 0; i < count; ++i){
 		printf(" :: %s", params[i]);
 	}
@@ -1251,18 +3702,41 @@ IRC_STR_CALLBACK(on_invite) {
 IRC_NUM_CALLBACK(on_numeric) {
 	static const char nick_start_symbols[] = "[]\\`_^{|}";
 
-	if(event == LIBIRC_RFC_RPL_NAMREPLY && count >= 4 && params[3]){
+	if(event == LIBIRC_RFC_RPL_NAMREPLY && count >= 4 && params[2] && params[3]){
+		const char* chan = params[2];
+		const char** nicks = NULL;
+
 		char *names = strdup(params[3]),
 		     *state = NULL,
 		     *n     = strtok_r(names, " ", &state);
 
-		do {
+		int chan_i = util_chan_add(chan);
+
+		for(; n; n = strtok_r(NULL, " ", &state)){
 			if(!isalpha(*n) && !strchr(nick_start_symbols, *n)){
 				++n;
 			}
-			irc_on_join(session, "join", n, (const char**)(params + 2), 1);
-		} while((n = strtok_r(NULL, " ", &state)));
+			if(*n){
+				util_nick_add(chan_i, n);
+				sb_push(nicks, n);
+			}
+		}
+
+		fprintf(stderr, "NAMES: %s (%zu nicks)\n", chan, sb_count(nicks));
+
+		// one callback for the whole reply where supported, the old per-nick join otherwise.
+		sb_each(m, irc_modules){
+			if(m->state != MOD_LIVE) continue;
+			if(ABI_CHECK(m, ABI_JOIN_BULK) && m->ctx->on_join_bulk){
+				IRC_MOD_CALL(m, on_join_bulk, (chan, nicks, sb_count(nicks)));
+			} else if(m->ctx->on_join){
+				sb_each(nick, nicks){
+					IRC_MOD_CALL(m, on_join, (chan, *nick));
+				}
+			}
+		}
 
+		sb_free(nicks);
 		free(names);
 	} else {
 		printf(":: [%03u] :: %s", event, origin_full);
@@ -1283,6 +3757,22 @@ static intptr_t core_get_info(int id){
 			return have_tag_hack;
 		} break;
 
+		case IRC_INFO_CMDS_SENT: {
+			return cmd_stat_sent;
+		} break;
+
+		case IRC_INFO_CMDS_DROPPED: {
+			return cmd_stat_dropped;
+		} break;
+
+		case IRC_INFO_CMD_LATENCY_MS: {
+			return cmd_stat_latency;
+		} break;
+
+		case IRC_INFO_CMD_LATENCY_MAX_MS: {
+			return cmd_stat_latency_max;
+		} break;
+
 		default: {
 			return 0;
 		} break;
@@ -1294,7 +3784,7 @@ static const char* core_get_username(void){
 }
 
 // FIXME: this function is bad and should return a FILE* instead
-static char datafile_buff[PATH_MAX];
+static __thread char datafile_buff[PATH_MAX];
 static const char* core_get_datafile(void){
 	Module* caller = sb_last(mod_call_stack);
 
@@ -1324,6 +3814,7 @@ static IRCModuleCtx** core_get_modules(bool chan_only){
 	sb_each(m, irc_modules){
 		// XXX: don't return modules with a lower ABI than the caller for safety.
 		if(caller && caller->ctx_size > m->ctx_size) continue;
+		if(m->state == MOD_INIT_FAILED || m->state == MOD_DEAD) continue;
 
 		sb_push(global_mod_list, m->ctx);
 		if(!(m->ctx->flags & IRC_MOD_GLOBAL)){
@@ -1344,13 +3835,7 @@ static const char** core_get_channels(void){
 static const char** core_get_nicks(const char* chan, int* count){
 	assert(count);
 
-	int index = -1;
-	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
-		if(strcasecmp(channels[i], chan) == 0){
-			index = i;
-			break;
-		}
-	}
+	int index = util_chan_find(chan);
 
 	if(index >= 0){
 		*count = sb_count(chan_nicks[index]);
@@ -1365,17 +3850,8 @@ static void core_join(const char* chan){
 
 	util_cmd_enqueue(IRC_CMD_JOIN, chan, NULL); //TODO: password protected channels?
 
-	int chan_i, nick_i;
-	util_find_chan_nick(chan, bot_nick, &chan_i, &nick_i);
-
-	if(chan_i == -1){
-		sb_last(channels) = strdup(chan);
-		chan_i = sb_count(channels) - 1;
-
-		sb_push(channels, 0);
-
-		sb_push(chan_nicks, 0);
-		sb_push(chan_nicks[chan_i], strdup(bot_nick));
+	if(util_chan_find(chan) == -1){
+		util_nick_add(util_chan_add(chan), bot_nick);
 	}
 
 }
@@ -1384,23 +3860,18 @@ static void core_part(const char* chan){
 
 	util_cmd_enqueue(IRC_CMD_PART, chan, NULL);
 
-	for(char** c = channels; *c; ++c){
-		if(strcmp(*c, chan) == 0){
-			free(*c);
-			sb_erase(channels, c - channels);
-			break;
-		}
+	int chan_i = util_chan_find(chan);
+	if(chan_i != -1){
+		util_chan_del(chan_i);
 	}
 }
 
-static size_t core_send_msg(const char* chan, const char* fmt, ...){
+static size_t core_send_msg_v(const char* chan, const char* fmt, va_list v){
 	if(!chan || !fmt) return 0;
 
 	size_t id = 0;
 	char buff[8192];
-	va_list v;
 
-	va_start(v, fmt);
 	int total_len = vsnprintf(buff, sizeof(buff), fmt, v);
 	if(total_len < 0)
 		goto end;
@@ -1408,36 +3879,48 @@ static size_t core_send_msg(const char* chan, const char* fmt, ...){
 	if(total_len > (int)sizeof(buff))
 		total_len = sizeof(buff);
 
-	if(!bot_host_len){
+	const int max_msg_len = util_msg_max_len(chan);
+
+	if(!max_msg_len){
 		id = util_cmd_enqueue(IRC_CMD_MSG, chan, buff);
 	} else {
 		char tmp[512];
 
-		const int max_msg_len = INSO_MAX(64, 512 - (int)(sizeof("PRIVMSG :\r\n") + strlen(chan) + bot_host_len));
 		const char* p = buff;
 		const char* const e = buff + total_len;
 
+		// every chunk gets the same id and priority, so filters see them all as the same message.
+		const size_t msg_id = util_cmd_next_id();
+		const int    prio   = util_cmd_prio(IRC_CMD_MSG, buff);
+
 		while(e - p){
 			const int n = INSO_MIN(max_msg_len, e - p);
 
 			memcpy(tmp, p, n);
 			tmp[n] = '\0';
 
-			// XXX: id of 2nd split onwards is lost - will affect on_filter
-			size_t tmpid = util_cmd_enqueue(IRC_CMD_MSG, chan, tmp);
-			if(!id) id = tmpid;
+			if(util_cmd_enqueue_id(msg_id, IRC_CMD_MSG, prio, chan, tmp)){
+				id = msg_id;
+			}
 
 			p += n;
 		}
 	}
 
 end:
-	va_end(v);
 	send_msg_called = true;
 
 	return id;
 }
 
+static size_t core_send_msg(const char* chan, const char* fmt, ...){
+	va_list v;
+	va_start(v, fmt);
+	size_t id = core_send_msg_v(chan, fmt, v);
+	va_end(v);
+	return id;
+}
+
 static size_t core_send_raw(const char* raw){
 	return util_cmd_enqueue(IRC_CMD_RAW, NULL, raw);
 }
@@ -1447,6 +3930,24 @@ static void core_send_ipc(int target, const void* data, size_t data_len){
 
 	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
 	const char* name = m ? m->ctx->name : "core";
+
+	bool to_ring = false, to_socket = false;
+	sb_each(p, ipc_peers){
+		if(target != 0 && p->id != target) continue;
+		if(p->ring){
+			to_ring = true;
+		} else {
+			to_socket = true;
+		}
+	}
+
+	if(to_ring){
+		util_ipc_queue(target, name, data, data_len);
+	}
+
+	if(!to_socket) return;
+
+	// peers without a ring get a datagram each, like before.
 	const size_t name_len = strlen(name);
 	const size_t total_len = data_len + name_len + 1;
 
@@ -1457,6 +3958,7 @@ static void core_send_ipc(int target, const void* data, size_t data_len){
 
 	for(IPCAddress* p = ipc_peers; p < sb_end(ipc_peers); ++p){
 		if(target != 0 && p->id != target) continue;
+		if(p->ring) continue;
 
 		printf("Sending IPC msg to %d for %s\n", p->id, name);
 
@@ -1474,6 +3976,7 @@ static void core_send_ipc(int target, const void* data, size_t data_len){
 
 			if(remove){
 				printf("removing [%s]\n", p->addr.sun_path);
+				util_ipc_peer_free(p);
 				sb_erase(ipc_peers, p - ipc_peers);
 				--p;
 			}
@@ -1488,11 +3991,13 @@ static void core_send_mod_msg(IRCModMsg* msg){
 	IRC_MOD_CALL_ALL(on_mod_msg, (sender, msg));
 }
 
+// only marks the module as changed, so a burst of these (e.g. karma changes) is one write a little later.
 static void core_self_save(void){
-	util_module_save(sb_last(mod_call_stack));
+	sb_last(mod_call_stack)->save_pending = true;
+	util_save_arm();
 }
 
-static void core_log(const char* fmt, ...){
+static void core_log_v(const char* fmt, va_list v){
 
 	if(getenv("INSOBOT_NO_FORK")){
 		char time_buf[64];
@@ -1504,9 +4009,13 @@ static void core_log(const char* fmt, ...){
 		fprintf(stderr, "%s %s: ", time_buf, mod_name);
 	}
 
+	vfprintf(stderr, fmt, v);
+}
+
+static void core_log(const char* fmt, ...){
 	va_list v;
 	va_start(v, fmt);
-	vfprintf(stderr, fmt, v);
+	core_log_v(fmt, v);
 	va_end(v);
 }
 
@@ -1523,22 +4032,24 @@ static bool core_responded(void){
 }
 
 static bool core_get_tag(size_t index, const char** k, const char** v){
-	index <<= 1;
-
-	if(index >= sb_count(irc_tag_ptrs)){
+	if(index >= sb_count(irc_tags)){
 		return false;
 	}
 
-	if(k) *k = irc_tag_ptrs[index+0];
-	if(v) *v = irc_tag_ptrs[index+1];
+	IRCTag* t = util_tag_decode(irc_tags + index);
+
+	if(k) *k = t->k;
+	if(v) *v = t->v;
 
 	return true;
 }
 
-static void core_gen_event(int which, ...){
-	va_list va;
-	va_start(va, which);
+static const char* core_get_tag_by_key(const char* key){
+	IRCTag* t = util_tag_find(key);
+	return t ? util_tag_decode(t)->v : NULL;
+}
 
+static void core_gen_event_v(int which, va_list va){
 	// TODO: get tags in here?
 	const char* pbuf[3] = { "" };
 	const char** params = pbuf + 1;
@@ -1592,10 +4103,209 @@ static void core_gen_event(int which, ...){
 			irc_on_pm(irc_ctx, "", origin, params, 2);
 		} break;
 	}
+}
+
+static void core_gen_event(int which, ...){
+	va_list va;
+	va_start(va, which);
+	core_gen_event_v(which, va);
+	va_end(va);
+}
+
+static void core_http_async(void* curl, IRCHttpCallback cb, intptr_t arg){
+	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
+
+	HTTPRequest* req = calloc(1, sizeof(*req));
+	req->curl  = curl;
+	req->owner = m ? m->ctx : NULL;
+	req->cb    = cb;
+	req->arg   = arg;
+
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &util_http_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+
+	sb_push(http_reqs, req);
+
+	CURLMcode err = curl_multi_add_handle(curl_multi, curl);
+	if(err != CURLM_OK){
+		fprintf(stderr, "http_async: %s\n", curl_multi_strerror(err));
+		util_http_finish(req, m, -CURLE_FAILED_INIT);
+	}
+}
+
+static bool core_add_fd(int fd, uint32_t events, IRCFdCallback cb, intptr_t arg){
+	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
+	const IRCModuleCtx* owner = m ? m->ctx : NULL;
+
+	IOWatch* w = util_io_find(fd);
+	if(w && w->owner != owner){
+		errno = EEXIST;
+		return false;
+	}
+
+	return util_io_add(fd, events, owner, cb, arg);
+}
+
+static void core_del_fd(int fd){
+	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
+
+	IOWatch* w = util_io_find(fd);
+	if(w && w->owner == (m ? m->ctx : NULL)){
+		util_io_del(fd);
+	}
+}
+
+static intptr_t core_add_timer(uint32_t ms, bool repeat, IRCTimerCallback cb, intptr_t arg){
+	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
+	if(!cb) return 0;
+
+	return util_timer_add(m ? m->ctx : NULL, util_now_ms() + ms, repeat ? INSO_MAX(ms, 1u) : 0, cb, arg);
+}
+
+static intptr_t core_add_timer_at(time_t when, IRCTimerCallback cb, intptr_t arg){
+	time_t now = time(0);
+	uint64_t ms = when > now ? (uint64_t)(when - now) * 1000 : 0;
+
+	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
+	if(!cb) return 0;
+
+	return util_timer_add(m ? m->ctx : NULL, util_now_ms() + ms, 0, cb, arg);
+}
+
+static void core_del_timer(intptr_t handle){
+	Module* m = sb_count(mod_call_stack) ? sb_last(mod_call_stack) : NULL;
+
+	CoreTimer* t = util_timer_get(handle);
+	if(t && t->owner == (m ? m->ctx : NULL)){
+		util_timer_unlink(t - timer_slots);
+	}
+}
+
+static void core_perms_changed(const char* chan){
+	sb_each(p, chan_perms){
+		if(!chan || strcasecmp((*p)->chan, chan) == 0){
+			(*p)->valid = 0;
+		}
+	}
+	++perms_epoch;
+}
+
+/*******************************
+ * Locked IRCCoreCtx functions *
+ *******************************/
+
+// given to the on_init calls on the init pool. Modules keep using it afterwards from the main thread, which
+// has the lock already, so these only take it if the calling thread doesn't.
+
+#define CORE_LOCKED(ret, name, params, args) \
+	static ret name##_locked params {        \
+		bool had_lock = core_locked;         \
+		if(!had_lock) util_core_lock();      \
+		ret r = name args;                   \
+		if(!had_lock) util_core_unlock();    \
+		return r;                            \
+	}
+
+#define CORE_LOCKED_VOID(name, params, args) \
+	static void name##_locked params {       \
+		bool had_lock = core_locked;         \
+		if(!had_lock) util_core_lock();      \
+		name args;                           \
+		if(!had_lock) util_core_unlock();    \
+	}
+
+CORE_LOCKED(intptr_t      , core_get_info    , (int id), (id));
+CORE_LOCKED(const char*   , core_get_username, (void), ());
+CORE_LOCKED(const char*   , core_get_datafile, (void), ());
+CORE_LOCKED(IRCModuleCtx**, core_get_modules , (bool chan_only), (chan_only));
+CORE_LOCKED(const char**  , core_get_channels, (void), ());
+CORE_LOCKED(const char**  , core_get_nicks   , (const char* chan, int* count), (chan, count));
+CORE_LOCKED(size_t        , core_send_raw    , (const char* raw), (raw));
+CORE_LOCKED(bool          , core_responded   , (void), ());
+CORE_LOCKED(bool          , core_get_tag     , (size_t index, const char** k, const char** v), (index, k, v));
+CORE_LOCKED(const char*   , core_get_tag_by_key, (const char* key), (key));
+CORE_LOCKED(bool          , core_add_fd      , (int fd, uint32_t events, IRCFdCallback cb, intptr_t arg), (fd, events, cb, arg));
+CORE_LOCKED(intptr_t      , core_add_timer   , (uint32_t ms, bool repeat, IRCTimerCallback cb, intptr_t arg), (ms, repeat, cb, arg));
+CORE_LOCKED(intptr_t      , core_add_timer_at, (time_t when, IRCTimerCallback cb, intptr_t arg), (when, cb, arg));
+
+CORE_LOCKED_VOID(core_join         , (const char* chan), (chan));
+CORE_LOCKED_VOID(core_part         , (const char* chan), (chan));
+CORE_LOCKED_VOID(core_send_ipc     , (int target, const void* data, size_t data_len), (target, data, data_len));
+CORE_LOCKED_VOID(core_send_mod_msg , (IRCModMsg* msg), (msg));
+CORE_LOCKED_VOID(core_self_save    , (void), ());
+CORE_LOCKED_VOID(core_http_async   , (void* curl, IRCHttpCallback cb, intptr_t arg), (curl, cb, arg));
+CORE_LOCKED_VOID(core_del_fd       , (int fd), (fd));
+CORE_LOCKED_VOID(core_del_timer    , (intptr_t handle), (handle));
+CORE_LOCKED_VOID(core_perms_changed, (const char* chan), (chan));
+
+static size_t core_send_msg_locked(const char* chan, const char* fmt, ...){
+	bool had_lock = core_locked;
+	if(!had_lock) util_core_lock();
+
+	va_list v;
+	va_start(v, fmt);
+	size_t id = core_send_msg_v(chan, fmt, v);
+	va_end(v);
+
+	if(!had_lock) util_core_unlock();
+	return id;
+}
+
+static void core_log_locked(const char* fmt, ...){
+	bool had_lock = core_locked;
+	if(!had_lock) util_core_lock();
+
+	va_list v;
+	va_start(v, fmt);
+	core_log_v(fmt, v);
+	va_end(v);
+
+	if(!had_lock) util_core_unlock();
+}
 
+static void core_gen_event_locked(int which, ...){
+	bool had_lock = core_locked;
+	if(!had_lock) util_core_lock();
+
+	va_list va;
+	va_start(va, which);
+	core_gen_event_v(which, va);
 	va_end(va);
+
+	if(!had_lock) util_core_unlock();
 }
 
+static const IRCCoreCtx core_ctx_locked = {
+	.api_version  = INSO_CORE_API_VERSION,
+	.get_info     = &core_get_info_locked,
+	.get_username = &core_get_username_locked,
+	.get_datafile = &core_get_datafile_locked,
+	.get_modules  = &core_get_modules_locked,
+	.get_channels = &core_get_channels_locked,
+	.get_nicks    = &core_get_nicks_locked,
+	.send_msg     = &core_send_msg_locked,
+	.send_raw     = &core_send_raw_locked,
+	.send_ipc     = &core_send_ipc_locked,
+	.send_mod_msg = &core_send_mod_msg_locked,
+	.join         = &core_join_locked,
+	.part         = &core_part_locked,
+	.save_me      = &core_self_save_locked,
+	.log          = &core_log_locked,
+	.strip_colors = &core_strip_colors,
+	.responded    = &core_responded_locked,
+	.get_tag      = &core_get_tag_locked,
+	.gen_event    = &core_gen_event_locked,
+	.http_async   = &core_http_async_locked,
+	.add_fd       = &core_add_fd_locked,
+	.del_fd       = &core_del_fd_locked,
+	.add_timer    = &core_add_timer_locked,
+	.del_timer    = &core_del_timer_locked,
+	.add_timer_at = &core_add_timer_at_locked,
+	.perms_changed = &core_perms_changed_locked,
+	.get_tag_by_key = &core_get_tag_by_key_locked,
+};
+
 /***************
  * entry point *
  * *************/
@@ -1662,6 +4372,16 @@ int main(int argc, char** argv){
 	util_ipc_init();
 
 	curl_global_init(CURL_GLOBAL_ALL);
+	curl_multi = curl_multi_init();
+
+	// event loop init
+
+	if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+		err(errno, "epoll_create1");
+	}
+
+	curl_multi_setopt(curl_multi, CURLMOPT_SOCKETFUNCTION, &util_http_sock_cb);
+	curl_multi_setopt(curl_multi, CURLMOPT_TIMERFUNCTION, &util_http_timer_cb);
 
 	// find modules
 
@@ -1709,22 +4429,49 @@ int main(int argc, char** argv){
 		.responded    = &core_responded,
 		.get_tag      = &core_get_tag,
 		.gen_event    = &core_gen_event,
+		.http_async   = &core_http_async,
+		.add_fd       = &core_add_fd,
+		.del_fd       = &core_del_fd,
+		.add_timer    = &core_add_timer,
+		.del_timer    = &core_del_timer,
+		.add_timer_at = &core_add_timer_at,
+		.perms_changed = &core_perms_changed,
+		.get_tag_by_key = &core_get_tag_by_key,
 	};
 
 	sb_push(channels, 0);
 
+	inso_ht_init(&chan_index , 64 , sizeof(ChanIndexEntry), &util_index_hash);
+	inso_ht_init(&nick_index , 512, sizeof(NickIndexEntry), &util_index_hash);
+	inso_ht_init(&nick_intern, 512, sizeof(InternEntry)   , &util_index_hash);
+
 	// check for patched lib with ircv3 tag parsing hack
 	{
 		unsigned irc_maj = 0, irc_min = 0;
 		irc_get_version(&irc_maj, &irc_min);
 		if(irc_maj == 1 && irc_min == 0x1b07){
 			have_tag_hack = 1;
+			util_tag_hash_init();
 		}
 	}
 
-	// initial load of modules
+	// stdin may be /dev/null, which epoll refuses. That's fine, there'd be nothing to read anyway.
+	util_io_add(STDIN_FILENO, EPOLLIN, NULL, &util_stdin_read, 0);
+	util_io_add(ipc_socket  , EPOLLIN, NULL, &util_ipc_io, 0);
+	if(ipc_ring){
+		util_io_add(ipc_efd, EPOLLIN, NULL, &util_ipc_ring_io, 0);
+	}
+	util_io_add(inotify.fd  , EPOLLIN, NULL, &util_inotify_io, (intptr_t)&core_ctx);
+
+	const char* save_delay = getenv("INSOBOT_SAVE_DELAY_MS");
+	if(save_delay){
+		save_delay_ms = INSO_MAX(atoi(save_delay), 0);
+	}
+
+	// initial load of modules, the ones on the init pool carry on loading while the bot connects.
 
-	util_reload_modules(&core_ctx);
+	util_core_lock();
+	util_reload_modules(&core_ctx, true);
 
 	if(sb_count(irc_modules) == 0){
 		errx(0, "No modules could be loaded.");
@@ -1786,7 +4533,11 @@ int main(int argc, char** argv){
 			libirc_serv = strdup(serv);
 		}
 
-		if(irc_connect(irc_ctx, libirc_serv, atoi(port), pass, user, user, user) != 0){
+		util_core_unlock();
+		int connect_ret = irc_connect(irc_ctx, libirc_serv, atoi(port), pass, user, user, user);
+		util_core_lock();
+
+		if(connect_ret != 0){
 			fprintf(stderr, "Unable to connect: %s\n", irc_strerror(irc_errno(irc_ctx)));
 		}
 
@@ -1794,131 +4545,56 @@ int main(int argc, char** argv){
 
 		// inner main loop
 
-		while(running && irc_is_connected(irc_ctx)){
-
-			util_process_pending_cmds();
-
-			//TODO: check on_meta & better timing for on_tick?
-			time_t now = time(0);
-			IRC_MOD_CALL_ALL(on_tick, (now));
-
-			int max_fd = 0;
-			fd_set in, out;
-
-			FD_ZERO(&in);
-			FD_ZERO(&out);
-
-			FD_SET(STDIN_FILENO, &in);
-			FD_SET(ipc_socket  , &in);
-			FD_SET(inotify.fd  , &in);
-
-			max_fd = INSO_MAX(max_fd, STDIN_FILENO);
-			max_fd = INSO_MAX(max_fd, ipc_socket);
-			max_fd = INSO_MAX(max_fd, inotify.fd);
-
-			if(debug_chan && debug_pipe[0]){
-				FD_SET(debug_pipe[0], &in);
-				max_fd = INSO_MAX(max_fd, debug_pipe[0]);
-			}
-
-			if(irc_add_select_descriptors(irc_ctx, &in, &out, &max_fd) != 0){
-				fprintf(stderr, "Error adding select fds: %s\n", irc_strerror(irc_errno(irc_ctx)));
-			}
-
-			struct timeval tv = {
-				.tv_sec  = 0,
-				.tv_usec = 250000,
-			}, orig_tv = tv;
-
-			int select_status = select(max_fd + 1, &in, &out, NULL, &tv);
-
-			if(select_status > 0){
-
-				if(FD_ISSET(STDIN_FILENO, &in)){
-					FD_CLR(STDIN_FILENO, &in);
-					char stdin_buf[1024];
-					ssize_t n = read(STDIN_FILENO, stdin_buf, sizeof(stdin_buf));
-					if(n > 0){
-						stdin_buf[n-1] = 0; // remove \n
-						IRC_MOD_CALL_ALL(on_stdin, (stdin_buf));
-					}
-				}
-
-				if(FD_ISSET(ipc_socket, &in)){
-					FD_CLR(ipc_socket, &in);
-					util_ipc_recv();
-				}
-
-				if(FD_ISSET(inotify.fd, &in)){
-					FD_CLR(inotify.fd, &in);
-					util_inotify_check(&core_ctx);
-				}
-
-				if(FD_ISSET(debug_pipe[0], &in)){
-					FD_CLR(debug_pipe[0], &in);
-					char buf[256];
-					char* fname;
-					int off;
-					size_t n = read(debug_pipe[0], buf, sizeof(buf)-1);
-
-					if(n > 0 && sscanf(buf, "%m[^(]%n", &fname, &off) == 1){
-						buf[n-1] = 0; // remove \n
-						core_send_msg(debug_chan, "Recovered from crash: %s%s", basename(fname), buf + off);
-						free(fname);
-					}
-				}
-
-				for(int i = 0; i < max_fd + 1; ++i){
-					if(FD_ISSET(i, &in)){
-						timerclear(&idle_tv);
-						ping_sent = 0;
-						break;
-					}
-				}
-
-				if(irc_process_select_descriptors(irc_ctx, &in, &out) != 0){
-					fprintf(stderr, "Error processing select fds: %s\n", irc_strerror(irc_errno(irc_ctx)));
-				}
-
-			} else if(select_status == 0){
-
-				struct timeval ping_tv    = { .tv_sec = 60 };
-				struct timeval restart_tv = { .tv_sec = 90 };
+		irc_read_ms = util_ms();
+		ping_sent = false;
+		ping_timer = util_timer_add(NULL, util_now_ms() + IRC_PING_MS + 1, 0, &util_ping_check, 0);
 
-				timeradd(&orig_tv, &idle_tv, &idle_tv);
+		while(running && irc_is_connected(irc_ctx)){
+			util_irc_io_update();
+			util_io_wait(util_timer_timeout());
+			util_timer_run();
+		}
 
-				if(!ping_sent && timercmp(&idle_tv, &ping_tv, >)){
-					irc_send_raw(irc_ctx, "PING %s", serv);
-					ping_sent = 1;
-				} else if(ping_sent && timercmp(&idle_tv, &restart_tv, >)){
-					puts("Reached 'no PONG' threshold, disconnecting."); 
-					irc_disconnect(irc_ctx);
-				}
+		util_timer_del(ping_timer);
+		ping_timer = 0;
 
-			} else {
-				perror("select");
-			}
+		if(irc_fd != -1){
+			util_io_del(irc_fd);
+			irc_fd = -1;
+			irc_events = 0;
 		}
 
 		irc_destroy_session(irc_ctx);
-		timerclear(&idle_tv);
-		ping_sent = 0;
 
 		if(running){
 			puts("Restarting.");
+			util_core_unlock();
 			if(getenv("INSOBOT_NO_AUTO_RESTART")){
 				puts("(when you press a key...)");
 				getchar();
 			}
 			usleep(10000000L);
+			util_core_lock();
 		}
 	} while(running);
 
+	// let any on_init still running on the init pool finish, modules it hadn't got to yet are just unloaded.
+
+	while(init_threads){
+		util_core_unlock();
+		usleep(10000);
+		util_core_lock();
+	}
+
 	// clean stuff up so real leaks are more obvious in valgrind
 
 	sb_each(m, irc_modules){
-		util_module_save(m);
-		IRC_MOD_CALL(m, on_quit, ());
+		util_module_detach(m);
+		if(m->state == MOD_LIVE || m->state == MOD_INIT_OK){
+			util_module_save(m);
+			IRC_MOD_CALL(m, on_quit, ());
+			if(m->save_pending) util_module_save(m);
+		}
 		free(m->lib_path);
 		dlclose(m->lib_handle);
 		m->lib_handle = NULL;
@@ -1928,21 +4604,46 @@ int main(int argc, char** argv){
 	sb_free(chan_mod_list);
 	sb_free(global_mod_list);
 	sb_free(mod_call_stack);
-	sb_free(cmd_queue);
-	sb_free(irc_tag_ptrs);
-
+	sb_free(cmd_trie);
+	sb_free(cmd_matches);
+	sb_each(q, cmd_queues){
+		util_cmd_queue_free(*q);
+	}
+	sb_free(cmd_queues);
+	sb_free(cmd_bucket.sent);
+	sb_free(cmd_bucket_msg.sent);
+	sb_free(cmd_bucket_mod.sent);
+	sb_free(cmd_bucket_join.sent);
+	sb_free(irc_tags);
+	sb_free(irc_tag_arena);
+
+	curl_multi_cleanup(curl_multi);
+	sb_free(http_reqs);
+
+	sb_each(w, io_watches){
+		free(*w);
+	}
+	sb_free(io_watches);
+	sb_each(w, io_dead){
+		free(*w);
+	}
+	sb_free(io_dead);
+	sb_free(timer_slots);
+	sb_free(timer_free);
+	sb_free(timer_heap);
+	close(epoll_fd);
 	curl_global_cleanup();
 
-	for(size_t i = 0; i < sb_count(channels) - 1; ++i){
-		free(channels[i]);
-		for(size_t j = 0; j < sb_count(chan_nicks[i]); ++j){
-			free(chan_nicks[i][j]);
-		}
-		sb_free(chan_nicks[i]);
+	while(sb_count(channels) > 1){
+		util_chan_del(0);
 	}
 	sb_free(channels);
 	sb_free(chan_nicks);
 
+	inso_ht_free(&chan_index);
+	inso_ht_free(&nick_index);
+	inso_ht_free(&nick_intern);
+
 	free(bot_nick);
 
 	free(inotify.module.path);
@@ -1953,8 +4654,21 @@ int main(int argc, char** argv){
 		close(ipc_socket);
 		unlink(ipc_self.addr.sun_path);
 	}
+	sb_each(p, ipc_peers){
+		util_ipc_peer_free(p);
+	}
 	sb_free(ipc_peers);
 
+	if(ipc_ring){
+		munmap(ipc_ring, sizeof(IPCRing) + IPC_RING_SIZE);
+		close(ipc_ring_fd);
+		close(ipc_efd);
+	}
+	sb_free(ipc_out);
+	sb_free(ipc_pending);
+	sb_free(ipc_scratch);
+	inso_ht_free(&mod_index);
+
 	if(pipe_fds[1]){
 		close(pipe_fds[1]);
 	}
@@ -306,15 +306,10 @@ static int am_score_flood(const Suspect* s, const char* msg, size_t len){
 
 static int am_score_emotes(const Suspect* s, const char* msg, size_t len){
 	int emote_count = 0;
-	int i = 0;
-	const char *k, *v;
+	const char* v = inso_tag(ctx, "emotes");
 
-	while(ctx->get_tag(i++, &k, &v)){
-		if(strcmp(k, "emotes") != 0) continue;
-		for(; *v; ++v){
-			if(*v == ':' || *v == ',') ++emote_count;
-		}
-		break;
+	for(; v && *v; ++v){
+		if(*v == ':' || *v == ',') ++emote_count;
 	}
 
 	return emote_count >= 5 ? 100 : emote_count * 10;
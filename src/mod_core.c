@@ -135,6 +135,13 @@ static struct chan* core_get_or_add(const char* chan_name){
 	return &sb_last(core_chans);
 }
 
+// the core caches what core_meta returns, so it needs to be told when a channel's list changes.
+static void core_perms_changed(const char* chan){
+	if(ctx->api_version >= 7){
+		ctx->perms_changed(chan);
+	}
+}
+
 static char* mod_find(struct chan* chan, const char* mod){
 	char* p = NULL;
 	while((p = argz_next(chan->mod_list_argz, chan->mod_list_len, p))){
@@ -184,6 +191,7 @@ static void core_cmd(const char* chan, const char* name, const char* arg, int cm
 						ctx->send_msg(chan, "%s: That module is already enabled here!", name);
 					} else {
 						argz_add(&info->mod_list_argz, &info->mod_list_len, arg);
+						core_perms_changed(chan);
 						ctx->send_msg(chan, "%s: Enabled module %s.", name, arg);
 						ctx->save_me();
 					}
@@ -210,6 +218,7 @@ static void core_cmd(const char* chan, const char* name, const char* arg, int cm
 					char* mod = mod_find(info, (*modules)->name);
 					if(mod){
 						argz_delete(&info->mod_list_argz, &info->mod_list_len, mod);
+						core_perms_changed(chan);
 						ctx->send_msg(chan, "%s: Disabled module %s.", name, (*modules)->name);
 						ctx->save_me();
 					} else {
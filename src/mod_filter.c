@@ -22,6 +22,8 @@ const IRCModuleCtx irc_mod_ctx = {
 	.on_quit    = &filter_quit,
 };
 
+#define FILTER_PERMITS_MAX 32
+
 static const IRCCoreCtx* ctx;
 static regex_t* regexen;
 static size_t* permits;
@@ -63,9 +65,9 @@ static bool filter_init(const IRCCoreCtx* _ctx){
 }
 
 static void filter_exec(size_t msg_id, const char* chan, char* msg, size_t len){
+	// long messages are split into several chunks with the same id, so permits can't be used up by the first one.
 	sb_each(p, permits){
 		if(*p == msg_id){
-			sb_erase(permits, p - permits);
 			caps_convert = false;
 			return;
 		}
@@ -131,6 +133,9 @@ static void filter_mod_msg(const char* sender, const IRCModMsg* msg){
 		}
 
 		if(!exists){
+			if(sb_count(permits) >= FILTER_PERMITS_MAX){
+				sb_erase(permits, 0);
+			}
 			sb_push(permits, id);
 		}
 	}
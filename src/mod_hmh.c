@@ -17,7 +17,6 @@ static bool hmh_init    (const IRCCoreCtx*);
 static void hmh_quit    (void);
 static void hmh_mod_msg (const char* sender, const IRCModMsg* msg);
 static void hmh_ipc     (int who, const uint8_t* ptr, size_t sz);
-static void hmh_tick    (time_t);
 
 
 enum { CMD_SCHEDULE, CMD_TIME, CMD_OWLBOT, CMD_OWL_Y, CMD_OWL_N, CMD_QA, CMD_LATEST };
@@ -30,7 +29,6 @@ const IRCModuleCtx irc_mod_ctx = {
 	.on_quit    = &hmh_quit,
 	.on_mod_msg = &hmh_mod_msg,
 	.on_ipc     = &hmh_ipc,
-	.on_tick    = &hmh_tick,
 	.commands = DEFINE_CMDS (
 		[CMD_SCHEDULE] = CMD("schedule"),
 		[CMD_TIME]     = CMD("tm") CMD("time") CMD("when"),
@@ -62,6 +60,7 @@ static time_t schedule_week;
 static char* tz_buf;
 
 static time_t owlbot_timer;
+static intptr_t owlbot_handle;
 static char** owlbot_voters;
 static int    owlbot_yea;
 static int    owlbot_nay;
@@ -503,8 +502,12 @@ static bool check_for_alias(const char* keys, const char* chan, const char* cc){
 
 #define HMH_MSG(...) ({ ctx->send_msg(hmh_get_channel(), __VA_ARGS__); })
 
+static void hmh_owlbot_end(intptr_t);
+
 static void hmh_owlbot_start(void){
 	owlbot_timer = time(0);
+	ctx->del_timer(owlbot_handle);
+	owlbot_handle = ctx->add_timer(60 * 1000, false, &hmh_owlbot_end, 0);
 	owlbot_yea = owlbot_nay = 0;
 	HMH_MSG("(/o.o): Owl vote started. Use !owly or !owln to vote whether or not to light The Owl and notify Casey of something important.");
 }
@@ -634,8 +637,10 @@ static void hmh_cmd(const char* chan, const char* name, const char* arg, int cmd
 	}
 }
 
-static void hmh_tick(time_t now){
-	if(owlbot_timer && now > owlbot_timer + 60){
+static void hmh_owlbot_end(intptr_t arg){
+	owlbot_handle = 0;
+
+	if(owlbot_timer){
 		if((owlbot_nay + owlbot_yea) >= 3){
 			if(owlbot_yea > owlbot_nay){
 				HMH_MSG("(/o.o): The owl will now be signalled. (votes: [Yea: %d, Nay: %d])", owlbot_yea, owlbot_nay);
@@ -677,6 +682,12 @@ static int ftw_cb(const char* path, const struct stat* st, int type){
 
 static bool hmh_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
+
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_hmh: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	ftw("/usr/share/zoneinfo/posix/", &ftw_cb, 10);
 	sb_push(tz_buf, 0);
 
@@ -13,7 +13,7 @@
 
 static bool hmnrss_init (const IRCCoreCtx*);
 static void hmnrss_quit (void);
-static void hmnrss_tick (time_t);
+static void hmnrss_check(intptr_t);
 
 const IRCModuleCtx irc_mod_ctx = {
 	.name    = "hmnrss",
@@ -21,14 +21,12 @@ const IRCModuleCtx irc_mod_ctx = {
 	.flags   = IRC_MOD_GLOBAL,
 	.on_init = &hmnrss_init,
 	.on_quit = &hmnrss_quit,
-	.on_tick = &hmnrss_tick,
 };
 
 static const IRCCoreCtx* ctx;
 static CURL* curl;
 static char* etag;
 static time_t latest_post;
-static time_t last_check;
 static regex_t url_regex;
 
 typedef struct {
@@ -59,12 +57,19 @@ static size_t etag_cb(char* buffer, size_t size, size_t nelem, void* arg){
 
 static bool hmnrss_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
+
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_hmnrss: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	curl = curl_easy_init();
 #ifdef DEBUG_MODE
-	last_check = time(0) - 50;
+	ctx->add_timer(10 * 1000, false, &hmnrss_check, 0);
 #else
-	last_check = latest_post = time(0);
+	latest_post = time(0);
 #endif
+	ctx->add_timer(60 * 1000, true, &hmnrss_check, 0);
 	regcomp(&url_regex, "https://([^\\.]*)\\.?handmade\\.network/.*/[0-9]+", REG_ICASE | REG_EXTENDED);
 
 	return true;
@@ -142,10 +147,7 @@ static bool hmnrss_check_spam(const char* msg, time_t post_time, const char* mem
 	return false;
 }
 
-static void hmnrss_tick(time_t now){
-	if(now - last_check < 60) return;
-	last_check = now;
-
+static void hmnrss_check(intptr_t arg){
 	char* data = NULL;
 	inso_curl_reset(curl, RSS_URL, &data);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &etag_cb);
@@ -11,6 +11,7 @@ static void karma_msg      (const char*, const char*, const char*);
 static void karma_cmd      (const char*, const char*, const char*, int);
 static void karma_nick     (const char*, const char*);
 static void karma_join     (const char*, const char*);
+static void karma_join_bulk(const char*, const char**, size_t);
 static bool karma_save     (FILE*);
 static bool karma_init     (const IRCCoreCtx*);
 static void karma_modified (void);
@@ -32,6 +33,7 @@ const IRCModuleCtx irc_mod_ctx = {
 	.on_save  = &karma_save,
 	.on_modified = &karma_modified,
 	.on_mod_msg  = &karma_mod_msg,
+	.on_join_bulk = &karma_join_bulk,
 	.commands = DEFINE_CMDS (
 		[KARMA_SHOW] = CMD("karma"),
 		[KARMA_TOP]  = CMD("ktop")
@@ -271,6 +273,9 @@ static void karma_cmd(const char* chan, const char* name, const char* arg, int c
 		case KARMA_TOP: {
 			if(!admin) return;
 
+			// karma_update doesn't keep klist in order, and karma_save runs in a fork so it can't either.
+			qsort(klist, sb_count(klist), sizeof(*klist), &karma_sort);
+
 			char msg_buf[256];
 			char* msg_ptr = msg_buf;
 			size_t sz = sizeof(msg_buf);
@@ -329,6 +334,70 @@ static void karma_join(const char* chan, const char* name){
 	karma_add_name(name);
 }
 
+typedef struct {
+	const char* name;
+	size_t entry;
+	int name_idx;
+} KName;
+
+static int karma_kname_cmp(const void* a, const void* b){
+	return strcasecmp(((const KName*)a)->name, ((const KName*)b)->name);
+}
+
+static int karma_str_cmp(const void* a, const void* b){
+	return strcasecmp(*(const char**)a, *(const char**)b);
+}
+
+// same as karma_join for each name, but with one sorted lookup table and a single re-sort of klist at the end.
+static void karma_join_bulk(const char* chan, const char** names, size_t count){
+	KName* known = NULL;
+
+	for(KEntry* k = klist; k < sb_end(klist); ++k){
+		for(char** n = k->names; n < sb_end(k->names); ++n){
+			KName kn = { *n, k - klist, n - k->names };
+			sb_push(known, kn);
+		}
+	}
+
+	qsort(known, sb_count(known), sizeof(*known), &karma_kname_cmp);
+
+	// a NAMES batch can have the same nick more than once, which would be added as separate entries below.
+	const char** batch = malloc(count * sizeof(*batch));
+	memcpy(batch, names, count * sizeof(*batch));
+	qsort(batch, count, sizeof(*batch), &karma_str_cmp);
+
+	size_t unique = 0;
+	for(size_t i = 0; i < count; ++i){
+		if(!unique || strcasecmp(batch[unique-1], batch[i]) != 0){
+			batch[unique++] = batch[i];
+		}
+	}
+
+	size_t added = 0;
+
+	for(size_t i = 0; i < unique; ++i){
+		KName key = { batch[i] };
+		KName* found = bsearch(&key, known, sb_count(known), sizeof(*known), &karma_kname_cmp);
+
+		if(found){
+			klist[found->entry].active_idx = found->name_idx;
+		} else {
+			KEntry k = {};
+			sb_push(k.names, strdup(batch[i]));
+			sb_push(klist, k);
+			++added;
+		}
+	}
+
+	free(batch);
+
+	if(added){
+		qsort(klist, sb_count(klist), sizeof(*klist), &karma_sort);
+	}
+
+	sb_free(known);
+}
+
 static void karma_load(void){
 	char* names;
 	int up, down;
@@ -355,9 +424,6 @@ static void karma_load(void){
 }
 
 static bool karma_save(FILE* f){
-
-	qsort(klist, sb_count(klist), sizeof(*klist), &karma_sort);
-
 	for(KEntry* k = klist; k < sb_end(klist); ++k){
 		if(k->up == 0 && k->down == 0) continue;
 
@@ -18,7 +18,7 @@ static void linkinfo_quit (void);
 const IRCModuleCtx irc_mod_ctx = {
 	.name     = "linkinfo",
 	.desc     = "Shows information about some links posted in the chat.",
-	.flags    = IRC_MOD_DEFAULT,
+	.flags    = IRC_MOD_DEFAULT | IRC_MOD_INIT_ASYNC,
 	.on_msg   = &linkinfo_msg,
 	.on_init  = &linkinfo_init,
 	.on_quit  = &linkinfo_quit
@@ -50,6 +50,11 @@ static regex_t twitch_vid_regex;
 static bool linkinfo_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
 
+	if(ctx->api_version < 4){
+		fprintf(stderr, "mod_linkinfo: insobot version too old (%d, need >= 4), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	bool ret = true;
 
 	ret = ret & (regcomp(
@@ -221,30 +226,44 @@ static void html_unescape(char* msg, size_t len){
 	}
 }
 
-#ifdef USE_LEGIT_YOUTUBE_API
-static void do_youtube_info(const char* chan, const char* msg, regmatch_t* matches){
-	regmatch_t* match = matches + 4;
+// state passed through ctx->http_async to the *_cb functions below
+typedef struct {
+	char* chan;
+	char* arg; // id / tag, depending on the request
+	struct curl_slist* headers;
+} LinkInfoReq;
 
-	if(!yt_api_key) return;
-	if(match->rm_so == -1 || match->rm_eo == -1) return;
+static void linkinfo_fetch(CURL* curl, IRCHttpCallback cb, const char* chan, const char* arg, struct curl_slist* headers){
+	LinkInfoReq* req = malloc(sizeof(*req));
 
-	char* url;
-	asprintf_check(
-		&url,
-		"https://www.googleapis.com/youtube/v3/videos?id=%.*s&part=contentDetails,snippet&key=%s"
-		"&fields=items(snippet(title,liveBroadcastContent),contentDetails(duration))",
-		match->rm_eo - match->rm_so,
-		msg + match->rm_so,
-		yt_api_key
-	);
+	req->chan    = strdup(chan);
+	req->arg     = arg ? strdup(arg) : NULL;
+	req->headers = headers;
 
-	char* data = NULL;
-	CURL* curl = inso_curl_init(url, &data);
-	free(url);
+	ctx->http_async(curl, cb, (intptr_t)req);
+}
 
-	if(curl_easy_perform(curl) == 0){
-		sb_push(data, 0);
+static void linkinfo_req_free(LinkInfoReq* req){
+	free(req->chan);
+	free(req->arg);
+	if(req->headers){
+		curl_slist_free_all(req->headers);
+	}
+	free(req);
+}
+
+// requests still in flight when the module is unloaded are aborted with this before linkinfo_quit runs,
+// the error paths use it to stay quiet instead of blaming anyone in chat.
+static bool linkinfo_aborted(long result){
+	return result == -CURLE_ABORTED_BY_CALLBACK;
+}
 
+#ifdef USE_LEGIT_YOUTUBE_API
+static void youtube_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	const char* chan = req->chan;
+
+	if(result >= 0){
 		static const char* items_path[]    = { "items", NULL };
 		static const char* title_path[]    = { "snippet", "title", NULL };
 		static const char* duration_path[] = { "contentDetails", "duration", NULL };
@@ -292,42 +311,39 @@ static void do_youtube_info(const char* chan, const char* msg, regmatch_t* match
 		yajl_tree_free(root);
 	}
 
-	curl_easy_cleanup(curl);
-	sb_free(data);
+	linkinfo_req_free(req);
 }
-#else
+
 static void do_youtube_info(const char* chan, const char* msg, regmatch_t* matches){
 	regmatch_t* match = matches + 4;
 
+	if(!yt_api_key) return;
 	if(match->rm_so == -1 || match->rm_eo == -1) return;
 
-	size_t matchsz = match->rm_eo - match->rm_so;
-
-	const char url_prefix[] = "https://www.youtube.com/get_video_info?video_id=";
-	const char url_suffix[] = "&el=vevo&el=embedded";
-	const size_t psz = sizeof(url_prefix) - 1;
-	const size_t ssz = sizeof(url_suffix) - 1;
-
-	char* url = alloca(psz + ssz + matchsz + 1);
-
-	memcpy(url, url_prefix, psz);
-	memcpy(url + psz, msg + match->rm_so, matchsz);
-	memcpy(url + psz + matchsz, url_suffix, ssz);
-
-	url[psz + matchsz + ssz] = 0;
-
-	char* data = NULL;
+	char* url;
+	asprintf_check(
+		&url,
+		"https://www.googleapis.com/youtube/v3/videos?id=%.*s&part=contentDetails,snippet&key=%s"
+		"&fields=items(snippet(title,liveBroadcastContent),contentDetails(duration))",
+		match->rm_eo - match->rm_so,
+		msg + match->rm_so,
+		yt_api_key
+	);
 
-	fprintf(stderr, "linkinfo: Fetching [%s]\n", url);
+	CURL* curl = inso_curl_init(url, NULL);
+	free(url);
 
-	CURL* curl = inso_curl_init(url, &data);
-	CURLcode result = curl_easy_perform(curl);
-	sb_push(data, 0);
+	linkinfo_fetch(curl, &youtube_info_cb, chan, NULL, NULL);
+}
+#else
+static void youtube_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	const char* chan = req->chan;
 
 	regmatch_t title[2] = {}, length[2];
 
 	if(
-		result == 0 &&
+		result >= 0 &&
 		regexec(&yt_title_regex, data, 2, title, 0) == 0 &&
 		title[1].rm_so != -1 &&
 		title[1].rm_eo != -1
@@ -368,43 +384,52 @@ static void do_youtube_info(const char* chan, const char* msg, regmatch_t* match
 
 		curl_free(str);
 	} else {
-		fprintf(stderr, "linkinfo: curl returned %d: %s\n", result, curl_easy_strerror(result));
+		if(result < 0){
+			fprintf(stderr, "linkinfo: curl returned %ld: %s\n", -result, curl_easy_strerror(-result));
+		}
 		fprintf(stderr, "data_len = %zu, so:%d eo:%d\n", strlen(data), title[1].rm_so, title[1].rm_eo);
-		ctx->send_msg(chan, "Error getting YT data. Blame insofaras.");
+		if(!linkinfo_aborted(result)){
+			ctx->send_msg(chan, "Error getting YT data. Blame insofaras.");
+		}
 	}
 
-	curl_easy_cleanup(curl);
-
-	sb_free(data);
+	linkinfo_req_free(req);
 }
-#endif
 
-void do_yt_playlist_info(const char* chan, const char* msg, regmatch_t* matches){
-	regmatch_t* id = matches + 1;
-	char url[1024];
+static void do_youtube_info(const char* chan, const char* msg, regmatch_t* matches){
+	regmatch_t* match = matches + 4;
 
-	if(!yt_api_key) return;
-	if(id->rm_so == -1 || id->rm_eo == -1) return;
+	if(match->rm_so == -1 || match->rm_eo == -1) return;
 
-	puts("mod_linkinfo: getting yt playlist info.");
-	snprintf(
-		url,
-		sizeof(url),
-		"https://www.googleapis.com/youtube/v3/playlists?part=snippet&id=%.*s&key=%s",
-		id->rm_eo - id->rm_so,
-		msg + id->rm_so,
-		yt_api_key
-	);
+	size_t matchsz = match->rm_eo - match->rm_so;
+
+	const char url_prefix[] = "https://www.youtube.com/get_video_info?video_id=";
+	const char url_suffix[] = "&el=vevo&el=embedded";
+	const size_t psz = sizeof(url_prefix) - 1;
+	const size_t ssz = sizeof(url_suffix) - 1;
+
+	char* url = alloca(psz + ssz + matchsz + 1);
+
+	memcpy(url, url_prefix, psz);
+	memcpy(url + psz, msg + match->rm_so, matchsz);
+	memcpy(url + psz + matchsz, url_suffix, ssz);
+
+	url[psz + matchsz + ssz] = 0;
+
+	fprintf(stderr, "linkinfo: Fetching [%s]\n", url);
+
+	linkinfo_fetch(inso_curl_init(url, NULL), &youtube_info_cb, chan, NULL, NULL);
+}
+#endif
+
+static void yt_playlist_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
 
 	static const char* items_path[] = { "items", NULL };
 	static const char* title_path[] = { "snippet", "title", NULL };
 	static const char* chant_path[] = { "snippet", "channelTitle", NULL };
 
-	char* data = NULL;
-	CURL* curl = inso_curl_init(url, &data);
-	if(curl_easy_perform(curl) == 0){
-		sb_push(data, 0);
-
+	if(result >= 0){
 		yajl_val root  = yajl_tree_parse(data, NULL, 0);
 		yajl_val items = yajl_tree_get(root, items_path, yajl_t_array);
 
@@ -414,56 +439,62 @@ void do_yt_playlist_info(const char* chan, const char* msg, regmatch_t* matches)
 			yajl_val chant = yajl_tree_get(obj, chant_path, yajl_t_string);
 
 			if(title && chant){
-				ctx->send_msg(chan, "↑ YT Playlist: [%s] by %s.", title->u.string, chant->u.string);
+				ctx->send_msg(req->chan, "↑ YT Playlist: [%s] by %s.", title->u.string, chant->u.string);
 			}
 		}
 		yajl_tree_free(root);
 	}
-	curl_easy_cleanup(curl);
-	sb_free(data);
+
+	linkinfo_req_free(req);
 }
 
-char* do_download(const char* url){
-	char* data = NULL;
-	CURL* curl = inso_curl_init(url, &data);
-	CURLcode curl_ret = curl_easy_perform(curl);
-	sb_push(data, 0);
-	curl_easy_cleanup(curl);
+void do_yt_playlist_info(const char* chan, const char* msg, regmatch_t* matches){
+	regmatch_t* id = matches + 1;
+	char url[1024];
 
-	if(curl_ret == CURLE_OK){
-		return data;
-	} else {
-		sb_free(data);
-		return NULL;
-	}
+	if(!yt_api_key) return;
+	if(id->rm_so == -1 || id->rm_eo == -1) return;
+
+	puts("mod_linkinfo: getting yt playlist info.");
+	snprintf(
+		url,
+		sizeof(url),
+		"https://www.googleapis.com/youtube/v3/playlists?part=snippet&id=%.*s&key=%s",
+		id->rm_eo - id->rm_so,
+		msg + id->rm_so,
+		yt_api_key
+	);
+
+	linkinfo_fetch(inso_curl_init(url, NULL), &yt_playlist_info_cb, chan, NULL, NULL);
 }
 
-void do_generic_info(const char* chan, const char* url, const char* tag){
-	char* html;
+static void generic_info_cb(void* curl, long result, char* html, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
 	regmatch_t title[2];
 	int title_len = 0;
 
-	fprintf(stderr, "linkinfo: Fetching title [%s]\n", url);
-
-	if((html = do_download(url)) &&
+	if(result >= 0 &&
 		regexec(&generic_title_regex, html, 2, title, 0) == 0 &&
 		(title_len = (title[1].rm_eo - title[1].rm_so)) > 0
 	){
 		char* title_str = strndupa(html + title[1].rm_so, title_len);
 		html_unescape(title_str, title_len);
-		ctx->send_msg(chan, "↑ %s: [%s]", tag, title_str);
+		ctx->send_msg(req->chan, "↑ %s: [%s]", req->arg, title_str);
 	}
 
-	sb_free(html);
+	linkinfo_req_free(req);
 }
 
-void do_ograph_info(const char* chan, const char* url, const char* tag){
-	char* html;
-	regmatch_t desc[2];
+void do_generic_info(const char* chan, const char* url, const char* tag){
+	fprintf(stderr, "linkinfo: Fetching title [%s]\n", url);
+	linkinfo_fetch(inso_curl_init(url, NULL), &generic_info_cb, chan, tag, NULL);
+}
 
-	fprintf(stderr, "linkinfo: Fetching og desc [%s]\n", url);
+static void ograph_info_cb(void* curl, long result, char* html, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	regmatch_t desc[2];
 
-	if((html = do_download(url)) && regexec(&ograph_desc_regex, html, 2, desc, 0) == 0){
+	if(result >= 0 && regexec(&ograph_desc_regex, html, 2, desc, 0) == 0){
 		int len = desc[1].rm_eo - desc[1].rm_so;
 		char* desc_str = strndupa(html + desc[1].rm_so, len);
 		char* p = strchr(desc_str, '\n');
@@ -472,10 +503,15 @@ void do_ograph_info(const char* chan, const char* url, const char* tag){
 			len = p - desc_str;
 		}
 		html_unescape(desc_str, len);
-		ctx->send_msg(chan, "↑ %s: [%s]", tag, desc_str);
+		ctx->send_msg(req->chan, "↑ %s: [%s]", req->arg, desc_str);
 	}
 
-	sb_free(html);
+	linkinfo_req_free(req);
+}
+
+void do_ograph_info(const char* chan, const char* url, const char* tag){
+	fprintf(stderr, "linkinfo: Fetching og desc [%s]\n", url);
+	linkinfo_fetch(inso_curl_init(url, NULL), &ograph_info_cb, chan, tag, NULL);
 }
 
 static const char* url_path[]        = { "url", NULL };
@@ -539,35 +575,8 @@ static int twitter_parse_entities(Replacement** out, yajl_val entity, bool is_me
 	return size;
 }
 
-static void do_twitter_info(const char* chan, const char* msg, regmatch_t* matches){
-
-	if(!twitter_token){
-		fputs("Can't fetch tweet, no twitter_token\n", stderr);
-		return;
-	}
-
-	char* tweet_id = strndupa(msg + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
-	char* auth_token = NULL;
-	char* data = NULL;
-	char* url = NULL;
-
-	asprintf_check(&auth_token, "Authorization: Bearer %s", twitter_token);
-	asprintf_check(&url, "https://api.twitter.com/1.1/statuses/show/%s.json?tweet_mode=extended", tweet_id);
-
-	CURL* curl = inso_curl_init(url, &data);
-
-	struct curl_slist* headers = curl_slist_append(NULL, auth_token);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
-	curl_easy_perform(curl);
-
-	sb_push(data, 0);
-
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(curl);
-
-	free(auth_token);
-	free(url);
+static void twitter_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
 
 //	printf("TWITTER DEBUG: [%s]\n", data);
 
@@ -632,38 +641,53 @@ static void do_twitter_info(const char* chan, const char* msg, regmatch_t* match
 	html_unescape(fixed_text, strlen(fixed_text));
 	sb_free(url_replacements);
 
-	ctx->send_msg(chan, "↑ Tweet by %s: [%s] [%s]", user->u.string, fixed_text, time_buf);
+	ctx->send_msg(req->chan, "↑ Tweet by %s: [%s] [%s]", user->u.string, fixed_text, time_buf);
 
 out:
 	if(root){
 		yajl_tree_free(root);
 	}
 
-	sb_free(data);
+	linkinfo_req_free(req);
 }
 
-static void do_steam_info(const char* chan, const char* msg, regmatch_t* matches){
-	const char* appid = strndupa(msg + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
+static void do_twitter_info(const char* chan, const char* msg, regmatch_t* matches){
 
-	char* url;
-	asprintf_check(&url, "http://store.steampowered.com/api/appdetails?appids=%s&cc=US", appid);
+	if(!twitter_token){
+		fputs("Can't fetch tweet, no twitter_token\n", stderr);
+		return;
+	}
 
-	char* data = NULL;
-	yajl_val root = NULL;
+	char* tweet_id = strndupa(msg + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
+	char* auth_token = NULL;
+	char* url = NULL;
+
+	asprintf_check(&auth_token, "Authorization: Bearer %s", twitter_token);
+	asprintf_check(&url, "https://api.twitter.com/1.1/statuses/show/%s.json?tweet_mode=extended", tweet_id);
+
+	CURL* curl = inso_curl_init(url, NULL);
 
-	CURL* curl = inso_curl_init(url, &data);
-	CURLcode ret = curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
+	struct curl_slist* headers = curl_slist_append(NULL, auth_token);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
+	free(auth_token);
 	free(url);
 
-	if(ret != 0){
-		fprintf(stderr, "mod_linkinfo: steam curl err %s\n", curl_easy_strerror(ret));
+	linkinfo_fetch(curl, &twitter_info_cb, chan, NULL, headers);
+}
+
+static void steam_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	const char* chan  = req->chan;
+	const char* appid = req->arg;
+
+	yajl_val root = NULL;
+
+	if(result < 0){
+		fprintf(stderr, "mod_linkinfo: steam curl err %s\n", curl_easy_strerror(-result));
 		goto out;
 	}
 
-	sb_push(data, 0);
-
 	root = yajl_tree_parse(data, NULL, 0);
 	if(!root){
 		fprintf(stderr, "mod_linkinfo: steam root null!\n");
@@ -712,29 +736,33 @@ static void do_steam_info(const char* chan, const char* msg, regmatch_t* matches
 	}
 
 out:
-	sb_free(data);
 	yajl_tree_free(root);
+	linkinfo_req_free(req);
 }
 
-static void do_vimeo_info(const char* chan, const char* msg, regmatch_t* matches){
-
-	char* data = NULL;
-	yajl_val root = NULL;
+static void do_steam_info(const char* chan, const char* msg, regmatch_t* matches){
+	const char* appid = strndupa(msg + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
 
-	char* id = strndupa(msg + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
 	char* url;
-	asprintf_check(&url, "https://vimeo.com/api/oembed.json?url=https%%3A%%2F%%2Fvimeo.com%%2F%s", id); 
+	asprintf_check(&url, "http://store.steampowered.com/api/appdetails?appids=%s&cc=US", appid);
 
-	CURL* curl = inso_curl_init(url, &data);
-	int ret = curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
+	CURL* curl = inso_curl_init(url, NULL);
 	free(url);
 
-	sb_push(data, 0);
+	linkinfo_fetch(curl, &steam_info_cb, chan, appid, NULL);
+}
 
-	if(ret != 0){
-		fprintf(stderr, "mod_linkinfo: vimeo curl err %s\n", curl_easy_strerror(ret));
-		ctx->send_msg(chan, "Error getting Vimeo data. Blame insofaras.");
+static void vimeo_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	const char* chan = req->chan;
+
+	yajl_val root = NULL;
+
+	if(result < 0){
+		fprintf(stderr, "mod_linkinfo: vimeo curl err %s\n", curl_easy_strerror(-result));
+		if(!linkinfo_aborted(result)){
+			ctx->send_msg(chan, "Error getting Vimeo data. Blame insofaras.");
+		}
 		goto out;
 	}
 
@@ -776,22 +804,25 @@ static void do_vimeo_info(const char* chan, const char* msg, regmatch_t* matches
 
 out:
 	yajl_tree_free(root);
-	sb_free(data);
+	linkinfo_req_free(req);
 }
 
-static void do_xkcd_info(const char* chan, const char* msg, regmatch_t* matches){
-
-	const char* id = strndupa(msg + matches[2].rm_so, matches[2].rm_eo - matches[2].rm_so);
-	char* data = NULL;
+static void do_vimeo_info(const char* chan, const char* msg, regmatch_t* matches){
+	char* id = strndupa(msg + matches[1].rm_so, matches[1].rm_eo - matches[1].rm_so);
 	char* url;
-	asprintf_check(&url, "https://xkcd.com/%s/info.0.json", id);
+	asprintf_check(&url, "https://vimeo.com/api/oembed.json?url=https%%3A%%2F%%2Fvimeo.com%%2F%s", id); 
 
-	CURL* curl = inso_curl_init(url, &data);
+	CURL* curl = inso_curl_init(url, NULL);
+	free(url);
+
+	linkinfo_fetch(curl, &vimeo_info_cb, chan, NULL, NULL);
+}
 
-	CURLcode err;
-	if((err = curl_easy_perform(curl)) == CURLE_OK){
-		sb_push(data, 0);
+static void xkcd_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	const char* id = req->arg;
 
+	if(result >= 0){
 		static const char* title_path[] = { "title", NULL };
 		static const char* img_path[] = { "img", NULL };
 		static const char* alt_path[] = { "alt", NULL };
@@ -805,37 +836,34 @@ static void do_xkcd_info(const char* chan, const char* msg, regmatch_t* matches)
 			fprintf(stderr, "mod_linkinfo; xkcd expand failed\n");
 		} else {
 			const char* suffix = strlen(alt->u.string) > 200 ? "..." : "";
-			ctx->send_msg(chan, "↑ xkcd %s: \"%s\", [%s] [Alt: %.200s%s]", id, title->u.string, img->u.string, alt->u.string, suffix);
+			ctx->send_msg(req->chan, "↑ xkcd %s: \"%s\", [%s] [Alt: %.200s%s]", id, title->u.string, img->u.string, alt->u.string, suffix);
 		}
 
 		yajl_tree_free(root);
-		curl_easy_cleanup(curl);
 	} else {
-		fprintf(stderr, "mod_linkinfo: xkcd curl [%s] err: %s", url, curl_easy_strerror(err));
+		fprintf(stderr, "mod_linkinfo: xkcd curl [%s] err: %s", id, curl_easy_strerror(-result));
 	}
 
-	sb_free(data);
-	free(url);
+	linkinfo_req_free(req);
 }
 
-static void do_github_info(const char* chan, const char* msg, regmatch_t* matches){
+static void do_xkcd_info(const char* chan, const char* msg, regmatch_t* matches){
 
+	const char* id = strndupa(msg + matches[2].rm_so, matches[2].rm_eo - matches[2].rm_so);
 	char* url;
-	asprintf_check(
-		&url,
-		"https://api.github.com/repos/%.*s/%.*s",
-		matches[2].rm_eo - matches[2].rm_so,
-		msg + matches[2].rm_so,
-		matches[3].rm_eo - matches[3].rm_so,
-		msg + matches[3].rm_so
-	);
+	asprintf_check(&url, "https://xkcd.com/%s/info.0.json", id);
 
-	char* data = NULL;
-	CURL* curl = inso_curl_init(url, &data);
-	struct curl_slist* headers = curl_slist_append(NULL, "Accept: application/vnd.github.drax-preview+json");
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	CURL* curl = inso_curl_init(url, NULL);
+	free(url);
+
+	linkinfo_fetch(curl, &xkcd_info_cb, chan, id, NULL);
+}
 
-	if(inso_curl_perform(curl, &data) == 200){
+static void github_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+	const char* chan = req->chan;
+
+	if(result == 200){
 		yajl_val root = yajl_tree_parse(data, NULL, 0);
 		yajl_val desc = YAJL_GET(root, yajl_t_string, ("description"));
 		yajl_val name = YAJL_GET(root, yajl_t_string, ("full_name"));
@@ -853,38 +881,34 @@ static void do_github_info(const char* chan, const char* msg, regmatch_t* matche
 		yajl_tree_free(root);
 	}
 
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(curl);
-	sb_free(data);
-	free(url);
+	linkinfo_req_free(req);
 }
 
-static void do_twitch_vid_info(const char* chan, const char* msg, regmatch_t* matches){
-	if(matches[2].rm_so == -1 || matches[2].rm_eo == -1) return;
+static void do_github_info(const char* chan, const char* msg, regmatch_t* matches){
 
 	char* url;
 	asprintf_check(
 		&url,
-		"https://api.twitch.tv/helix/videos?id=%.*s",
+		"https://api.github.com/repos/%.*s/%.*s",
 		matches[2].rm_eo - matches[2].rm_so,
-		msg + matches[2].rm_so
+		msg + matches[2].rm_so,
+		matches[3].rm_eo - matches[3].rm_so,
+		msg + matches[3].rm_so
 	);
 
-	char* data = NULL;
-	CURL* curl = inso_curl_init(url, &data);
-	struct curl_slist* headers = NULL;
+	CURL* curl = inso_curl_init(url, NULL);
+	struct curl_slist* headers = curl_slist_append(NULL, "Accept: application/vnd.github.drax-preview+json");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
-	const char* client_id = getenv("INSOBOT_TWITCH_CLIENT_ID");
-	if(!client_id){
-		client_id = "jzkbprff40iqj646a697cyrvl0zt2m6";
-	}
+	free(url);
 
-	char buf[256];
-	snprintf(buf, sizeof(buf), "Client-ID: %s", client_id);
-	headers = curl_slist_append(headers, buf);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	linkinfo_fetch(curl, &github_info_cb, chan, NULL, headers);
+}
 
-	if(inso_curl_perform(curl, &data) == 200){
+static void twitch_vid_info_cb(void* curl, long result, char* data, intptr_t arg){
+	LinkInfoReq* req = (LinkInfoReq*)arg;
+
+	if(result == 200){
 		yajl_val root = yajl_tree_parse(data, NULL, 0);
 		yajl_val data = YAJL_GET(root, yajl_t_array, ("data"));
 
@@ -897,7 +921,7 @@ static void do_twitch_vid_info(const char* chan, const char* msg, regmatch_t* ma
 				yajl_val duration = YAJL_GET(obj, yajl_t_string, ("duration"));
 
 				if(title && name){
-					ctx->send_msg(chan, "↑ Twitch VoD: [%s] [%s] by %s", title->u.string, duration->u.string, name->u.string);
+					ctx->send_msg(req->chan, "↑ Twitch VoD: [%s] [%s] by %s", title->u.string, duration->u.string, name->u.string);
 				}
 			}
 		}
@@ -905,9 +929,36 @@ static void do_twitch_vid_info(const char* chan, const char* msg, regmatch_t* ma
 		yajl_tree_free(root);
 	}
 
+	linkinfo_req_free(req);
+}
+
+static void do_twitch_vid_info(const char* chan, const char* msg, regmatch_t* matches){
+	if(matches[2].rm_so == -1 || matches[2].rm_eo == -1) return;
+
+	char* url;
+	asprintf_check(
+		&url,
+		"https://api.twitch.tv/helix/videos?id=%.*s",
+		matches[2].rm_eo - matches[2].rm_so,
+		msg + matches[2].rm_so
+	);
+
+	CURL* curl = inso_curl_init(url, NULL);
+	struct curl_slist* headers = NULL;
+
+	const char* client_id = getenv("INSOBOT_TWITCH_CLIENT_ID");
+	if(!client_id){
+		client_id = "jzkbprff40iqj646a697cyrvl0zt2m6";
+	}
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "Client-ID: %s", client_id);
+	headers = curl_slist_append(headers, buf);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
 	free(url);
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(curl);
+
+	linkinfo_fetch(curl, &twitch_vid_info_cb, chan, NULL, headers);
 }
 
 static void linkinfo_msg(const char* chan, const char* name, const char* msg){
@@ -6,6 +6,13 @@
 #include <assert.h>
 #include <regex.h>
 #include <zlib.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
 #include "module.h"
 #include "inso_utils.h"
 #include "inso_ht.h"
@@ -13,7 +20,10 @@
 
 static bool markov_init (const IRCCoreCtx*);
 static void markov_quit (void);
+static void* markov_handoff (void);
+static bool markov_adopt (const IRCCoreCtx*, void*);
 static void markov_join (const char*, const char*);
+static void markov_join_bulk(const char*, const char**, size_t);
 static void markov_cmd  (const char*, const char*, const char*, int);
 static void markov_msg  (const char*, const char*, const char*);
 static void markov_mod_msg(const char* sender, const IRCModMsg* msg);
@@ -25,7 +35,7 @@ enum { MARKOV_SAY, MARKOV_ASK, MARKOV_INTERVAL, MARKOV_LENGTH, MARKOV_STATUS, MA
 const IRCModuleCtx irc_mod_ctx = {
 	.name     = "markov",
 	.desc     = "Says incomprehensible stuff",
-	.flags    = IRC_MOD_DEFAULT,
+	.flags    = IRC_MOD_DEFAULT | IRC_MOD_SAVE_INLINE | IRC_MOD_INIT_ASYNC,
 	.on_init  = &markov_init,
 	.on_quit  = &markov_quit,
 	.on_cmd   = &markov_cmd,
@@ -34,6 +44,9 @@ const IRCModuleCtx irc_mod_ctx = {
 	.on_save  = &markov_save,
 	.on_stdin = &markov_stdin,
 	.on_mod_msg = &markov_mod_msg,
+	.on_join_bulk = &markov_join_bulk,
+	.on_handoff = &markov_handoff,
+	.on_adopt   = &markov_adopt,
 	.commands = DEFINE_CMDS (
 		[MARKOV_SAY]      = CMD("say"),
 		[MARKOV_ASK]      = CMD("ask"),
@@ -59,21 +72,44 @@ static const IRCCoreCtx* ctx;
 // Unique ID for a word, and an offset into the word_mem array that contains the actual string.
 typedef uint32_t word_idx_t;
 
-// Used in chain_keys_ht hash table, one entry for each unique pair of words.
-// val_idx points into the chain_vals array
+// Used in a model's keys_ht hash table, one entry for each unique context of markov_order words.
+// val_idx points into the model's vals array, and the context follows it as 24-bit word_idxs, oldest first,
+// so each key is MARKOV_KEY_SIZE(markov_order) bytes (order 2 has the same layout the older files use).
 typedef struct __attribute__((packed)) {
 	uint32_t val_idx;
-	word_idx_t word_idx_1 : 24;
-	word_idx_t word_idx_2 : 24;
+	uint8_t  words[];
 } MarkovLinkKey;
 
-// Used in chain_vals array, describes the possible next states for a key
-// next points to the next value for the key, terminated by (uint32_t)-1
+#define MARKOV_ORDER_MAX    4
+#define MARKOV_KEY_SIZE(n)  (sizeof(MarkovLinkKey) + 3 * (n))
+
+// A context, most recent word last. The words before the ones a key uses are 0, which is never a real word.
+typedef word_idx_t MarkovContext[MARKOV_ORDER_MAX];
+
+// Used in a model's vals array, which has a block for each key: a header followed by the possible next states,
+// sorted by word_idx, with room for MARKOV_BLOCK_CAP(n) of them. Blocks that fill up are moved to the end.
+typedef union {
+	struct {
+		word_idx_t word_idx : 24;
+		uint8_t    count;
+		uint32_t   cum; // running total of count up to and including this one, if the header's cum_ok is set
+	};
+	struct {
+		uint32_t   n : 24;
+		uint32_t   cum_ok : 1;
+		uint32_t   age : 7; // pruning passes since this key last learned something
+		uint32_t   total;
+	} hdr;
+} MarkovLinkVal;
+
+#define MARKOV_BLOCK_CAP(n) ((n) <= 1 ? 1u : 1u << (32 - __builtin_clz((n) - 1)))
+
+// vals entries in IBMK v3 / v4 files: one linked list per key, terminated by (uint32_t)-1
 typedef struct {
 	word_idx_t word_idx : 24;
 	uint8_t count;
 	uint32_t next;
-} MarkovLinkVal;
+} MarkovLinkValV4;
 
 // Used in word_ht hash table, one entry per unique word
 typedef struct {
@@ -81,6 +117,25 @@ typedef struct {
 	uint32_t   total;
 } WordInfo;
 
+// The chains for one channel (or group of channels), they all share word_mem / word_ht.
+typedef struct {
+	char*          name;         // NULL for the default model
+	inso_ht        keys_ht;
+	MarkovLinkVal* vals;
+	size_t         vals_map_len; // while vals still points into the save file, 0 once it's our own
+	time_t         used;         // last learned from or generated with
+	bool           mapped;       // keys_ht + vals are still the untouched mappings of the save file
+	bool           cold;         // and their pages have been dropped, see markov_model_check
+	char**         pool;         // sentences the generation worker made ahead of time
+	bool           gen_failed;   // the worker couldn't make one, don't retry until it learns something
+} MarkovModel;
+
+// From INSOBOT_MARKOV_MODELS, a channel that learns into / generates from the model of that name.
+typedef struct {
+	char* chan;
+	char* model;
+} MarkovGroup;
+
 typedef struct {
 	word_idx_t word;
 	time_t updated;
@@ -104,11 +159,18 @@ static const char* skip_words[]    = { "p", "d", "b", "o", "-p", "-d", "-b", "-o
 static char*   word_mem;
 static inso_ht word_ht;
 
-static inso_ht        chain_keys_ht;
-static MarkovLinkVal* chain_vals;
+// models[0] is the default one, model is the one learning / generation is currently using.
+// once the generation worker is running, it's only set and used with gen_lock held.
+static MarkovModel**         models;
+static MarkovModel*          model;
+static MarkovGroup*          markov_groups;
+static bool                  markov_chan_models; // channels not in a group get their own model
+
+// held by the generation worker while it uses the models, and by the main thread while it changes them.
+static pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static char rng_state_mem[256];
-static struct random_data rng_state;
+static __thread char rng_state_mem[256];
+static __thread struct random_data rng_state;
 
 static regex_t url_regex;
 
@@ -118,13 +180,20 @@ static size_t msg_chance = 150;
 static word_idx_t start_sym_idx;
 static word_idx_t end_sym_idx;
 
+// words of context per key, and the shortest context also learned for generation to fall back on.
+static int    markov_order = 2;
+static int    markov_order_min = 2;
+static size_t markov_key_size = MARKOV_KEY_SIZE(2);
+
 static uint32_t recent_hashes[128];
 static size_t   recent_hash_idx;
 
 static char** markov_nicks;
 
-static int    dict_fd;
-static size_t dict_fd_size;
+// words from the dictionary file, and a bit per word_mem offset set if the word there is one of them.
+static char*    dict_mem;
+static inso_ht  dict_ht;
+static uint8_t* dict_bits;
 
 #if 0
 static MarkovTopic    markov_topics[64];
@@ -169,6 +238,15 @@ static bool wordinfo_cmp(const void* elem, void* param){
 	return strcmp(str, word_mem + w->word_idx) == 0;
 }
 
+static size_t dict_hash(const void* arg){
+	const char* word = dict_mem + *(const uint32_t*)arg;
+	return markov_hash(word, strlen(word));
+}
+
+static bool dict_cmp(const void* elem, void* param){
+	return strcmp(param, dict_mem + *(const uint32_t*)elem) == 0;
+}
+
 static uint32_t hash6432shift(uint64_t key){
 	key = (~key) + (key << 18);
 	key = key ^ (key >> 31);
@@ -179,17 +257,96 @@ static uint32_t hash6432shift(uint64_t key){
 	return (uint32_t)key;
 }
 
+// hashes the last len words of ctx, as if the ones before them were 0. The last two hash the way order 2 keys
+// always have, so the ctrl bytes of older files stay valid.
+static uint32_t markov_ctx_hash(const MarkovContext ctx, int len){
+	word_idx_t w0 = len > 3 ? ctx[0] : 0;
+	word_idx_t w1 = len > 2 ? ctx[1] : 0;
+	word_idx_t w2 = len > 1 ? ctx[2] : 0;
+
+	uint32_t hash = hash6432shift(((uint64_t)w2 << 32UL) | ctx[3]);
+
+	if(w0 | w1){
+		hash ^= hash6432shift((((uint64_t)w0 << 32UL) | w1) ^ 0x9E3779B97F4A7C15ULL);
+	}
+
+	return hash;
+}
+
+// the words of a key as one number, the oldest one in the low bits. Keys are read and written through this
+// with a constant size for each order, which is a couple of loads / stores instead of a byte at a time.
+typedef unsigned __int128 MarkovKeyId;
+
+// the id of the key for the last len words of ctx, with 0s in front of them up to markov_order.
+static MarkovKeyId markov_ctx_id(const MarkovContext ctx, int len){
+	MarkovKeyId id = (MarkovKeyId)ctx[0] | (MarkovKeyId)ctx[1] << 24 | (MarkovKeyId)ctx[2] << 48 | (MarkovKeyId)ctx[3] << 72;
+	return (id >> (24 * (MARKOV_ORDER_MAX - len))) << (24 * (markov_order - len));
+}
+
+static MarkovKeyId markov_key_id(const MarkovLinkKey* key){
+	MarkovKeyId id = 0;
+
+	switch(markov_order){
+		case 1:  memcpy(&id, key->words, 3);  break;
+		case 2:  memcpy(&id, key->words, 6);  break;
+		case 3:  memcpy(&id, key->words, 9);  break;
+		default: memcpy(&id, key->words, 12); break;
+	}
+
+	return id;
+}
+
+static void markov_key_set(MarkovLinkKey* key, MarkovKeyId id){
+	switch(markov_order){
+		case 1:  memcpy(key->words, &id, 3);  break;
+		case 2:  memcpy(key->words, &id, 6);  break;
+		case 3:  memcpy(key->words, &id, 9);  break;
+		default: memcpy(key->words, &id, 12); break;
+	}
+}
+
+static void markov_key_get(const MarkovLinkKey* key, MarkovContext ctx){
+	MarkovKeyId id = markov_key_id(key);
+
+	memset(ctx, 0, sizeof(MarkovContext));
+	for(int i = MARKOV_ORDER_MAX - markov_order; i < MARKOV_ORDER_MAX; ++i, id >>= 24){
+		ctx[i] = id & 0xFFFFFF;
+	}
+}
+
 static size_t chain_key_hash(const void* arg){
-	const MarkovLinkKey* k = arg;
-	return hash6432shift(((uint64_t)k->word_idx_1 << 32UL) | k->word_idx_2);
+	MarkovContext ctx;
+	markov_key_get(arg, ctx);
+	return markov_ctx_hash(ctx, markov_order);
+}
+
+// one of these for each order, so the size of the compare is a constant. Up to order 2 it's all in the low 64 bits.
+static bool chain_key_cmp_1(const void* elem, void* param){
+	uint64_t id = 0;
+	memcpy(&id, ((const MarkovLinkKey*)elem)->words, 3);
+	return id == (uint64_t)*(MarkovKeyId*)param;
+}
+
+static bool chain_key_cmp_2(const void* elem, void* param){
+	uint64_t id = 0;
+	memcpy(&id, ((const MarkovLinkKey*)elem)->words, 6);
+	return id == (uint64_t)*(MarkovKeyId*)param;
+}
+
+static bool chain_key_cmp_3(const void* elem, void* param){
+	MarkovKeyId id = 0;
+	memcpy(&id, ((const MarkovLinkKey*)elem)->words, 9);
+	return id == *(MarkovKeyId*)param;
 }
 
-static bool chain_key_cmp(const void* elem, void* param){
-	uint64_t* id = param;
-	const MarkovLinkKey* key = elem;
-	return (((uint64_t)key->word_idx_1 << 32UL) | key->word_idx_2) == *id;
+static bool chain_key_cmp_4(const void* elem, void* param){
+	MarkovKeyId id = 0;
+	memcpy(&id, ((const MarkovLinkKey*)elem)->words, 12);
+	return id == *(MarkovKeyId*)param;
 }
 
+static inso_ht_cmp_fn chain_key_cmp = &chain_key_cmp_2;
+
 // }}}
 
 // Utility Funcs {{{
@@ -204,9 +361,95 @@ static void ht_free(void* p, size_t n){
 	assert(munmap(p, n) == 0);
 }
 
+// mapped length of word_mem while it still points into the save file (spare room included), 0 once it's our own.
+static size_t word_mem_map_len;
+
+// address space left after the word_mem / vals sections of the save file for what's learned afterwards.
+// It's only backed by memory once it's written to.
+#define MARKOV_MAP_SPARE ((size_t)256 << 20)
+
+// maps len bytes of the file, followed by spare bytes of anonymous memory. *mapped is cleared if it had to be
+// read in instead.
+static void* markov_map_section(int fd, uint64_t off, uint64_t len, size_t spare, bool* mapped){
+	if(!len) return NULL;
+
+	void* mem = mmap(0, len + spare, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(mem == MAP_FAILED){
+		perror("markov_map_section: mmap");
+		return NULL;
+	}
+
+	if(off % sysconf(_SC_PAGESIZE) == 0){
+		if(mmap(mem, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off) != MAP_FAILED){
+			madvise(mem, len, MADV_RANDOM);
+			return mem;
+		}
+		perror("markov_map_section: mmap");
+	}
+
+	// written with a bigger page size than ours, fall back to reading it in.
+	*mapped = false;
+	if(pread(fd, mem, len, off) != (ssize_t)len){
+		ht_free(mem, len + spare);
+		return NULL;
+	}
+
+	return mem;
+}
+
+// the stretchy buffer functions grow with mremap, which can't span the file mapping and the spare room after it,
+// so an array that fills the spare room is moved into anonymous memory of its own.
+static void* markov_unmap_sb(void* arr, size_t itemsize, size_t* map_len){
+	if(!*map_len) return arr;
+
+	size_t n = stb__sbn(arr);
+	void* copy = stb__sbgrowf_mm(NULL, n + SB_PAGE_SIZE, itemsize);
+	memcpy(copy, arr, n * itemsize);
+	stb__sbn(copy) = n;
+
+	munmap(stb__sbraw(arr), *map_len);
+	*map_len = 0;
+
+	return copy;
+}
+
+// called before appending n items to an array that might still be mapped from the save file. The capacity
+// in its header is set from the mapping each time, since markov_model_check can drop the page it's on.
+static void* markov_sb_room(void* arr, size_t itemsize, size_t n, size_t* map_len){
+	if(!*map_len) return arr;
+
+	size_t cap = (*map_len - sizeof(size_t) * 2) / itemsize;
+	if(stb__sbn(arr) + n >= cap){
+		return markov_unmap_sb(arr, itemsize, map_len);
+	}
+
+	stb__sbm(arr) = cap;
+	return arr;
+}
+
+static void markov_rng_init(void){
+	unsigned int seed = rand();
+
+	int fd = open("/dev/urandom", O_RDONLY);
+	if(fd != -1){
+		if(read(fd, &seed, sizeof(seed)) == -1){
+			perror("markov_rng_init: read");
+		}
+		close(fd);
+	}
+
+	initstate_r(seed, rng_state_mem, sizeof(rng_state_mem), &rng_state);
+	setstate_r(rng_state_mem, &rng_state);
+}
+
 static uint32_t markov_rand(uint32_t limit){
 	int32_t x;
 
+	// each thread has its own state, seeded the first time it needs a number.
+	if(!rng_state.state){
+		markov_rng_init();
+	}
+
 	do {
 		random_r(&rng_state, &x);
 	} while ((size_t)x >= (RAND_MAX - RAND_MAX % limit));
@@ -214,6 +457,70 @@ static uint32_t markov_rand(uint32_t limit){
 	return x % limit;
 }
 
+static void markov_dict_set(word_idx_t idx){
+	size_t n = idx / 8 + 1;
+	if(sb_count(dict_bits) < n){
+		size_t grow = n - sb_count(dict_bits);
+		memset(sb_add(dict_bits, grow), 0, grow);
+	}
+	dict_bits[idx / 8] |= 1 << (idx % 8);
+}
+
+static void markov_dict_check(word_idx_t idx, const char* word){
+	if(dict_ht.memory && inso_ht_get(&dict_ht, markov_hash(word, strlen(word)), &dict_cmp, (void*)word)){
+		markov_dict_set(idx);
+	}
+}
+
+// every word is good enough if there's no dictionary to check against.
+static bool markov_is_dict_word(word_idx_t idx){
+	if(!dict_ht.memory) return true;
+	return idx / 8 < sb_count(dict_bits) && (dict_bits[idx / 8] & (1 << (idx % 8)));
+}
+
+static void markov_dict_load(void){
+	const char* path = getenv("INSOBOT_MARKOV_DICT");
+	if(!path){
+		path = "/usr/share/dict/words";
+	}
+
+	FILE* f = fopen(path, "r");
+	if(!f){
+		perror("mod_markov: open dict");
+		return;
+	}
+
+	inso_ht_init(&dict_ht, 65536, sizeof(uint32_t), &dict_hash);
+	sb_push(dict_mem, 0);
+
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+
+	while((len = getline(&line, &line_cap, f)) > 0){
+		if(line[len-1] == '\n') line[--len] = 0;
+		if(!len) continue;
+
+		uint32_t off = sb_count(dict_mem);
+		memcpy(sb_add(dict_mem, len+1), line, len+1);
+		inso_ht_put(&dict_ht, &off);
+	}
+
+	free(line);
+	fclose(f);
+
+	// resolve it against the words we already know, new ones are checked as they're added.
+	for(size_t off = 1; off < (size_t)sb_count(dict_mem); off += strlen(dict_mem + off) + 1){
+		const char* word = dict_mem + off;
+		WordInfo* info = inso_ht_get(&word_ht, markov_hash(word, strlen(word)), &wordinfo_cmp, (void*)word);
+		if(info){
+			markov_dict_set(info->word_idx);
+		}
+	}
+
+	printf("mod_markov: loaded %zu dictionary words from %s.\n", dict_ht.used, path);
+}
+
 static word_idx_t find_word_addref(const char* word, size_t word_len, uint32_t* total){
 	WordInfo* info;
 	size_t hash = markov_hash(word, word_len);
@@ -234,9 +541,11 @@ static word_idx_t find_or_add_word(const char* word, size_t word_len, uint32_t*
 	word_idx_t index;
 
 	if(!(index = find_word_addref(word, word_len, total))){
+		word_mem = markov_sb_room(word_mem, sizeof(*word_mem), word_len+1, &word_mem_map_len);
 		char* p = memcpy(sbmm_add(word_mem, word_len+1), word, word_len+1);
 		index = p - word_mem;
 		inso_ht_put(&word_ht, &(WordInfo){ index, 1 });
+		markov_dict_check(index, p);
 		if(total){
 			*total = 1;
 		}
@@ -245,9 +554,21 @@ static word_idx_t find_or_add_word(const char* word, size_t word_len, uint32_t*
 	return index;
 }
 
-static MarkovLinkKey* find_key(word_idx_t a, word_idx_t b){
-	uint64_t id = ((uint64_t)a << 32) | b;
-	return inso_ht_get(&chain_keys_ht, hash6432shift(id), &chain_key_cmp, &id);
+// the key for the last len words of ctx.
+static MarkovLinkKey* find_key(const MarkovContext ctx, int len){
+	MarkovKeyId id = markov_ctx_id(ctx, len);
+	return inso_ht_get(&model->keys_ht, markov_ctx_hash(ctx, len), chain_key_cmp, &id);
+}
+
+// the key with the longest context that has been seen, shortening it down to markov_order_min.
+static MarkovLinkKey* find_key_backoff(const MarkovContext ctx){
+	MarkovLinkKey* key = NULL;
+
+	for(int n = markov_order; !key && n >= markov_order_min; --n){
+		key = find_key(ctx, n);
+	}
+
+	return key;
 }
 
 static const char* markov_get_punct(){
@@ -263,95 +584,197 @@ static const char* markov_get_punct(){
 	return ". Kappa";
 }
 
-static void markov_add(word_idx_t indices[static 3]){
+// index in the block of the first successor with a word_idx >= word.
+static uint32_t markov_block_find(const MarkovLinkVal* blk, word_idx_t word){
+	const MarkovLinkVal* succ = blk + 1;
+	uint32_t lo = 0, hi = blk->hdr.n;
+
+	while(lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if(succ[mid].word_idx < word){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// map_len is the length of the save file mapping *vals is still in, if any.
+static uint32_t markov_block_alloc(MarkovLinkVal** vals, size_t* map_len, uint32_t n){
+	if(map_len){
+		*vals = markov_sb_room(*vals, sizeof(**vals), 1 + MARKOV_BLOCK_CAP(n), map_len);
+	}
+
+	uint32_t idx = sbmm_count(*vals);
+	memset(sbmm_add(*vals, 1 + MARKOV_BLOCK_CAP(n)), 0, (1 + MARKOV_BLOCK_CAP(n)) * sizeof(MarkovLinkVal));
+	return idx;
+}
+
+// picks a successor weighted by count, with a binary search over the running totals.
+static const MarkovLinkVal* markov_block_pick(MarkovLinkVal* blk){
+	MarkovLinkVal* succ = blk + 1;
+
+	if(!blk->hdr.cum_ok){
+		uint32_t sum = 0;
+		for(uint32_t i = 0; i < blk->hdr.n; ++i){
+			sum += succ[i].count;
+			succ[i].cum = sum;
+		}
+		blk->hdr.cum_ok = 1;
+	}
+
+	uint32_t r  = markov_rand(blk->hdr.total);
+	uint32_t lo = 0, hi = blk->hdr.n - 1;
+
+	while(lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if(succ[mid].cum > r){
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
 
-	MarkovLinkKey* key = find_key(indices[0], indices[1]);
+	return succ + lo;
+}
 
-	printf("markov_add: %s %s %s\n",
-	       word_mem + indices[0],
-	       word_mem + indices[1],
-	       word_mem + indices[2]);
+static void markov_add_ctx(const MarkovContext ctx, int len, word_idx_t next){
+	MarkovLinkKey* key = find_key(ctx, len);
 
 	if(!key){
-		MarkovLinkVal val = {
-			.word_idx = indices[2],
-			.count = 1,
-			.next = -1
-		};
-		sbmm_push(chain_vals, val);
-
-		MarkovLinkKey new_key = {
-			.word_idx_1 = indices[0],
-			.word_idx_2 = indices[1],
-			.val_idx  = sbmm_count(chain_vals) - 1
-		};
-		inso_ht_put(&chain_keys_ht, &new_key);
+		uint32_t idx = markov_block_alloc(&model->vals, &model->vals_map_len, 1);
+		model->vals[idx].hdr.n      = 1;
+		model->vals[idx].hdr.total  = 1;
+		model->vals[idx+1].word_idx = next;
+		model->vals[idx+1].count    = 1;
 
-	} else {
-		bool found = false;
-		ssize_t last_idx = -1;
+		char key_buf[MARKOV_KEY_SIZE(MARKOV_ORDER_MAX)];
+		MarkovLinkKey* new_key = (MarkovLinkKey*)key_buf;
 
-		for(uint32_t i = key->val_idx; i != UINT32_MAX; i = chain_vals[i].next){
-			if(chain_vals[i].word_idx == indices[2]){
+		new_key->val_idx = idx;
+		markov_key_set(new_key, markov_ctx_id(ctx, len));
+		inso_ht_put(&model->keys_ht, new_key);
 
-				if(chain_vals[i].count == 255){
-					// adjust all counts for this key >> 1
-					for(uint32_t j = key->val_idx; j != UINT32_MAX; j = chain_vals[j].next){
-						chain_vals[j].count = INSO_MAX(chain_vals[j].count >> 1, 1);
-					}
+	} else {
+		MarkovLinkVal* blk = model->vals + key->val_idx;
+		uint32_t n   = blk->hdr.n;
+		uint32_t pos = markov_block_find(blk, next);
+
+		if(pos < n && blk[1+pos].word_idx == next){
+			if(blk[1+pos].count == 255){
+				// adjust all counts for this key >> 1
+				blk->hdr.total = 0;
+				for(uint32_t i = 1; i <= n; ++i){
+					blk[i].count = INSO_MAX(blk[i].count >> 1, 1);
+					blk->hdr.total += blk[i].count;
 				}
+			}
 
-				++chain_vals[i].count;
-				found = true;
-				break;
+			++blk[1+pos].count;
+		} else {
+			if(n == MARKOV_BLOCK_CAP(n)){
+				uint32_t idx = markov_block_alloc(&model->vals, &model->vals_map_len, n + 1);
+				memcpy(model->vals + idx, model->vals + key->val_idx, (1 + n) * sizeof(MarkovLinkVal));
+				key->val_idx = idx;
+				blk = model->vals + idx;
 			}
 
-			last_idx = i;
+			memmove(blk + 2 + pos, blk + 1 + pos, (n - pos) * sizeof(MarkovLinkVal));
+			blk[1+pos] = (MarkovLinkVal){ .word_idx = next, .count = 1 };
+			blk->hdr.n = n + 1;
 		}
 
-		if(!found){
-			MarkovLinkVal val = {
-				.word_idx = indices[2],
-				.count = 1,
-				.next = -1
-			};
-			sbmm_push(chain_vals, val);
+		++blk->hdr.total;
+		blk->hdr.cum_ok = 0;
+		blk->hdr.age    = 0;
+	}
+}
 
-			assert(last_idx != -1);
-			chain_vals[last_idx].next = sbmm_count(chain_vals) - 1;
-		}
+// words is a context followed by the word that came after it, which is learned for the full context and the
+// shorter ones generation backs off to.
+static void markov_add(const word_idx_t words[static MARKOV_ORDER_MAX + 1]){
+
+	printf("markov_add:");
+	for(int i = MARKOV_ORDER_MAX - markov_order; i <= MARKOV_ORDER_MAX; ++i){
+		printf(" %s", word_mem + words[i]);
+	}
+	putchar('\n');
+
+	// counts in the mapped blocks are about to change, so it can't be dropped back to the file any more.
+	model->mapped     = false;
+	model->gen_failed = false;
+
+	for(int n = markov_order; n >= markov_order_min; --n){
+		markov_add_ctx(words, n, words[MARKOV_ORDER_MAX]);
 	}
 }
 
-static void markov_replace(char** msg, const char* from, const char* to){
-	size_t from_len = strlen(from);
-	size_t to_len = strlen(to);
-	size_t msg_len = sb_count(*msg);
+enum { MKTOK_WORD, MKTOK_SPACE, MKTOK_COMMA, MKTOK_STOP };
 
-	char* p;
-	size_t off = 0;
+static const uint8_t markov_tok_class[256] = {
+	[1 ... ' '] = MKTOK_SPACE, [127 ... 255] = MKTOK_SPACE,
+	['$'] = MKTOK_SPACE, ['@'] = MKTOK_SPACE, [':'] = MKTOK_SPACE, [';'] = MKTOK_SPACE, ['`'] = MKTOK_SPACE,
+	['^'] = MKTOK_SPACE, ['('] = MKTOK_SPACE, [')'] = MKTOK_SPACE, ['{'] = MKTOK_SPACE, ['}'] = MKTOK_SPACE,
+	['['] = MKTOK_SPACE, [']'] = MKTOK_SPACE, ['"'] = MKTOK_SPACE,
+	[','] = MKTOK_COMMA,
+	['.'] = MKTOK_STOP, ['!'] = MKTOK_STOP, ['?'] = MKTOK_STOP,
+};
+
+typedef struct {
+	char*       p;
+	const char* pending;
+} MarkovTokenizer;
+
+// .!? only end a sentence when followed by whitespace, otherwise they just separate words.
+static const char* markov_tok_delim(const char* p){
+	switch(markov_tok_class[(uint8_t)p[0]]){
+		case MKTOK_COMMA:
+			return ",";
+		case MKTOK_STOP:
+			return p[1] && ((uint8_t)p[1] <= ' ' || (uint8_t)p[1] >= 127) ? "$" : NULL;
+		default:
+			return NULL;
+	}
+}
 
-	while((p = strstr(*msg + off, from))){
+// returns the next word, "," or "$" (end of sentence) from the message in one pass, lowercasing words and
+// terminating them in place. The returned string is only valid until the next call.
+static const char* markov_tok_next(MarkovTokenizer* tok, size_t* len){
+	const char* ret;
 
-		off = p - *msg;
+	if((ret = tok->pending)){
+		tok->pending = NULL;
+		*len = 1;
+		return ret;
+	}
 
-		if(to_len > from_len){
-			memset(sb_add(*msg, to_len - from_len), 0, to_len - from_len);
-		} else {
-			stb__sbn(*msg) -= (from_len - to_len);
+	for(; *tok->p && markov_tok_class[(uint8_t)*tok->p] != MKTOK_WORD; ++tok->p){
+		if((ret = markov_tok_delim(tok->p))){
+			++tok->p;
+			*len = 1;
+			return ret;
 		}
+	}
 
-		p = *msg + off;
+	if(!*tok->p){
+		return NULL;
+	}
 
-		const char* end_p = *msg + msg_len;
-		memmove(p + to_len, p + from_len, end_p - (p + from_len));
-		memcpy(p, to, to_len);
+	char* word = tok->p;
+	for(; *tok->p && markov_tok_class[(uint8_t)*tok->p] == MKTOK_WORD; ++tok->p){
+		*tok->p = tolower(*tok->p);
+	}
 
-		off += to_len;
+	*len = tok->p - word;
 
-		msg_len += (to_len - from_len);
+	if(*tok->p){
+		tok->pending = markov_tok_delim(tok->p);
+		*tok->p++ = '\0';
 	}
 
+	return word;
 }
 
 static int markov_topic_cmp(const void* _a, const void* _b){
@@ -366,396 +789,2233 @@ static int markov_topic_cmp(const void* _a, const void* _b){
 	return a->updated - b->updated;
 }
 
-static long word_bs(const char* word){
-	char buf[4096];
-	size_t lo = 0, hi = dict_fd_size;
+// }}}
+
+// Models {{{
+
+// By default every channel learns into (and generates from) the one model. INSOBOT_MARKOV_MODELS can split that up,
+// it's a list of channel groups like "#a,#b;#c;*": each group gets a model of its own named after its first channel,
+// and "*" gives every channel not in a group its own model too. The word table is shared between all of them.
+//
+// Models nobody has used for MARKOV_MODEL_IDLE and that haven't learned anything since they were loaded still
+// point straight into the save file, so their pages are dropped and only read back in if they're used again.
+
+#define MARKOV_MODEL_NAME_MAX  64
+#define MARKOV_MODEL_IDLE      (60*60)
+#define MARKOV_MODEL_MIN_KEYS  1000
+
+// Keys have markov_order words of context: 2 unless INSOBOT_MARKOV_ORDER (1 to MARKOV_ORDER_MAX) says otherwise,
+// but a save file keeps the order it was made with. Above 2, each line is also learned for the shorter contexts
+// down to 2 words, which all go in the same table with 0s in front, and generation backs off to the longest one
+// that has been seen. That's what lets a chain go on once pruning has dropped the longer contexts.
+//
+// Order 2 costs exactly what it used to. Going by markov_train -b on a 40MB log, order 3 should stay within 2.5x the
+// memory and 2x the lookup time of that, and order 4 within 5x and 2.5x.
+static void markov_set_order(int order){
+	markov_order     = order;
+	markov_order_min = INSO_MIN(order, 2);
+	markov_key_size  = MARKOV_KEY_SIZE(order);
+
+	static const inso_ht_cmp_fn cmp_fns[] = { &chain_key_cmp_1, &chain_key_cmp_2, &chain_key_cmp_3, &chain_key_cmp_4 };
+	chain_key_cmp = cmp_fns[order - 1];
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		models[i]->keys_ht.elem_size = markov_key_size;
+	}
+}
+
+static MarkovModel* markov_model_new(const char* name){
+	MarkovModel* m = calloc(1, sizeof(*m));
+
+	m->name = name ? strdup(name) : NULL;
+	m->used = time(0);
+
+	m->keys_ht.hash_fn   = &chain_key_hash;
+	m->keys_ht.elem_size = markov_key_size;
+	m->keys_ht.alloc_fn  = &ht_alloc;
+	m->keys_ht.free_fn   = &ht_free;
+
+	sb_push(models, m);
+	return m;
+}
+
+static void markov_model_free(MarkovModel* m){
+	if(m->vals_map_len){
+		munmap(stb__sbraw(m->vals), m->vals_map_len);
+	} else {
+		sbmm_free(m->vals);
+	}
+
+	for(size_t i = 0; i < sb_count(m->pool); ++i){
+		free(m->pool[i]);
+	}
+	sb_free(m->pool);
+
+	inso_ht_free(&m->keys_ht);
+	free(m->name);
+	free(m);
+}
+
+static MarkovModel* markov_model_find(const char* name){
+	char lname[MARKOV_MODEL_NAME_MAX];
+	size_t i;
+
+	for(i = 0; name[i] && i < sizeof(lname) - 1; ++i){
+		lname[i] = tolower(name[i]);
+	}
+	lname[i] = 0;
+
+	for(i = 1; i < sb_count(models); ++i){
+		if(strcmp(models[i]->name, lname) == 0){
+			return models[i];
+		}
+	}
+
+	MarkovModel* m = markov_model_new(lname);
+	inso_ht_init(&m->keys_ht, 4096, markov_key_size, &chain_key_hash);
+	return m;
+}
+
+// the model a channel learns into.
+static MarkovModel* markov_model_for(const char* chan){
+	const char* name = NULL;
+
+	for(MarkovGroup* g = markov_groups; g < sb_end(markov_groups); ++g){
+		if(strcasecmp(g->chan, chan) == 0){
+			name = g->model;
+			break;
+		}
+	}
+
+	if(!name && markov_chan_models){
+		name = chan;
+	}
+
+	MarkovModel* m = name ? markov_model_find(name) : models[0];
+	m->used = time(0);
+	m->cold = false;
+
+	return m;
+}
+
+// the model a channel generates from, which is the default one while its own hasn't learned much yet.
+static MarkovModel* markov_model_gen_for(const char* chan){
+	MarkovModel* m = markov_model_for(chan);
+
+	if(m->keys_ht.used < MARKOV_MODEL_MIN_KEYS && models[0]->keys_ht.used > m->keys_ht.used){
+		m = models[0];
+		m->used = time(0);
+		m->cold = false;
+	}
+
+	return m;
+}
+
+static void markov_model_parse(const char* spec){
+	char* groups = strdupa(spec);
+	char *gstate, *cstate;
+
+	for(char* group = strtok_r(groups, "; ", &gstate); group; group = strtok_r(NULL, "; ", &gstate)){
+		const char* first = NULL;
+
+		for(char* chan = strtok_r(group, ", ", &cstate); chan; chan = strtok_r(NULL, ", ", &cstate)){
+			if(strcmp(chan, "*") == 0){
+				markov_chan_models = true;
+				continue;
+			}
+
+			for(char* c = chan; *c; ++c){
+				*c = tolower(*c);
+			}
+
+			if(!first){
+				first = chan;
+			}
+
+			sb_push(markov_groups, ((MarkovGroup){ strdup(chan), strndup(first, MARKOV_MODEL_NAME_MAX - 1) }));
+		}
+	}
+}
+
+// called from the gc check timer.
+static void markov_model_check(void){
+	time_t now = time(0);
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		MarkovModel* m = models[i];
+		if(!m->mapped || m->cold || now - m->used < MARKOV_MODEL_IDLE) continue;
+
+		// they're private file mappings nothing has written to (except for the cached cumulative counts, which are
+		// all dropped together), so they just get read back from the file.
+		madvise(stb__sbraw(m->vals), m->vals_map_len, MADV_DONTNEED);
+		madvise(m->keys_ht.memory, m->keys_ht.capacity * m->keys_ht.elem_size, MADV_DONTNEED);
+		madvise(m->keys_ht.ctrl, INSO_HT_CTRL_SIZE(m->keys_ht.capacity), MADV_DONTNEED);
+
+		m->cold = true;
+	}
+}
+
+// }}}
+
+// Generation {{
+
+// makes a sentence of up to max_len links (plus a few to get to a good place to end) with the current model.
+static size_t markov_gen(char* buffer, size_t buffer_len, size_t max_len){
+	if(!buffer_len) return 0;
+	*buffer = 0;
+
+	MarkovContext chain;
+	for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+		chain[i] = start_sym_idx;
+	}
 
-	if(dict_fd <= 0 || dict_fd_size == 0){
+	// nothing learned in this model yet
+	MarkovLinkKey* key = find_key_backoff(chain);
+	if(!key){
 		return 0;
 	}
 
-	while(lo < hi){
-		size_t mid = (lo+hi)>>1;
+	int chain_len = 1 + markov_rand(max_len);
+	int links = 0;
+	bool should_end = false;
+
+	do {
+		MarkovLinkVal* blk = model->vals + key->val_idx;
+		size_t total = blk->hdr.total;
+		size_t end_count = 0;
+
+		uint32_t end_pos = markov_block_find(blk, end_sym_idx);
+		if(end_pos < blk->hdr.n && blk[1+end_pos].word_idx == end_sym_idx){
+			end_count = blk[1+end_pos].count;
+		}
+
+		const MarkovLinkVal* val = NULL;
+
+		if(!ib_assert(total)){
+			return 0;
+		}
+
+		should_end =
+			(end_count > (total / 2)) ||
+			(links >= chain_len * 2);
+
+		const char* word = NULL;
+
+		// try a few times to get a good word
+		for(size_t picks = 5; picks --> 0 ;){
+			val  = markov_block_pick(blk);
+			word = word_mem + val->word_idx;
+
+			// seems good, exit loop
+			if(val->word_idx == end_sym_idx	|| (word[0] == ',' || markov_is_dict_word(val->word_idx))){
+				break;
+			}
+		}
+
+		if(val->word_idx == end_sym_idx){
+			break;
+		}
+
+		for(const char** c = bad_end_words; *c; ++c){
+			if(strcmp(*c, word) == 0){
+				should_end = false;
+				break;
+			}
+		}
+
+		if(*buffer && strcmp(word, ",") != 0){
+			inso_strcat(buffer, buffer_len, " ");
+		}
+		inso_strcat(buffer, buffer_len, word);
+
+		memmove(chain, chain + 1, (MARKOV_ORDER_MAX - 1) * sizeof(word_idx_t));
+		chain[MARKOV_ORDER_MAX - 1] = val->word_idx;
+
+		// the rest of this chain might have been pruned.
+		if(!(key = find_key_backoff(chain))){
+			break;
+		}
+
+		++links;
+	} while(!should_end);
+
+	return strlen(buffer);
+}
+
+static bool markov_gen_formatted(char* msg, size_t msg_len){
+	int num_sentences = markov_rand(10) < 8 ? 1 : 2;
+
+	while(num_sentences--){
+		int attempts = 0;
+
+		size_t buff_len = msg_len;
+		char* buff = alloca(msg_len);
+
+		size_t tmp_len;
+
+		do {
+			tmp_len = markov_gen(buff, buff_len, max_chain_len);
+			if(!tmp_len) return false;
+
+			// a sentence that's only a comma ends up empty here, try again.
+			if(*buff == ','){
+				tmp_len = tmp_len > 2 ? tmp_len - 2 : 0;
+				memmove(buff, buff + 2, tmp_len);
+			}
+		} while(attempts++ < 5 && (!tmp_len || markov_check_dup(buff, tmp_len)));
+
+		buff_len = tmp_len;
+
+		if(attempts >= 5){
+			puts("Couldn't get a good message, giving up.");
+			return false;
+		}
+
+		markov_add_hash(buff, buff_len);
+
+		*buff = toupper(*buff);
+		memcpy(msg, buff, buff_len);
+		msg[buff_len] = 0;
+
+		msg += buff_len;
+		msg_len -= buff_len;
+
+		if(num_sentences){
+			int written = 0;
+			written = INSO_MAX(written, inso_strcat(msg, msg_len, markov_get_punct()));
+			written = INSO_MAX(written, inso_strcat(msg, msg_len, " "));
+
+			msg += written;
+			msg_len -= written;
+		}
+	}
+
+	inso_strcat(msg, msg_len, markov_get_punct());
+
+	return true;
+}
+
+// }}}
+
+// Worker {{{
+
+// Sentences are made on a worker thread instead of the IRC one. It keeps a few ready in the pool of each model that
+// was used recently, so a !say just takes one. The same goes for markov_gen mod_msgs, which get raw ones from the
+// default model: there's a pool for each length that's been asked for.
+// If the pool is empty, the request is queued for the worker instead, and what it makes comes back through an
+// eventfd watched by the main loop. The worker uses the models in place under gen_lock, which the main thread only
+// holds while it learns, prunes or saves.
+
+#define MARKOV_POOL_SIZE      4
+#define MARKOV_RAW_POOLS_MAX  4
+
+enum { GEN_SAY, GEN_REPLY, GEN_ASK };
+
+typedef struct {
+	int          type;
+	MarkovModel* model;
+	char*        chan;
+	char*        nick;
+	char*        text; // filled in by the worker, NULL if it couldn't come up with anything
+} MarkovGenJob;
+
+typedef struct {
+	size_t len;   // the mod_msg's arg, 0 for max_chain_len
+	char** texts;
+} MarkovRawPool;
+
+static pthread_t      gen_thread;
+static pthread_cond_t gen_cond = PTHREAD_COND_INITIALIZER;
+static bool           gen_running;
+static bool           gen_quit;
+static int            gen_efd = -1;
+static MarkovGenJob*  gen_jobs;      // waiting for the worker
+static MarkovGenJob*  gen_done;      // waiting for the main thread to send them
+static MarkovRawPool* gen_raw_pools; // unformatted, for markov_gen mod_msgs
+
+static char* markov_gen_sentence(void){
+	char buffer[256];
+	if(!markov_gen_formatted(buffer, sizeof(buffer))){
+		model->gen_failed = true;
+		return NULL;
+	}
+	return strdup(buffer);
+}
+
+// a recently used model whose pool could do with another sentence.
+static MarkovModel* markov_gen_pick(void){
+	time_t now = time(0);
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		MarkovModel* m = models[i];
+		if(m->cold || m->gen_failed || !m->keys_ht.used || now - m->used >= MARKOV_MODEL_IDLE) continue;
+		if(sb_count(m->pool) < MARKOV_POOL_SIZE) return m;
+	}
+
+	return NULL;
+}
+
+// a raw pool that could do with another sentence.
+static MarkovRawPool* markov_gen_pick_raw(void){
+	if(!models[0]->keys_ht.used || models[0]->gen_failed) return NULL;
+
+	for(MarkovRawPool* p = gen_raw_pools; p < sb_end(gen_raw_pools); ++p){
+		if(sb_count(p->texts) < MARKOV_POOL_SIZE) return p;
+	}
+
+	return NULL;
+}
+
+static void* markov_gen_worker(void* arg){
+	MarkovRawPool* pool;
+
+	markov_rng_init();
+
+	pthread_mutex_lock(&gen_lock);
+
+	while(!gen_quit){
+		if(sb_count(gen_jobs)){
+			MarkovGenJob job = gen_jobs[0];
+			sb_erase(gen_jobs, 0);
+
+			model = job.model;
+			job.text = markov_gen_sentence();
+			sb_push(gen_done, job);
+
+			uint64_t one = 1;
+			if(write(gen_efd, &one, sizeof(one)) == -1){
+				perror("mod_markov: eventfd write");
+			}
+		} else if((model = markov_gen_pick())){
+			char* text = markov_gen_sentence();
+			if(text){
+				sb_push(model->pool, text);
+			}
+		} else if((pool = markov_gen_pick_raw())){
+			model = models[0];
+
+			char* text = malloc(256);
+			if(markov_gen(text, 256, pool->len ? pool->len : max_chain_len)){
+				sb_push(pool->texts, text);
+			} else {
+				model->gen_failed = true;
+				free(text);
+			}
+		} else {
+			pthread_cond_wait(&gen_cond, &gen_lock);
+		}
+
+		// let the main thread in between sentences.
+		pthread_mutex_unlock(&gen_lock);
+		pthread_mutex_lock(&gen_lock);
+	}
+
+	pthread_mutex_unlock(&gen_lock);
+	return NULL;
+}
+
+static void markov_gen_send(int type, const char* chan, const char* nick, const char* text){
+	switch(type){
+		case GEN_SAY: {
+			ctx->send_msg(chan, "%s", text);
+		} break;
+
+		case GEN_REPLY: {
+			ctx->send_msg(chan, "@%s: %s", inso_dispname(ctx, nick), text);
+		} break;
+
+		case GEN_ASK: {
+			char buffer[256];
+			snprintf(buffer, sizeof(buffer), "%s", text);
+
+			size_t len = strlen(buffer);
+			if(len && ispunct(buffer[len-1])){
+				buffer[len-1] = '?';
+			} else if(sizeof(buffer) - len > 1){
+				buffer[len] = '?';
+				buffer[len+1] = 0;
+			}
+			ctx->send_msg(chan, "Q: %s", buffer);
+		} break;
+	}
+}
+
+// called on the main thread once the worker has finished some queued requests.
+static void markov_gen_ready(int fd, uint32_t events, intptr_t arg){
+	uint64_t n;
+	if(read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN){
+		perror("mod_markov: eventfd read");
+	}
+
+	pthread_mutex_lock(&gen_lock);
+	MarkovGenJob* done = gen_done;
+	gen_done = NULL;
+	pthread_mutex_unlock(&gen_lock);
+
+	for(MarkovGenJob* job = done; job < sb_end(done); ++job){
+		if(job->text){
+			markov_gen_send(job->type, job->chan, job->nick, job->text);
+		}
+		free(job->chan);
+		free(job->nick);
+		free(job->text);
+	}
+
+	sb_free(done);
+}
+
+// sends a sentence from the channel's pool, or leaves it to the worker if there isn't one ready.
+static void markov_gen_request(int type, const char* chan, const char* nick){
+	char* text = NULL;
+
+	pthread_mutex_lock(&gen_lock);
+
+	MarkovModel* m = markov_model_gen_for(chan);
+
+	if(sb_count(m->pool)){
+		text = m->pool[0];
+		sb_erase(m->pool, 0);
+	} else if(gen_running){
+		sb_push(gen_jobs, ((MarkovGenJob){ type, m, strdup(chan), nick ? strdup(nick) : NULL }));
+	} else {
+		model = m;
+		text = markov_gen_sentence();
+	}
+
+	pthread_cond_signal(&gen_cond);
+	pthread_mutex_unlock(&gen_lock);
+
+	if(text){
+		markov_gen_send(type, chan, nick, text);
+		free(text);
+	}
+}
+
+static bool markov_gen_start(void){
+	if((gen_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1){
+		perror("mod_markov: eventfd");
+		return false;
+	}
+
+	if(!ctx->add_fd(gen_efd, EPOLLIN, &markov_gen_ready, 0)){
+		perror("mod_markov: add_fd");
+		goto fail;
+	}
+
+	// the default length is the one that's asked for the most, so it's ready from the start.
+	sb_push(gen_raw_pools, ((MarkovRawPool){ .len = 0 }));
+
+	if(pthread_create(&gen_thread, NULL, &markov_gen_worker, NULL) != 0){
+		perror("mod_markov: pthread_create");
+		ctx->del_fd(gen_efd);
+		sb_free(gen_raw_pools);
+		goto fail;
+	}
+
+	gen_running = true;
+	return true;
+
+fail:
+	close(gen_efd);
+	gen_efd = -1;
+	return false;
+}
+
+static void markov_gen_stop(void){
+	if(gen_running){
+		pthread_mutex_lock(&gen_lock);
+		gen_quit = true;
+		pthread_cond_signal(&gen_cond);
+		pthread_mutex_unlock(&gen_lock);
+
+		pthread_join(gen_thread, NULL);
+		gen_running = false;
+		gen_quit    = false;
+
+		ctx->del_fd(gen_efd);
+		close(gen_efd);
+		gen_efd = -1;
+	}
+
+	// anything left over is dropped.
+	for(size_t i = 0; i < sb_count(gen_jobs); ++i){
+		free(gen_jobs[i].chan);
+		free(gen_jobs[i].nick);
+	}
+	sb_free(gen_jobs);
+
+	for(size_t i = 0; i < sb_count(gen_done); ++i){
+		free(gen_done[i].chan);
+		free(gen_done[i].nick);
+		free(gen_done[i].text);
+	}
+	sb_free(gen_done);
+
+	for(MarkovRawPool* p = gen_raw_pools; p < sb_end(gen_raw_pools); ++p){
+		for(size_t i = 0; i < sb_count(p->texts); ++i){
+			free(p->texts[i]);
+		}
+		sb_free(p->texts);
+	}
+	sb_free(gen_raw_pools);
+}
+
+static void markov_send(const char* chan){
+	markov_gen_request(GEN_SAY, chan, NULL);
+}
+
+static void markov_reply(const char* chan, const char* nick){
+	markov_gen_request(GEN_REPLY, chan, nick);
+}
+
+static void markov_ask(const char* chan){
+	markov_gen_request(GEN_ASK, chan, NULL);
+}
+
+// }}}
+
+// Loading/Saving {{{
+
+// IBMK v4 is uncompressed, and every section starts on a page boundary so it can be mapped straight from the
+// file with MAP_PRIVATE: startup doesn't need to read anything until it's used, and instances on the same host
+// share the page cache until they write to a page. word_mem and the vals arrays include their stretchy buffer header.
+// v5 has the same layout, but vals holds successor blocks instead of linked lists.
+// v6 adds a table of the other models after the default one's sections, each with sections of its own.
+// v7 records the markov order, keys are MARKOV_KEY_SIZE(order) bytes instead of always being order 2.
+
+enum {
+	MKSEC_WORDS,
+	MKSEC_VALS,
+	MKSEC_KEYS,
+	MKSEC_KEYS_CTRL,
+	MKSEC_WORD_HT,
+	MKSEC_WORD_HT_CTRL,
+	MKSEC_COUNT,
+};
+
+typedef struct {
+	uint64_t off;
+	uint64_t len;
+} MarkovSection;
+
+typedef struct {
+	char     fourcc[4];
+	uint32_t version;
+	uint32_t ht_version; // the ctrl sections are only used if this matches INSO_HT_VERSION
+	uint32_t page_size;
+
+	uint64_t keys_cap;
+	uint64_t keys_used;
+	uint64_t words_cap;
+	uint64_t words_used;
+
+	MarkovSection sections[MKSEC_COUNT];
+
+	uint64_t journal_gen;
+
+	MarkovSection models; // v6+, array of MarkovModelEntry (older files have zeroes here from the padding)
+
+	uint32_t order;       // v7+
+} MarkovFileHeader;
+
+typedef struct {
+	char          name[MARKOV_MODEL_NAME_MAX];
+	uint64_t      keys_cap;
+	uint64_t      keys_used;
+	MarkovSection vals;
+	MarkovSection keys;
+	MarkovSection keys_ctrl;
+} MarkovModelEntry;
+
+// Learned n-grams are appended to a journal next to the data file, as "word word word\n" lines (markov_order + 1
+// words, with the model's name in front for anything but the default one) after an "IBMJ <gen>" header line.
+// on_save only syncs it, and the full snapshot is only rewritten (compacted) once the journal gets big or a save is
+// forced. Each snapshot has a generation number, and the journal is only replayed on load if it continues the
+// snapshot's generation.
+//
+// Compaction writes the snapshot from a forked child, so the bot carries on while it's written. Before forking, a
+// new journal for the next generation is started as <data>.journal.next, and the old one is kept as it is. Once the
+// child has renamed the snapshot into place, journal.next is renamed over the old journal; if it failed, what was
+// learned meanwhile is appended back to the old journal. A crash in between leaves one of:
+//  - snapshot gen, journal gen, next gen + 1: the snapshot didn't land, replay both.
+//  - snapshot gen + 1, journal gen, next gen + 1: it did, replay only next and make it the journal.
+
+#define MARKOV_JOURNAL_MAX     (8 << 20)
+#define MARKOV_JOURNAL_SYNC_MS 5000
+#define MARKOV_COMPACT_REAP_MS 250
+
+static char     journal_path[PATH_MAX];
+static char     journal_next_path[PATH_MAX];
+static int      journal_fd = -1;
+static int      journal_prev_fd = -1; // the journal before journal.next, until the snapshot being written lands
+static char*    journal_buf;       // lines for the current message, written in one go
+static size_t   journal_size;
+static bool     journal_dirty;     // written, but not fdatasync'd yet
+static uint64_t journal_gen;       // generation of the snapshot the journal continues
+static intptr_t journal_timer;
+static bool     markov_compact;    // next on_save writes a full snapshot
+static pid_t    compact_pid;       // the child writing it
+static intptr_t compact_timer;
+
+static bool markov_gc_running(void);
+static void markov_gc_defer(const word_idx_t words[static MARKOV_ORDER_MAX + 1]);
+
+static void markov_learn(const word_idx_t words[static MARKOV_ORDER_MAX + 1]){
+	if(markov_gc_running()){
+		markov_gc_defer(words);
+	} else {
+		markov_add(words);
+	}
+
+	if(journal_fd == -1) return;
+
+	if(model->name){
+		size_t len = strlen(model->name);
+		memcpy(sb_add(journal_buf, len + 1), model->name, len);
+		sb_last(journal_buf) = ' ';
+	}
+
+	for(int i = MARKOV_ORDER_MAX - markov_order; i <= MARKOV_ORDER_MAX; ++i){
+		const char* w = word_mem + words[i];
+		size_t len = strlen(w);
+		memcpy(sb_add(journal_buf, len + 1), w, len);
+		sb_last(journal_buf) = i == MARKOV_ORDER_MAX ? '\n' : ' ';
+	}
+}
+
+static int markov_journal_header_len(uint64_t gen){
+	return snprintf(NULL, 0, "IBMJ %" PRIu64 "\n", gen);
+}
+
+// empties journal_fd and starts it over for the snapshot with generation gen.
+static bool markov_journal_header(uint64_t gen){
+	char hdr[64];
+	int len = snprintf(hdr, sizeof(hdr), "IBMJ %" PRIu64 "\n", gen);
+
+	if(ftruncate(journal_fd, 0) == -1 || write(journal_fd, hdr, len) != len){
+		perror("mod_markov: journal reset");
+		return false;
+	}
+
+	journal_size = len;
+	return true;
+}
+
+// appends the bytes of from between off and end to the journal to.
+static bool markov_journal_copy(int to, int from, size_t off, size_t end){
+	char buf[65536];
+
+	while(off < end){
+		ssize_t n = pread(from, buf, INSO_MIN(sizeof(buf), end - off), off);
+		if(n <= 0 || write(to, buf, n) != n){
+			perror("mod_markov: journal copy");
+			return false;
+		}
+		off += n;
+	}
+
+	return true;
+}
+
+static void markov_journal_flush(void){
+	if(journal_fd == -1 || !sb_count(journal_buf)) return;
+
+	ssize_t n = write(journal_fd, journal_buf, sb_count(journal_buf));
+	if(n != (ssize_t)sb_count(journal_buf)){
+		perror("mod_markov: journal write");
+	}
+	if(n > 0){
+		journal_size += n;
+		journal_dirty = true;
+	}
+
+	stb__sbn(journal_buf) = 0;
+}
+
+static void markov_journal_sync(void){
+	markov_journal_flush();
+
+	if(journal_dirty && fdatasync(journal_fd) == 0){
+		journal_dirty = false;
+	}
+}
+
+static void markov_journal_tick(intptr_t arg){
+	markov_journal_sync();
+
+	if(journal_size > MARKOV_JOURNAL_MAX){
+		markov_compact = true;
+		ctx->save_me();
+	}
+}
+
+static word_idx_t markov_journal_word(const char* word){
+	size_t len = strlen(word);
+	WordInfo* info = inso_ht_get(&word_ht, markov_hash(word, len), &wordinfo_cmp, (void*)word);
+	return info ? info->word_idx : find_or_add_word(word, len, NULL);
+}
+
+// adds the entries in the journal fd if its header says it continues generation gen. Returns how much of it is
+// good (0 if it's for another generation), anything after that is a torn write.
+static size_t markov_journal_replay(int fd, uint64_t gen, size_t* count){
+	FILE* f = fdopen(dup(fd), "r");
+	char line[256];
+	uint64_t hdr_gen;
+	size_t good = 0;
+
+	if(f && fgets(line, sizeof(line), f) && sscanf(line, "IBMJ %" SCNu64, &hdr_gen) == 1 && hdr_gen == gen){
+		good = strlen(line);
+
+		while(fgets(line, sizeof(line), f)){
+			size_t len = strlen(line);
+			char *state, *w[MARKOV_ORDER_MAX + 2];
+			int n = 0;
+
+			// a torn write at the end, drop it
+			if(line[len-1] != '\n') break;
+			good += len;
+
+			for(char* tok = strtok_r(line, " \n", &state); tok && n < (int)ARRAY_SIZE(w); tok = strtok_r(NULL, " \n", &state)){
+				w[n++] = tok;
+			}
+			if(n != markov_order + 1 && n != markov_order + 2) continue;
+
+			model = n == markov_order + 2 ? markov_model_find(w[0]) : models[0];
+
+			word_idx_t words[MARKOV_ORDER_MAX + 1] = {};
+			for(int i = 0; i <= markov_order; ++i){
+				words[MARKOV_ORDER_MAX - markov_order + i] = markov_journal_word(w[n - markov_order - 1 + i]);
+			}
+			markov_add(words);
+			++*count;
+		}
+	}
+
+	model = models[0];
+
+	if(f) fclose(f);
+	return good;
+}
+
+// replays the journal (and a journal.next left by a compaction that didn't finish) if it continues the loaded
+// snapshot, otherwise starts it over.
+static void markov_journal_open(void){
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", ctx->get_datafile());
+	snprintf(journal_next_path, sizeof(journal_next_path), "%s.journal.next", ctx->get_datafile());
+
+	if((journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) == -1){
+		perror("mod_markov: journal open");
+		return;
+	}
+
+	size_t count = 0;
+	size_t good = markov_journal_replay(journal_fd, journal_gen, &count);
+
+	int next_fd = open(journal_next_path, O_RDWR | O_APPEND | O_CLOEXEC);
+	if(next_fd != -1){
+		size_t next_good;
+
+		if(!good && (next_good = markov_journal_replay(next_fd, journal_gen, &count))){
+			// the snapshot landed, but journal.next wasn't renamed yet.
+			if(rename(journal_next_path, journal_path) == -1){
+				perror("mod_markov: journal rename");
+			}
+			close(journal_fd);
+			journal_fd = next_fd;
+			good = next_good;
+		} else {
+			size_t hdr_len = markov_journal_header_len(journal_gen + 1);
+
+			// the snapshot didn't land, so journal.next carries on from the journal.
+			if(good && (next_good = markov_journal_replay(next_fd, journal_gen + 1, &count)) > hdr_len){
+				if(ftruncate(journal_fd, good) == 0 && markov_journal_copy(journal_fd, next_fd, hdr_len, next_good)){
+					good += next_good - hdr_len;
+					fdatasync(journal_fd);
+				}
+			}
+
+			close(next_fd);
+			unlink(journal_next_path);
+		}
+	}
+
+	if(good){
+		if(ftruncate(journal_fd, good) == -1){
+			perror("mod_markov: journal truncate");
+		}
+		journal_size = good;
+		printf("mod_markov: replayed %zu journal entries.\n", count);
+	} else {
+		markov_journal_header(journal_gen);
+		fdatasync(journal_fd);
+	}
+
+	journal_timer = ctx->add_timer(MARKOV_JOURNAL_SYNC_MS, true, &markov_journal_tick, 0);
+}
+
+static void markov_journal_close(void){
+	if(journal_fd == -1) return;
+
+	markov_journal_sync();
+	close(journal_fd);
+	journal_fd = -1;
+
+	if(journal_prev_fd != -1){
+		close(journal_prev_fd);
+		journal_prev_fd = -1;
+	}
+
+	ctx->del_timer(journal_timer);
+	journal_timer = 0;
+
+	sb_free(journal_buf);
+}
+
+static bool markov_load_v3(gzFile f){
+	uint32_t word_size = 0, val_size = 0;
+
+#define GZREAD(f, ptr, sz) if(gzread(f, ptr, sz) < (int)(sz)) goto fail
+
+	GZREAD(f, &word_size, sizeof(word_size));
+	GZREAD(f, &val_size , sizeof(val_size));
+
+	GZREAD(f, &model->keys_ht.capacity, 4);
+	GZREAD(f, &model->keys_ht.used    , 4);
+
+	GZREAD(f, &word_ht.capacity, 4);
+	GZREAD(f, &word_ht.used    , 4);
+
+	GZREAD(f, sbmm_add(word_mem   , word_size), word_size);
+	GZREAD(f, sbmm_add(model->vals, val_size ), val_size * sizeof(MarkovLinkVal));
+
+	model->keys_ht.memory = ht_alloc(model->keys_ht.capacity);
+	GZREAD(f, model->keys_ht.memory, model->keys_ht.capacity);
+
+	word_ht.memory = ht_alloc(word_ht.capacity);
+	GZREAD(f, word_ht.memory, word_ht.capacity);
+
+	// v3 stored the capacities in bytes
+	model->keys_ht.used     /= model->keys_ht.elem_size;
+	model->keys_ht.capacity /= model->keys_ht.elem_size;
+
+	word_ht.used     /= word_ht.elem_size;
+	word_ht.capacity /= word_ht.elem_size;
+
+#undef GZREAD
+
+	// the file only has the entries (empty slots are zeroed), the probe metadata has to be rebuilt.
+	inso_ht_rebuild(&model->keys_ht);
+	inso_ht_rebuild(&word_ht);
+
+	return true;
+
+fail:
+	return false;
+}
+
+// rewrites the per-key linked lists of v3 / v4 files into sorted successor blocks.
+static bool markov_convert_vals(void){
+	MarkovLinkValV4* old = (MarkovLinkValV4*)model->vals;
+	size_t old_count     = sbmm_count(model->vals);
+	size_t old_map_len   = model->vals_map_len;
+
+	model->vals = NULL;
+	model->vals_map_len = 0;
+
+	for(size_t i = 0; i < model->keys_ht.capacity; ++i){
+		if(model->keys_ht.ctrl[i] == INSO_HT_EMPTY) continue;
+
+		MarkovLinkKey* key = (MarkovLinkKey*)(model->keys_ht.memory + i * markov_key_size);
+		uint32_t idx = UINT32_MAX;
+
+		for(uint32_t v = key->val_idx, hops = 0; v != UINT32_MAX; v = old[v].next){
+			if(v >= old_count || ++hops > old_count){
+				fputs("markov_load: bad value chain.\n", stderr);
+				goto fail;
+			}
+
+			if(idx == UINT32_MAX){
+				idx = markov_block_alloc(&model->vals, NULL, 1);
+			}
+
+			MarkovLinkVal* blk = model->vals + idx;
+			uint32_t n   = blk->hdr.n;
+			uint32_t pos = markov_block_find(blk, old[v].word_idx);
+
+			if(pos < n && blk[1+pos].word_idx == old[v].word_idx){
+				blk[1+pos].count = INSO_MIN(blk[1+pos].count + old[v].count, 255);
+			} else {
+				if(n == MARKOV_BLOCK_CAP(n)){
+					// the block is always the last one here, so it can just grow in place
+					memset(sbmm_add(model->vals, MARKOV_BLOCK_CAP(n + 1) - n), 0, (MARKOV_BLOCK_CAP(n + 1) - n) * sizeof(MarkovLinkVal));
+					blk = model->vals + idx;
+				}
+				memmove(blk + 2 + pos, blk + 1 + pos, (n - pos) * sizeof(MarkovLinkVal));
+				blk[1+pos] = (MarkovLinkVal){ .word_idx = old[v].word_idx, .count = old[v].count };
+				blk->hdr.n = n + 1;
+			}
+		}
+
+		if(idx == UINT32_MAX){
+			fputs("markov_load: key without values.\n", stderr);
+			goto fail;
+		}
+
+		MarkovLinkVal* blk = model->vals + idx;
+		for(uint32_t j = 1; j <= blk->hdr.n; ++j){
+			blk->hdr.total += blk[j].count;
+		}
+		key->val_idx = idx;
+	}
+
+	if(old_map_len){
+		munmap(stb__sbraw(old), old_map_len);
+	} else {
+		sbmm_free(old);
+	}
+	model->mapped = false;
+
+	return true;
+
+fail:
+	sbmm_free(model->vals);
+	model->vals = (MarkovLinkVal*)old;
+	model->vals_map_len = old_map_len;
+	return false;
+}
+
+static bool markov_load_model(int fd, uint64_t file_size, uint32_t ht_version, MarkovModel* m, const MarkovModelEntry* e){
+	const MarkovSection* secs[] = { &e->vals, &e->keys, &e->keys_ctrl };
+	for(size_t i = 0; i < ARRAY_SIZE(secs); ++i){
+		if(secs[i]->off + secs[i]->len > file_size){
+			fputs("markov_load: truncated file.\n", stderr);
+			return false;
+		}
+	}
+
+	const size_t sb_hdr = sizeof(size_t) * 2;
+	const bool use_ctrl = ht_version == INSO_HT_VERSION;
+
+	if(e->vals.len < sb_hdr
+	|| e->keys.len != e->keys_cap * markov_key_size
+	|| !e->keys_cap || (e->keys_cap & (e->keys_cap - 1))
+	|| (use_ctrl && e->keys_ctrl.len != INSO_HT_CTRL_SIZE(e->keys_cap))){
+		fputs("markov_load: bad section table.\n", stderr);
+		return false;
+	}
+
+	bool mapped = true;
+	void* vals = markov_map_section(fd, e->vals.off, e->vals.len, MARKOV_MAP_SPARE, &mapped);
+	void* keys = markov_map_section(fd, e->keys.off, e->keys.len, 0, &mapped);
+	void* ctrl = use_ctrl ? markov_map_section(fd, e->keys_ctrl.off, e->keys_ctrl.len, 0, &mapped) : NULL;
+
+	if(!vals || !keys || (use_ctrl && !ctrl) || ((size_t*)vals)[1] * sizeof(MarkovLinkVal) + sb_hdr != e->vals.len){
+		fputs("markov_load: bad model sections.\n", stderr);
+		if(vals) munmap(vals, e->vals.len + MARKOV_MAP_SPARE);
+		if(keys) munmap(keys, e->keys.len);
+		if(ctrl) munmap(ctrl, e->keys_ctrl.len);
+		return false;
+	}
+
+	sbmm_free(m->vals);
+
+	m->vals         = (MarkovLinkVal*)((size_t*)vals + 2);
+	m->vals_map_len = e->vals.len + MARKOV_MAP_SPARE;
+
+	m->keys_ht.memory   = keys;
+	m->keys_ht.ctrl     = ctrl;
+	m->keys_ht.capacity = e->keys_cap;
+	m->keys_ht.used     = e->keys_used;
+
+	if(!use_ctrl){
+		inso_ht_rebuild(&m->keys_ht);
+		mapped = false;
+	}
+
+	m->mapped = mapped;
+	return true;
+}
+
+static bool markov_load_v4(int fd){
+	MarkovFileHeader hdr;
+	if(pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)){
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1) return false;
+
+	// the keys are laid out for the order the file was made with, so that's used whatever the config says.
+	uint32_t order = hdr.version >= 7 ? hdr.order : 2;
+	if(order < 1 || order > MARKOV_ORDER_MAX){
+		fputs("markov_load: bad order.\n", stderr);
+		return false;
+	}
+	if((int)order != markov_order){
+		printf("mod_markov: the data file has order %u chains, using that instead of %d.\n", order, markov_order);
+		markov_set_order(order);
+	}
+
+	const int word_secs[] = { MKSEC_WORDS, MKSEC_WORD_HT, MKSEC_WORD_HT_CTRL };
+	for(size_t i = 0; i < ARRAY_SIZE(word_secs); ++i){
+		if(hdr.sections[word_secs[i]].off + hdr.sections[word_secs[i]].len > (uint64_t)st.st_size){
+			fputs("markov_load: truncated file.\n", stderr);
+			return false;
+		}
+	}
+
+	const size_t sb_hdr = sizeof(size_t) * 2;
+	if(hdr.sections[MKSEC_WORDS].len < sb_hdr
+	|| hdr.sections[MKSEC_WORD_HT].len != hdr.words_cap * sizeof(WordInfo)
+	|| !hdr.words_cap || (hdr.words_cap & (hdr.words_cap - 1))
+	|| (hdr.ht_version == INSO_HT_VERSION && hdr.sections[MKSEC_WORD_HT_CTRL].len != INSO_HT_CTRL_SIZE(hdr.words_cap))){
+		fputs("markov_load: bad section table.\n", stderr);
+		return false;
+	}
+
+	bool mapped = true;
+	void* sec[MKSEC_COUNT] = {};
+	for(size_t i = 0; i < ARRAY_SIZE(word_secs); ++i){
+		int idx = word_secs[i];
+		if(idx == MKSEC_WORD_HT_CTRL && hdr.ht_version != INSO_HT_VERSION) continue;
+
+		size_t spare = idx == MKSEC_WORDS ? MARKOV_MAP_SPARE : 0;
+		if(hdr.sections[idx].len && !(sec[idx] = markov_map_section(fd, hdr.sections[idx].off, hdr.sections[idx].len, spare, &mapped))){
+			goto fail;
+		}
+	}
+
+	if(((size_t*)sec[MKSEC_WORDS])[1] * sizeof(*word_mem) + sb_hdr != hdr.sections[MKSEC_WORDS].len){
+		fputs("markov_load: bad array sizes.\n", stderr);
+		goto fail;
+	}
+
+	MarkovModelEntry def = {
+		.keys_cap  = hdr.keys_cap,
+		.keys_used = hdr.keys_used,
+		.vals      = hdr.sections[MKSEC_VALS],
+		.keys      = hdr.sections[MKSEC_KEYS],
+		.keys_ctrl = hdr.sections[MKSEC_KEYS_CTRL],
+	};
+
+	if(!markov_load_model(fd, st.st_size, hdr.ht_version, models[0], &def)){
+		goto fail;
+	}
+
+	sbmm_free(word_mem);
+
+	word_mem         = (char*)((size_t*)sec[MKSEC_WORDS] + 2);
+	word_mem_map_len = hdr.sections[MKSEC_WORDS].len + MARKOV_MAP_SPARE;
+
+	word_ht.memory   = sec[MKSEC_WORD_HT];
+	word_ht.ctrl     = sec[MKSEC_WORD_HT_CTRL];
+	word_ht.capacity = hdr.words_cap;
+	word_ht.used     = hdr.words_used;
+
+	journal_gen = hdr.journal_gen;
+
+	if(hdr.ht_version != INSO_HT_VERSION){
+		inso_ht_rebuild(&word_ht);
+	}
+
+	// a model that can't be loaded is left out, and its channels start over with an empty one.
+	size_t nmodels = hdr.version >= 6 ? hdr.models.len / sizeof(MarkovModelEntry) : 0;
+	MarkovModelEntry* entries = NULL;
+
+	if(nmodels && hdr.models.off + hdr.models.len <= (uint64_t)st.st_size){
+		entries = malloc(hdr.models.len);
+		if(pread(fd, entries, hdr.models.len, hdr.models.off) != (ssize_t)hdr.models.len){
+			nmodels = 0;
+		}
+	}
+
+	for(size_t i = 0; i < nmodels && entries; ++i){
+		entries[i].name[MARKOV_MODEL_NAME_MAX - 1] = 0;
+
+		MarkovModel* m = markov_model_new(entries[i].name);
+		if(!markov_load_model(fd, st.st_size, hdr.ht_version, m, entries + i)){
+			fprintf(stderr, "markov_load: skipping model %s.\n", entries[i].name);
+			sb_pop(models);
+			markov_model_free(m);
+		}
+	}
+
+	free(entries);
+	return true;
+
+fail:
+	for(int i = 0; i < MKSEC_COUNT; ++i){
+		if(sec[i]) munmap(sec[i], hdr.sections[i].len + (i == MKSEC_WORDS ? MARKOV_MAP_SPARE : 0));
+	}
+	return false;
+}
+
+static bool markov_load(bool* converted){
+	const char* fname = ctx->get_datafile();
+	char fourcc[4];
+	uint32_t version = 0;
+	bool ret = false;
+
+	int fd = open(fname, O_RDONLY);
+	if(fd == -1){
+		perror("markov_load: open");
+		return false;
+	}
+
+	if(pread(fd, fourcc, 4, 0) == 4 && pread(fd, &version, 4, 4) == 4 && memcmp(fourcc, "IBMK", 4) == 0){
+		if(version >= 4 && version <= 7){
+			ret = markov_load_v4(fd);
+		} else {
+			fputs("markov_load: invalid version.\n", stderr);
+		}
+		close(fd);
+	} else {
+		// older versions are gzipped
+		gzFile f = gzdopen(fd, "rb");
+
+		if(gzread(f, fourcc, 4) < 4 || memcmp(fourcc, "IBMK", 4) != 0){
+			fputs("markov_load: invalid file format.\n", stderr);
+		} else if(gzread(f, &version, 4) < 4 || version != 3){
+			fputs("markov_load: invalid version.\n", stderr);
+		} else {
+			markov_set_order(2);
+			ret = markov_load_v3(f);
+		}
+
+		gzclose(f);
+	}
+
+	if(ret && version < 5 && (ret = markov_convert_vals())){
+		printf("mod_markov: converting IBMK v%u data to v7.\n", version);
+		*converted = true;
+	}
+
+	if(!ret){
+		puts("markov: couldn't read file.");
+	}
+
+	return ret;
+}
+
+// write(2)s all of mem to fd. The snapshot is written from a forked child, see markov_write_file.
+static bool markov_write_all(int fd, const void* mem, size_t len){
+	const char* p = mem;
+
+	while(len){
+		ssize_t n = write(fd, p, len);
+		if(n == -1 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		p   += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+// pads the file out to the next page boundary, and starts the section there.
+static bool markov_begin_section(int fd, uint32_t page_size, MarkovSection* sec){
+	static const char zeroes[4096];
+
+	off_t off = lseek(fd, 0, SEEK_CUR);
+	if(off < 0) return false;
+
+	size_t pad = (page_size - (off % page_size)) % page_size;
+	sec->off = off + pad;
+
+	while(pad){
+		size_t n = INSO_MIN(pad, sizeof(zeroes));
+		if(!markov_write_all(fd, zeroes, n)) return false;
+		pad -= n;
+	}
+
+	return true;
+}
+
+static bool markov_write_section(int fd, uint32_t page_size, MarkovSection* sec, const void* mem, size_t len){
+	if(!markov_begin_section(fd, page_size, sec)) return false;
+
+	sec->len = len;
+	return markov_write_all(fd, mem, len);
+}
+
+// writes a stretchy buffer with a header claiming it's full, so nothing will try to grow it in place.
+static bool markov_write_sb(int fd, uint32_t page_size, MarkovSection* sec, const void* arr, size_t itemsize){
+	size_t n = sbmm_count(arr);
+	size_t sb_hdr[2] = { n, n };
+
+	if(!markov_begin_section(fd, page_size, sec)) return false;
+
+	sec->len = sizeof(sb_hdr) + n * itemsize;
+	return markov_write_all(fd, sb_hdr, sizeof(sb_hdr)) && (n == 0 || markov_write_all(fd, arr, n * itemsize));
+}
+
+static bool markov_write_model(int fd, uint32_t page_size, MarkovModel* m, MarkovSection* vals, MarkovSection* keys, MarkovSection* keys_ctrl){
+	while(inso_ht_tick(&m->keys_ht));
+
+	return markov_write_sb(fd, page_size, vals, m->vals, sizeof(*m->vals))
+	    && markov_write_section(fd, page_size, keys, m->keys_ht.memory, m->keys_ht.capacity * m->keys_ht.elem_size)
+	    && markov_write_section(fd, page_size, keys_ctrl, m->keys_ht.ctrl, INSO_HT_CTRL_SIZE(m->keys_ht.capacity));
+}
+
+// writes a snapshot with generation gen to fd. The tables must not change while it runs.
+static bool markov_write(int fd, uint64_t gen){
+	while(inso_ht_tick(&models[0]->keys_ht));
+	while(inso_ht_tick(&word_ht));
+
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	MarkovFileHeader hdr = {
+		.fourcc     = "IBMK",
+		.version    = 7,
+		.ht_version = INSO_HT_VERSION,
+		.page_size  = page_size > SB_PAGE_SIZE ? page_size : SB_PAGE_SIZE,
+		.keys_cap   = models[0]->keys_ht.capacity,
+		.keys_used  = models[0]->keys_ht.used,
+		.words_cap  = word_ht.capacity,
+		.words_used = word_ht.used,
+		.journal_gen = gen,
+		.order      = markov_order,
+	};
+
+	const size_t words_ctrl_len = INSO_HT_CTRL_SIZE(word_ht.capacity);
+	const size_t nmodels = sb_count(models) - 1;
+	MarkovModelEntry* entries = calloc(nmodels + 1, sizeof(*entries));
+	bool ok;
+
+	// header goes first, and gets rewritten once the section offsets are known.
+	ok = markov_write_all(fd, &hdr, sizeof(hdr))
+	  && markov_write_sb(fd, hdr.page_size, hdr.sections + MKSEC_WORDS, word_mem, sizeof(*word_mem))
+	  && markov_write_model(fd, hdr.page_size, models[0], hdr.sections + MKSEC_VALS, hdr.sections + MKSEC_KEYS, hdr.sections + MKSEC_KEYS_CTRL)
+	  && markov_write_section(fd, hdr.page_size, hdr.sections + MKSEC_WORD_HT, word_ht.memory, word_ht.capacity * word_ht.elem_size)
+	  && markov_write_section(fd, hdr.page_size, hdr.sections + MKSEC_WORD_HT_CTRL, word_ht.ctrl, words_ctrl_len);
+
+	for(size_t i = 0; ok && i < nmodels; ++i){
+		MarkovModel* m = models[i+1];
+		MarkovModelEntry* e = entries + i;
+
+		ok = markov_write_model(fd, hdr.page_size, m, &e->vals, &e->keys, &e->keys_ctrl);
+
+		strncpy(e->name, m->name, sizeof(e->name) - 1);
+		e->keys_cap  = m->keys_ht.capacity;
+		e->keys_used = m->keys_ht.used;
+	}
+
+	ok = ok
+	  && markov_write_section(fd, hdr.page_size, &hdr.models, entries, nmodels * sizeof(*entries))
+	  && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+
+	free(entries);
+	return ok;
+}
+
+// writes the snapshot to a temp file, and renames it over the data file fname once it's on disk. This runs in the
+// forked child, which only has this thread, so it sticks to plain syscalls: another thread might have held stdio's
+// or the core's locks at the fork. malloc is fine, glibc resets its locks in the child.
+static bool markov_write_file(const char* fname, uint64_t gen){
+	char tmp[PATH_MAX], dir[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.compact", fname);
+	snprintf(dir, sizeof(dir), "%s", fname);
+
+	char* slash = strrchr(dir, '/');
+	if(slash) slash[1] = '\0';
+	else strcpy(dir, ".");
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(fd == -1) return false;
+
+	bool ok = markov_write(fd, gen) && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+
+	if(!ok || rename(tmp, fname) == -1){
+		unlink(tmp);
+		return false;
+	}
+
+	// the rename has to be on disk before journal.next replaces the journal.
+	int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dir_fd != -1){
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	return true;
+}
+
+static void markov_compact_finish(uint64_t gen, bool ok){
+	if(journal_prev_fd != -1){
+		if(ok){
+			if(rename(journal_next_path, journal_path) == -1){
+				perror("mod_markov: journal rename");
+			}
+			close(journal_prev_fd);
+			journal_prev_fd = -1;
+		} else {
+			// the old journal still continues the snapshot on disk, so put what was learned meanwhile back on it.
+			markov_journal_flush();
+
+			size_t hdr_len   = markov_journal_header_len(gen);
+			off_t  prev_size = lseek(journal_prev_fd, 0, SEEK_END);
+
+			if(prev_size != -1 && markov_journal_copy(journal_prev_fd, journal_fd, hdr_len, journal_size) && fdatasync(journal_prev_fd) == 0){
+				close(journal_fd);
+				unlink(journal_next_path);
+
+				journal_fd      = journal_prev_fd;
+				journal_prev_fd = -1;
+				journal_size    = prev_size + journal_size - hdr_len;
+				journal_dirty   = false;
+			} else {
+				// both stay as they are, which the next start replays fine. Until then, don't compact again.
+				fputs("mod_markov: couldn't move the journal back, not compacting again until restarted.\n", stderr);
+				if(prev_size != -1 && ftruncate(journal_prev_fd, prev_size) == -1){
+					perror("mod_markov: journal truncate");
+				}
+			}
+		}
+	}
+
+	if(!ok){
+		puts("mod_markov: error saving file.");
+		return;
+	}
+
+	journal_gen = gen;
+	puts("mod_markov: save complete.");
+
+	// asked for again while this one was being written.
+	if(markov_compact){
+		ctx->save_me();
+	}
+}
+
+static void markov_compact_reap(bool block){
+	if(!compact_pid) return;
+
+	int status;
+	pid_t pid;
+
+	while((pid = waitpid(compact_pid, &status, block ? 0 : WNOHANG)) == -1 && errno == EINTR);
+	if(pid == 0) return;
+
+	if(pid == -1){
+		perror("mod_markov: waitpid");
+	} else if(WIFSIGNALED(status)){
+		fprintf(stderr, "mod_markov: snapshot writer killed by signal %d\n", WTERMSIG(status));
+	}
+
+	compact_pid = 0;
+	ctx->del_timer(compact_timer);
+	compact_timer = 0;
+
+	markov_compact_finish(journal_gen + 1, pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void markov_compact_tick(intptr_t arg){
+	markov_compact_reap(false);
+}
+
+// starts journal.next, then forks a child to write the snapshot that it continues.
+static void markov_compact_start(void){
+	const uint64_t gen = journal_gen + 1;
+
+	markov_journal_sync();
+
+	if(journal_fd != -1){
+		int fd = open(journal_next_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+		if(fd == -1){
+			perror("mod_markov: journal.next open");
+			return;
+		}
+
+		journal_prev_fd = journal_fd;
+		journal_fd = fd;
+
+		size_t prev_size = journal_size;
+
+		if(!markov_journal_header(gen) || fdatasync(fd) == -1){
+			close(fd);
+			unlink(journal_next_path);
+			journal_fd      = journal_prev_fd;
+			journal_prev_fd = -1;
+			journal_size    = prev_size;
+			return;
+		}
+	}
+
+	puts("mod_markov: now saving...");
+
+	// the worker fills in the cached cumulative counts as it goes, so hold it off while the child's copy is made.
+	pthread_mutex_lock(&gen_lock);
+	fflush(NULL);
+
+	const char* fname = ctx->get_datafile();
+
+	pid_t pid = fork();
+	if(pid == 0){
+		_exit(markov_write_file(fname, gen) ? 0 : 1);
+	}
+
+	if(pid == -1){
+		perror("mod_markov: fork");
+		bool ok = markov_write_file(fname, gen);
+		pthread_mutex_unlock(&gen_lock);
+
+		markov_compact_finish(gen, ok);
+		return;
+	}
+
+	pthread_mutex_unlock(&gen_lock);
+
+	compact_pid   = pid;
+	compact_timer = ctx->add_timer(MARKOV_COMPACT_REAP_MS, true, &markov_compact_tick, 0);
+}
+
+// the core's file is never used: compaction writes and renames the data file itself, see above.
+static bool markov_save(FILE* file){
+	markov_journal_sync();
+
+	// the tables are being rebuilt, a snapshot now would miss the lines held back until it's done. If one is still
+	// being written, markov_compact_finish asks for another save once it's done.
+	if(markov_gc_running() || compact_pid || journal_prev_fd != -1){
+		return false;
+	}
+
+	// everything since the last snapshot is in the journal, so only compact when asked to.
+	if(!markov_compact && journal_fd != -1){
+		return false;
+	}
+	markov_compact = false;
+
+	markov_compact_start();
+	return false;
+}
+
+// }}}
+
+// Pruning {{{
+
+// Nothing is ever removed from the models as they learn, so every MARKOV_GC_INTERVAL (or sooner, once they use more
+// than INSOBOT_MARKOV_MAX_MB) they're copied into new, dense tables without the rarely used parts: successors only
+// seen once for keys that haven't learned anything in MARKOV_PRUNE_AGE passes, then keys left with no successors,
+// then words nothing refers to any more. Words are renumbered in the copy, and the space left behind by moved
+// blocks is dropped. The copy is done a slice at a time from a timer, and lines learned meanwhile are held back
+// and added to the new tables when they replace the old ones. Since the words are renumbered, every model is
+// rewritten, and none of them point into the save file any more until the next start.
+//
+// While the models are over the limit, each pass also drops successors with counts up to an increasing level.
+
+#define MARKOV_GC_INTERVAL     (24*60*60)
+#define MARKOV_GC_CHECK_MS     60000
+#define MARKOV_GC_TICK_MS      10
+#define MARKOV_GC_SLICE_NS     2000000
+#define MARKOV_PRUNE_AGE       30
+#define MARKOV_PRUNE_LEVEL_MAX 16
+
+enum { GC_IDLE, GC_MARK, GC_WORDS, GC_KEYS };
+
+// the new tables for a model that existed when the pass started.
+typedef struct {
+	MarkovModel*   model;
+	inso_ht        keys_ht;
+	MarkovLinkVal* vals;
+	size_t         nkeys;
+} MarkovGCModel;
+
+typedef struct {
+	MarkovModel* model;
+	word_idx_t   words[MARKOV_ORDER_MAX + 1];
+} MarkovGCLine;
+
+static struct {
+	int            phase;
+	size_t         model;     // index into models the current phase is up to
+	size_t         pos;       // slot in that model's keys_ht or offset in word_mem that the current phase is up to
+	size_t         words_end; // size of word_mem when the pass started, anything after it is new
+	uint8_t*       used;      // bit per word_mem offset
+	uint32_t*      remap;     // old word_idx -> new, 0 if dropped
+	size_t         nwords;    // kept so far, out of words_used when the pass started
+	size_t         words_used;
+	size_t         dropped;
+	char*          word_mem;
+	inso_ht        word_ht;
+	MarkovGCModel* models;
+	uint8_t*       dict_bits;
+	MarkovGCLine*  deferred;
+	int            level;     // successors with counts up to this are dropped too
+	time_t         last;
+	intptr_t       timer;
+} gc;
+
+static size_t   gc_max_mem; // from INSOBOT_MARKOV_MAX_MB, 0 for no limit
+static intptr_t gc_check_timer;
+
+static bool markov_gc_running(void){
+	return gc.phase != GC_IDLE;
+}
+
+static void markov_gc_defer(const word_idx_t words[static MARKOV_ORDER_MAX + 1]){
+	MarkovGCLine* line = sb_add(gc.deferred, 1);
+	line->model = model;
+	memcpy(line->words, words, sizeof(line->words));
+}
+
+static size_t markov_mem_usage(void){
+	size_t total = sbmm_count(word_mem) + word_ht.capacity * word_ht.elem_size + INSO_HT_CTRL_SIZE(word_ht.capacity);
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		const MarkovModel* m = models[i];
+		total += sbmm_count(m->vals) * sizeof(MarkovLinkVal)
+		       + m->keys_ht.capacity * m->keys_ht.elem_size + INSO_HT_CTRL_SIZE(m->keys_ht.capacity);
+	}
+
+	return total;
+}
+
+static size_t markov_keys_used(void){
+	size_t total = 0;
+	for(size_t i = 0; i < sb_count(models); ++i){
+		total += models[i]->keys_ht.used;
+	}
+	return total;
+}
+
+// ctx is the key's context, which only ends in the start symbol at the start of a sentence.
+static bool markov_gc_keep(const MarkovContext ctx, const MarkovLinkVal* blk, const MarkovLinkVal* val){
+	if(ctx[MARKOV_ORDER_MAX - 1] == start_sym_idx){
+		return true;
+	}
+	return val->count > gc.level && !(val->count == 1 && blk->hdr.age >= MARKOV_PRUNE_AGE);
+}
+
+static void markov_gc_mark(word_idx_t w){
+	if(!(gc.used[w / 8] & (1 << (w % 8)))){
+		gc.used[w / 8] |= 1 << (w % 8);
+		++gc.nwords;
+	}
+}
+
+static bool markov_gc_marked(word_idx_t w){
+	return w < gc.words_end && (gc.used[w / 8] & (1 << (w % 8)));
+}
+
+// word_idx in the new tables for a word from the old ones, adding it if it was learned during the pass.
+static word_idx_t markov_gc_word(const char* old_mem, word_idx_t w){
+	if(w < gc.words_end && gc.remap[w]){
+		return gc.remap[w];
+	}
+
+	const char* word = old_mem + w;
+	size_t len = strlen(word);
+	WordInfo* info = inso_ht_get(&word_ht, markov_hash(word, len), &wordinfo_cmp, (void*)word);
+
+	return info ? info->word_idx : find_or_add_word(word, len, NULL);
+}
+
+static void markov_gc_free(void){
+	if(gc.remap) ht_free(gc.remap, gc.words_end * sizeof(uint32_t));
+	gc.remap = NULL;
 
-		memset(buf, 0, sizeof(buf));
-		pread(dict_fd, buf, sizeof(buf), mid);
+	free(gc.used);
+	gc.used = NULL;
 
-		char *p, *prev_p = mid == 0 ? buf : rawmemchr(buf, '\n') + 1, *end = buf + sizeof(buf);
+	for(size_t i = 0; i < sb_count(gc.models); ++i){
+		sbmm_free(gc.models[i].vals);
+		inso_ht_free(&gc.models[i].keys_ht);
+	}
+	sb_free(gc.models);
 
-		while((p = memchr(prev_p, '\n', end - prev_p))){
-			*p = '\0';
+	sbmm_free(gc.word_mem);
+	sb_free(gc.dict_bits);
+	sb_free(gc.deferred);
 
-			int cmp = strcmp(word, prev_p);
-			if(cmp < 0){
-				hi = mid;
-				break;
-			} else if(cmp == 0){
-				return mid + (prev_p - buf);
-			}
+	inso_ht_free(&gc.word_ht);
 
-			prev_p = p + 1;
-			lo = mid + sizeof(buf);
-		}
+	if(gc.timer){
+		ctx->del_timer(gc.timer);
+		gc.timer = 0;
 	}
 
-	return -1;
+	gc.phase = GC_IDLE;
 }
 
-// }}}
+// returns false once the current slice has used up its time, checked every so often.
+static bool markov_gc_slice(const struct timespec* start, size_t* n){
+	if(++*n % 256) return true;
 
-// Generation {{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec) < MARKOV_GC_SLICE_NS;
+}
 
-static size_t markov_gen(char* buffer, size_t buffer_len){
-	if(!buffer_len) return 0;
-	*buffer = 0;
+static void markov_gc_step_mark(const struct timespec* start){
+	size_t n = 0;
 
-	MarkovLinkKey* key = find_key(start_sym_idx, start_sym_idx);
-	if(!ib_assert(key)){
-		return 0;
-	}
+	for(; gc.model < sb_count(gc.models); ++gc.model, gc.pos = 0){
+		MarkovGCModel* g = gc.models + gc.model;
+		MarkovModel*   m = g->model;
 
-	int chain_len = 1 + markov_rand(max_chain_len);
-	int links = 0;
-	bool should_end = false;
+		for(; gc.pos < m->keys_ht.capacity && markov_gc_slice(start, &n); ++gc.pos){
+			if(m->keys_ht.ctrl[gc.pos] & INSO_HT_EMPTY) continue;
 
-	do {
-		size_t total = 0;
-		size_t end_count = 0;
+			MarkovLinkKey* key = (MarkovLinkKey*)(m->keys_ht.memory + gc.pos * markov_key_size);
+			MarkovLinkVal* blk = m->vals + key->val_idx;
+			uint32_t kept = 0;
 
-		MarkovLinkVal* val = chain_vals + key->val_idx;
-		do {
-			if(val->word_idx == end_sym_idx){
-				end_count = val->count;
+			MarkovContext ctx;
+			markov_key_get(key, ctx);
+
+			for(uint32_t i = 1; i <= blk->hdr.n; ++i){
+				if(markov_gc_keep(ctx, blk, blk + i)){
+					markov_gc_mark(blk[i].word_idx);
+					++kept;
+				}
 			}
-			total += val->count;
-		} while(val->next != UINT32_MAX && (val = chain_vals + val->next));
 
-		if(!ib_assert(total)){
-			return 0;
+			if(kept){
+				for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+					if(ctx[i]) markov_gc_mark(ctx[i]);
+				}
+				++g->nkeys;
+			}
+
+			gc.dropped += blk->hdr.n - kept;
 		}
 
-		should_end =
-			(end_count > (total / 2)) ||
-			(links >= chain_len * 2);
+		if(gc.pos < m->keys_ht.capacity) return;
+	}
 
-		const char* word;
+	gc.word_ht.alloc_fn = &ht_alloc;
+	gc.word_ht.free_fn  = &ht_free;
+	inso_ht_init(&gc.word_ht, gc.nwords * 4 / 3 + 1, sizeof(WordInfo), &wordinfo_hash);
 
-		// try a few times to get a good word
-		for(size_t picks = 5; picks --> 0 ;){
-			ssize_t count = markov_rand(total);
+	for(MarkovGCModel* g = gc.models; g < sb_end(gc.models); ++g){
+		g->keys_ht.alloc_fn = &ht_alloc;
+		g->keys_ht.free_fn  = &ht_free;
+		inso_ht_init(&g->keys_ht, g->nkeys * 4 / 3 + 1, markov_key_size, &chain_key_hash);
+	}
 
-			val = chain_vals + key->val_idx;
-			while((count -= val->count) >= 0){
-				val = chain_vals + val->next;
-			}
+	gc.remap = ht_alloc(gc.words_end * sizeof(uint32_t));
+	sbmm_push(gc.word_mem, 0);
 
-			word = word_mem + val->word_idx;
+	gc.phase = GC_WORDS;
+	gc.pos   = 1;
+}
 
-			// seems good, exit loop
-			if(val->word_idx == end_sym_idx	|| (word[0] == ',' || word_bs(word) != -1)){
-				break;
-			}
-		}
+static void markov_gc_step_words(const struct timespec* start){
+	size_t n = 0;
 
-		if(val->word_idx == end_sym_idx){
-			break;
-		}
+	while(gc.pos < gc.words_end && markov_gc_slice(start, &n)){
+		const char* word = word_mem + gc.pos;
+		size_t len = strlen(word);
 
-		for(const char** c = bad_end_words; *c; ++c){
-			if(strcmp(*c, word) == 0){
-				should_end = false;
-				break;
+		if(markov_gc_marked(gc.pos)){
+			WordInfo* info = inso_ht_get(&word_ht, markov_hash(word, len), &wordinfo_cmp, (void*)word);
+			word_idx_t idx = sbmm_count(gc.word_mem);
+
+			memcpy(sbmm_add(gc.word_mem, len + 1), word, len + 1);
+			gc.remap[gc.pos] = idx;
+
+			if(dict_ht.memory && markov_is_dict_word(gc.pos)){
+				size_t need = idx / 8 + 1;
+				if(sb_count(gc.dict_bits) < need){
+					size_t grow = need - sb_count(gc.dict_bits);
+					memset(sb_add(gc.dict_bits, grow), 0, grow);
+				}
+				gc.dict_bits[idx / 8] |= 1 << (idx % 8);
 			}
-		}
 
-		if(*buffer && strcmp(word, ",") != 0){
-			inso_strcat(buffer, buffer_len, " ");
+			// wordinfo_hash looks at word_mem, so point it at the new one while inserting.
+			char* old_mem = word_mem;
+			word_mem = gc.word_mem;
+			inso_ht_put(&gc.word_ht, &(WordInfo){ idx, info ? info->total : 1 });
+			word_mem = old_mem;
 		}
-		inso_strcat(buffer, buffer_len, word);
 
-		key = find_key(key->word_idx_2, val->word_idx);
-		if(!ib_assert(key)){
-			break;
-		}
+		gc.pos += len + 1;
+	}
 
-		++links;
-	} while(!should_end);
+	if(gc.pos < gc.words_end) return;
 
-	return strlen(buffer);
+	gc.phase = GC_KEYS;
+	gc.model = 0;
+	gc.pos   = 0;
 }
 
-static bool markov_gen_formatted(char* msg, size_t msg_len){
-	int num_sentences = markov_rand(10) < 8 ? 1 : 2;
+static void markov_gc_finish(void);
 
-	while(num_sentences--){
-		int attempts = 0;
+static void markov_gc_step_keys(const struct timespec* start){
+	size_t n = 0;
 
-		size_t buff_len = msg_len;
-		char* buff = alloca(msg_len);
+	for(; gc.model < sb_count(gc.models); ++gc.model, gc.pos = 0){
+		MarkovGCModel* g = gc.models + gc.model;
+		MarkovModel*   m = g->model;
 
-		size_t tmp_len;
+		for(; gc.pos < m->keys_ht.capacity && markov_gc_slice(start, &n); ++gc.pos){
+			if(m->keys_ht.ctrl[gc.pos] & INSO_HT_EMPTY) continue;
 
-		do {
-			tmp_len = markov_gen(buff, buff_len);
-			if(!tmp_len) return false;
+			MarkovLinkKey* key = (MarkovLinkKey*)(m->keys_ht.memory + gc.pos * markov_key_size);
+			MarkovLinkVal* blk = m->vals + key->val_idx;
+			uint32_t kept = 0;
 
-			if(*buff == ','){
-				tmp_len -= 2;
-				memmove(buff, buff + 2, tmp_len);
-			}
-		} while(attempts++ < 5 && markov_check_dup(buff, tmp_len));
+			MarkovContext ctx;
+			markov_key_get(key, ctx);
 
-		buff_len = tmp_len;
+			for(uint32_t i = 1; i <= blk->hdr.n; ++i){
+				kept += markov_gc_keep(ctx, blk, blk + i);
+			}
+			if(!kept) continue;
 
-		if(attempts >= 5){
-			puts("Couldn't get a good message, giving up.");
-			return false;
-		}
+			uint32_t idx = markov_block_alloc(&g->vals, NULL, kept);
+			MarkovLinkVal* new_blk = g->vals + idx;
 
-		markov_add_hash(buff, buff_len);
+			// words keep their order when renumbered, so the successors stay sorted.
+			for(uint32_t i = 1; i <= blk->hdr.n; ++i){
+				if(!markov_gc_keep(ctx, blk, blk + i)) continue;
 
-		*buff = toupper(*buff);
-		memcpy(msg, buff, buff_len);
-		msg[buff_len] = 0;
+				new_blk[1 + new_blk->hdr.n++] = (MarkovLinkVal){
+					.word_idx = gc.remap[blk[i].word_idx],
+					.count    = blk[i].count,
+				};
+				new_blk->hdr.total += blk[i].count;
+			}
+			new_blk->hdr.age = INSO_MIN(blk->hdr.age + 1, 127);
 
-		msg += buff_len;
-		msg_len -= buff_len;
+			// the 0s in front of shorter contexts stay 0.
+			for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+				ctx[i] = gc.remap[ctx[i]];
+			}
 
-		if(num_sentences){
-			int written = 0;
-			written = INSO_MAX(written, inso_strcat(msg, msg_len, markov_get_punct()));
-			written = INSO_MAX(written, inso_strcat(msg, msg_len, " "));
+			char key_buf[MARKOV_KEY_SIZE(MARKOV_ORDER_MAX)];
+			MarkovLinkKey* new_key = (MarkovLinkKey*)key_buf;
 
-			msg += written;
-			msg_len -= written;
+			new_key->val_idx = idx;
+			markov_key_set(new_key, markov_ctx_id(ctx, markov_order));
+			inso_ht_put(&g->keys_ht, new_key);
 		}
-	}
-
-	inso_strcat(msg, msg_len, markov_get_punct());
-
-	return true;
-}
 
-static void markov_send(const char* chan){
-	char buffer[256];
-	if(!markov_gen_formatted(buffer, sizeof(buffer))) return;
-	ctx->send_msg(chan, "%s", buffer);
-}
+		if(gc.pos < m->keys_ht.capacity) return;
+	}
 
-static void markov_reply(const char* chan, const char* nick){
-	char buffer[256];
-	if(!markov_gen_formatted(buffer, sizeof(buffer))) return;
-	ctx->send_msg(chan, "@%s: %s", inso_dispname(ctx, nick), buffer);
+	markov_gc_finish();
 }
 
-static void markov_ask(const char* chan){
-	char buffer[256];
-	if(!markov_gen_formatted(buffer, sizeof(buffer))) return;
+static void markov_gc_finish(void){
+	size_t before = markov_mem_usage();
+	size_t old_keys = markov_keys_used(), new_keys = 0;
 
-	size_t len = strlen(buffer);
-	if(len && ispunct(buffer[len-1])){
-		buffer[len-1] = '?';
-	} else if(sizeof(buffer) - len > 1){
-		buffer[len] = '?';
-		buffer[len+1] = 0;
+	// counted before the held back lines are added, which can bring new ones.
+	for(MarkovGCModel* g = gc.models; g < sb_end(gc.models); ++g){
+		new_keys += g->nkeys;
 	}
-	ctx->send_msg(chan, "Q: %s", buffer);
-}
-// }}}
-
-// Loading/Saving {{{
 
-static bool markov_load(){
-	gzFile f = gzopen(ctx->get_datafile(), "rb");
-	uint32_t word_size = 0, val_size = 0, version = 0;
-	char fourcc[4];
+	char*   old_mem      = word_mem;
+	inso_ht old_words_ht = word_ht;
 
-#define GZREAD(f, ptr, sz) if(gzread(f, ptr, sz) < (int)(sz)) goto fail
+	word_mem = gc.word_mem;
+	word_ht  = gc.word_ht;
 
-	GZREAD(f, fourcc, 4);
-	if(memcmp(fourcc, "IBMK", 4) != 0){
-		fputs("markov_load: invalid file format.", stderr);
-		goto fail;
-	}
+	start_sym_idx = gc.remap[start_sym_idx];
+	end_sym_idx   = gc.remap[end_sym_idx];
 
-	GZREAD(f, &version, 4);
-	if(version != 3){
-		fputs("markov_load: invalid version.", stderr);
-		goto fail;
-	}
+	uint8_t* old_dict_bits = dict_bits;
+	dict_bits = gc.dict_bits;
 
-	GZREAD(f, &word_size, sizeof(word_size));
-	GZREAD(f, &val_size , sizeof(val_size));
+	gc.word_mem  = NULL;
+	gc.dict_bits = NULL;
+	memset(&gc.word_ht, 0, sizeof(gc.word_ht));
 
-	GZREAD(f, &chain_keys_ht.capacity, 4);
-	GZREAD(f, &chain_keys_ht.used    , 4);
+	for(MarkovGCModel* g = gc.models; g < sb_end(gc.models); ++g){
+		MarkovModel* m = g->model;
 
-	GZREAD(f, &word_ht.capacity, 4);
-	GZREAD(f, &word_ht.used    , 4);
+		if(m->vals_map_len){
+			munmap(stb__sbraw(m->vals), m->vals_map_len);
+			m->vals_map_len = 0;
+		} else {
+			sbmm_free(m->vals);
+		}
+		inso_ht_free(&m->keys_ht);
 
-	GZREAD(f, sbmm_add(word_mem  , word_size), word_size);
-	GZREAD(f, sbmm_add(chain_vals, val_size) , val_size * sizeof(MarkovLinkVal));
+		m->vals    = g->vals;
+		m->keys_ht = g->keys_ht;
+		m->mapped  = false;
 
-	chain_keys_ht.memory = ht_alloc(chain_keys_ht.capacity);
-	GZREAD(f, chain_keys_ht.memory, chain_keys_ht.capacity);
+		g->vals = NULL;
+		memset(&g->keys_ht, 0, sizeof(g->keys_ht));
+	}
 
-	word_ht.memory = ht_alloc(word_ht.capacity);
-	GZREAD(f, word_ht.memory, word_ht.capacity);
+	// lines learned while this was running, their words might not be in the new tables yet.
+	MarkovModel* prev_model = model;
 
-#if INSO_HT_VERSION == 2
-	chain_keys_ht.used     /= chain_keys_ht.elem_size;
-	chain_keys_ht.capacity /= chain_keys_ht.elem_size;
+	for(MarkovGCLine* l = gc.deferred; l < sb_end(gc.deferred); ++l){
+		word_idx_t words[MARKOV_ORDER_MAX + 1] = {};
+		for(int j = MARKOV_ORDER_MAX - markov_order; j <= MARKOV_ORDER_MAX; ++j){
+			words[j] = markov_gc_word(old_mem, l->words[j]);
+		}
+		model = l->model;
+		markov_add(words);
+	}
 
-	word_ht.used     /= word_ht.elem_size;
-	word_ht.capacity /= word_ht.elem_size;
-#endif
+	model = prev_model;
 
-#undef GZREAD
+	if(word_mem_map_len){
+		munmap(stb__sbraw(old_mem), word_mem_map_len);
+		word_mem_map_len = 0;
+	} else {
+		sbmm_free(old_mem);
+	}
 
-	gzclose(f);
-	return true;
+	inso_ht_free(&old_words_ht);
+	sb_free(old_dict_bits);
 
-fail:
-	puts("markov: couldn't read file.");
-	gzclose(f);
-	return false;
-}
+	size_t after = markov_mem_usage();
+	printf("mod_markov: pruned %zu successors, %zu keys and %zu words (%.2fMB -> %.2fMB).\n",
+	       gc.dropped, old_keys - new_keys, gc.words_used - gc.nwords,
+	       before / (1024.f*1024.f), after / (1024.f*1024.f));
 
-static bool markov_save(FILE* file){
-	puts("mod_markov: now saving...");
+	if(gc_max_mem && after > gc_max_mem){
+		gc.level = INSO_MIN(gc.level + 1, MARKOV_PRUNE_LEVEL_MAX);
+	} else {
+		gc.level = 0;
+	}
 
-	uint32_t word_size = sbmm_count(word_mem) - 1;
-	uint32_t val_size  = sbmm_count(chain_vals);
-	uint32_t version   = 3;
+	gc.last = time(0);
+	markov_gc_free();
 
-	while(inso_ht_tick(&chain_keys_ht));
-	while(inso_ht_tick(&word_ht));
+	markov_compact = true;
+}
 
-	gzFile f = gzdopen(dup(fileno(file)), "wb");
+static void markov_gc_tick(intptr_t arg){
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-#define GZWRITE(f, ptr, sz) if(gzwrite(f, ptr, sz) < (int)(sz)) goto fail
+	pthread_mutex_lock(&gen_lock);
 
-	GZWRITE(f, "IBMK"  , 4);
-	GZWRITE(f, &version, 4);
+	switch(gc.phase){
+		case GC_MARK:  markov_gc_step_mark(&start);  break;
+		case GC_WORDS: markov_gc_step_words(&start); break;
+		case GC_KEYS:  markov_gc_step_keys(&start);  break;
+	}
 
-	GZWRITE(f, &word_size, sizeof(word_size));
-	GZWRITE(f, &val_size , sizeof(val_size));
+	pthread_mutex_unlock(&gen_lock);
 
-#if INSO_HT_VERSION == 2
-	{
-		uint32_t cap  = chain_keys_ht.capacity * chain_keys_ht.elem_size;
-		uint32_t used = chain_keys_ht.used     * chain_keys_ht.elem_size;
-		GZWRITE(f, &cap , 4);
-		GZWRITE(f, &used, 4);
+	// finished, save the new tables.
+	if(!markov_gc_running()){
+		ctx->save_me();
 	}
+}
 
-	{
-		uint32_t cap  = word_ht.capacity * word_ht.elem_size;
-		uint32_t used = word_ht.used     * word_ht.elem_size;
-		GZWRITE(f, &cap , 4);
-		GZWRITE(f, &used, 4);
+static void markov_gc_start(void){
+	gc.phase      = GC_MARK;
+	gc.model      = 0;
+	gc.pos        = 0;
+	gc.nwords     = 0;
+	gc.dropped    = 0;
+	gc.words_end  = sbmm_count(word_mem);
+	gc.words_used = word_ht.used;
+	gc.used       = calloc(gc.words_end / 8 + 1, 1);
+
+	markov_gc_mark(start_sym_idx);
+	markov_gc_mark(end_sym_idx);
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		sb_push(gc.models, ((MarkovGCModel){ .model = models[i] }));
 	}
-#else
-	GZWRITE(f, &chain_keys_ht.capacity, 4);
-	GZWRITE(f, &chain_keys_ht.used    , 4);
 
-	GZWRITE(f, &word_ht.capacity, 4);
-	GZWRITE(f, &word_ht.used    , 4);
-#endif
-
-	GZWRITE(f, word_mem + 1, word_size);
-	GZWRITE(f, chain_vals, sizeof(MarkovLinkVal) * val_size);
+	gc.timer = ctx->add_timer(MARKOV_GC_TICK_MS, true, &markov_gc_tick, 0);
+}
 
-	GZWRITE(f, chain_keys_ht.memory, chain_keys_ht.capacity * chain_keys_ht.elem_size);
-	GZWRITE(f, word_ht.memory, word_ht.capacity * word_ht.elem_size);
+static void markov_gc_check(intptr_t arg){
+	pthread_mutex_lock(&gen_lock);
+	markov_model_check();
+	pthread_mutex_unlock(&gen_lock);
 
-#undef GZWRITE
+	if(markov_gc_running()) return;
 
-	puts("mod_markov: save complete.");
-	gzclose(f);
-	return true;
+	// wait for any incremental rehash to finish, the passes walk the table slots directly.
+	if(word_ht.prev_memory) return;
+	for(size_t i = 0; i < sb_count(models); ++i){
+		if(models[i]->keys_ht.prev_memory) return;
+	}
 
-fail:
-	puts("mod_markov: error saving file.");
-	gzclose(f);
-	return false;
+	if(time(0) - gc.last >= MARKOV_GC_INTERVAL || (gc_max_mem && markov_mem_usage() > gc_max_mem)){
+		markov_gc_start();
+	}
 }
 
 // }}}
 
 // IRC Callbacks {{{
 
+// the rest of init, once the model is loaded or adopted.
+static void markov_start(void){
+	const char* max_mb = getenv("INSOBOT_MARKOV_MAX_MB");
+	if(max_mb){
+		gc_max_mem = strtoul(max_mb, NULL, 10) << 20;
+	}
+
+	gc_check_timer = ctx->add_timer(MARKOV_GC_CHECK_MS, true, &markov_gc_check, 0);
+
+	if(!markov_gen_start()){
+		puts("mod_markov: no generation worker, messages will be generated inline.");
+	}
+}
+
 static bool markov_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
 
-	unsigned int seed = rand();
-
-	int fd = open("/dev/urandom", O_RDONLY);
-	if(fd != -1){
-		if(read(fd, &seed, sizeof(seed)) == -1){
-			perror("markov_init: read");
-		}
-		close(fd);
+	if(ctx->api_version < 5){
+		fprintf(stderr, "mod_markov: insobot version too old (%d, need >= 5), exiting.\n", (int)ctx->api_version);
+		return false;
 	}
 
-	initstate_r(seed, rng_state_mem, sizeof(rng_state_mem), &rng_state);
-	setstate_r(rng_state_mem, &rng_state);
+	// this can run on the init pool, so the rng is left for markov_rand to seed on whichever thread uses it.
 
 	sbmm_push(word_mem, 0);
 
 	regcomp(&url_regex, "(www\\.|https?:\\/\\/|\\.com|\\.[a-zA-Z]\\/)", REG_ICASE | REG_EXTENDED | REG_NOSUB);
 
-	chain_keys_ht.hash_fn   = &chain_key_hash;
-	chain_keys_ht.elem_size = sizeof(MarkovLinkKey);
-	chain_keys_ht.alloc_fn  = &ht_alloc;
-	chain_keys_ht.free_fn   = &ht_free;
+	int order = 2;
+	const char* order_str = getenv("INSOBOT_MARKOV_ORDER");
+	if(order_str){
+		order = strtol(order_str, NULL, 10);
+		if(order < 1 || order > MARKOV_ORDER_MAX){
+			fprintf(stderr, "mod_markov: INSOBOT_MARKOV_ORDER should be 1 to %d, using 2.\n", MARKOV_ORDER_MAX);
+			order = 2;
+		}
+	}
+	markov_set_order(order);
+
+	model = markov_model_new(NULL);
+
+	const char* model_spec = getenv("INSOBOT_MARKOV_MODELS");
+	if(model_spec){
+		markov_model_parse(model_spec);
+	}
 
 	word_ht.hash_fn   = &wordinfo_hash;
 	word_ht.elem_size = sizeof(WordInfo);
 	word_ht.alloc_fn  = &ht_alloc;
 	word_ht.free_fn   = &ht_free;
 
-	if(!markov_load()){
-		if(chain_keys_ht.memory) ht_free(chain_keys_ht.memory, chain_keys_ht.capacity);
-		inso_ht_init(&chain_keys_ht, 4096, sizeof(MarkovLinkKey), &chain_key_hash);
+	bool converted = false;
+	if(!markov_load(&converted)){
+		markov_set_order(order);
+
+		// whatever the load got to is dropped. inso_ht_free clears the allocator too, so that's put back.
+		inso_ht_free(&model->keys_ht);
+		model->keys_ht.alloc_fn = &ht_alloc;
+		model->keys_ht.free_fn  = &ht_free;
+		inso_ht_init(&model->keys_ht, 4096, markov_key_size, &chain_key_hash);
 
-		if(word_ht.memory) ht_free(word_ht.memory, word_ht.capacity);
+		inso_ht_free(&word_ht);
+		word_ht.alloc_fn = &ht_alloc;
+		word_ht.free_fn  = &ht_free;
 		inso_ht_init(&word_ht, 4096, sizeof(WordInfo), &wordinfo_hash);
 	}
 
+	markov_journal_open();
+
 	start_sym_idx = find_or_add_word("^", 1, NULL);
 	end_sym_idx   = find_or_add_word("$", 1, NULL);
 
-	if((dict_fd = open("/usr/share/dict/words", O_RDONLY)) == -1){
-		perror("mod_markov: open dict");
-	} else {
-		posix_fadvise(dict_fd, 0, 0, POSIX_FADV_RANDOM);
+	markov_dict_load();
 
-		struct stat st;
-		if(fstat(dict_fd, &st) == -1){
-			perror("mod_markov: fstat");
-			return false;
-		} else {
-			dict_fd_size = st.st_size;
-		}
+	gc.last = time(0);
+	markov_start();
+
+	// write out the current format straight away, so the next start can map it.
+	if(converted){
+		markov_compact = true;
+		ctx->save_me();
 	}
 
 	return true;
 }
 
 static void markov_quit(void){
-	sbmm_free(word_mem);
-	sbmm_free(chain_vals);
+	markov_gen_stop();
+	markov_compact_reap(true);
+	markov_journal_close();
+
+	markov_gc_free();
+	ctx->del_timer(gc_check_timer);
+
+	if(word_mem_map_len){
+		munmap(stb__sbraw(word_mem), word_mem_map_len);
+		word_mem = NULL;
+	} else {
+		sbmm_free(word_mem);
+	}
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		markov_model_free(models[i]);
+	}
+	sb_free(models);
+	model = NULL;
+
+	for(size_t i = 0; i < sb_count(markov_groups); ++i){
+		free(markov_groups[i].chan);
+		free(markov_groups[i].model);
+	}
+	sb_free(markov_groups);
 
 	for(size_t i = 0; i < sb_count(markov_nicks); ++i){
 		free(markov_nicks[i]);
 	}
 	sb_free(markov_nicks);
 
-	inso_ht_free(&chain_keys_ht);
 	inso_ht_free(&word_ht);
 
+	inso_ht_free(&dict_ht);
+	sb_free(dict_mem);
+	sb_free(dict_bits);
+
+	regfree(&url_regex);
+}
+
+// Everything a reloaded mod_markov carries on with, so it doesn't have to map the file and replay the journal
+// again. Bump the version below when this or any of the structs it points to change.
+DEFINE_HANDOFF_VERSION(3);
+
+typedef struct {
+	int           order;
+	char*         word_mem;
+	size_t        word_mem_map_len;
+	inso_ht       word_ht;
+	MarkovModel** models;
+	MarkovGroup*  groups;
+	bool          chan_models;
+	char**        nicks;
+	char*         dict_mem;
+	inso_ht       dict_ht;
+	uint8_t*      dict_bits;
+	word_idx_t    start_sym_idx;
+	word_idx_t    end_sym_idx;
+	size_t        max_chain_len;
+	size_t        msg_chance;
+	uint32_t      recent_hashes[128];
+	size_t        recent_hash_idx;
+	int           journal_fd;
+	size_t        journal_size;
+	uint64_t      journal_gen;
+	int           journal_prev_fd;
+	bool          compact;
+	pid_t         compact_pid;
+	int           gc_level;
+	time_t        gc_last;
+} MarkovHandoff;
+
+static void* markov_handoff(void){
+	// the tables are half rebuilt, it's simpler for the new code to start over from the file.
+	if(markov_gc_running()) return NULL;
+
+	markov_gen_stop();
+	markov_journal_sync();
+
+	// a snapshot still being written is reaped by the new code, see markov_adopt.
+	ctx->del_timer(journal_timer);
+	ctx->del_timer(gc_check_timer);
+	ctx->del_timer(compact_timer);
+	sb_free(journal_buf);
+
+	MarkovHandoff* h = malloc(sizeof(*h));
+	*h = (MarkovHandoff){
+		.order             = markov_order,
+		.word_mem          = word_mem,
+		.word_mem_map_len  = word_mem_map_len,
+		.word_ht           = word_ht,
+		.models            = models,
+		.groups            = markov_groups,
+		.chan_models       = markov_chan_models,
+		.nicks             = markov_nicks,
+		.dict_mem          = dict_mem,
+		.dict_ht           = dict_ht,
+		.dict_bits         = dict_bits,
+		.start_sym_idx     = start_sym_idx,
+		.end_sym_idx       = end_sym_idx,
+		.max_chain_len     = max_chain_len,
+		.msg_chance        = msg_chance,
+		.recent_hash_idx   = recent_hash_idx,
+		.journal_fd        = journal_fd,
+		.journal_size      = journal_size,
+		.journal_gen       = journal_gen,
+		.journal_prev_fd   = journal_prev_fd,
+		.compact           = markov_compact,
+		.compact_pid       = compact_pid,
+		.gc_level          = gc.level,
+		.gc_last           = gc.last,
+	};
+
+	memcpy(h->recent_hashes, recent_hashes, sizeof(recent_hashes));
+
 	regfree(&url_regex);
+
+	return h;
+}
+
+static bool markov_adopt(const IRCCoreCtx* _ctx, void* arg){
+	MarkovHandoff* h = arg;
+	ctx = _ctx;
+
+	markov_rng_init();
+	regcomp(&url_regex, "(www\\.|https?:\\/\\/|\\.com|\\.[a-zA-Z]\\/)", REG_ICASE | REG_EXTENDED | REG_NOSUB);
+
+	word_mem           = h->word_mem;
+	word_mem_map_len   = h->word_mem_map_len;
+	word_ht            = h->word_ht;
+	models             = h->models;
+	markov_groups      = h->groups;
+	markov_chan_models = h->chan_models;
+	markov_nicks       = h->nicks;
+	dict_mem           = h->dict_mem;
+	dict_ht            = h->dict_ht;
+	dict_bits          = h->dict_bits;
+	start_sym_idx      = h->start_sym_idx;
+	end_sym_idx        = h->end_sym_idx;
+	max_chain_len      = h->max_chain_len;
+	msg_chance         = h->msg_chance;
+	recent_hash_idx    = h->recent_hash_idx;
+	markov_compact     = h->compact;
+	gc.level           = h->gc_level;
+	gc.last            = h->gc_last;
+
+	memcpy(recent_hashes, h->recent_hashes, sizeof(recent_hashes));
+
+	// the old code's functions are gone, point the tables at ours.
+	word_ht.hash_fn  = &wordinfo_hash;
+	word_ht.alloc_fn = &ht_alloc;
+	word_ht.free_fn  = &ht_free;
+	dict_ht.hash_fn  = &dict_hash;
+
+	for(size_t i = 0; i < sb_count(models); ++i){
+		models[i]->keys_ht.hash_fn  = &chain_key_hash;
+		models[i]->keys_ht.alloc_fn = &ht_alloc;
+		models[i]->keys_ht.free_fn  = &ht_free;
+	}
+
+	markov_set_order(h->order);
+	model = models[0];
+
+	snprintf(journal_path, sizeof(journal_path), "%s.journal", ctx->get_datafile());
+	snprintf(journal_next_path, sizeof(journal_next_path), "%s.journal.next", ctx->get_datafile());
+	journal_fd      = h->journal_fd;
+	journal_size    = h->journal_size;
+	journal_gen     = h->journal_gen;
+	journal_prev_fd = h->journal_prev_fd;
+	compact_pid     = h->compact_pid;
+
+	if(journal_fd != -1){
+		journal_timer = ctx->add_timer(MARKOV_JOURNAL_SYNC_MS, true, &markov_journal_tick, 0);
+	}
+	if(compact_pid){
+		compact_timer = ctx->add_timer(MARKOV_COMPACT_REAP_MS, true, &markov_compact_tick, 0);
+	}
+
+	free(h);
+
+	markov_start();
+	return true;
 }
 
 static void markov_cmd(const char* chan, const char* name, const char* arg, int cmd){
@@ -811,21 +3071,32 @@ static void markov_cmd(const char* chan, const char* name, const char* arg, int
 		case MARKOV_STATUS: {
 			if(!admin) break;
 
-			size_t nwords, nkeys, nvals = sbmm_count(chain_vals);
+			size_t nwords, nkeys, nvals = 0;
+			for(size_t i = 0; i < sb_count(models); ++i){
+				nvals += sbmm_count(models[i]->vals);
+			}
 #if INSO_HT_VERSION >= 2
 			nwords = word_ht.used;
-			nkeys  = chain_keys_ht.used;
+			nkeys  = markov_keys_used();
 #else
 			nwords = word_ht.used / word_ht.elem_size;
-			nkeys  = chain_keys_ht.used / chain_keys_ht.elem_size;
+			nkeys  = markov_keys_used() / markov_key_size;
 #endif
+			char limit[32] = "none";
+			if(gc_max_mem){
+				snprintf(limit, sizeof(limit), "%zuMB", gc_max_mem >> 20);
+			}
+
 			ctx->send_msg(
 				chan,
-				"%s: markov status: [words: %zu/%.2fMB] [keys: %zu/%.2fMB] [vals: %zu/%.2fMB]",
+				"%s: markov status: [words: %zu/%.2fMB] [keys: %zu/%.2fMB, order %d] [vals: %zu/%.2fMB] [models: %zu] [total: %.2fMB, limit: %s%s]",
 				name,
 				nwords,	(nwords * sizeof(WordInfo) + sbmm_count(word_mem)) / (1024.f*1024.f),
-				nkeys , (nkeys  * sizeof(MarkovLinkKey)) / (1024.f*1024.f),
-				nvals ,	(nvals  * sizeof(MarkovLinkVal)) / (1024.f*1024.f)
+				nkeys , (nkeys  * markov_key_size) / (1024.f*1024.f), markov_order,
+				nvals ,	(nvals  * sizeof(MarkovLinkVal)) / (1024.f*1024.f),
+				sb_count(models),
+				markov_mem_usage() / (1024.f*1024.f), limit,
+				markov_gc_running() ? ", pruning" : ""
 			);
 
 		} break;
@@ -835,8 +3106,9 @@ static void markov_cmd(const char* chan, const char* name, const char* arg, int
 			if(!owner || strcmp(name, owner) != 0)
 				break;
 
+			markov_compact = true;
 			ctx->save_me();
-			ctx->send_msg(chan, "%s: save complete.", name);
+			ctx->send_msg(chan, "%s: saving shortly.", name);
 		} break;
 	}
 
@@ -868,10 +3140,6 @@ static void markov_msg(const char* chan, const char* name, const char* _msg){
 
 	ctx->strip_colors(msg);
 
-	for(char* c = msg; c < sb_end(msg); ++c){
-		*c = tolower(*c);
-	}
-
 	// check for mentions, and reply
 	{
 		const char* bot_name = ctx->get_username();
@@ -899,39 +3167,25 @@ static void markov_msg(const char* chan, const char* name, const char* _msg){
 		}
 	}
 
-	// strip various punctuation
-	{
-		if(*msg == '@') *msg = ' ';
-
-		for(char* p = msg; *p; ++p){
-			if(*p < ' ' || *p >= 127) *p = ' ';
-			else if(*p == '$') *p = '@';
-		}
-
-		markov_replace(&msg, ". ", " $ ");
-		markov_replace(&msg, "! ", " $ ");
-		markov_replace(&msg, "? ", " $ ");
-
-		markov_replace(&msg, ",", " , ");
+	pthread_mutex_lock(&gen_lock);
 
-		for(char* p = msg; *p; ++p){
-			if(strchr(".!?@:;`^(){}[]\"", *p)) *p = ' ';
-		}
+	model = markov_model_for(chan);
 
-		markov_replace(&msg, "  ", " ");
+	// the chain to be added by markov_add(). key = the words before the last one, value = the last one
+	word_idx_t words[MARKOV_ORDER_MAX + 1];
+	for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+		words[i] = start_sym_idx;
 	}
 
-	// the chain to be added by markov_add(). key = [0]+[1], value = [2]
-	word_idx_t words[] = { start_sym_idx, start_sym_idx, 0 };
-
 	MarkovTopic new_topics[3] = {};
 
-	char* state = NULL;
-	char* word = strtok_r(msg, " ", &state);
+	MarkovTokenizer tok = { .p = msg };
+	const char* word;
+	size_t len;
 
 	//printf("Adding:");
 
-	for(; word; word = strtok_r(NULL, " ", &state)){
+	while((word = markov_tok_next(&tok, &len))){
 
 		// skip words from hardcoded list
 		bool skip = false;
@@ -945,7 +3199,6 @@ static void markov_msg(const char* chan, const char* name, const char* _msg){
 
 		//printf(" [%s]", word);
 
-		size_t len = strlen(word);
 		word_idx_t idx = 0;
 		uint32_t wcount;
 
@@ -967,14 +3220,16 @@ static void markov_msg(const char* chan, const char* name, const char* _msg){
 			idx = find_or_add_word(word, len, &wcount);
 		}
 
+		word_idx_t prev = words[MARKOV_ORDER_MAX - 1];
+
 		// skip empty sentences + triplicates
-		if ((idx == end_sym_idx && words[1] == start_sym_idx) ||
-			(idx == words[1]    && words[1] == words[0])){
+		if ((idx == end_sym_idx && prev == start_sym_idx) ||
+			(idx == prev        && prev == words[MARKOV_ORDER_MAX - 2])){
 			continue;
 		}
 
-		words[2] = idx;
-		markov_add(words);
+		words[MARKOV_ORDER_MAX] = idx;
+		markov_learn(words);
 
 #if 0
 		printf("m: [%s:%d]\n", word_mem + idx, wcount);
@@ -1002,11 +3257,11 @@ skip_topics:
 
 		// shift words down, or start a new sentence if this was the end symbol, $
 		if(idx == end_sym_idx){
-			words[0] = start_sym_idx;
-			words[1] = start_sym_idx;
+			for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+				words[i] = start_sym_idx;
+			}
 		} else {
-			words[0] = words[1];
-			words[1] = words[2];
+			memmove(words, words + 1, MARKOV_ORDER_MAX * sizeof(word_idx_t));
 		}
 	}
 
@@ -1018,8 +3273,13 @@ skip_topics:
 	//puts(".");
 
 	// add final link to the end symbol
-	words[2] = end_sym_idx;
-	if(words[1] != start_sym_idx) markov_add(words);
+	words[MARKOV_ORDER_MAX] = end_sym_idx;
+	if(words[MARKOV_ORDER_MAX - 1] != start_sym_idx) markov_learn(words);
+
+	pthread_cond_signal(&gen_cond);
+	pthread_mutex_unlock(&gen_lock);
+
+	markov_journal_flush();
 
 	// maybe send a message
 	if(markov_rand(msg_chance) == 0){
@@ -1040,22 +3300,68 @@ static void markov_join(const char* chan, const char* name){
 	sb_push(markov_nicks, strdup(name));
 }
 
+static int markov_nick_cmp(const void* a, const void* b){
+	return strcasecmp(*(const char**)a, *(const char**)b);
+}
+
+static void markov_join_bulk(const char* chan, const char** names, size_t count){
+	const char* self = ctx->get_username();
+
+	// sort a copy of the known nicks once instead of scanning them for each new one.
+	size_t nknown = sb_count(markov_nicks);
+	char** known = malloc(nknown * sizeof(char*) + 1);
+	memcpy(known, markov_nicks, nknown * sizeof(char*));
+	qsort(known, nknown, sizeof(char*), &markov_nick_cmp);
+
+	for(size_t i = 0; i < count; ++i){
+		if(strcasecmp(names[i], self) == 0) continue;
+		if(bsearch(names + i, known, nknown, sizeof(char*), &markov_nick_cmp)) continue;
+
+		sb_push(markov_nicks, strdup(names[i]));
+	}
+
+	free(known);
+}
+
 static void markov_mod_msg(const char* sender, const IRCModMsg* msg){
 	if(strcmp(msg->cmd, "markov_gen") == 0){
-		size_t prev_len = max_chain_len;
-		if(msg->arg != 0){
-			max_chain_len = msg->arg;
+		char* buffer = NULL;
+
+		pthread_mutex_lock(&gen_lock);
+
+		MarkovRawPool* pool = NULL;
+		for(MarkovRawPool* p = gen_raw_pools; p < sb_end(gen_raw_pools); ++p){
+			if(p->len == (size_t)msg->arg){
+				pool = p;
+				break;
+			}
 		}
 
-		char* buffer = malloc(256);
-		if(!markov_gen(buffer, 256)){
-			free(buffer);
-			return;
+		// the first time a length is asked for, the worker starts keeping some of those ready too.
+		if(!pool && gen_running && sb_count(gen_raw_pools) < MARKOV_RAW_POOLS_MAX){
+			pool = sb_add(gen_raw_pools, 1);
+			*pool = (MarkovRawPool){ .len = msg->arg };
+		}
+
+		if(pool && sb_count(pool->texts)){
+			buffer = pool->texts[0];
+			sb_erase(pool->texts, 0);
+		} else {
+			model  = models[0];
+			buffer = malloc(256);
+			if(!markov_gen(buffer, 256, msg->arg ? (size_t)msg->arg : max_chain_len)){
+				free(buffer);
+				buffer = NULL;
+			}
 		}
 
-		msg->callback((intptr_t)buffer, msg->cb_arg);
+		pthread_cond_signal(&gen_cond);
 
-		max_chain_len = prev_len;
+		pthread_mutex_unlock(&gen_lock);
+
+		if(buffer){
+			msg->callback((intptr_t)buffer, msg->cb_arg);
+		}
 	}
 }
 
@@ -1063,6 +3369,7 @@ static void markov_stdin(const char* msg){
 	int chance;
 
 	if(strcmp(msg, "msave") == 0){
+		markov_compact = true;
 		ctx->save_me();
 	} else if(sscanf(msg, "mgap %d", &chance) == 1 && chance > 0){
 		msg_chance = chance;
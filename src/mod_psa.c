@@ -12,7 +12,6 @@ static void psa_add    (const char*, const char*, bool);
 static bool psa_init   (const IRCCoreCtx*);
 static void psa_cmd    (const char*, const char*, const char*, int);
 static void psa_msg    (const char*, const char*, const char*);
-static void psa_tick   (time_t);
 static bool psa_save   (FILE*);
 static void psa_quit   (void);
 static void psa_reload (void);
@@ -25,7 +24,6 @@ const IRCModuleCtx irc_mod_ctx = {
 	.on_init  = &psa_init,
 	.on_cmd   = &psa_cmd,
 	.on_msg   = &psa_msg,
-	.on_tick  = &psa_tick,
 	.on_save  = &psa_save,
 	.on_quit  = &psa_quit,
 	.on_modified = &psa_reload,
@@ -55,10 +53,20 @@ typedef struct {
 	time_t last_posted;
 	int freq_mins;
 	bool when_live;
+	intptr_t key;
+	intptr_t timer;
 } PSAData;
 
 static PSAData* psa_data;
 static time_t psa_last_update;
+static intptr_t psa_last_key;
+
+static void psa_timer(intptr_t key);
+
+static void psa_schedule(PSAData* p, time_t secs){
+	ctx->del_timer(p->timer);
+	p->timer = ctx->add_timer(secs * 1000, false, &psa_timer, p->key);
+}
 
 static void psa_reload(void){
 	FILE* file = fopen(ctx->get_datafile(), "r");
@@ -77,6 +85,12 @@ static void psa_reload(void){
 
 static bool psa_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
+
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_psa: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	psa_reload();
 	return true;
 }
@@ -87,6 +101,7 @@ static bool psa_delete(const char* chan, const char* id){
 			continue;
 		}
 
+		ctx->del_timer(p->timer);
 		free(p->channel);
 		free(p->message);
 		free(p->id);
@@ -230,8 +245,13 @@ static void psa_add(const char* chan, const char* arg, bool silent){
 		psa.cmdline = strdup(psa.cmdline);
 		psa.channel = strdup(chan);
 		psa.last_posted = (time(0) + 5) - (psa.freq_mins * 60);
+		psa.key = ++psa_last_key;
 		sb_push(psa_data, psa);
 
+		if(!psa.trigger){
+			psa_schedule(&sb_last(psa_data), 5);
+		}
+
 		if(!silent){
 			ctx->send_msg(chan, "PSA [%s] Added.", psa.id);
 		}
@@ -350,23 +370,38 @@ static void psa_msg(const char* chan, const char* name, const char* msg){
 
 }
 
-static void psa_tick(time_t now){
-	if(now - psa_last_update < 60) return;
-	psa_last_update = now;
-
-	sb_each(p, psa_data){
-		if(now - p->last_posted > p->freq_mins * 60 && !p->trigger){
-			bool post = true;
-			if(p->when_live){
-				MOD_MSG(ctx, "twitch_is_live", p->channel, &psa_twitch_cb, &post);
-			}
+// timed PSAs are still posted at most once a minute between them, like when they were checked from on_tick.
+static void psa_timer(intptr_t key){
+	time_t now = time(0);
+	PSAData* p = NULL;
 
-			if(post){
-				psa_post(p, "", now);
-			}
+	sb_each(q, psa_data){
+		if(q->key == key){
+			p = q;
 			break;
 		}
 	}
+
+	if(!p) return;
+	p->timer = 0;
+
+	if(now - psa_last_update < 60){
+		psa_schedule(p, 60 - (now - psa_last_update));
+		return;
+	}
+
+	bool post = true;
+	if(p->when_live){
+		MOD_MSG(ctx, "twitch_is_live", p->channel, &psa_twitch_cb, &post);
+	}
+
+	if(post){
+		psa_last_update = now;
+		psa_post(p, "", now);
+		psa_schedule(p, p->freq_mins * 60);
+	} else {
+		psa_schedule(p, 60);
+	}
 }
 
 static bool psa_save(FILE* file){
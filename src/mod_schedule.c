@@ -20,7 +20,6 @@
 
 static bool sched_init (const IRCCoreCtx*);
 static void sched_cmd  (const char*, const char*, const char*, int);
-static void sched_tick (time_t);
 static void sched_quit (void);
 static void sched_mod_msg (const char*, const IRCModMsg*);
 
@@ -29,9 +28,9 @@ enum { SCHED_ADD, SCHED_DEL, SCHED_EDIT, SCHED_SHOW, SCHED_LINK, SCHED_NEXT };
 const IRCModuleCtx irc_mod_ctx = {
 	.name        = "schedule",
 	.desc        = "Stores stream schedules",
+	.flags       = IRC_MOD_INIT_ASYNC,
 	.on_init     = &sched_init,
 	.on_cmd      = &sched_cmd,
-	.on_tick     = &sched_tick,
 	.on_quit     = &sched_quit,
 	.on_mod_msg  = &sched_mod_msg,
 	.commands    = DEFINE_CMDS (
@@ -70,11 +69,18 @@ typedef struct {
 	const SchedEntry* entry;
 } SchedOffset;
 
+// a command waiting for an up-to-date schedule before it runs, see sched_cmd.
+typedef struct {
+	int   cmd;
+	char* chan;
+	char* name;
+	char* arg;
+} SchedPending;
+
 static char**       sched_keys;
 static SchedEntry** sched_vals;
 static inso_gist*   gist;
 
-static CURL*        curl;
 static time_t       prev_get;
 
 static const char*  sched_auth;
@@ -83,16 +89,48 @@ static const char*  sched_url_api;
 
 static SchedOffset* sched_offsets;
 static time_t       offset_expiry;
+static intptr_t     offset_timer;
+
+static SchedPending** sched_queue;
+static int            sched_inflight; // http requests whose results the queue has to wait for
+
+// a user's schedules as a mod_msg left them while a reload was in flight. The reload's result would replace
+// them with the copy from before, so they're put back once it lands, see sched_replay_apply.
+typedef struct {
+	char*       user;
+	SchedEntry* entries;
+} SchedReplay;
+
+static SchedReplay*   sched_replay;
+static bool           sched_reloading;
+static bool           sched_save_pending; // a mod_msg asked for an upload while another request was in flight
 
 static const char* days[] = { "mon", "tue", "wed", "thu", "fri", "sat", "sun" };
 
+static void sched_entries_free(SchedEntry* entries){
+	for(size_t i = 0; i < sb_count(entries); ++i){
+		free(entries[i].title);
+		free(entries[i].source);
+	}
+	sb_free(entries);
+}
+
+static SchedEntry* sched_entries_dup(const SchedEntry* entries){
+	SchedEntry* copy = NULL;
+
+	for(size_t i = 0; i < sb_count(entries); ++i){
+		SchedEntry e = entries[i];
+		e.title  = strdup(e.title);
+		e.source = e.source ? strdup(e.source) : NULL;
+		sb_push(copy, e);
+	}
+
+	return copy;
+}
+
 static void sched_free(void){
 	for(size_t i = 0; i < sb_count(sched_keys); ++i){
-		for(size_t j = 0; j < sb_count(sched_vals[i]); ++j){
-			free(sched_vals[i][j].title);
-			free(sched_vals[i][j].source);
-		}
-		sb_free(sched_vals[i]);
+		sched_entries_free(sched_vals[i]);
 		free(sched_keys[i]);
 	}
 	sb_free(sched_keys);
@@ -119,10 +157,64 @@ static int sched_get_add(const char* name){
 	return i;
 }
 
+// called after a mod_msg changes user's schedules. Only needed while a reload is in flight.
+static void sched_replay_note(const char* user){
+	if(!sched_reloading) return;
+
+	SchedReplay* r = NULL;
+	sb_each(it, sched_replay){
+		if(strcmp(it->user, user) == 0){
+			r = it;
+			break;
+		}
+	}
+
+	if(r){
+		sched_entries_free(r->entries);
+	} else {
+		sb_push(sched_replay, ((SchedReplay){ .user = strdup(user) }));
+		r = &sb_last(sched_replay);
+	}
+
+	int i = sched_get(user);
+	r->entries = i == -1 ? NULL : sched_entries_dup(sched_vals[i]);
+}
+
+static void sched_offsets_update(void);
+
+#if !SCHEDULE_USE_GIST
+// puts back what the mod_msgs did while the reload that just landed was in flight.
+static void sched_replay_apply(void){
+	if(!sched_replay) return;
+
+	sb_each(r, sched_replay){
+		int i = sched_get(r->user);
+
+		if(r->entries){
+			if(i == -1) i = sched_get_add(r->user);
+			sched_entries_free(sched_vals[i]);
+			sched_vals[i] = r->entries;
+		} else if(i != -1){
+			sched_entries_free(sched_vals[i]);
+			free(sched_keys[i]);
+			sb_erase(sched_keys, i);
+			sb_erase(sched_vals, i);
+		}
+
+		free(r->user);
+	}
+	sb_free(sched_replay);
+
+	sched_offsets_update();
+}
+#endif
+
 static int sched_off_cmp(const void* a, const void* b){
 	return ((SchedOffset*)a)->offset - ((SchedOffset*)b)->offset;
 }
 
+static void sched_offsets_timer(intptr_t arg);
+
 static void sched_offsets_update(void){
 	sb_free(sched_offsets);
 
@@ -167,56 +259,45 @@ static void sched_offsets_update(void){
 
 	offset_expiry = week_start + (7*24*60*60);
 	qsort(sched_offsets, sb_count(sched_offsets), sizeof(SchedOffset), &sched_off_cmp);
-}
-
-static bool sched_reload(void){
-	char* data = NULL;
-
-#if SCHEDULE_USE_GIST
-	inso_gist_file* files = NULL;
-	int ret = inso_gist_load(gist, &files);
 
-	if(ret == INSO_GIST_304){
-		puts("mod_schedule: not modified.");
-		return true;
-	}
+	ctx->del_timer(offset_timer);
+	offset_timer = ctx->add_timer_at(offset_expiry, &sched_offsets_timer, 0);
+}
 
-	if(ret != INSO_GIST_OK){
-		puts("mod_schedule: gist error.");
-		return false;
-	}
+static void sched_offsets_timer(intptr_t arg){
+	offset_timer = 0;
+	sched_offsets_update();
+}
 
-	puts("mod_schedule: doing full reload");
+static void sched_run(SchedPending* p);
+static void sched_queue_next(void);
+static void sched_upload(void);
 
-	for(inso_gist_file* f = files; f; f = f->next){
-		if(strcmp(f->name, "schedule.json") != 0){
-			continue;
-		} else {
-			data = f->content;
-			break;
-		}
-	}
+static void sched_pending_free(SchedPending* p){
+	free(p->chan);
+	free(p->name);
+	free(p->arg);
+	free(p);
+}
 
-	inso_gist_file_free(files);
-#else
-	inso_curl_reset(curl, sched_url_get, &data);
-	curl_easy_setopt(curl, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
-	curl_easy_setopt(curl, CURLOPT_TIMEVALUE, prev_get);
-	long ret = inso_curl_perform(curl, &data);
+#if !SCHEDULE_USE_GIST
+// the core aborts our requests with this when the module is unloaded, before sched_quit runs. Nothing queued
+// gets to run then: its own reload would only be aborted too, after telling the user it had worked.
+static bool sched_aborted(long ret){
+	if(ret != -CURLE_ABORTED_BY_CALLBACK) return false;
 
-	if(ret == 304){
-		puts("mod_schedule: not modified.");
-		return true;
-	}
-
-	if(ret != 200){
-		printf("mod_schedule: curl error: %ld\n", ret);
-		return false;
+	sb_each(p, sched_queue){
+		sched_pending_free(*p);
 	}
+	sb_free(sched_queue);
 
-	curl_easy_getinfo(curl, CURLOPT_FILETIME, &prev_get);
+	sched_reloading = false;
+	--sched_inflight;
+	return true;
+}
 #endif
 
+static bool sched_load_json(const char* data){
 	if(!data){
 		puts("mod_schedule: data null?!");
 		return false;
@@ -288,9 +369,114 @@ static bool sched_reload(void){
 	return true;
 }
 
+#if SCHEDULE_USE_GIST
+static void sched_reload(SchedPending* p){
+	char* data = NULL;
+	bool locked = p && p->cmd != SCHED_SHOW;
+
+	if(locked){
+		inso_gist_lock(gist);
+	}
+
+	inso_gist_file* files = NULL;
+	int ret = inso_gist_load(gist, &files);
+
+	if(ret == INSO_GIST_304){
+		puts("mod_schedule: not modified.");
+	} else if(ret != INSO_GIST_OK){
+		puts("mod_schedule: gist error.");
+	} else {
+		puts("mod_schedule: doing full reload");
+
+		for(inso_gist_file* f = files; f; f = f->next){
+			if(strcmp(f->name, "schedule.json") != 0){
+				continue;
+			} else {
+				data = f->content;
+				break;
+			}
+		}
+
+		sched_load_json(data);
+	}
+
+	inso_gist_file_free(files);
+
+	if(p){
+		sched_run(p);
+	}
+
+	if(locked){
+		inso_gist_unlock(gist);
+	}
+}
+#else
+static void sched_reload_cb(void* curl, long ret, char* data, intptr_t arg){
+	SchedPending* p = (SchedPending*)arg;
+
+	if(sched_aborted(ret)){
+		if(p) sched_pending_free(p);
+		return;
+	}
+
+	if(ret == 304){
+		puts("mod_schedule: not modified.");
+	} else if(ret != 200){
+		printf("mod_schedule: curl error: %ld\n", ret);
+	} else {
+		long filetime = -1;
+		curl_easy_getinfo(curl, CURLINFO_FILETIME, &filetime);
+		if(filetime != -1){
+			prev_get = filetime;
+		}
+		sched_load_json(data);
+	}
+
+	sched_reloading = false;
+	sched_replay_apply();
+
+	// run the waiting command before letting the queue move on, so any upload it does is waited for too.
+	if(p){
+		sched_run(p);
+	}
+
+	--sched_inflight;
+	sched_queue_next();
+}
+
+static void sched_reload(SchedPending* p){
+	CURL* curl = inso_curl_init(sched_url_get, NULL);
+	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
+	curl_easy_setopt(curl, CURLOPT_TIMEVALUE, prev_get);
+
+	++sched_inflight;
+	sched_reloading = true;
+	ctx->http_async(curl, &sched_reload_cb, (intptr_t)p);
+}
+#endif
+
+// commands are run one at a time, each after its own reload, so an edit can't be lost to a reload racing its upload.
+static void sched_queue_next(void){
+	if(!sched_inflight && sched_save_pending){
+		sched_upload();
+	}
+
+	while(!sched_inflight && sb_count(sched_queue)){
+		SchedPending* p = sched_queue[0];
+		sb_erase(sched_queue, 0);
+		sched_reload(p);
+	}
+}
+
 static bool sched_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
 
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_schedule: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 #if SCHEDULE_USE_GIST
 	char* gist_id = getenv("INSOBOT_SCHED_GIST_ID");
 	if(!gist_id || !*gist_id){
@@ -320,14 +506,30 @@ static bool sched_init(const IRCCoreCtx* _ctx){
 		fputs("mod_schedule: INSOBOT_SCHEDULE_{AUTH,URL_GET,URL_API} missing. can't continue\n", stderr);
 		return false;
 	}
-
-	curl = curl_easy_init();
 #endif
 
-	return sched_reload();
+	sched_reload(NULL);
+	return true;
 }
 
+#if !SCHEDULE_USE_GIST
+static void sched_upload_cb(void* curl, long ret, char* data, intptr_t arg){
+	if(sched_aborted(ret)){
+		return;
+	}
+
+	if(ret < 0){
+		printf("mod_schedule: upload error: %s\n", curl_easy_strerror(-ret));
+	}
+
+	--sched_inflight;
+	sched_queue_next();
+}
+#endif
+
 static void sched_upload(void){
+	sched_save_pending = false;
+
 	yajl_gen json = yajl_gen_alloc(NULL);
 	yajl_gen_config(json, yajl_gen_beautify, 1);
 
@@ -374,10 +576,13 @@ static void sched_upload(void){
 	inso_gist_save(gist, "insobot stream schedule", file);
 	inso_gist_file_free(file);
 #else
-	inso_curl_reset(curl, sched_url_api, NULL);
+	CURL* curl = inso_curl_init(sched_url_api, NULL);
 	curl_easy_setopt(curl, CURLOPT_USERPWD, sched_auth);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-	curl_easy_perform(curl);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)json_len);
+	curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, json_data);
+
+	++sched_inflight;
+	ctx->http_async(curl, &sched_upload_cb, 0);
 #endif
 
 	yajl_gen_free(json);
@@ -971,38 +1176,41 @@ static void sched_next(const char* chan){
 	}
 }
 
+static void sched_run(SchedPending* p){
+	switch(p->cmd){
+		case SCHED_ADD:  sched_add (p->chan, p->name, p->arg); break;
+		case SCHED_DEL:  sched_del (p->chan, p->name, p->arg); break;
+		case SCHED_EDIT: sched_edit(p->chan, p->name, p->arg); break;
+		case SCHED_SHOW: sched_show(p->chan, p->name, p->arg); break;
+	}
+
+	sched_pending_free(p);
+}
+
+static void sched_queue_add(int cmd, const char* chan, const char* name, const char* arg){
+	SchedPending* p = malloc(sizeof(*p));
+
+	p->cmd  = cmd;
+	p->chan = strdup(chan);
+	p->name = strdup(name);
+	p->arg  = strdup(arg);
+
+	sb_push(sched_queue, p);
+	sched_queue_next();
+}
+
 static void sched_cmd(const char* chan, const char* name, const char* arg, int cmd){
 	switch(cmd){
-		case SCHED_ADD: {
-			if(inso_is_wlist(ctx, name)){
-				inso_gist_lock(gist);
-				sched_reload();
-				sched_add(chan, name, arg);
-				inso_gist_unlock(gist);
-			}
-		} break;
-		
-		case SCHED_DEL: {
-			if(inso_is_wlist(ctx, name)){
-				inso_gist_lock(gist);
-				sched_reload();
-				sched_del(chan, name, arg);
-				inso_gist_unlock(gist);
-			}
-		} break;
-
+		case SCHED_ADD:
+		case SCHED_DEL:
 		case SCHED_EDIT: {
 			if(inso_is_wlist(ctx, name)){
-				inso_gist_lock(gist);
-				sched_reload();
-				sched_edit(chan, name, arg);
-				inso_gist_unlock(gist);
+				sched_queue_add(cmd, chan, name, arg);
 			}
 		} break;
 
 		case SCHED_SHOW: {
-			sched_reload();
-			sched_show(chan, name, arg);
+			sched_queue_add(cmd, chan, name, arg);
 		} break;
 
 		case SCHED_LINK: {
@@ -1015,13 +1223,18 @@ static void sched_cmd(const char* chan, const char* name, const char* arg, int c
 	}
 }
 
-static void sched_tick(time_t now){
-	if(now >= offset_expiry){
-		sched_offsets_update();
+static void sched_quit(void){
+	sb_each(p, sched_queue){
+		sched_pending_free(*p);
 	}
-}
+	sb_free(sched_queue);
+
+	sb_each(r, sched_replay){
+		free(r->user);
+		sched_entries_free(r->entries);
+	}
+	sb_free(sched_replay);
 
-static void sched_quit(void){
 	sched_free();
 	sb_free(sched_offsets);
 	inso_gist_close(gist);
@@ -1050,6 +1263,9 @@ static void sched_mod_msg(const char* sender, const IRCModMsg* msg){
 				.user = sched_keys[index],
 			};
 
+			char* changed = NULL; // the user's name, once the callback has changed any of their schedules
+			bool  stop    = false;
+
 			for(size_t i = 0; i < sb_count(sched_vals[index]); ++i){
 				SchedEntry* ent = sched_vals[index] + i;
 				result.sched_id = i;
@@ -1061,6 +1277,17 @@ static void sched_mod_msg(const char* sender, const IRCModMsg* msg){
 
 				SchedIterCmd cmd = msg->callback((intptr_t)&result, msg->cb_arg);
 
+				bool edited = (cmd & SCHED_ITER_DELETE)
+					|| result.start  != ent->start
+					|| result.end    != ent->end
+					|| result.repeat != ent->repeat
+					|| result.title  != ent->title
+					|| result.source != ent->source;
+
+				if(edited && !changed){
+					changed = strdup(sched_keys[index]);
+				}
+
 				// if the callback changed anything, save back those changes.
 
 				ent->start  = result.start;
@@ -1082,11 +1309,17 @@ static void sched_mod_msg(const char* sender, const IRCModMsg* msg){
 				}
 
 				if(cmd & SCHED_ITER_STOP){
-					return;
+					stop = true;
+					break;
 				}
 			}
 
-			if(!iter_all) break;
+			if(changed){
+				sched_replay_note(changed);
+				free(changed);
+			}
+
+			if(stop || !iter_all) break;
 		}
 
 		return;
@@ -1124,6 +1357,7 @@ static void sched_mod_msg(const char* sender, const IRCModMsg* msg){
 					&& s->repeat){
 
 					s->repeat |= (1 << get_dow(&want));
+					sched_replay_note(user);
 					return;
 				}
 			}
@@ -1138,12 +1372,18 @@ static void sched_mod_msg(const char* sender, const IRCModMsg* msg){
 
 		index = sched_get_add(user);
 		sb_push(sched_vals[index], sched);
+		sched_replay_note(user);
 
 		return;
 	}
 
 	else if(is_msg_save){
-		sched_upload();
+		// an upload now could be overtaken by the one in flight, or miss what the reload in flight puts back.
+		if(sched_inflight){
+			sched_save_pending = true;
+		} else {
+			sched_upload();
+		}
 		return;
 	}
 }
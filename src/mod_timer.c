@@ -6,7 +6,6 @@
 
 static bool timer_init (const IRCCoreCtx*);
 static void timer_cmd  (const char* chan, const char* name, const char* arg, int cmd);
-static void timer_tick (time_t);
 static bool timer_save (FILE*);
 
 enum { TIMER_INFO, TIMER_ADD, TIMER_DEL, TIMER_LIST };
@@ -16,7 +15,6 @@ const IRCModuleCtx irc_mod_ctx = {
 	.desc     = "create timers",
 	.on_init  = &timer_init,
 	.on_cmd   = &timer_cmd,
-	.on_tick  = &timer_tick,
 	.on_save  = &timer_save,
 	.flags    = IRC_MOD_GLOBAL,
 	.commands = DEFINE_CMDS (
@@ -40,11 +38,23 @@ struct timer {
 	char* id;
 	char* msg;
 	time_t expiry;
+	intptr_t key;
+	intptr_t handle;
 };
 
 static sb(struct timer) timers;
+static intptr_t timer_last_key;
+
+static void timer_expire(intptr_t key);
+
+static void timer_schedule(struct timer* t) {
+	t->key = ++timer_last_key;
+	t->handle = ctx->add_timer_at(t->expiry, &timer_expire, t->key);
+}
 
 static void timer_free(struct timer* t) {
+	ctx->del_timer(t->handle);
+	t->handle = 0;
 	free(t->chan);
 	free(t->id);
 	free(t->msg);
@@ -65,7 +75,9 @@ static void timer_load(void) {
 			timer_free(&t);
 		} else {
 			t.expiry = expiry;
+			timer_schedule(&t);
 			sb_push(timers, t);
+			t = (struct timer){};
 		}
 	}
 
@@ -90,6 +102,12 @@ static struct timer* timer_get(const char* chan, const char* id) {
 
 static bool timer_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
+
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_timer: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	timer_load();
 	return true;
 }
@@ -225,6 +243,7 @@ static void timer_cmd(const char* chan, const char* name, const char* arg, int c
 			t->id = strdup(id);
 			t->msg = msg ? strdup(msg) : NULL;
 			t->expiry = expiry;
+			timer_schedule(t);
 
 			ctx->send_msg(chan, "%s: Timer %s created/updated.", nick, id);
 			ctx->save_me();
@@ -270,14 +289,17 @@ static void timer_cmd(const char* chan, const char* name, const char* arg, int c
 	}
 }
 
-static void timer_tick(time_t now) {
+// timers can move around in the array, so the core timer refers to them by key instead of by pointer.
+static void timer_expire(intptr_t key) {
 	sb_each(t, timers) {
-		if(now < t->expiry)
+		if(t->key != key)
 			continue;
 
 		ctx->send_msg(t->chan, "⏰ Timer [%s] expired! %s", t->id, t->msg ?: "");
 
+		timer_free(t);
 		sb_erase(timers, t - timers);
-		--t;
+		ctx->save_me();
+		break;
 	}
 }
@@ -7,7 +7,6 @@
 static bool topic_init    (const IRCCoreCtx*);
 static void topic_cmd     (const char* chan, const char* name, const char* arg, int cmd);
 static void topic_msg     (const char* chan, const char* name, const char* msg);
-static void topic_tick    (time_t);
 static bool topic_save    (FILE*);
 static void topic_mod_msg (const char*, const IRCModMsg*);
 
@@ -19,7 +18,6 @@ const IRCModuleCtx irc_mod_ctx = {
 	.on_init    = &topic_init,
 	.on_cmd     = &topic_cmd,
 	.on_msg     = &topic_msg,
-	.on_tick    = &topic_tick,
 	.on_save    = &topic_save,
 	.on_mod_msg = &topic_mod_msg,
 	.commands = DEFINE_CMDS (
@@ -41,28 +39,58 @@ struct chan {
 	char   topic[512];
 	time_t ask_time;
 	bool   waiting;
+	intptr_t ask_timer;
 };
 
 static sb(struct chan) topic_chans;
 
+static void topic_ask(intptr_t index);
+
+// (re)starts the timer for c's question. A time that has already passed would fire straight away, so it's at
+// least a second off.
+static void topic_ask_arm(struct chan* c){
+	time_t when = INSO_MAX(c->ask_time, time(0) + 1);
+
+	ctx->del_timer(c->ask_timer);
+	c->ask_timer = ctx->add_timer_at(when, &topic_ask, c - topic_chans);
+}
+
 static void topic_load(void){
 	sb_free(topic_chans);
 
 	FILE* f = fopen(ctx->get_datafile(), "r");
 
-	struct chan c;
 	unsigned long tmp_time;
 	time_t now = time(0);
+	char line[1024];
+
+	while(fgets(line, sizeof(line), f)){
+		struct chan c = {};
+		int off = 0;
 
-	while(fscanf(f, "%63s %lu %511[^\n]\n", c.name, &tmp_time, c.topic) == 3){
-		if(now - tmp_time > (20*60*60))
+		// the topic is empty while the bot is waiting to ask for it.
+		if(sscanf(line, "%63s %lu %n", c.name, &tmp_time, &off) < 2)
 			continue;
 
+		// tmp_time is unsigned, without the cast a question due in the future would look ancient.
+		if(now - (time_t)tmp_time > (20*60*60))
+			continue;
+
+		*stpncpy(c.topic, line + off, sizeof(c.topic)-1) = '\0';
+		c.topic[strcspn(c.topic, "\n")] = '\0';
+
 		c.ask_time = tmp_time;
 		sb_push(topic_chans, c);
 	}
 
 	fclose(f);
+
+	// questions that were still due when the bot stopped, or came due so recently that an answer would still count.
+	sb_each(c, topic_chans){
+		if(!*c->topic && c->ask_time && now - c->ask_time < 4*60){
+			topic_ask_arm(c);
+		}
+	}
 }
 
 static bool topic_save(FILE* f){
@@ -88,6 +116,12 @@ static struct chan* topic_lookup_or_create(const char* chan){
 
 static bool topic_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
+
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_topic: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	topic_load();
 	return true;
 }
@@ -152,12 +186,14 @@ static void topic_cmd(const char* chan, const char* name, const char* arg, int c
 	}
 }
 
-static void topic_tick(time_t now){
-	sb_each(c, topic_chans){
-		if(!*c->topic && c->ask_time && c->ask_time < now && !c->waiting){
-			ctx->send_msg(c->name, "What is the topic for today?");
-			c->waiting = true;
-		}
+// topic_chans is only ever appended to, so the index is a stable way to refer to a channel here.
+static void topic_ask(intptr_t index){
+	struct chan* c = topic_chans + index;
+	c->ask_timer = 0;
+
+	if(!*c->topic && c->ask_time && c->ask_time <= time(0) && !c->waiting){
+		ctx->send_msg(c->name, "What is the topic for today?");
+		c->waiting = true;
 	}
 }
 
@@ -181,6 +217,8 @@ static void topic_mod_msg(const char* sender, const IRCModMsg* msg){
 			memset(c->topic, 0, sizeof(c->topic));
 			c->ask_time = time(0) + 90;
 			c->waiting = false;
+
+			topic_ask_arm(c);
 		}
 	}
 }
@@ -13,9 +13,10 @@
 
 static bool twitch_init    (const IRCCoreCtx*);
 static void twitch_cmd     (const char*, const char*, const char*, int);
-static void twitch_tick    (time_t);
 static bool twitch_save    (FILE*);
 static void twitch_quit    (void);
+static void* twitch_handoff(void);
+static bool twitch_adopt   (const IRCCoreCtx*, void*);
 static void twitch_mod_msg (const char* sender, const IRCModMsg* msg);
 static void twitch_unknown (const char*, const char*, const char**, size_t);
 static void twitch_modified(void);
@@ -27,12 +28,13 @@ const IRCModuleCtx irc_mod_ctx = {
 	.desc     = "Functionality specific to twitch.tv",
 	.on_init  = twitch_init,
 	.on_cmd   = &twitch_cmd,
-	.on_tick  = &twitch_tick,
 	.on_save  = &twitch_save,
 	.on_quit  = &twitch_quit,
 	.on_mod_msg = &twitch_mod_msg,
 	.on_unknown = &twitch_unknown,
 	.on_modified = &twitch_modified,
+	.on_handoff = &twitch_handoff,
+	.on_adopt   = &twitch_adopt,
 	.commands = DEFINE_CMDS (
 		[FOLLOW_NOTIFY]  = CMD("fnotify"),
 		[UPTIME]         = CMD("uptime" ),
@@ -46,7 +48,9 @@ const IRCModuleCtx irc_mod_ctx = {
 		[TWITCH_VOD]     = "[#chan] | Displays the URL of the channel's most recent VoD (past broadcast).",
 		[TWITCH_TRACKER] = "[list|tagme [chans...]|untagme|chans|add <chan> [name]|del <chan>] | Operate the twitch stream tracker (#streams channel on HMN IRC)",
 		[TWITCH_TITLE]   = "[title] | Displays the current channel's stream title or, if given and I am made an editor for the channel, sets it to [title]"
-	)
+	),
+	// the tracker sends schedule sched_iter / sched_add, which it drops until its on_init is done.
+	.init_after = DEFINE_DEPS("schedule")
 };
 
 static const IRCCoreCtx* ctx;
@@ -57,8 +61,12 @@ static const long tracker_update_interval = 50;
 
 static time_t last_uptime_check;
 static time_t last_follower_check;
-static time_t last_tracker_update;
 
+static void twitch_tracker_timer  (intptr_t);
+static void twitch_follower_timer (intptr_t);
+static void twitch_start          (void);
+
+// only used by the blocking lookup in twitch_get_user, everything else goes through ctx->http_async.
 static CURL* curl;
 static struct curl_slist* twitch_headers;
 
@@ -76,6 +84,7 @@ typedef struct {
 
 	time_t stream_start;
 	time_t last_uptime_check;
+	int    uptime_pending; // in-flight uptime checks that include this channel
 
 	enum stream_state_change live_state_changed;
 
@@ -206,15 +215,29 @@ static void twitch_modified(void){
 static bool twitch_init(const IRCCoreCtx* _ctx){
 	ctx = _ctx;
 
+	if(ctx->api_version < 6){
+		fprintf(stderr, "mod_twitch: insobot version too old (%d, need >= 6), exiting.\n", (int)ctx->api_version);
+		return false;
+	}
+
 	time_t now = time(0);
 	last_uptime_check = now;
 	last_follower_check = now;
-	last_tracker_update = now - 50;
 
 	FILE* f = fopen(ctx->get_datafile(), "r");
 	twitch_load(f);
 	fclose(f);
 
+	twitch_start();
+	return true;
+}
+
+// the rest of init, once the channels are loaded or adopted.
+static void twitch_start(void){
+	ctx->add_timer(1000, false, &twitch_tracker_timer, 0);
+	ctx->add_timer(tracker_update_interval * 1000, true, &twitch_tracker_timer, 0);
+	ctx->add_timer(follower_check_interval * 1000, true, &twitch_follower_timer, 0);
+
 	curl = curl_easy_init();
 
 	twitch_headers = curl_slist_append(twitch_headers, "Accept: application/vnd.twitchtv.v5+json");
@@ -232,8 +255,6 @@ static bool twitch_init(const IRCCoreCtx* _ctx){
 		snprintf(buf, sizeof(buf), "Authorization: OAuth %s", oauth_token);
 		twitch_headers = curl_slist_append(twitch_headers, buf);
 	}
-
-	return true;
 }
 
 static long __attribute__((format(printf, 3, 4)))
@@ -285,31 +306,68 @@ twitch_curl(char** data, long last_time, const char* fmt, ...){
 	return http_code;
 }
 
-static void twitch_resolve_user_id_bulk(int* indices, size_t count) {
-	size_t total = sb_count(twitch_vals);
+static void __attribute__((format(printf, 4, 5)))
+twitch_fetch(IRCHttpCallback cb, intptr_t arg, long last_time, const char* fmt, ...){
+	va_list v;
+	va_start(v, fmt);
 
-	char user_buf[4096];
+	char* url;
+	if(vasprintf(&url, fmt, v) == -1){
+		perror("vasprintf");
+		abort();
+	}
 
-	char*  user_buf_ptr = user_buf;
-	size_t user_buf_sz = sizeof(user_buf);
+	va_end(v);
 
-	for(size_t i = 0; i < count; ++i) {
-		int index = indices[i];
+	CURL* req = inso_curl_init(url, NULL);
+	free(url);
 
-		if(index < 0 || index >= (int)total)
-			continue;
+	if(twitch_headers){
+		curl_easy_setopt(req, CURLOPT_HTTPHEADER, twitch_headers);
+	}
 
-		char* chan    = twitch_keys[index];
-		TwitchInfo* t = twitch_vals + index;
+	if(last_time){
+		curl_easy_setopt(req, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(req, CURLOPT_TIMEVALUE, last_time);
+	}
 
-		if(t->user_id)
-			continue;
+	ctx->http_async(req, cb, arg);
+}
 
-		snprintf_chain(&user_buf_ptr, &user_buf_sz, "&login=%s", chan+1);
+// requests still in flight when the module is unloaded are aborted with this before twitch_quit runs,
+// their callbacks just free what they have instead of carrying on or saying anything in chat.
+static bool twitch_aborted(long result){
+	return result == -CURLE_ABORTED_BY_CALLBACK;
+}
+
+static bool twitch_fetch_ok(long result){
+	if(result < 0){
+		fprintf(stderr, "twitch_fetch: error: %s\n", curl_easy_strerror(-result));
+		return false;
 	}
+	return true;
+}
 
-	char* data = NULL;
-	if(twitch_curl(&data, 0, "https://api.twitch.tv/helix/users?%s", user_buf) == 200) {
+// continuation for the async helpers below. cancel (if not NULL) is called instead of done when the request
+// was aborted, to free done_arg.
+typedef void (*TwitchDoneFn)(intptr_t arg);
+
+typedef struct {
+	TwitchDoneFn done;
+	TwitchDoneFn cancel;
+	intptr_t     done_arg;
+} TwitchResolveReq;
+
+static void twitch_resolve_user_id_cb(void* curl, long result, char* data, intptr_t arg){
+	TwitchResolveReq* req = (TwitchResolveReq*)arg;
+
+	if(twitch_aborted(result)){
+		if(req->cancel) req->cancel(req->done_arg);
+		free(req);
+		return;
+	}
+
+	if(twitch_fetch_ok(result) && result == 200) {
 		yajl_val root = yajl_tree_parse(data, NULL, 0);
 
 		if(root) {
@@ -336,42 +394,82 @@ static void twitch_resolve_user_id_bulk(int* indices, size_t count) {
 		yajl_tree_free(root);
 	}
 
-	sb_free(data);
+	req->done(req->done_arg);
+	free(req);
 }
 
-static bool twitch_resolve_user_id(TwitchInfo* t) {
-	int index = t - twitch_vals;
-	twitch_resolve_user_id_bulk(&index, 1);
-	return t->user_id;
-}
+// calls done once every user_id that could be resolved has been, immediately if none were missing.
+static void twitch_resolve_user_id_bulk(int* indices, size_t count, TwitchDoneFn done, TwitchDoneFn cancel, intptr_t done_arg) {
+	size_t total = sb_count(twitch_vals);
 
+	char user_buf[4096] = {};
 
-static void twitch_check_uptime(size_t count, size_t* indices){
-	if(count == 0) return;
+	char*  user_buf_ptr = user_buf;
+	size_t user_buf_sz = sizeof(user_buf);
 
-	char chan_buffer[4096] = {};
-	for(size_t i = 0; i < count; ++i){
-		inso_strcat(chan_buffer, sizeof(chan_buffer), "&user_login=");
-		inso_strcat(chan_buffer, sizeof(chan_buffer), twitch_keys[indices[i]] + 1);
+	for(size_t i = 0; i < count; ++i) {
+		int index = indices[i];
+
+		if(index < 0 || index >= (int)total)
+			continue;
+
+		char* chan    = twitch_keys[index];
+		TwitchInfo* t = twitch_vals + index;
+
+		if(t->user_id)
+			continue;
+
+		snprintf_chain(&user_buf_ptr, &user_buf_sz, "&login=%s", chan+1);
 	}
 
-	char* data = NULL;
+	if(!*user_buf){
+		done(done_arg);
+		return;
+	}
+
+	TwitchResolveReq* req = malloc(sizeof(*req));
+	req->done     = done;
+	req->cancel   = cancel;
+	req->done_arg = done_arg;
+
+	twitch_fetch(&twitch_resolve_user_id_cb, (intptr_t)req, 0, "https://api.twitch.tv/helix/users?%s", user_buf);
+}
+
+static void twitch_resolve_user_id(size_t index, TwitchDoneFn done, TwitchDoneFn cancel, intptr_t done_arg) {
+	int i = index;
+	twitch_resolve_user_id_bulk(&i, 1, done, cancel, done_arg);
+}
+
+typedef struct {
+	size_t*      indices;
+	TwitchDoneFn done;
+	TwitchDoneFn cancel;
+	intptr_t     done_arg;
+} TwitchUptimeReq;
+
+static void twitch_check_uptime_cb(void* curl, long result, char* data, intptr_t arg){
+	TwitchUptimeReq* req = (TwitchUptimeReq*)arg;
+	size_t  count   = sb_count(req->indices);
+	size_t* indices = req->indices;
+
 	yajl_val root = NULL;
 	time_t now = time(0);
 
-	printf("mod_twitch: doing uptime check [%s]\n", chan_buffer);
-
-	// TODO: pagination
+	for(size_t i = 0; i < count; ++i){
+		twitch_vals[indices[i]].uptime_pending--;
+	}
 
-	long ret = twitch_curl(&data, last_uptime_check, "https://api.twitch.tv/helix/streams?%s", chan_buffer);
-	last_uptime_check = now;
+	if(twitch_aborted(result)){
+		if(req->cancel) req->cancel(req->done_arg);
+		goto free_req;
+	}
 
-	if(ret == 304){
+	if(result == 304){
 		goto unchanged;
 	}
 
-	if(ret != 200 || !(root = yajl_tree_parse(data, NULL, 0))){
-		fprintf(stderr, "mod_twitch: error getting uptime. (%ld)\n", ret);
+	if(!twitch_fetch_ok(result) || result != 200 || !(root = yajl_tree_parse(data, NULL, 0))){
+		fprintf(stderr, "mod_twitch: error getting uptime. (%ld)\n", result);
 		goto unchanged;
 	}
 
@@ -437,45 +535,113 @@ static void twitch_check_uptime(size_t count, size_t* indices){
 	}
 
 	yajl_tree_free(root);
-	sb_free(data);
-	return;
+	goto out;
 
 unchanged:
 	for(size_t i = 0; i < count; ++i){
 		twitch_vals[indices[i]].live_state_changed = SSC_UNCHANGED;
+		twitch_vals[indices[i]].last_uptime_check = now;
 	}
+
+out:
+	if(req->done){
+		req->done(req->done_arg);
+	}
+
+free_req:
+	sb_free(req->indices);
+	free(req);
 }
 
+// refreshes the uptime info of the given channels, then calls done (if not NULL).
+static void twitch_check_uptime(size_t count, size_t* indices, TwitchDoneFn done, TwitchDoneFn cancel, intptr_t done_arg){
+	if(count == 0){
+		if(done) done(done_arg);
+		return;
+	}
+
+	char chan_buffer[4096] = {};
+	for(size_t i = 0; i < count; ++i){
+		inso_strcat(chan_buffer, sizeof(chan_buffer), "&user_login=");
+		inso_strcat(chan_buffer, sizeof(chan_buffer), twitch_keys[indices[i]] + 1);
+	}
+
+	printf("mod_twitch: doing uptime check [%s]\n", chan_buffer);
+
+	TwitchUptimeReq* req = calloc(1, sizeof(*req));
+	req->done     = done;
+	req->cancel   = cancel;
+	req->done_arg = done_arg;
+
+	memcpy(sb_add(req->indices, count), indices, count * sizeof(*indices));
+	for(size_t i = 0; i < count; ++i){
+		twitch_vals[indices[i]].uptime_pending++;
+	}
+
+	// TODO: pagination
+
+	twitch_fetch(&twitch_check_uptime_cb, (intptr_t)req, last_uptime_check, "https://api.twitch.tv/helix/streams?%s", chan_buffer);
+	last_uptime_check = time(0);
+}
+
+// returns the cached live status, starting a refresh in the background if it is out of date.
 static bool twitch_check_live(size_t index){
 	time_t now = time(0);
 
 	TwitchInfo* t = twitch_vals + index;
 
-	if(now - t->last_uptime_check > uptime_check_interval){
-		twitch_check_uptime(1, (size_t[]){ index });
-		t->last_uptime_check = now;
+	if(now - t->last_uptime_check > uptime_check_interval && !t->uptime_pending){
+		twitch_check_uptime(1, (size_t[]){ index }, NULL, NULL, 0);
 	}
 
 	return t->stream_start != 0;
 }
 
 static const char* twitch_display_name(const char* fallback){
-	int i = 0;
-	const char *k, *v;
 	static char caps_buffer[256];
+	const char* v = inso_tag(ctx, "display-name");
 
-	while(ctx->get_tag(i++, &k, &v)){
-		if(strcmp(k, "display-name") == 0){
-			if(*v) return v;
-			else { // When twitch returns an empty tag, the web UI shows the first char capitalized.
-				strncpy(caps_buffer, fallback, 255);
-				caps_buffer[0] = toupper(caps_buffer[0]);
-				return caps_buffer;
-			}
-		}
-	}
+	if(!v) return fallback;
+	if(*v) return v;
+
+	// When twitch returns an empty tag, the web UI shows the first char capitalized.
+	strncpy(caps_buffer, fallback, 255);
+	caps_buffer[0] = toupper(caps_buffer[0]);
+	return caps_buffer;
+}
+
+// state kept for commands that reply once their http requests are done
+typedef struct {
+	size_t index; // into twitch_keys / twitch_vals
+	char*  chan;
+	char*  name;
+	char*  dispname;
+	char*  arg;
+	bool   check_alias;
+} TwitchCmdReq;
+
+static TwitchCmdReq* twitch_cmd_req_new(size_t index, const char* chan, const char* name, const char* arg){
+	TwitchCmdReq* req = calloc(1, sizeof(*req));
+
+	req->index    = index;
+	req->chan     = strdup(chan);
+	req->name     = strdup(name);
+	req->dispname = strdup(twitch_display_name(name));
+	req->arg      = arg ? strdup(arg) : NULL;
+
+	return req;
+}
 
-	return fallback;
+static void twitch_cmd_req_free(TwitchCmdReq* req){
+	free(req->chan);
+	free(req->name);
+	free(req->dispname);
+	free(req->arg);
+	free(req);
+}
+
+static void twitch_cmd_req_cancel(intptr_t arg){
+	twitch_cmd_req_free((TwitchCmdReq*)arg);
 }
 
 static intptr_t check_alias_cb(intptr_t result, intptr_t arg){
@@ -483,26 +649,26 @@ static intptr_t check_alias_cb(intptr_t result, intptr_t arg){
 	return 0;
 }
 
-static void twitch_print_vod(size_t index, const char* send_chan, const char* name, bool check_alias){
+static void twitch_print_vod_cb(void* curl, long ret, char* data, intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
 
-	char* chan    = twitch_keys[index];
-	TwitchInfo* t = twitch_vals + index;
+	char* chan    = twitch_keys[req->index];
+	TwitchInfo* t = twitch_vals + req->index;
 
-	if(!twitch_resolve_user_id(t))
-		return;
+	yajl_val root = NULL;
 
-	char* data = NULL;
-	const char url_fmt[] = "https://api.twitch.tv/helix/videos?user_id=%s&sort=time&type=archive&first=1";
+	if(twitch_aborted(ret)){
+		goto out;
+	}
 
-	long ret = twitch_curl(&data, t->last_vod_check, url_fmt, t->user_id);
-	if(ret == 304 || ret == -1){
+	if(ret == 304 || !twitch_fetch_ok(ret)){
 		if(t->last_vod_msg){
-			ctx->send_msg(send_chan, "%s: %s", name, t->last_vod_msg);
+			ctx->send_msg(req->chan, "%s: %s", req->name, t->last_vod_msg);
 		}
-		return;
+		goto out;
 	}
 
-	yajl_val root = yajl_tree_parse(data, NULL, 0);
+	root = yajl_tree_parse(data, NULL, 0);
 	if(!root){
 		fprintf(stderr, "twitch_print_vod: root null\n");
 		goto out;
@@ -519,13 +685,13 @@ static void twitch_print_vod(size_t index, const char* send_chan, const char* na
 	if(videos->u.array.len == 0){
 		int alias_exists = 0;
 
-		if(check_alias){
-			const char* args[] = { "vod", send_chan };
+		if(req->check_alias){
+			const char* args[] = { "vod", req->chan };
 			MOD_MSG(ctx, "alias_exists", args, &check_alias_cb, &alias_exists);
 		}
 
 		if(!alias_exists){
-			ctx->send_msg(send_chan, "%s: No recent VoD found for %s.", name, chan + 1);
+			ctx->send_msg(req->chan, "%s: No recent VoD found for %s.", req->name, chan + 1);
 		}
 
 		goto out;
@@ -548,14 +714,26 @@ static void twitch_print_vod(size_t index, const char* send_chan, const char* na
 
 	const char* title = vod_title->u.string ?: "untitled";
 	const char* duration = vod_dur ? vod_dur->u.string : "??h??m??s";
-	const char* dispname = twitch_display_name(name);
 
 	asprintf_check(&t->last_vod_msg, "%s's last VoD: %s [%s] [%s]", chan + 1, vod_url->u.string, title, duration);
-	ctx->send_msg(send_chan, "%s: %s", dispname, t->last_vod_msg);
+	ctx->send_msg(req->chan, "%s: %s", req->dispname, t->last_vod_msg);
 
 out:
-	if(data) sb_free(data);
 	if(root) yajl_tree_free(root);
+	twitch_cmd_req_free(req);
+}
+
+static void twitch_print_vod(intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
+	TwitchInfo* t = twitch_vals + req->index;
+
+	if(!t->user_id){
+		twitch_cmd_req_free(req);
+		return;
+	}
+
+	const char url_fmt[] = "https://api.twitch.tv/helix/videos?user_id=%s&sort=time&type=archive&first=1";
+	twitch_fetch(&twitch_print_vod_cb, arg, t->last_vod_check, url_fmt, t->user_id);
 }
 
 #define TWITCH_TRACKER_MSG(fmt, ...) \
@@ -739,7 +917,7 @@ static void twitch_tracker_schedule_update(TwitchInfo* t){
 	MOD_MSG(ctx, "sched_add", &new_sched, NULL, NULL);
 }
 
-static void twitch_tracker_update(void){
+static void twitch_tracker_output(intptr_t unused){
 	char topic[1024] = "\002\0030,4[LIVE]\017 ";
 
 	bool any_changed = false;
@@ -747,19 +925,6 @@ static void twitch_tracker_update(void){
 	bool sent_ping = false;
 	bool sched_needs_save = false;
 
-	size_t* track_indices = NULL;
-	size_t index_count = 0;
-
-	for(size_t i = 0; i < sb_count(twitch_keys); ++i){
-		if(twitch_vals[i].is_tracked){
-			sb_push(track_indices, i);
-			index_count++;
-		}
-	}
-
-	twitch_check_uptime(index_count, track_indices);
-	sb_free(track_indices);
-
 	// don't output on the first update, to avoid duplication in case the bot has been restarted.
 	if(first_update){
 		first_update = false;
@@ -825,6 +990,21 @@ static void twitch_tracker_update(void){
 	}
 }
 
+static void twitch_tracker_update(void){
+	size_t* track_indices = NULL;
+	size_t index_count = 0;
+
+	for(size_t i = 0; i < sb_count(twitch_keys); ++i){
+		if(twitch_vals[i].is_tracked){
+			sb_push(track_indices, i);
+			index_count++;
+		}
+	}
+
+	twitch_check_uptime(index_count, track_indices, &twitch_tracker_output, NULL, 0);
+	sb_free(track_indices);
+}
+
 static void twitch_tracker_cmd(const char* chan, const char* name, const char* arg, int perms){
 
 	int enabled_index = -1;
@@ -967,77 +1147,115 @@ static void twitch_tracker_cmd(const char* chan, const char* name, const char* a
 	}
 }
 
-static void twitch_get_title(const char* chan, const char* name){
-	char* data = NULL;
+static void twitch_get_title_cb(void* curl, long result, char* data, intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
 	static const char* status_path[] = { "status", NULL };
 
-	TwitchInfo* t = twitch_get_or_add(chan);
-	if(!twitch_resolve_user_id(t)) {
-		ctx->send_msg(chan, "Can't resolve user_id for channel '%s'.", chan+1);
-		return;
-	}
-
-	// XXX: can't find helix version 2019-07-27
-	if(twitch_curl(&data, 0, "https://api.twitch.tv/kraken/channels/%s", t->user_id) == 200){
+	if(twitch_fetch_ok(result) && result == 200){
 		yajl_val root   = yajl_tree_parse(data, NULL, 0);
 		yajl_val status = yajl_tree_get(root, status_path, yajl_t_string);
 
 		if(status){
-			ctx->send_msg(chan, "%s: Current title for %s: [%s].", inso_dispname(ctx, name), chan, status->u.string);
+			ctx->send_msg(req->chan, "%s: Current title for %s: [%s].", req->dispname, req->chan, status->u.string);
 		}
 
 		yajl_tree_free(root);
 	}
 
-	sb_free(data);
+	twitch_cmd_req_free(req);
 }
 
-static void twitch_set_title(const char* chan, const char* name, const char* msg){
+static void twitch_get_title(intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
+	TwitchInfo* t = twitch_vals + req->index;
 
-	TwitchInfo* t = twitch_get_or_add(chan);
-	if(!twitch_resolve_user_id(t)) {
-		ctx->send_msg(chan, "Can't resolve user_id for channel '%s' :(", chan);
+	if(!t->user_id) {
+		ctx->send_msg(req->chan, "Can't resolve user_id for channel '%s'.", req->chan+1);
+		twitch_cmd_req_free(req);
 		return;
 	}
 
-	char* title = curl_easy_escape(curl, msg, 0);
+	// XXX: can't find helix version 2019-07-27
+	twitch_fetch(&twitch_get_title_cb, arg, 0, "https://api.twitch.tv/kraken/channels/%s", t->user_id);
+}
+
+static void twitch_set_title_cb(void* curl, long http_code, char* response, intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
+
+	const char* chan     = req->chan;
+	const char* dispname = req->dispname;
+
+	if(twitch_aborted(http_code)){
+		fprintf(stderr, "mod_twitch: title update for %s aborted.\n", chan);
+	} else if(http_code == 200){
+		ctx->send_msg(chan, "%s: Title updated successfully.", dispname);
+	} else if(http_code == 403){
+		ctx->send_msg(chan, "%s: I don't have permission to update the title.", dispname);
+	} else {
+		long err = http_code < 0 ? -http_code : 0;
+		ctx->send_msg(chan, "%s: Error updating title for channel (%ld) \"%s\".", dispname, http_code, chan+1);
+		fprintf(stderr, "response: [%s], curl=[%ld] [%s]\n", response, err, curl_easy_strerror(err));
+	}
+
+	twitch_cmd_req_free(req);
+}
+
+static void twitch_set_title(intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
+	TwitchInfo* t = twitch_vals + req->index;
+
+	if(!t->user_id) {
+		ctx->send_msg(req->chan, "Can't resolve user_id for channel '%s' :(", req->chan);
+		twitch_cmd_req_free(req);
+		return;
+	}
 
 	char *url, *data;
 
 	// XXX: can't find helix version 2019-07-27
-	asprintf_check(&url , "https://api.twitch.tv/kraken/channels/%s", t->user_id);
+	asprintf_check(&url, "https://api.twitch.tv/kraken/channels/%s", t->user_id);
+
+	CURL* curl = inso_curl_init(url, NULL);
+	char* title = curl_easy_escape(curl, req->arg, 0);
+
 	asprintf_check(&data, "channel[status]=%s", title);
 
 	curl_free(title);
 
-	char* response = NULL;
-	inso_curl_reset(curl, url, &response);
-
 	curl_easy_setopt(curl, CURLOPT_POST, 1);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+	curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, data);
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, twitch_headers);
 	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
 
-	CURLcode err = curl_easy_perform(curl);
-
 	free(url);
 	free(data);
 
-	long http_code = 0;
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+	ctx->http_async(curl, &twitch_set_title_cb, arg);
+}
 
-	const char* dispname = twitch_display_name(name);
+static void twitch_uptime_reply(intptr_t arg){
+	TwitchCmdReq* req = (TwitchCmdReq*)arg;
+	TwitchInfo* t = twitch_vals + req->index;
 
-	if(http_code == 200){
-		ctx->send_msg(chan, "%s: Title updated successfully.", dispname);
-	} else if(http_code == 403){
-		ctx->send_msg(chan, "%s: I don't have permission to update the title.", dispname);
+	if(t->stream_start){
+		int minutes = (time(0) - t->stream_start) / 60;
+		char time_buf[256];
+		char *time_ptr = time_buf;
+		size_t time_sz = sizeof(time_buf);
+
+		if(minutes > 60){
+			int h = minutes / 60;
+			snprintf_chain(&time_ptr, &time_sz, "%d hour%s, ", h, h == 1 ? "" : "s");
+			minutes %= 60;
+		}
+		snprintf_chain(&time_ptr, &time_sz, "%d minute%s.", minutes, minutes == 1 ? "" : "s");
+
+		ctx->send_msg(req->chan, "%s: The stream has been live for %s", req->dispname, time_buf);
 	} else {
-		ctx->send_msg(chan, "%s: Error updating title for channel (%ld) \"%s\".", dispname, http_code, chan+1);
-		fprintf(stderr, "response: [%s], curl=[%d] [%s]\n", response, err, curl_easy_strerror(err));
+		ctx->send_msg(req->chan, "%s: The stream is not live.", req->dispname);
 	}
 
-	sb_free(response);
+	twitch_cmd_req_free(req);
 }
 
 static void twitch_cmd(const char* chan, const char* name, const char* arg, int cmd){
@@ -1081,26 +1299,13 @@ static void twitch_cmd(const char* chan, const char* name, const char* arg, int
 				*stpncpy(c, chan, sizeof(chan_buf)-1) = 0;
 			}
 
-			time_t now = time(0);
-
 			TwitchInfo* t = twitch_get_or_add(c);
+			TwitchCmdReq* req = twitch_cmd_req_new(t - twitch_vals, chan, name, NULL);
 
-			if(twitch_check_live(t - twitch_vals)){
-				int minutes = (now - t->stream_start) / 60;
-				char time_buf[256];
-				char *time_ptr = time_buf;
-				size_t time_sz = sizeof(time_buf);
-
-				if(minutes > 60){
-					int h = minutes / 60;
-					snprintf_chain(&time_ptr, &time_sz, "%d hour%s, ", h, h == 1 ? "" : "s");
-					minutes %= 60;
-				}
-				snprintf_chain(&time_ptr, &time_sz, "%d minute%s.", minutes, minutes == 1 ? "" : "s");
-
-				ctx->send_msg(chan, "%s: The stream has been live for %s", dispname, time_buf);
+			if(time(0) - t->last_uptime_check > uptime_check_interval){
+				twitch_check_uptime(1, &req->index, &twitch_uptime_reply, &twitch_cmd_req_cancel, (intptr_t)req);
 			} else {
-				ctx->send_msg(chan, "%s: The stream is not live.", dispname);
+				twitch_uptime_reply((intptr_t)req);
 			}
 		} break;
 
@@ -1123,7 +1328,11 @@ static void twitch_cmd(const char* chan, const char* name, const char* arg, int
 			}
 
 			while(*--c);
-			twitch_print_vod(t - twitch_vals, chan, name, c[1] == '!');
+
+			TwitchCmdReq* req = twitch_cmd_req_new(t - twitch_vals, chan, name, NULL);
+			req->check_alias = c[1] == '!';
+
+			twitch_resolve_user_id(req->index, &twitch_print_vod, &twitch_cmd_req_cancel, (intptr_t)req);
 		} break;
 
 		case TWITCH_TRACKER: {
@@ -1134,142 +1343,154 @@ static void twitch_cmd(const char* chan, const char* name, const char* arg, int
 			bool have_arg = *arg++ == ' ';
 
 			if(is_admin && have_arg){
-				twitch_set_title(chan, name, arg);
+				TwitchInfo* t = twitch_get_or_add(chan);
+				TwitchCmdReq* req = twitch_cmd_req_new(t - twitch_vals, chan, name, arg);
+				twitch_resolve_user_id(req->index, &twitch_set_title, &twitch_cmd_req_cancel, (intptr_t)req);
 			} else if(is_wlist && !have_arg){
-				twitch_get_title(chan, name);
+				TwitchInfo* t = twitch_get_or_add(chan);
+				TwitchCmdReq* req = twitch_cmd_req_new(t - twitch_vals, chan, name, NULL);
+				twitch_resolve_user_id(req->index, &twitch_get_title, &twitch_cmd_req_cancel, (intptr_t)req);
 			}
 		} break;
 	}
 }
 
-static void twitch_check_followers(void){
+static void twitch_followers_cb(void* curl, long ret, char* data, intptr_t arg){
+	char* chan    = twitch_keys[arg];
+	TwitchInfo* t = twitch_vals + arg;
 
-	char* data = NULL;
 	yajl_val root = NULL;
 
-	size_t twitch_key_count = sb_count(twitch_keys);
-
-	int* user_index_list = calloc(twitch_key_count, sizeof(int));
-	int* user_index_ptr = user_index_list;
-
-	for(size_t i = 0; i < twitch_key_count; ++i){
-		TwitchInfo* t = twitch_vals + i;
-
-		if(!t->do_follower_notify || !twitch_check_live(i)){
-			continue;
-		}
-
-		*user_index_ptr++ = i;
+	if(ret == 304 || !twitch_fetch_ok(ret)){
+		return;
 	}
 
-	twitch_resolve_user_id_bulk(user_index_list, user_index_ptr - user_index_list);
+	root = yajl_tree_parse(data, NULL, 0);
 
-	for(int* iptr = user_index_list; iptr < user_index_ptr; ++iptr) {
-		int i = *iptr;
+	if(!YAJL_IS_OBJECT(root)){
+		fprintf(stderr, "mod_twitch: root not object!\n");
+		goto out;
+	}
 
-		char* chan    = twitch_keys[i];
-		TwitchInfo* t = twitch_vals + i;
+	yajl_val follows = YAJL_GET(root, yajl_t_array, ("data"));
+	if(!follows){
+		fprintf(stderr, "mod_twitch: follows not array!\n");
+		goto out;
+	}
 
-		if(!t->user_id) {
-			continue;
-		}
+	char msg_buf[256] = {};
+	size_t new_follow_count = 0;
+	time_t new_time = t->last_follower_time;
 
-		static const char url[] = "https://api.twitch.tv/helix/users/follows?to_id=%s&first=10";
-		long ret = twitch_curl(&data, last_follower_check, url, t->user_id);
+	for(size_t j = 0; j < follows->u.array.len; ++j){
+		yajl_val user = follows->u.array.values[j];
 
-		if(ret == 304){
-			continue;
-		} else if(ret == -1){
+		yajl_val date = YAJL_GET(user, yajl_t_string, ("followed_at"));
+		if(!date){
+			fprintf(stderr, "mod_twitch date object null!\n");
 			goto out;
 		}
 
-		root = yajl_tree_parse(data, NULL, 0);
-
-		if(!YAJL_IS_OBJECT(root)){
-			fprintf(stderr, "mod_twitch: root not object!\n");
+		yajl_val name = YAJL_GET(user, yajl_t_string, ("from_name"));
+		if(!name){
+			fprintf(stderr, "mod_twitch name object null!\n");
 			goto out;
 		}
 
-		yajl_val follows = YAJL_GET(root, yajl_t_array, ("data"));
-		if(!follows){
-			fprintf(stderr, "mod_twitch: follows not array!\n");
+		struct tm follow_tm = {};
+		char* end = strptime(date->u.string, "%Y-%m-%dT%TZ", &follow_tm);
+		if(!end || *end){
+			fprintf(stderr, "mod_twitch wrong date format?!\n");
 			goto out;
 		}
 
-		char msg_buf[256] = {};
-		size_t new_follow_count = 0;
-		time_t new_time = t->last_follower_time;
-
-		for(size_t j = 0; j < follows->u.array.len; ++j){
-			yajl_val user = follows->u.array.values[j];
+		time_t follow_time = mktime(&follow_tm);
 
-			yajl_val date = YAJL_GET(user, yajl_t_string, ("followed_at"));
-			if(!date){
-				fprintf(stderr, "mod_twitch date object null!\n");
-				goto out;
+		if(follow_time > t->last_follower_time){
+			++new_follow_count;
+			if(j){
+				inso_strcat(msg_buf, sizeof(msg_buf), ", ");
 			}
+			inso_strcat(msg_buf, sizeof(msg_buf), name->u.string);
 
-			yajl_val name = YAJL_GET(user, yajl_t_string, ("from_name"));
-			if(!name){
-				fprintf(stderr, "mod_twitch name object null!\n");
-				goto out;
-			}
+			if(follow_time > new_time) new_time = follow_time;
+		}
+	}
 
-			struct tm follow_tm = {};
-			char* end = strptime(date->u.string, "%Y-%m-%dT%TZ", &follow_tm);
-			if(!end || *end){
-				fprintf(stderr, "mod_twitch wrong date format?!\n");
-				goto out;
-			}
+	t->last_follower_time = new_time;
 
-			time_t follow_time = mktime(&follow_tm);
+	if(new_follow_count == 1){
+		ctx->send_msg(chan, "Thank you to %s for following the channel! <3", msg_buf);
+	} else if(new_follow_count > 1){
+		ctx->send_msg(chan, "Thank you new followers: %s! <3", msg_buf);
+	}
 
-			if(follow_time > t->last_follower_time){
-				++new_follow_count;
-				if(j){
-					inso_strcat(msg_buf, sizeof(msg_buf), ", ");
-				}
-				inso_strcat(msg_buf, sizeof(msg_buf), name->u.string);
+out:
+	if(root) yajl_tree_free(root);
+}
 
-				if(follow_time > new_time) new_time = follow_time;
-			}
-		}
+typedef struct {
+	int*   indices;
+	time_t since;
+} TwitchFollowReq;
+
+static void twitch_check_followers_cancel(intptr_t arg){
+	TwitchFollowReq* req = (TwitchFollowReq*)arg;
+	sb_free(req->indices);
+	free(req);
+}
 
-		t->last_follower_time = new_time;
+static void twitch_check_followers_fetch(intptr_t arg){
+	TwitchFollowReq* req = (TwitchFollowReq*)arg;
 
-		if(new_follow_count == 1){
-			ctx->send_msg(chan, "Thank you to %s for following the channel! <3", msg_buf);
-		} else if(new_follow_count > 1){
-			ctx->send_msg(chan, "Thank you new followers: %s! <3", msg_buf);
-		}
+	sb_each(i, req->indices){
+		TwitchInfo* t = twitch_vals + *i;
 
-		sb_free(data);
-		data = NULL;
+		if(!t->user_id) {
+			continue;
+		}
 
-		yajl_tree_free(root);
-		root = NULL;
+		static const char url[] = "https://api.twitch.tv/helix/users/follows?to_id=%s&first=10";
+		twitch_fetch(&twitch_followers_cb, *i, req->since, url, t->user_id);
 	}
 
-out:
-	free(user_index_list);
-	if(data) sb_free(data);
-	if(root) yajl_tree_free(root);
+	sb_free(req->indices);
+	free(req);
 }
 
-static void twitch_tick(time_t now){
+static void twitch_check_followers(void){
+	int* user_index_list = NULL;
 
-	if(now - last_tracker_update > tracker_update_interval){
-//		puts("mod_twitch: tracker update...");
-		twitch_tracker_update();
-		last_tracker_update = now;
+	for(size_t i = 0; i < sb_count(twitch_keys); ++i){
+		TwitchInfo* t = twitch_vals + i;
+
+		if(!t->do_follower_notify || !twitch_check_live(i)){
+			continue;
+		}
+
+		sb_push(user_index_list, i);
 	}
 
-	if(sb_count(twitch_keys) && (now - last_follower_check > follower_check_interval)){
-//		puts("mod_twitch: checking new followers...");
-		twitch_check_followers();
-		last_follower_check = now;
+	if(!user_index_list){
+		return;
 	}
 
+	TwitchFollowReq* req = malloc(sizeof(*req));
+	req->indices = user_index_list;
+	req->since   = last_follower_check;
+
+	twitch_resolve_user_id_bulk(user_index_list, sb_count(user_index_list), &twitch_check_followers_fetch, &twitch_check_followers_cancel, (intptr_t)req);
+}
+
+static void twitch_tracker_timer(intptr_t arg){
+	twitch_tracker_update();
+}
+
+static void twitch_follower_timer(intptr_t arg){
+	if(sb_count(twitch_keys)){
+		twitch_check_followers();
+		last_follower_check = time(0);
+	}
 }
 
 static bool twitch_save(FILE* f){
@@ -1333,6 +1554,62 @@ static void twitch_quit(void){
 	curl_easy_cleanup(curl);
 }
 
+// Everything a reloaded mod_twitch carries on with, so it keeps the cached user IDs and stream state instead of
+// fetching them all again. Bump the version below when this or any of the structs it points to change.
+DEFINE_HANDOFF_VERSION(1);
+
+typedef struct {
+	char**      keys;
+	TwitchInfo* vals;
+	char**      tracker_chans;
+	TwitchTag*  tracker_tags;
+	TwitchUser* users;
+	bool        first_update;
+	time_t      last_uptime_check;
+	time_t      last_follower_check;
+} TwitchHandoff;
+
+static void* twitch_handoff(void){
+	TwitchHandoff* h = malloc(sizeof(*h));
+	*h = (TwitchHandoff){
+		.keys                = twitch_keys,
+		.vals                = twitch_vals,
+		.tracker_chans       = twitch_tracker_chans,
+		.tracker_tags        = twitch_tracker_tags,
+		.users               = twitch_users,
+		.first_update        = first_update,
+		.last_uptime_check   = last_uptime_check,
+		.last_follower_check = last_follower_check,
+	};
+
+	if(twitch_headers){
+		curl_slist_free_all(twitch_headers);
+	}
+
+	curl_easy_cleanup(curl);
+
+	return h;
+}
+
+static bool twitch_adopt(const IRCCoreCtx* _ctx, void* arg){
+	TwitchHandoff* h = arg;
+	ctx = _ctx;
+
+	twitch_keys          = h->keys;
+	twitch_vals          = h->vals;
+	twitch_tracker_chans = h->tracker_chans;
+	twitch_tracker_tags  = h->tracker_tags;
+	twitch_users         = h->users;
+	first_update         = h->first_update;
+	last_uptime_check    = h->last_uptime_check;
+	last_follower_check  = h->last_follower_check;
+
+	free(h);
+
+	twitch_start();
+	return true;
+}
+
 static TwitchUser* twitch_get_user(const char* name){
 
 	for(size_t i = 0; i < sb_count(twitch_users); ++i){
@@ -1416,17 +1693,12 @@ static void twitch_mod_msg(const char* sender, const IRCModMsg* msg){
 static void twitch_unknown(const char* ev, const char* origin, const char** params, size_t nparams){
 	if(nparams < 2 || strcmp(ev, "USERNOTICE") != 0) return;
 	const char* chan = params[0];
-	const char* name = NULL;
-
-	size_t i = 0;
-	const char *k, *v;
-	while(ctx->get_tag(i++, &k, &v)){
-		if(strcmp(k, "msg-id") == 0 && strcmp(v, "ritual") != 0) return;
-		if(strcmp(k, "msg-param-ritual-name") == 0 && strcmp(v, "new_chatter") != 0) return;
-		if(strcmp(k, "display-name") == 0){
-			name = v;
-		}
-	}
+	const char* name = inso_tag(ctx, "display-name");
+	const char* id   = inso_tag(ctx, "msg-id");
+	const char* kind = inso_tag(ctx, "msg-param-ritual-name");
+
+	if(id && strcmp(id, "ritual") != 0) return;
+	if(kind && strcmp(kind, "new_chatter") != 0) return;
 
 	if(name){
 		ctx->send_msg(chan, "@%s: Welcome! VoHiYo", name);
@@ -9,6 +9,13 @@
 typedef struct IRCCoreCtx_ IRCCoreCtx;
 typedef struct IRCModMsg_ IRCModMsg;
 
+// completion callback for IRCCoreCtx.http_async, see below.
+typedef void (*IRCHttpCallback)(void* curl, long result, char* data, intptr_t arg);
+
+// callbacks for IRCCoreCtx.add_fd / add_timer, see below.
+typedef void (*IRCFdCallback)(int fd, uint32_t events, intptr_t arg);
+typedef void (*IRCTimerCallback)(intptr_t arg);
+
 // defined by a module to provide info & callbacks to the core.
 typedef struct IRCModuleCtx_ {
 
@@ -33,19 +40,22 @@ typedef struct IRCModuleCtx_ {
 	// called when a command listed by the module was found in a message, before on_msg
 	void (*on_cmd)     (const char* chan, const char* name, const char* arg, int cmd);
 
-	// called to request the module saves any data it needs, return true to complete the save
+	// called to request the module saves any data it needs, return true to complete the save.
+	// this runs in a forked copy of the bot unless the module has IRC_MOD_SAVE_INLINE, so any changes it makes
+	// to the module's own state are lost.
 	bool (*on_save)    (FILE* file);
 
 	// called when the module's data file is modified externally
 	void (*on_modified)(void);
 
-	// called before other callbacks to allow per-channel modules
+	// called before other callbacks to allow per-channel modules. The core caches the results per channel,
+	// so call IRCCoreCtx.perms_changed when they would change.
 	bool (*on_meta)    (const char* modname, const char* chan, int callback_id);
 
 	// simple inter-module communication callback
 	void (*on_mod_msg) (const char* sender, const IRCModMsg* msg);
 
-	// called atleast once every ~250ms
+	// called every ~250ms. Only kept for older modules, use IRCCoreCtx.add_timer instead.
 	void (*on_tick)    (time_t now);
 
 	// called if something was written to stdin
@@ -60,6 +70,9 @@ typedef struct IRCModuleCtx_ {
 	// called before a message is sent out, to allow filtering.
 	// chan will be NULL for a raw message.
 	// set msg[0] to '\0' to prevent the message being sent at all.
+	// long messages are split into chunks that are each filtered with the same msg_id, and short ones
+	// may be sent on one line together with others, but are still filtered one at a time.
+	// on_msg_out gets the line as it was actually sent.
 	void (*on_filter)  (size_t msg_id, const char* chan, char* msg, size_t msg_len);
 
 	// called on an unknown IRC event
@@ -71,16 +84,47 @@ typedef struct IRCModuleCtx_ {
 	// link to online guide / documentation for this module
 	const char* help_url;
 
+	// called with every nick from a NAMES reply at once, instead of on_join being called for each of them.
+	// modules without it still get the per-nick on_join calls.
+	void (*on_join_bulk)(const char* chan, const char** names, size_t count);
+
+	// called instead of on_quit when the module's .so changed and is being reloaded, after on_save. Return whatever
+	// the new code should carry on with, which on_adopt gets, or NULL to be quit and re-initialized as normal.
+	// The old code is unloaded right after this, so stop any threads, fds and timers, and fix up any pointers
+	// into the module itself (e.g. inso_ht hash functions) in on_adopt.
+	// Only called if the old and new .so have the same DEFINE_HANDOFF_VERSION, otherwise on_quit is. The save just
+	// before it may still be running in a forked copy, and a save_me from before it is left for the new code.
+	void* (*on_handoff)(void);
+
+	// called instead of on_init on the reloaded module, with what on_handoff returned. The module owns it from then
+	// on, on every path: if it returns false to be initialized with on_init instead, it has to free it first.
+	// It carries on where the old code was, so it doesn't get the on_connect / on_join calls that on_init does.
+	bool  (*on_adopt)  (const IRCCoreCtx* ctx, void* state);
+
+	// null-terminated names of modules whose on_init has to be done before this one's starts, use DEFINE_DEPS.
+	// Modules that set this (or the IRC_MOD_INIT_ASYNC flag) have on_init run on a thread pool when the bot starts,
+	// alongside other modules' code, after the rest have been initialized in priority order as normal. The bot
+	// connects without waiting for it. Nothing else is called until it's done, then the module gets the on_connect /
+	// on_join calls it missed. The IRCCoreCtx functions can be called from there as normal, but anything
+	// get_channels / get_nicks return can change as soon as they do, process wide state (e.g. the TZ env var that
+	// inso_tz.h changes) shouldn't be touched, and anything __thread it sets up won't be there for the main thread.
+	const char** init_after;
+
 } IRCModuleCtx;
 
 // incremented when new functions are added to IRCCoreCtx
-#define INSO_CORE_API_VERSION 3
+#define INSO_CORE_API_VERSION 8
 
 // API version history:
 // 1: Initial version.
 // 2: send_msg and send_raw now return an ID for the message.
 //    This will be passed to the filter function of IRCModuleCtx.
 // 3: Added gen_event function
+// 4: Added http_async function
+// 5: Added add_fd, del_fd, add_timer and del_timer functions
+// 6: Added add_timer_at function, timers no longer need a fd each
+// 7: Added perms_changed function, on_meta results are now cached
+// 8: Added get_tag_by_key function, long tags are no longer truncated
 
 // passed to modules to provide functions for them to use.
 struct IRCCoreCtx_ {
@@ -103,7 +147,7 @@ struct IRCCoreCtx_ {
 	size_t         (*send_raw)     (const char* raw);
 	void           (*send_ipc)     (int target, const void* data, size_t data_len); // target 0 == broadcast
 	void           (*send_mod_msg) (IRCModMsg* msg);
-	void           (*save_me)      (void);
+	void           (*save_me)      (void); // on_save is called once SAVE_DELAY_MS has passed
 	void           (*log)          (const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
 	void           (*strip_colors) (char* msg);
 	bool           (*responded)    (void); // true if send_msg was called for the current msg already
@@ -114,10 +158,53 @@ struct IRCCoreCtx_ {
 	// The variadic args should be the same as for the corresponding on_ callback in IRCModuleCtx.
 	// Supported callbacks are in the enum below.
 	void           (*gen_event)    (int which, ...);
+
+	// === Since API v4 ===
+	// Performs an HTTP transfer from the core's main loop instead of blocking the caller.
+	// curl should be a CURL* made with inso_curl_init or curl_easy_init, the core takes ownership of it
+	// and replaces its write callback. When the transfer is done, cb is called on the main thread with:
+	//   result - the HTTP response code, or -CURLcode on failure (same as inso_curl_perform).
+	//   data   - the null-terminated response body, freed after cb returns.
+	// The handle is cleaned up after cb returns, but any curl_slist headers remain the caller's to free.
+	// If the module is unloaded first, cb is called before on_quit with -CURLE_ABORTED_BY_CALLBACK.
+	void           (*http_async)   (void* curl, IRCHttpCallback cb, intptr_t arg);
+
+	// === Since API v5 ===
+	// Watches fd in the core's (level-triggered) epoll loop. events is a mask of EPOLLIN / EPOLLOUT, and cb
+	// gets the EPOLL* events that occurred. Calling it again for the same fd replaces the events / callback.
+	// Returns false and sets errno on failure. del_fd stops watching fd, but does not close it.
+	bool           (*add_fd)       (int fd, uint32_t events, IRCFdCallback cb, intptr_t arg);
+	void           (*del_fd)       (int fd);
+
+	// Calls cb after ms milliseconds, and every ms milliseconds after that if repeat is true.
+	// Returns a handle for del_timer, or 0 on failure. One-shot timers are deleted before their cb is called,
+	// and del_timer on a handle that has already fired or been deleted does nothing.
+	// Any fds or timers a module still has are removed automatically when it is unloaded.
+	intptr_t       (*add_timer)    (uint32_t ms, bool repeat, IRCTimerCallback cb, intptr_t arg);
+	void           (*del_timer)    (intptr_t handle);
+
+	// === Since API v6 ===
+	// One-shot timer that calls cb at (or just after) the wall-clock time when, or as soon as possible if that
+	// has already passed. The returned handle works with del_timer the same as one from add_timer.
+	intptr_t       (*add_timer_at) (time_t when, IRCTimerCallback cb, intptr_t arg);
+
+	// === Since API v7 ===
+	// Drops the core's cached on_meta results for chan (or every channel if chan is NULL).
+	// Must be called by modules implementing on_meta whenever their answer for a channel changes.
+	void           (*perms_changed)(const char* chan);
+
+	// === Since API v8 ===
+	// Returns the unescaped value of the current message's IRCv3 tag called key, or NULL if it doesn't have one.
+	// The usual twitch tags are found without going through every tag like with get_tag.
+	const char*    (*get_tag_by_key)(const char* key);
 };
 
 enum {
-	IRC_INFO_CAN_PARSE_TAGS, // bool
+	IRC_INFO_CAN_PARSE_TAGS,     // bool
+	IRC_INFO_CMDS_SENT,          // size_t, outgoing commands sent since startup
+	IRC_INFO_CMDS_DROPPED,       // size_t, outgoing commands dropped because their channel's queue was full
+	IRC_INFO_CMD_LATENCY_MS,     // ms a command waits in the queue, as a moving average
+	IRC_INFO_CMD_LATENCY_MAX_MS, // ms the slowest command since startup waited in the queue
 };
 
 // used for on_meta callback & gen_event.
@@ -133,8 +220,10 @@ enum  {
 
 // used for the flags field of IRCModuleCtx
 enum {
-	IRC_MOD_GLOBAL  = 1, // not a module that can be enabled / disabled per channel
-	IRC_MOD_DEFAULT = 2, // enabled by default when joining new channels
+	IRC_MOD_GLOBAL      = 1, // not a module that can be enabled / disabled per channel
+	IRC_MOD_DEFAULT     = 2, // enabled by default when joining new channels
+	IRC_MOD_SAVE_INLINE = 4, // on_save changes the module's state or uses threads, so it can't run in a fork
+	IRC_MOD_INIT_ASYNC  = 8, // on_init can run on the init pool without needing any init_after, see above
 };
 
 // used for inter-module communication messages
@@ -154,6 +243,15 @@ struct IRCModMsg_ {
 	0\
 }
 
+#define DEFINE_DEPS(...) DEFINE_CMDS(__VA_ARGS__)
+
+// the layout of what on_handoff returns. Bump it when that (or anything it points to) changes. The core reads it
+// from the new .so before asking the old code for its state, so the new code never gets a state it can't use.
+#define DEFINE_HANDOFF_VERSION(n) \
+	__attribute__((section(IRC_HANDOFF_SECTION), used)) const uint32_t irc_mod_handoff_version = (n)
+
+#define IRC_HANDOFF_SECTION ".insobot_handoff"
+
 #define CMD1(x) CONTROL_CHAR x " "
 
 #ifdef CONTROL_CHAR_2
@@ -0,0 +1,296 @@
+// Measures how fast mod_markov gets through chat it learns from: the message tokenizer on its own, the five
+// markov_replace passes + strtok_r it replaced (kept here for comparison), and the tokenizer feeding words into
+// the module's tables with find_or_add_word / markov_add like markov_msg does.
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include "../src/mod_markov.c"
+#define INSO_IMPL
+#include "../src/inso_ht.h"
+#include "../src/inso_utils.h"
+
+static char** lines;
+static size_t corpus_bytes;
+
+// the old markov_msg stripping, as it was before the single-pass tokenizer.
+static void old_replace(char** msg, const char* from, const char* to){
+	size_t from_len = strlen(from);
+	size_t to_len = strlen(to);
+	size_t msg_len = sb_count(*msg);
+
+	char* p;
+	size_t off = 0;
+
+	while((p = strstr(*msg + off, from))){
+
+		off = p - *msg;
+
+		if(to_len > from_len){
+			memset(sb_add(*msg, to_len - from_len), 0, to_len - from_len);
+		} else {
+			stb__sbn(*msg) -= (from_len - to_len);
+		}
+
+		p = *msg + off;
+
+		const char* end_p = *msg + msg_len;
+		memmove(p + to_len, p + from_len, end_p - (p + from_len));
+		memcpy(p, to, to_len);
+
+		off += to_len;
+
+		msg_len += (to_len - from_len);
+	}
+}
+
+static size_t old_tokenize(const char* line, uint64_t* sum){
+	size_t msg_len = strlen(line);
+	size_t count = 0;
+
+	char* msg = NULL;
+	memcpy(sb_add(msg, msg_len + 1), line, msg_len + 1);
+
+	for(char* c = msg; c < sb_end(msg); ++c){
+		*c = tolower(*c);
+	}
+
+	if(*msg == '@') *msg = ' ';
+
+	for(char* p = msg; *p; ++p){
+		if(*p < ' ' || *p >= 127) *p = ' ';
+		else if(*p == '$') *p = '@';
+	}
+
+	old_replace(&msg, ". ", " $ ");
+	old_replace(&msg, "! ", " $ ");
+	old_replace(&msg, "? ", " $ ");
+
+	old_replace(&msg, ",", " , ");
+
+	for(char* p = msg; *p; ++p){
+		if(strchr(".!?@:;`^(){}[]\"", *p)) *p = ' ';
+	}
+
+	old_replace(&msg, "  ", " ");
+
+	char* state = NULL;
+	for(char* word = strtok_r(msg, " ", &state); word; word = strtok_r(NULL, " ", &state)){
+		*sum += markov_hash(word, strlen(word));
+		++count;
+	}
+
+	sb_free(msg);
+	return count;
+}
+
+static size_t new_tokenize(const char* line, uint64_t* sum){
+	size_t msg_len = strlen(line);
+	size_t count = 0;
+
+	char* msg = NULL;
+	memcpy(sb_add(msg, msg_len + 1), line, msg_len + 1);
+
+	MarkovTokenizer tok = { .p = msg };
+	const char* word;
+	size_t len;
+
+	while((word = markov_tok_next(&tok, &len))){
+		*sum += markov_hash(word, len);
+		++count;
+	}
+
+	sb_free(msg);
+	return count;
+}
+
+// the learning loop of markov_msg, minus the nick / skip word checks and the journal.
+static size_t new_learn(const char* line, uint64_t* sum){
+	size_t msg_len = strlen(line);
+	size_t count = 0;
+
+	char* msg = NULL;
+	memcpy(sb_add(msg, msg_len + 1), line, msg_len + 1);
+
+	word_idx_t words[MARKOV_ORDER_MAX + 1];
+	for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+		words[i] = start_sym_idx;
+	}
+
+	MarkovTokenizer tok = { .p = msg };
+	const char* word;
+	size_t len;
+
+	while((word = markov_tok_next(&tok, &len))){
+		uint32_t wcount;
+		word_idx_t idx = len > 24 ? find_or_add_word("something", 9, &wcount) : find_or_add_word(word, len, &wcount);
+		word_idx_t prev = words[MARKOV_ORDER_MAX - 1];
+
+		++count;
+
+		if((idx == end_sym_idx && prev == start_sym_idx) || (idx == prev && prev == words[MARKOV_ORDER_MAX - 2])){
+			continue;
+		}
+
+		words[MARKOV_ORDER_MAX] = idx;
+		markov_add(words);
+
+		if(idx == end_sym_idx){
+			for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+				words[i] = start_sym_idx;
+			}
+		} else {
+			memmove(words, words + 1, MARKOV_ORDER_MAX * sizeof(word_idx_t));
+		}
+	}
+
+	words[MARKOV_ORDER_MAX] = end_sym_idx;
+	if(words[MARKOV_ORDER_MAX - 1] != start_sym_idx) markov_add(words);
+
+	sb_free(msg);
+	return count;
+}
+
+static double bench_elapsed_ms(const struct timespec* start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// best of passes runs over the whole corpus. With mute, anything fn prints goes to /dev/null while it runs.
+static void bench_run(const char* name, size_t (*fn)(const char*, uint64_t*), int passes, bool mute){
+	double best = 0;
+	size_t tokens = 0;
+	uint64_t sum = 0;
+	int saved_stdout = -1;
+
+	if(mute){
+		int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		fflush(stdout);
+		saved_stdout = dup(STDOUT_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+
+	for(int pass = 0; pass < passes; ++pass){
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		tokens = 0;
+		sum = 0;
+		sb_each(l, lines){
+			tokens += fn(*l, &sum);
+		}
+
+		double ms = bench_elapsed_ms(&start);
+		if(!pass || ms < best) best = ms;
+	}
+
+	if(mute){
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+	}
+
+	printf("%-9s %9.1f ms  %7.1f MB/s  %6.2f M tokens/s  %6.1f ns/token\n", name, best,
+	       corpus_bytes / (best * 1e3), tokens / (best * 1e3), best * 1e6 / tokens);
+}
+
+static char bench_datafile[PATH_MAX];
+static const char* bench_get_datafile(void){ return bench_datafile; }
+static intptr_t bench_add_timer(uint32_t ms, bool repeat, IRCTimerCallback cb, intptr_t arg){ return 0; }
+static void bench_del_timer(intptr_t id){}
+static bool bench_add_fd(int fd, uint32_t events, IRCFdCallback cb, intptr_t arg){ errno = ENOSYS; return false; }
+
+static const IRCCoreCtx bench_ctx = {
+	.api_version  = INSO_CORE_API_VERSION,
+	.get_datafile = &bench_get_datafile,
+	.add_timer    = &bench_add_timer,
+	.del_timer    = &bench_del_timer,
+	.add_fd       = &bench_add_fd,
+};
+
+int main(int argc, char** argv){
+	int passes = 5;
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:")) != -1){
+		switch(opt){
+			case 'p': passes = atoi(optarg); break;
+			default: goto usage;
+		}
+	}
+
+	if(optind >= argc || passes < 1){
+usage:
+		fprintf(stderr, "Usage: %s [-p passes] corpus...\n  one chat message per line, e.g. from grep/cut on logs.\n", argv[0]);
+		return 1;
+	}
+
+	for(int i = optind; i < argc; ++i){
+		FILE* f = fopen(argv[i], "r");
+		if(!f){
+			perror(argv[i]);
+			return 1;
+		}
+
+		char* line = NULL;
+		size_t cap = 0;
+		ssize_t n;
+
+		while((n = getline(&line, &cap, f)) != -1){
+			if(n && line[n-1] == '\n') line[--n] = '\0';
+			if(n && line[n-1] == '\r') line[--n] = '\0';
+			if(!n) continue;
+
+			sb_push(lines, strdup(line));
+			corpus_bytes += n;
+		}
+
+		free(line);
+		fclose(f);
+	}
+
+	printf("%zu messages, %.1f MB, best of %d passes:\n", sb_count(lines), corpus_bytes / 1e6, passes);
+
+	bench_run("replace", &old_tokenize, passes, false);
+	bench_run("tokenize", &new_tokenize, passes, false);
+
+	// runs of sentence ends like "!. " used to give "$ $", now just "$", which markov_msg skipped anyway.
+	size_t differ = 0;
+	sb_each(l, lines){
+		uint64_t a = 0, b = 0;
+		old_tokenize(*l, &a);
+		new_tokenize(*l, &b);
+		differ += a != b;
+	}
+	printf("%zu messages tokenized differently.\n", differ);
+
+	char dir[] = "/tmp/markov_tokbench.XXXXXX";
+	if(!mkdtemp(dir)){
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(bench_datafile, sizeof(bench_datafile), "%s/markov.data", dir);
+
+	if(!markov_init(&bench_ctx)){
+		return 1;
+	}
+
+	// learning into the same tables again is cheaper, so only one pass of this. markov_add logs every chain it adds,
+	// which the bot does too, so that's counted but kept off the terminal.
+	bench_run("learn", &new_learn, 1, true);
+	printf("%zu words, %zu keys.\n", word_ht.used, model->keys_ht.used);
+
+	markov_quit();
+
+	snprintf(bench_datafile, sizeof(bench_datafile), "%s/markov.data.journal", dir);
+	unlink(bench_datafile);
+	rmdir(dir);
+
+	sb_each(l, lines){
+		free(*l);
+	}
+	sb_free(lines);
+
+	return 0;
+}
@@ -0,0 +1,670 @@
+// Builds a mod_markov data file from plain text or IRC logs, using several threads.
+//
+// Each thread takes chunks of the input, tokenizes them the same way mod_markov does for chat messages and keeps
+// its own word list + n-gram counts. These are merged into mod_markov's tables at the end and saved with its own
+// code, so the output is exactly what the module loads.
+
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../src/mod_markov.c"
+#define INSO_IMPL
+#include "../src/inso_ht.h"
+#include "../src/inso_utils.h"
+
+#define CHUNK_SIZE (4 << 20)
+
+typedef struct {
+	const char* start;
+	const char* end;
+} TrainChunk;
+
+typedef struct {
+	uint32_t off;   // into TrainShard.word_mem
+	uint32_t count;
+} TrainWord;
+
+// a context and the word after it, like the words passed to markov_add, but only with the shard's word_mem offsets.
+// There's one of these for each of the shorter contexts mod_markov learns too, with 0s in front.
+typedef struct {
+	uint32_t w[MARKOV_ORDER_MAX + 1];
+	uint32_t count;
+} TrainNgram;
+
+typedef struct {
+	pthread_t thread;
+
+	char*   word_mem;
+	inso_ht words;
+	inso_ht ngrams;
+
+	uint32_t start_sym, end_sym;
+
+	inso_ht nicks;
+	char*   line;
+	size_t  lines;
+} TrainShard;
+
+typedef struct {
+	word_idx_t w[MARKOV_ORDER_MAX + 1];
+	uint64_t   count;
+} TrainMerged;
+
+static TrainChunk* chunks;
+static size_t      chunk_next;
+
+static bool   irc_logs;
+static bool   bench;
+static char** nicks;
+
+// the tables hash through this, each thread has its own word_mem.
+static __thread char* shard_word_mem;
+
+static size_t train_word_hash(const void* arg){
+	const char* word = shard_word_mem + ((const TrainWord*)arg)->off;
+	return markov_hash(word, strlen(word));
+}
+
+static bool train_word_cmp(const void* elem, void* param){
+	return strcmp(param, shard_word_mem + ((const TrainWord*)elem)->off) == 0;
+}
+
+static size_t train_ngram_hash(const void* arg){
+	const uint32_t* w = ((const TrainNgram*)arg)->w;
+	return markov_ctx_hash(w, MARKOV_ORDER_MAX) ^ hash6432shift((uint64_t)w[MARKOV_ORDER_MAX] * 0x9E3779B97F4A7C15ULL);
+}
+
+static bool train_ngram_cmp(const void* elem, void* param){
+	return memcmp(((const TrainNgram*)elem)->w, param, sizeof(((TrainNgram*)0)->w)) == 0;
+}
+
+static int train_merged_cmp(const void* _a, const void* _b){
+	const TrainMerged *a = _a, *b = _b;
+	for(int i = 0; i <= MARKOV_ORDER_MAX; ++i){
+		if(a->w[i] != b->w[i]) return a->w[i] < b->w[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static size_t train_nick_hash(const void* arg){
+	const char* nick = *(char* const*)arg;
+	return markov_hash(nick, strlen(nick));
+}
+
+static bool train_nick_cmp(const void* elem, void* param){
+	return strcmp(*(char* const*)elem, param) == 0;
+}
+
+static int train_str_cmp(const void* a, const void* b){
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static uint32_t train_word(TrainShard* s, const char* word, size_t len){
+	size_t hash = markov_hash(word, len);
+	TrainWord* w;
+
+	if((w = inso_ht_get(&s->words, hash, &train_word_cmp, (void*)word))){
+		++w->count;
+		return w->off;
+	}
+
+	uint32_t off = sb_count(s->word_mem);
+	memcpy(sb_add(s->word_mem, len + 1), word, len + 1);
+	shard_word_mem = s->word_mem;
+
+	inso_ht_put(&s->words, &(TrainWord){ off, 1 });
+	return off;
+}
+
+// counts the window for each context length markov_add would learn it for.
+static void train_ngram(TrainShard* s, const uint32_t w[static MARKOV_ORDER_MAX + 1]){
+	for(int n = markov_order; n >= markov_order_min; --n){
+		TrainNgram g = { .count = 1 };
+		memcpy(g.w + MARKOV_ORDER_MAX - n, w + MARKOV_ORDER_MAX - n, (n + 1) * sizeof(uint32_t));
+
+		TrainNgram* t = inso_ht_get(&s->ngrams, train_ngram_hash(&g), &train_ngram_cmp, g.w);
+		if(t){
+			if(t->count < UINT32_MAX) ++t->count;
+		} else {
+			inso_ht_put(&s->ngrams, &g);
+		}
+	}
+}
+
+// the irc core does this with libircclient, which this doesn't link against.
+static void train_strip_colors(char* msg){
+	char* out = msg;
+
+	for(char* p = msg; *p; ++p){
+		switch(*p){
+			case '\x02': case '\x0f': case '\x11': case '\x16': case '\x1d': case '\x1e': case '\x1f':
+				break;
+
+			case '\x03':
+				if(isdigit(p[1])) ++p;
+				if(isdigit(p[1])) ++p;
+				if(p[1] == ',' && isdigit(p[2])){
+					p += 2;
+					if(isdigit(p[1])) ++p;
+				}
+				break;
+
+			default:
+				*out++ = *p;
+		}
+	}
+
+	*out = '\0';
+}
+
+// finds the nick and message in lines like "[12:34] <@nick> msg" or "2016-01-01 12:34:56\tnick\tmsg".
+// anything else (joins, parts, actions...) is skipped.
+static bool train_parse_log(char* line, char** nick, char** msg){
+	char* lt   = memchr(line, '<', strnlen(line, 64));
+	char* tab1 = strchr(line, '\t');
+
+	if(lt && (!tab1 || lt < tab1)){
+		char* gt = strchr(lt, '>');
+		if(!gt || gt[1] != ' ' || memchr(lt, ' ', gt - lt)) return false;
+
+		*gt   = '\0';
+		*nick = lt + 1;
+		*msg  = gt + 2;
+	} else {
+		char* tab2 = tab1 ? strchr(tab1 + 1, '\t') : NULL;
+		if(!tab2) return false;
+
+		*tab1 = *tab2 = '\0';
+		*nick = tab1 + 1;
+		*msg  = tab2 + 1;
+	}
+
+	*nick += strspn(*nick, "@+%~& ");
+	return **nick && !strchr(*nick, ' ');
+}
+
+static bool train_next_chunk(TrainChunk* c){
+	size_t i = __sync_fetch_and_add(&chunk_next, 1);
+	if(i >= sb_count(chunks)) return false;
+	*c = chunks[i];
+	return true;
+}
+
+static const char* train_next_line(TrainShard* s, const char** p, const char* end){
+	if(*p >= end) return NULL;
+
+	const char* nl = memchr(*p, '\n', end - *p);
+	size_t len = (nl ? nl : end) - *p;
+
+	if(s->line) stb__sbn(s->line) = 0;
+	memcpy(sb_add(s->line, len + 1), *p, len);
+	s->line[len] = '\0';
+	if(len && s->line[len-1] == '\r') s->line[len-1] = '\0';
+
+	*p += len + 1;
+	return s->line;
+}
+
+static void* train_find_nicks(void* arg){
+	TrainShard* s = arg;
+	TrainChunk c;
+
+	inso_ht_init(&s->nicks, 256, sizeof(char*), &train_nick_hash);
+
+	while(train_next_chunk(&c)){
+		char *nick, *msg;
+		for(const char* p = c.start; train_next_line(s, &p, c.end);){
+			if(!train_parse_log(s->line, &nick, &msg)) continue;
+
+			for(char* n = nick; *n; ++n) *n = tolower(*n);
+
+			if(!inso_ht_get(&s->nicks, markov_hash(nick, strlen(nick)), &train_nick_cmp, nick)){
+				char* copy = strdup(nick);
+				inso_ht_put(&s->nicks, &copy);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// mirrors the learning part of markov_msg.
+static void train_msg(TrainShard* s, const char* name, char* msg){
+	if(*msg == '!' || *msg == '\\') return;
+	if(regexec(&url_regex, msg, 0, NULL, 0) == 0) return;
+
+	for(const char** n = ignores; *n; ++n){
+		if(strcasecmp(*n, name) == 0) return;
+	}
+
+	train_strip_colors(msg);
+
+	uint32_t words[MARKOV_ORDER_MAX + 1];
+	for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+		words[i] = s->start_sym;
+	}
+
+	MarkovTokenizer tok = { .p = msg };
+	const char* word;
+	size_t len;
+
+	while((word = markov_tok_next(&tok, &len))){
+		bool skip = false;
+		for(const char** c = skip_words; *c; ++c){
+			if(strcmp(word, *c) == 0){
+				skip = true;
+				break;
+			}
+		}
+		if(skip) continue;
+
+		uint32_t idx;
+
+		if(len > 24){
+			idx = train_word(s, "something", 9);
+		} else {
+			if(bsearch(&word, nicks, sb_count(nicks), sizeof(char*), &train_str_cmp)) continue;
+			idx = train_word(s, word, len);
+		}
+
+		uint32_t prev = words[MARKOV_ORDER_MAX - 1];
+
+		if((idx == s->end_sym && prev == s->start_sym) ||
+		   (idx == prev       && prev == words[MARKOV_ORDER_MAX - 2])){
+			continue;
+		}
+
+		words[MARKOV_ORDER_MAX] = idx;
+		train_ngram(s, words);
+
+		if(idx == s->end_sym){
+			for(int i = 0; i < MARKOV_ORDER_MAX; ++i){
+				words[i] = s->start_sym;
+			}
+		} else {
+			memmove(words, words + 1, MARKOV_ORDER_MAX * sizeof(uint32_t));
+		}
+	}
+
+	words[MARKOV_ORDER_MAX] = s->end_sym;
+	if(words[MARKOV_ORDER_MAX - 1] != s->start_sym) train_ngram(s, words);
+
+	++s->lines;
+}
+
+static void* train_thread(void* arg){
+	TrainShard* s = arg;
+	TrainChunk c;
+
+	shard_word_mem = s->word_mem;
+
+	while(train_next_chunk(&c)){
+		for(const char* p = c.start; train_next_line(s, &p, c.end);){
+			char *nick = "", *msg = s->line;
+			if(irc_logs && !train_parse_log(s->line, &nick, &msg)) continue;
+
+			train_msg(s, nick, msg);
+		}
+	}
+
+	return NULL;
+}
+
+static bool train_map_file(const char* path){
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if(fd == -1 || fstat(fd, &st) == -1){
+		perror(path);
+		if(fd != -1) close(fd);
+		return false;
+	}
+
+	if(st.st_size == 0){
+		close(fd);
+		return true;
+	}
+
+	const char* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(mem == MAP_FAILED){
+		perror(path);
+		return false;
+	}
+
+	madvise((void*)mem, st.st_size, MADV_SEQUENTIAL);
+
+	// split at line boundaries so the threads can take them in any order.
+	const char *p = mem, *end = mem + st.st_size;
+	while(p < end){
+		const char* c_end = p + CHUNK_SIZE;
+		if(c_end >= end){
+			c_end = end;
+		} else {
+			const char* nl = memchr(c_end, '\n', end - c_end);
+			c_end = nl ? nl + 1 : end;
+		}
+
+		sb_push(chunks, ((TrainChunk){ p, c_end }));
+		p = c_end;
+	}
+
+	return true;
+}
+
+static void train_run(TrainShard* shards, int nthreads, void* (*fn)(void*)){
+	chunk_next = 0;
+
+	for(int i = 0; i < nthreads; ++i){
+		if(pthread_create(&shards[i].thread, NULL, fn, shards + i) != 0){
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for(int i = 0; i < nthreads; ++i){
+		pthread_join(shards[i].thread, NULL);
+	}
+}
+
+static void train_merge(TrainShard* shards, int nthreads){
+	TrainMerged* merged = NULL;
+
+	for(int i = 0; i < nthreads; ++i){
+		TrainShard* s = shards + i;
+		uint32_t* remap = calloc(sb_count(s->word_mem), sizeof(uint32_t));
+
+		shard_word_mem = s->word_mem;
+		while(inso_ht_tick(&s->words));
+		while(inso_ht_tick(&s->ngrams));
+
+		for(size_t j = 0; j < s->words.capacity; ++j){
+			if(s->words.ctrl[j] & INSO_HT_EMPTY) continue;
+
+			TrainWord* w = (TrainWord*)s->words.memory + j;
+			const char* str = s->word_mem + w->off;
+
+			remap[w->off] = find_or_add_word(str, strlen(str), NULL);
+
+			WordInfo* info = inso_ht_get(&word_ht, markov_hash(str, strlen(str)), &wordinfo_cmp, (void*)str);
+			info->total = INSO_MIN((uint64_t)info->total + w->count - 1, UINT32_MAX);
+		}
+
+		// remap[0] stays 0 for the padding in front of shorter contexts.
+		for(size_t j = 0; j < s->ngrams.capacity; ++j){
+			if(s->ngrams.ctrl[j] & INSO_HT_EMPTY) continue;
+
+			TrainNgram*  t = (TrainNgram*)s->ngrams.memory + j;
+			TrainMerged* m = sbmm_add(merged, 1);
+
+			for(int k = 0; k <= MARKOV_ORDER_MAX; ++k){
+				m->w[k] = remap[t->w[k]];
+			}
+			m->count = t->count;
+		}
+
+		free(remap);
+		inso_ht_free(&s->words);
+		inso_ht_free(&s->ngrams);
+		sb_free(s->word_mem);
+	}
+
+	qsort(merged, sbmm_count(merged), sizeof(*merged), &train_merged_cmp);
+
+	// counts are 8 bits, so scale each key's successors down the way markov_add does when one saturates.
+	size_t n = sbmm_count(merged);
+	for(size_t i = 0, j; i < n; i = j){
+		uint64_t max = 0;
+		size_t succ = 0;
+
+		for(j = i; j < n && memcmp(merged[j].w, merged[i].w, sizeof(MarkovContext)) == 0; ++j){
+			if(j > i && merged[j].w[MARKOV_ORDER_MAX] == merged[j-1].w[MARKOV_ORDER_MAX]){
+				merged[j].count += merged[j-1].count;
+				merged[j-1].count = 0;
+			} else {
+				++succ;
+			}
+		}
+
+		for(size_t k = i; k < j; ++k){
+			max = INSO_MAX(max, merged[k].count);
+		}
+		uint64_t scale = max > 255 ? (max + 254) / 255 : 1;
+
+		uint32_t idx = markov_block_alloc(&model->vals, succ);
+		MarkovLinkVal* blk = model->vals + idx;
+
+		for(size_t k = i; k < j; ++k){
+			if(!merged[k].count) continue;
+
+			uint8_t count = merged[k].count >= scale ? merged[k].count / scale : 1;
+			blk[1 + blk->hdr.n++] = (MarkovLinkVal){ .word_idx = merged[k].w[MARKOV_ORDER_MAX], .count = count };
+			blk->hdr.total += count;
+		}
+
+		char key_buf[MARKOV_KEY_SIZE(MARKOV_ORDER_MAX)];
+		MarkovLinkKey* key = (MarkovLinkKey*)key_buf;
+
+		key->val_idx = idx;
+		markov_key_set(key, markov_ctx_id(merged[i].w, markov_order));
+		inso_ht_put(&model->keys_ht, key);
+	}
+
+	sbmm_free(merged);
+}
+
+static double train_elapsed_ns(const struct timespec* start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+// memory use and the cost of lookups / generation with the tables just built, to compare different orders with.
+static void train_bench(void){
+	struct timespec start;
+	size_t n = 0, found = 0;
+
+	while(inso_ht_tick(&model->keys_ht));
+
+	// every key once in a random order, each shorter context looked up at its own length like generation does.
+	MarkovContext* ctxs = NULL;
+	for(size_t i = 0; i < model->keys_ht.capacity; ++i){
+		if(model->keys_ht.ctrl[i] & INSO_HT_EMPTY) continue;
+		markov_key_get((MarkovLinkKey*)(model->keys_ht.memory + i * markov_key_size), *sbmm_add(ctxs, 1));
+	}
+
+	n = sbmm_count(ctxs);
+	for(size_t i = n; i > 1; --i){
+		size_t j = markov_rand(i);
+		MarkovContext tmp;
+		memcpy(tmp, ctxs[i-1], sizeof(tmp));
+		memcpy(ctxs[i-1], ctxs[j], sizeof(tmp));
+		memcpy(ctxs[j], tmp, sizeof(tmp));
+	}
+
+	// the first pass is only there to fault the tables in.
+	double lookup_ns = 0;
+	for(int pass = 0; pass < 2; ++pass){
+		found = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(size_t i = 0; i < n; ++i){
+			int len = markov_order;
+			while(len > 1 && !ctxs[i][MARKOV_ORDER_MAX - len]) --len;
+
+			found += find_key(ctxs[i], len) != NULL;
+		}
+		lookup_ns = n ? train_elapsed_ns(&start) / n : 0;
+	}
+
+	sbmm_free(ctxs);
+
+	char buf[256];
+	size_t sentences = 0, gen_words = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < 100000; ++i){
+		if(markov_gen(buf, sizeof(buf))){
+			++sentences;
+			for(const char* p = buf; *p; ++p) gen_words += *p == ' ';
+			++gen_words;
+		}
+	}
+	double gen_ns = train_elapsed_ns(&start);
+
+	size_t vals = sbmm_count(model->vals);
+
+	printf("Order %d: %zu keys (%zu bytes each, %zu found), %zu vals, %.2fMB total.\n",
+	       markov_order, n, markov_key_size, found, vals, markov_mem_usage() / (1024.f*1024.f));
+	printf("  %.1fns per key lookup, %.1fus per sentence, %.1fns per generated word.\n",
+	       lookup_ns, sentences ? gen_ns / sentences / 1000.0 : 0, gen_words ? gen_ns / gen_words : 0);
+}
+
+static const char* out_path;
+static const char* train_get_datafile(void){ return out_path; }
+static intptr_t train_add_timer(uint32_t ms, bool repeat, IRCTimerCallback cb, intptr_t arg){ return 0; }
+static void train_del_timer(intptr_t id){}
+static bool train_add_fd(int fd, uint32_t events, IRCFdCallback cb, intptr_t arg){ errno = ENOSYS; return false; }
+
+static const IRCCoreCtx train_ctx = {
+	.api_version  = INSO_CORE_API_VERSION,
+	.get_datafile = &train_get_datafile,
+	.add_timer    = &train_add_timer,
+	.del_timer    = &train_del_timer,
+	.add_fd       = &train_add_fd,
+};
+
+static void usage(const char* argv0){
+	fprintf(stderr,
+		"Usage: %s [-l] [-b] [-j threads] [-n order] -o data/markov.data corpus...\n"
+		"  -l  the corpus is IRC logs (\"<nick> msg\" or \"date\\tnick\\tmsg\" lines), otherwise one message per line.\n"
+		"  -j  number of threads to use, defaults to the number of CPUs.\n"
+		"  -n  words of context per key (1 to %d), same as INSOBOT_MARKOV_ORDER, defaults to 2.\n"
+		"  -b  print memory use and lookup / generation times for the result.\n",
+		argv0, MARKOV_ORDER_MAX
+	);
+	exit(1);
+}
+
+int main(int argc, char** argv){
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while((opt = getopt(argc, argv, "lbj:n:o:")) != -1){
+		switch(opt){
+			case 'l': irc_logs = true; break;
+			case 'b': bench = true; break;
+			case 'n': setenv("INSOBOT_MARKOV_ORDER", optarg, 1); break;
+			case 'j': nthreads = atoi(optarg); break;
+			case 'o': out_path = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if(!out_path || optind >= argc || nthreads < 1){
+		usage(argv[0]);
+	}
+
+	struct stat st;
+	if(stat(out_path, &st) == 0){
+		fprintf(stderr, "%s already exists, exiting.\n", out_path);
+		return 1;
+	}
+
+	for(int i = optind; i < argc; ++i){
+		if(!train_map_file(argv[i])) return 1;
+	}
+
+	TrainShard* shards = calloc(nthreads, sizeof(*shards));
+
+	if(irc_logs){
+		train_run(shards, nthreads, &train_find_nicks);
+
+		for(int i = 0; i < nthreads; ++i){
+			inso_ht* ht = &shards[i].nicks;
+			while(inso_ht_tick(ht));
+
+			for(size_t j = 0; j < ht->capacity; ++j){
+				if(!(ht->ctrl[j] & INSO_HT_EMPTY)){
+					sb_push(nicks, ((char**)ht->memory)[j]);
+				}
+			}
+			inso_ht_free(ht);
+		}
+
+		qsort(nicks, sb_count(nicks), sizeof(char*), &train_str_cmp);
+
+		// the same nick can come from several threads.
+		size_t unique = 0;
+		for(size_t i = 0; i < sb_count(nicks); ++i){
+			if(unique && strcmp(nicks[unique-1], nicks[i]) == 0){
+				free(nicks[i]);
+			} else {
+				nicks[unique++] = nicks[i];
+			}
+		}
+		if(nicks) stb__sbn(nicks) = unique;
+		printf("Found %zu nicks.\n", sb_count(nicks));
+	}
+
+	// this sets up the module's tables, with nothing in them since the output file doesn't exist yet.
+	if(!markov_init(&train_ctx)){
+		return 1;
+	}
+
+	for(int i = 0; i < nthreads; ++i){
+		TrainShard* s = shards + i;
+
+		sb_push(s->word_mem, 0);
+		inso_ht_init(&s->words, 4096, sizeof(TrainWord), &train_word_hash);
+		inso_ht_init(&s->ngrams, 4096, sizeof(TrainNgram), &train_ngram_hash);
+
+		shard_word_mem = s->word_mem;
+		s->start_sym = train_word(s, "^", 1);
+		s->end_sym   = train_word(s, "$", 1);
+	}
+
+	printf("Training on %zu chunks with %d threads...\n", sb_count(chunks), nthreads);
+	train_run(shards, nthreads, &train_thread);
+
+	size_t lines = 0;
+	for(int i = 0; i < nthreads; ++i){
+		lines += shards[i].lines;
+		sb_free(shards[i].line);
+	}
+
+	puts("Merging...");
+	train_merge(shards, nthreads);
+
+	printf("Learned %zu messages: %zu words, %zu keys.\n", lines, word_ht.used, model->keys_ht.used);
+
+	if(bench){
+		train_bench();
+	}
+
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+	FILE* f = fopen(tmp_path, "wb");
+	if(!f){
+		perror(tmp_path);
+		return 1;
+	}
+
+	bool ok = markov_write(f, journal_gen + 1);
+
+	if(fclose(f) != 0 || !ok || rename(tmp_path, out_path) == -1){
+		fprintf(stderr, "Couldn't write %s.\n", out_path);
+		unlink(tmp_path);
+		return 1;
+	}
+
+	// the module starts a new journal for the saved file itself.
+	markov_quit();
+	unlink(journal_path);
+
+	puts("Done!");
+	return 0;
+}
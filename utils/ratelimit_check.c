@@ -0,0 +1,68 @@
+// Checks the core's outgoing command rate limits: sends as fast as each bucket allows (and at random times), and
+// fails if any window_ms ever has more than limit sends in it, or if a full burst of limit isn't allowed.
+
+#define main insobot_main
+#include "../src/insobot.c"
+#undef main
+
+static bool check_bucket(const char* name, uint32_t limit, uint32_t window_ms, bool greedy){
+	CmdBucket b = { limit, window_ms };
+	uint64_t* times = NULL;
+	uint64_t now = 1000000;
+	bool ok = true;
+
+	while(sb_count(times) < limit * 20){
+		uint64_t wait = util_bucket_wait(&b, now);
+
+		if(wait){
+			now += greedy ? wait : wait + rand() % window_ms;
+			continue;
+		}
+
+		util_bucket_take(&b, now);
+		sb_push(times, now);
+
+		now += greedy ? 0 : rand() % (window_ms / limit + 1);
+	}
+
+	for(size_t i = 0; i + limit < sb_count(times); ++i){
+		if(times[i + limit] - times[i] < window_ms){
+			printf("%s: %u sends within %ums, at %zu\n", name, limit + 1, (unsigned)(times[i + limit] - times[i]), i);
+			ok = false;
+			break;
+		}
+	}
+
+	if(greedy && times[limit - 1] != times[0]){
+		printf("%s: the first %u sends weren't allowed at once\n", name, limit);
+		ok = false;
+	}
+
+	printf("%-10s %-6s %s\n", name, greedy ? "greedy" : "random", ok ? "ok" : "FAILED");
+
+	sb_free(times);
+	sb_free(b.sent);
+	return ok;
+}
+
+int main(void){
+	static const struct {
+		const char* name;
+		uint32_t limit, window_ms;
+	} buckets[] = {
+		{ "default", 1                   , CMD_RATE_LIMIT_MS     },
+		{ "msg"    , TWITCH_MSG_LIMIT    , TWITCH_MSG_WINDOW_MS  },
+		{ "mod"    , TWITCH_MOD_MSG_LIMIT, TWITCH_MSG_WINDOW_MS  },
+		{ "join"   , TWITCH_JOIN_LIMIT   , TWITCH_JOIN_WINDOW_MS },
+	};
+
+	bool ok = true;
+	srand(time(0));
+
+	for(size_t i = 0; i < ARRAY_SIZE(buckets); ++i){
+		ok &= check_bucket(buckets[i].name, buckets[i].limit, buckets[i].window_ms, true);
+		ok &= check_bucket(buckets[i].name, buckets[i].limit, buckets[i].window_ms, false);
+	}
+
+	return ok ? 0 : 1;
+}